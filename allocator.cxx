@@ -0,0 +1,120 @@
+#include <new>
+#include "allocator.hxx"
+
+constexpr static size_t alignment = alignof(std::max_align_t);
+// The smallest size class is 64 bytes, so tiny allocations don't each get a class of their own.
+constexpr static size_t minClass = 6;
+
+void deallocator_t::operator ()(uint8_t *const data) const noexcept
+{
+	if (allocator)
+		allocator->deallocate(data, length);
+	else
+		delete [] data;
+}
+
+allocation_t allocateFrom(allocator_t *const allocator, const size_t length)
+{
+	if (!allocator)
+		return allocation_t{new uint8_t[length], deallocator_t{nullptr, length}};
+	return allocation_t{static_cast<uint8_t *>(allocator->allocate(length)), deallocator_t{allocator, length}};
+}
+
+arenaAllocator_t::arenaAllocator_t(const size_t length) : blockLength{length}, blocks{}, current{0}, used{0}, lock{} { }
+
+void *arenaAllocator_t::allocate(const size_t length)
+{
+	const size_t alignedLength = (length + alignment - 1) & ~(alignment - 1);
+	if (alignedLength < length)
+		throw std::bad_alloc{};
+	std::lock_guard<std::mutex> guard{lock};
+	// Carry on through the blocks kept from before the last reset, moving on from any too full for this.
+	for (; current < blocks.size(); ++current, used = 0)
+	{
+		block_t &block = blocks[current];
+		if (block.length - used >= alignedLength)
+		{
+			uint8_t *const data = block.data.get() + used;
+			used += alignedLength;
+			return data;
+		}
+	}
+	// Allocations larger than a block get a block of their own.
+	const size_t newLength = alignedLength > blockLength ? alignedLength : blockLength;
+	blocks.push_back({std::unique_ptr<uint8_t []>{new uint8_t[newLength]}, newLength});
+	current = blocks.size() - 1;
+	used = alignedLength;
+	return blocks.back().data.get();
+}
+
+void arenaAllocator_t::reset() noexcept
+{
+	std::lock_guard<std::mutex> guard{lock};
+	current = 0;
+	used = 0;
+}
+
+size_t arenaAllocator_t::capacity() const noexcept
+{
+	size_t length = 0;
+	for (const auto &block : blocks)
+		length += block.length;
+	return length;
+}
+
+poolAllocator_t::poolAllocator_t(const size_t length) : maxLength{length}, freeLists(sizeClass(length) + 1),
+	lock{} { }
+
+poolAllocator_t::~poolAllocator_t() noexcept { trim(); }
+
+// The power of two an allocation of the given length gets rounded up to.
+size_t poolAllocator_t::sizeClass(const size_t length) noexcept
+{
+	size_t result = minClass;
+	while ((size_t{1} << result) < length)
+		++result;
+	return result;
+}
+
+void *poolAllocator_t::allocate(const size_t length)
+{
+	if (length > maxLength)
+		return ::operator new(length);
+	const size_t index = sizeClass(length);
+	{
+		std::lock_guard<std::mutex> guard{lock};
+		auto &freeList = freeLists[index];
+		if (!freeList.empty())
+		{
+			void *const data = freeList.back();
+			freeList.pop_back();
+			return data;
+		}
+	}
+	return ::operator new(size_t{1} << index);
+}
+
+void poolAllocator_t::deallocate(void *const data, const size_t length) noexcept
+{
+	if (length > maxLength)
+		return ::operator delete(data);
+	const size_t index = sizeClass(length);
+	try
+	{
+		std::lock_guard<std::mutex> guard{lock};
+		freeLists[index].push_back(data);
+	}
+	catch (std::bad_alloc &)
+		{ ::operator delete(data); }
+}
+
+void poolAllocator_t::trim() noexcept
+{
+	std::lock_guard<std::mutex> guard{lock};
+	for (auto &freeList : freeLists)
+	{
+		for (void *const data : freeList)
+			::operator delete(data);
+		freeList.clear();
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef ALLOCATOR__HXX
+#define ALLOCATOR__HXX
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "apng.hxx"
+
+// Hands out memory by bumping a pointer through large blocks, so allocating costs next to nothing and deallocating
+// does nothing at all. reset() gives everything back at once while keeping the blocks for the next decode to reuse,
+// which suits memory that only lives as long as one decode, as decodeOptions_t::scratchAllocator's does.
+// Everything allocated from the arena must be gone before it is reset or destroyed.
+struct APNG_API arenaAllocator_t final : public allocator_t
+{
+private:
+	struct block_t final
+	{
+		std::unique_ptr<uint8_t []> data;
+		size_t length;
+	};
+
+	const size_t blockLength;
+	std::vector<block_t> blocks;
+	size_t current;
+	size_t used;
+	std::mutex lock;
+
+public:
+	arenaAllocator_t(const size_t blockLength = 1024_KiB);
+	arenaAllocator_t(const arenaAllocator_t &) = delete;
+	arenaAllocator_t(arenaAllocator_t &&) = delete;
+	~arenaAllocator_t() noexcept final override = default;
+	arenaAllocator_t &operator =(const arenaAllocator_t &) = delete;
+	arenaAllocator_t &operator =(arenaAllocator_t &&) = delete;
+
+	void *allocate(const size_t length) final override;
+	void deallocate(void *const, const size_t) noexcept final override { }
+	void reset() noexcept;
+	// How many bytes the arena's blocks hold between them.
+	size_t capacity() const noexcept;
+};
+
+// Recycles memory in power-of-two size classes, so decoding image after image of similar sizes stops going back to
+// the system for every canvas and frame. Memory handed back is kept on its class's free list until trim() is called
+// or the pool is destroyed, and requests larger than maxLength bypass the pool entirely.
+struct APNG_API poolAllocator_t final : public allocator_t
+{
+private:
+	const size_t maxLength;
+	std::vector<std::vector<void *>> freeLists;
+	std::mutex lock;
+
+	static size_t sizeClass(const size_t length) noexcept;
+
+public:
+	poolAllocator_t(const size_t maxLength = 64 * 1024_KiB);
+	poolAllocator_t(const poolAllocator_t &) = delete;
+	poolAllocator_t(poolAllocator_t &&) = delete;
+	~poolAllocator_t() noexcept final override;
+	poolAllocator_t &operator =(const poolAllocator_t &) = delete;
+	poolAllocator_t &operator =(poolAllocator_t &&) = delete;
+
+	void *allocate(const size_t length) final override;
+	void deallocate(void *const data, const size_t length) noexcept final override;
+	// Frees all the memory being held on to for reuse.
+	void trim() noexcept;
+};
+
+#endif /*ALLOCATOR__HXX*/
@@ -6,8 +6,12 @@
 #include <exception>
 #include <array>
 #include <vector>
+#include <deque>
 #include <memory>
 #include <utility>
+#include <functional>
+#include <mutex>
+#include <chrono>
 
 #ifndef _MSC_VER
 	#if __GNUC__ >= 4
@@ -25,6 +29,39 @@
 
 #include "stream.hxx"
 
+struct unfilter_t;
+struct convert_t;
+struct bitmap_t;
+struct canvas_t;
+struct fcTL_t;
+struct decodeContext_t;
+struct poolAllocator_t;
+struct inflater_t;
+struct frameRegion_t;
+
+// Where bitmaps, canvases and chunk data get their memory from. Memory from allocate() is left uninitialised, must be
+// aligned for any type and is handed back to deallocate() along with the length it was allocated with. As frames can
+// be decoded on several threads at once, implementations have to be safe to call from more than one thread.
+struct APNG_API allocator_t
+{
+	virtual ~allocator_t() noexcept = default;
+	virtual void *allocate(const size_t length) = 0;
+	virtual void deallocate(void *const data, const size_t length) noexcept = 0;
+};
+
+// Hands memory back to the allocator_t it came from, or delete []s it when there isn't one.
+struct APNG_API deallocator_t final
+{
+	allocator_t *allocator;
+	size_t length;
+
+	void operator ()(uint8_t *const data) const noexcept;
+};
+
+using allocation_t = std::unique_ptr<uint8_t [], deallocator_t>;
+// Allocates length bytes from allocator, or with new [] when that's nullptr, leaving them uninitialised.
+APNG_API allocation_t allocateFrom(allocator_t *const allocator, const size_t length);
+
 struct chunkType_t final
 {
 private:
@@ -47,25 +84,162 @@ public:
 	const std::array<uint8_t, 4> &type() const noexcept { return _type; }
 };
 
+// strict checks every chunk's CRC; criticalOnly skips the checks on ancillary chunks that don't affect decoding,
+// still checking APNG's own acTL, fcTL and fdAT chunks; none skips them all, and is only for trusted assets.
+enum class crcCheck_t : uint8_t { strict, criticalOnly, none };
+
+// The pixel format to decode frames into. png keeps the PNG's own layout, with 16-bit samples left big-endian;
+// rgba8 and bgra8 expand every colour type to 8-bit RGBA or BGRA, optionally premultiplying the colour by alpha;
+// host16 puts 16-bit samples in the host's byte order; and strip16 keeps just the high byte of 16-bit samples.
+// Other than png, these composit alpha with the over operator so the canvas's alpha reflects what's drawn on it.
+enum class targetFormat_t : uint8_t
+{
+	png,
+	rgba8,
+	bgra8,
+	rgba8Premultiplied,
+	bgra8Premultiplied,
+	host16,
+	strip16
+};
+
+// How a frame's compressed image data is inflated. streaming inflates it a slice at a time as scanlines are unfiltered,
+// holding the least memory; singleShot inflates a whole frame with a single call into a buffer from the scratch
+// allocator, then unfilters its scanlines where they lie; and libdeflate does the same as singleShot using libdeflate,
+// which is only there when the library is built with it. automatic picks the fastest of these that's there, and
+// asking for one that isn't falls back to singleShot.
+enum class inflateBackend_t : uint8_t { automatic, streaming, singleShot, libdeflate };
+
+// Decodes an image scaled down by 2, 4 or 8 in each direction, box-filtering each frame's rows as they come out of
+// unfiltering so that frames are composited, and canvases kept, at the reduced size.
+enum class downscale_t : uint8_t { none, half, quarter, eighth };
+
+// Limits on what decoding an image may cost, for decoding files that can't be trusted such as in a shared service.
+// Each is checked as soon as the file gives enough to go on, the canvas size from IHDR, the frame count from acTL
+// and the bytes each frame decodes to from its fcTL, so a small file declaring a huge image is turned away before
+// any of its pixels are allocated. Going over any of them throws budgetExceeded_t, and 0 means no limit.
+struct decodeBudget_t final
+{
+	// The most pixels the canvas may have, once scaled down by decodeOptions_t::downscale.
+	uint64_t maxCanvasPixels{0};
+	uint32_t maxFrames{0};
+	// The most bytes decoding all the frames may allocate and hold on to: each frame's decoded pixels, the canvas
+	// rows it's drawn on, which become copies of their own, and the table of rows of the canvas apng_t keeps for it.
+	uint64_t maxDecodedBytes{0};
+	// How many times bigger the frames' scanlines may be than the compressed data they're inflated from, counting
+	// every frame up to the one about to be decoded.
+	uint32_t maxCompressionRatio{0};
+	// How long loading the chunks may take from the decoder being constructed, and decoding frames from the first
+	// frame being started, checked as each chunk is loaded and each frame begins.
+	std::chrono::nanoseconds maxTime{0};
+};
+
+// Whether the library was built with the given inflate backend.
+APNG_API bool inflateSupported(const inflateBackend_t backend) noexcept;
+
+// Called with the frame index, the Adam7 pass (1 to 7) just decoded and the canvas as it would look were each pixel
+// of the frame decoded so far filling the block of pixels later passes refine.
+using progressCallback_t = std::function<void (const uint32_t frame, const uint8_t pass, const canvas_t &preview)>;
+
+// Where decoding spent its time and what it got through, as gathered for a decodeObserver_t.
+struct APNG_API decodeStats_t final
+{
+	enum stage_t : uint8_t { chunkLoading, crc, inflate, unfilter, convert, composite };
+
+	// Wall time spent in each stage, with chunk loading not counting the time spent checking CRCs.
+	std::array<std::chrono::nanoseconds, 6> stageTimes{};
+	// Bytes read from the file, bytes of scanlines inflated from it and bytes of frame pixels decoded.
+	uint64_t bytesIn{};
+	uint64_t bytesInflated{};
+	uint64_t bytesOut{};
+	// How many scanlines used each of the five filter types.
+	std::array<uint64_t, 5> filterTypes{};
+	// How many frames were composited with each disposeOp_t and blendOp_t.
+	std::array<uint32_t, 3> disposeOps{};
+	std::array<uint32_t, 2> blendOps{};
+	// The most bytes held at once between the partially decoded frames and the distinct rows of the canvases kept.
+	uint64_t peakBitmapMemory{};
+	// With decodeOptions_t::dedupFrames, how many frames turned out to repeat an earlier one and the bytes of canvas
+	// rows and frames() bitmaps that sharing them saved.
+	uint32_t framesDeduplicated{};
+	uint64_t dedupBytesSaved{};
+
+	// Adds the times and counts of another decode or frame to these, keeping the larger peak.
+	decodeStats_t &operator +=(const decodeStats_t &stats) noexcept;
+};
+
+// Installed through decodeOptions_t::observer to find out where decoding goes. stats accumulates everything decoding
+// does, and the hooks, which by default do nothing, hand on each step as it happens such as for forwarding to a tracer.
+// Without an observer none of this is gathered, and the scanline loops run without any of the timing in them.
+struct APNG_API decodeObserver_t
+{
+	decodeStats_t stats{};
+
+	virtual ~decodeObserver_t() noexcept = default;
+	// Called once every chunk has been read and checked, with what that took. apngPushDecoder_t doesn't call this.
+	virtual void chunksLoaded(const decodeStats_t &) { }
+	// Called as a frame starts decoding. With more than one thread, later frames may begin before earlier ones end.
+	virtual void frameBegin(const uint32_t, const fcTL_t &) { }
+	// Called once a frame has been composited, with what decoding just that frame took.
+	virtual void frameEnd(const uint32_t, const decodeStats_t &) { }
+};
+
+struct decodeOptions_t final
+{
+	crcCheck_t crcCheck{crcCheck_t::strict};
+	// How many threads to inflate and unfilter frames on when decoding every frame. 1 decodes everything
+	// on the calling thread, and 0 uses one thread per hardware thread. Compositing always happens in order.
+	uint32_t threads{1};
+	targetFormat_t target{targetFormat_t::png};
+	inflateBackend_t inflate{inflateBackend_t::automatic};
+	downscale_t downscale{downscale_t::none};
+	// For interlaced images, previews each frame after every pass so something can be shown after as little as
+	// 1/64th of its data. Only called when frames are decoded on the calling thread.
+	progressCallback_t progress{};
+	// Gathers statistics on decoding when set, and must outlive the decoder it's given to.
+	decodeObserver_t *observer{nullptr};
+	// Where the canvases and bitmaps handed out get their memory from, and where the chunks and partially decoded
+	// frames that only last as long as decoding do. Either being nullptr means new [], and both have to outlive
+	// whatever is allocated from them: for allocator, every canvas or bitmap kept from the decode.
+	allocator_t *allocator{nullptr};
+	allocator_t *scratchAllocator{nullptr};
+	// Reuses the inflate state, row buffers and scratch memory held by a decodeContext_t rather than setting them up
+	// afresh, for frames decoded on the calling thread. The context's pool serves as scratchAllocator if that isn't set.
+	decodeContext_t *context{nullptr};
+	// Has apng_t look for frames whose composited canvas is identical to an earlier one, as ping-pong loops, held
+	// frames and disposeOp_t::previous tend to make, and share the earlier frame's rows and bitmap with them.
+	bool dedupFrames{false};
+	decodeBudget_t budget{};
+};
+
+// A chunk either owns a copy of its data, or when loaded from a stream that holds its data in memory
+// (such as memoryStream_t or mmapStream_t), is a view straight into that stream's memory.
 struct chunk_t final
 {
 private:
 	uint32_t _length;
 	chunkType_t _chunkType;
-	std::unique_ptr<uint8_t[]> _chunkData;
+	allocation_t _chunkStorage;
+	const uint8_t *_chunkData;
 
-	chunk_t() noexcept : _length(0), _chunkType{0, 0, 0, 0}, _chunkData(nullptr) { }
+	chunk_t() noexcept : _length(0), _chunkType{0, 0, 0, 0}, _chunkStorage(nullptr), _chunkData(nullptr) { }
 
 public:
 	chunk_t(chunk_t &&chunk) noexcept : _length(chunk._length), _chunkType(chunk._chunkType),
-		_chunkData(std::move(chunk._chunkData)) { }
+		_chunkStorage(std::move(chunk._chunkStorage)), _chunkData(chunk._chunkData) { }
 	chunk_t &operator =(chunk_t &&chunk) noexcept;
 	~chunk_t() noexcept = default;
 	uint32_t length() const noexcept { return _length; }
 	const chunkType_t &type() const noexcept { return _chunkType; }
-	const uint8_t *data() const noexcept { return _chunkData.get(); }
+	const uint8_t *data() const noexcept { return _chunkData; }
+
+	bool isCritical() const noexcept;
 
-	static chunk_t loadChunk(stream_t &stream);
+	// With skipPixelData, IDAT and fdAT chunks whose CRC isn't to be checked are skipped over and left without data.
+	// With stats, the chunk's bytes and the time spent checking its CRC are added to them. When the chunk
+	// can't be a view into the stream, its copy of the data comes from allocator.
+	static chunk_t loadChunk(stream_t &stream, const crcCheck_t crcCheck = crcCheck_t::strict,
+		const bool skipPixelData = false, decodeStats_t *const stats = nullptr, allocator_t *const allocator = nullptr);
 	chunk_t(const chunk_t &) = delete;
 	chunk_t &operator =(const chunk_t &) = delete;
 };
@@ -225,6 +399,8 @@ public:
 	uint16_t delayD() const noexcept { return _delayD; }
 	disposeOp_t disposeOp() const noexcept { return _disposeOp; }
 	blendOp_t blendOp() const noexcept { return _blendOp; }
+	// How long the frame is shown for, a delay denominator of 0 meaning hundredths of a second.
+	std::chrono::nanoseconds delay() const noexcept;
 };
 
 enum class pixelFormat_t : uint8_t
@@ -236,7 +412,15 @@ enum class pixelFormat_t : uint8_t
 	format24bppRGB,
 	format32bppRGBA,
 	format48bppRGB,
-	format64bppRGBA
+	format64bppRGBA,
+	format32bppBGRA,
+	format32bppRGBAPremultiplied,
+	format32bppBGRAPremultiplied,
+	// 16-bit samples in the host's byte order, rather than big-endian as PNG stores them.
+	format16bppGreyHost,
+	format16bppGreyAHost,
+	format48bppRGBHost,
+	format64bppRGBAHost
 };
 
 struct APNG_API displayTime_t final
@@ -248,6 +432,9 @@ public:
 	constexpr displayTime_t(const uint32_t N, const uint32_t D) noexcept : delayN{N}, delayD{D} { }
 	displayTime_t(const displayTime_t &) noexcept = default;
 	~displayTime_t() noexcept = default;
+	std::chrono::nanoseconds delay() const noexcept;
+	// Sleeps for the frame's delay. Sleeping frame by frame lets timing errors build up, so playbackScheduler_t
+	// from scheduler.hxx is better suited to playing whole animations.
 	void waitFor() const noexcept;
 
 	displayTime_t(displayTime_t &&) = delete;
@@ -258,20 +445,26 @@ public:
 struct APNG_API bitmap_t final
 {
 private:
-	std::unique_ptr<uint8_t []> _data;
+	allocation_t _data;
 	const uint32_t _width, _height;
 	const pixelFormat_t _format;
 	bool transValueValid;
 	uint16_t transValue[3];
 
 public:
-	bitmap_t(const uint32_t width, const uint32_t height, const pixelFormat_t format);
+	// The pixels come from allocator, or new [] when that's nullptr. Without clear they're left uninitialised,
+	// for when they're about to be overwritten anyway.
+	bitmap_t(const uint32_t width, const uint32_t height, const pixelFormat_t format,
+		allocator_t *const allocator = nullptr, const bool clear = true);
+	// The copy's pixels come from the same allocator.
+	bitmap_t(const bitmap_t &bitmap);
 	const uint8_t *data() const noexcept { return _data.get(); }
 	uint8_t *data() noexcept { return _data.get(); }
 	void *rawData() noexcept { return _data.get(); }
 	uint32_t width() const noexcept { return _width; }
 	uint32_t height() const noexcept { return _height; }
 	pixelFormat_t format() const noexcept { return _format; }
+	size_t length() const noexcept;
 	bool hasTransparency() const noexcept { return transValueValid; }
 	template<typename T> T transparent() const noexcept { return T{}; }
 	void transparent(const uint16_t *const value) noexcept
@@ -281,47 +474,419 @@ public:
 		transValue[2] = value[2];
 		transValueValid = true;
 	}
+
+	bitmap_t &operator =(const bitmap_t &) = delete;
 };
 
-struct APNG_API apng_t final
+// canvas_t holds a composited frame as rows that are reference counted and shared with any copies of the canvas,
+// so copying one is cheap. Rows are only duplicated when they are about to be written by detachRows(), which lets
+// each frame share every row outside of the region it changed with the frame before it.
+struct APNG_API canvas_t final
+{
+private:
+	using row_t = std::shared_ptr<uint8_t>;
+	uint32_t _width, _height;
+	pixelFormat_t _format;
+	size_t _rowLength;
+	std::vector<row_t> rows;
+	row_t zeroRow;
+	allocator_t *allocator;
+
+	row_t allocRows(const uint32_t count) const;
+
+public:
+	canvas_t() noexcept : _width{0}, _height{0}, _format{pixelFormat_t::format8bppGrey}, _rowLength{0}, rows{},
+		zeroRow{}, allocator{nullptr} { }
+	// Rows come from allocator, or new [] when that's nullptr, as do the bitmaps materialize() creates.
+	canvas_t(const uint32_t width, const uint32_t height, const pixelFormat_t format,
+		allocator_t *const allocator = nullptr);
+	canvas_t(const bitmap_t &bitmap, allocator_t *const allocator = nullptr);
+	canvas_t(const canvas_t &) = default;
+	canvas_t(canvas_t &&) = default;
+	~canvas_t() noexcept = default;
+	canvas_t &operator =(const canvas_t &) = default;
+	canvas_t &operator =(canvas_t &&) = default;
+
+	uint32_t width() const noexcept { return _width; }
+	uint32_t height() const noexcept { return _height; }
+	pixelFormat_t format() const noexcept { return _format; }
+	size_t rowLength() const noexcept { return _rowLength; }
+	size_t length() const noexcept { return _rowLength * _height; }
+	bool valid() const noexcept { return !rows.empty(); }
+	const uint8_t *row(const uint32_t y) const noexcept { return rows[y].get(); }
+	bool sharesRow(const canvas_t &canvas, const uint32_t y) const noexcept { return rows[y] == canvas.rows[y]; }
+
+	// Sets every row to zero, sharing a single zeroed row between them.
+	void clear() noexcept;
+	// Gives this canvas its own copy of the count rows from y, which are then contiguous
+	// and returned as a pointer to the first row of the block. Without keepContents the rows are left uninitialised.
+	uint8_t *detachRows(const uint32_t y, const uint32_t count, const bool keepContents = true);
+	// Copies the canvas into a contiguous bitmap.
+	std::unique_ptr<bitmap_t> materialize() const;
+	void materialize(bitmap_t &bitmap) const noexcept;
+};
+
+// What apngDecoder_t::probe() finds out about an APNG without decoding any of its frames.
+struct apngInfo_t final
+{
+	uint32_t width;
+	uint32_t height;
+	bitDepth_t bitDepth;
+	colourType_t colourType;
+	interlace_t interlacing;
+	uint32_t frames;
+	uint32_t loops;
+	bool defaultIsFirstFrame;
+	std::vector<fcTL_t> frameControls;
+	// How long one play through of the animation takes.
+	std::chrono::nanoseconds duration;
+	// The frames decoding can start from, as apngDecoder_t::keyframes() gives them.
+	std::vector<uint32_t> keyframes;
+};
+
+// apngDecoder_t parses and validates all the chunks of an APNG up front, but only inflates, unfilters and
+// composits a frame when it is asked for. It keeps just the current canvas and, when a later frame disposes to
+// disposeOp_t::previous, the one canvas that frame will be restored from. When reading from a memoryStream_t
+// or mmapStream_t, the chunks are views into the stream's memory so the stream must outlive the decoder.
+struct APNG_API apngDecoder_t final
 {
 private:
 	using chunkList_t = std::vector<chunk_t>;
 	using chunkIter_t = chunkList_t::const_iterator;
+	using chunkRefs_t = std::vector<const chunk_t *>;
 
+	chunkList_t chunks;
 	uint32_t _width;
 	uint32_t _height;
 	bitDepth_t _bitDepth;
 	colourType_t _colourType;
 	interlace_t _interlacing;
 	acTL_t controlChunk;
-	bitmap_t *_defaultFrame;
-	std::vector<std::pair<fcTL_t, std::unique_ptr<bitmap_t>>> _frames;
-	std::unique_ptr<bitmap_t> defaultFrameStorage;
 	bool transColourValid;
 	uint16_t transColour[3];
+	std::vector<std::array<uint8_t, 4>> palette;
+	bool paletteAlpha;
+	const unfilter_t *unfilter;
+	targetFormat_t target;
+	inflateBackend_t inflateBackend;
+	uint8_t scaleShift;
+	std::unique_ptr<const convert_t> convert;
+	progressCallback_t progress;
+	decodeObserver_t *observer;
+	allocator_t *allocator;
+	allocator_t *scratchAllocator;
+	decodeContext_t *context;
+	bool defaultIsFrame;
+	chunkRefs_t defaultChunks;
+	std::vector<fcTL_t> frameControls;
+	std::vector<chunkRefs_t> frameChunks;
+	std::vector<uint32_t> _keyframes;
+	decodeBudget_t budget;
+	std::chrono::steady_clock::time_point budgetStart;
+	bool budgetDecoding;
+	// What the frames read so far come to against the budget.
+	uint64_t budgetDecodedBytes;
+	uint64_t budgetScanlineBytes;
+	uint64_t budgetCompressedBytes;
+	uint32_t framesDecoded;
+	canvas_t canvas;
+	canvas_t previousCanvas;
+
+	apngDecoder_t(const decodeOptions_t &options);
+	friend struct apngPushDecoder_t;
 
 public:
-	apng_t(stream_t &stream);
-
-	uint32_t width() const noexcept { return _width; }
-	uint32_t height() const noexcept { return _height; }
+	apngDecoder_t(stream_t &stream, const decodeOptions_t &options = {});
+	apngDecoder_t(const apngDecoder_t &) = delete;
+	apngDecoder_t(apngDecoder_t &&) = delete;
+	~apngDecoder_t() noexcept;
+	apngDecoder_t &operator =(const apngDecoder_t &) = delete;
+	apngDecoder_t &operator =(apngDecoder_t &&) = delete;
+
+	// The size of the frames decoded, which decodeOptions_t::downscale makes smaller than the image in the file.
+	uint32_t width() const noexcept;
+	uint32_t height() const noexcept;
 	bitDepth_t bitDepth() const noexcept { return _bitDepth; }
 	colourType_t colourType() const noexcept { return _colourType; }
 	interlace_t interlacing() const noexcept { return _interlacing; }
-	const bitmap_t *defaultFrame() const noexcept { return _defaultFrame; }
-	pixelFormat_t pixelFormat() const;
+	// The format frames are decoded into, as decodeOptions_t::target picks.
+	pixelFormat_t pixelFormat() const noexcept;
 	uint32_t loops() const noexcept { return controlChunk.loops(); }
-	std::vector<std::pair<const displayTime_t, const bitmap_t *const>> frames() const noexcept;
+	uint32_t frameCount() const noexcept { return controlChunk.frames(); }
+	const fcTL_t &frameControl(const uint32_t index) const { return frameControls.at(index); }
+	// True when the default image (IDAT) is also the first frame of the animation.
+	bool defaultIsFirstFrame() const noexcept { return defaultIsFrame; }
+	// The frames whose canvas doesn't depend on any frame before them, in order, found as the fcTLs are read.
+	// The first frame is always one, as is any frame that clears the canvas or replaces all of it.
+	const std::vector<uint32_t> &keyframes() const noexcept { return _keyframes; }
+	// The last keyframe at or before index.
+	uint32_t keyframeFor(const uint32_t index) const noexcept;
+
+	std::unique_ptr<bitmap_t> decodeDefaultFrame() const;
+	// Decodes frames up to and including index, returning the canvas for that frame. The reference is only valid
+	// until the next call, but copying the canvas to keep it is cheap. Decoding carries on from the last frame
+	// decoded, unless going backwards or there's a keyframe after it to start from instead.
+	const canvas_t &frame(const uint32_t index) { return seek(index); }
+	// Jumps to the given frame, only decoding from the nearest keyframe before it, and returns its canvas.
+	const canvas_t &seek(const uint32_t index);
+	// Decodes the frame after the last one decoded, wrapping back around to the first after the last.
+	const canvas_t &nextFrame() { return frame(framesDecoded == frameCount() ? 0 : framesDecoded); }
+	uint32_t decodedFrames() const noexcept { return framesDecoded; }
+
+	using frameCallback_t = std::function<void (const uint32_t index, const canvas_t &frame)>;
+	// Decodes every frame from the first, calling callback with each in turn. With more than one thread,
+	// frames are inflated and unfiltered on a pool of that many threads while earlier ones are still being composited.
+	void decodeFrames(const frameCallback_t &callback, const uint32_t threads = 1);
+
+	// Validates an APNG's structure just as constructing a decoder does, but only reads the chunks describing
+	// the animation, seeking past the image data unless its CRCs are to be checked, and never inflates anything.
+	static apngInfo_t probe(stream_t &stream, const crcCheck_t crcCheck = crcCheck_t::none);
 
 private:
 	void checkSig(stream_t &stream);
 	void validateHeader();
+	void loadHeader(const chunk_t &header);
+	void loadColour(const chunkRefs_t &palettes, const chunkRefs_t &transChunks);
+	void loadChunks(stream_t &stream, const crcCheck_t crcCheck, const bool skipPixelData = false);
+	decodeStats_t *chunkStats() const noexcept { return observer ? &observer->stats : nullptr; }
+	pixelFormat_t pngFormat() const;
+	uint8_t bytesPerPixel() const noexcept;
+	void indexFrame(const uint32_t index);
+	void checkFrameCount() const;
+	void checkTime() const;
+	// Restarts the clock maxTime is measured against when the first frame is decoded.
+	void startDecoding() noexcept;
+	// Counts what the frame decodes to against the budget, which needs its fcTL and the colour chunks.
+	void chargeFrame(const uint32_t index);
+	// Counts the frame's compressed data against the budget, which needs all of it.
+	void chargeFrameData(const uint32_t index);
+
+	using passCallback_t = std::function<void (const uint8_t pass, const bitmap_t &partialFrame)>;
+	// Frames decoded with a frameContext use its inflate state and row buffer, which only the calling thread may do.
+	// rows is where the scanlines come from, either a stream to inflate them from or a frame already inflated whole.
+	// region is where the frame lies in the image at full size, and frame is that region scaled down.
+	template<typename rows_t> bool processFrame(rows_t rows, const frameRegion_t &region, bitmap_t &frame,
+		const passCallback_t &passDone, decodeStats_t *const stats, decodeContext_t *const frameContext) const;
+	void inflateFrame(stream_t &chunkStream, const frameRegion_t &region, bitmap_t &frame,
+		const passCallback_t &passDone, decodeStats_t *const stats, decodeContext_t *const frameContext) const;
+	frameRegion_t frameRegion(const uint32_t index) const noexcept;
+	std::unique_ptr<bitmap_t> decodeDefaultFrame(const passCallback_t &passDone, decodeStats_t *const stats,
+		allocator_t *const frameAllocator, decodeContext_t *const frameContext) const;
+	std::unique_ptr<bitmap_t> decodePartial(const uint32_t index, const passCallback_t &passDone = {},
+		decodeStats_t *const stats = nullptr, decodeContext_t *const frameContext = nullptr) const;
+	void composit(const uint32_t index, const bitmap_t &partialFrame, canvas_t &destination) const;
+	void compositFrame(const uint32_t index, const bitmap_t &partialFrame, decodeStats_t *const stats = nullptr);
+	void observeFrame(const uint32_t index, decodeStats_t &stats, const uint64_t partialBytes);
+	void decodeNextFrame();
+};
+
+// apngPushDecoder_t decodes an APNG from bytes handed to it as they arrive, such as off a socket, rather than
+// pulling the whole file from a stream_t before decoding anything. Each call to push() takes whatever bytes are
+// to hand, parses every chunk they complete and returns without waiting for more, calling back as soon as the header,
+// each frame's fcTL and each frame's pixel data are in. Only the bytes of a chunk split across calls are buffered,
+// and a frame's data chunks are let go as soon as it is decoded, so memory use follows the largest frame.
+struct APNG_API apngPushDecoder_t final
+{
+public:
+	struct callbacks_t final
+	{
+		// Called once the IHDR chunk is read, after which width(), height() and the other header properties are valid.
+		std::function<void ()> header{};
+		// Called with each frame's control chunk as it's read, ahead of the frame's pixel data.
+		std::function<void (const uint32_t index, const fcTL_t &frameControl)> frameControl{};
+		// Called with each frame's canvas as soon as the frame is complete. The canvas is reused for the next frame.
+		apngDecoder_t::frameCallback_t frame{};
+	};
+
+private:
+	enum class state_t : uint8_t { signature, header, chunks, finished };
+
+	apngDecoder_t decoder;
+	callbacks_t callbacks;
+	crcCheck_t crcCheck;
+	state_t state;
+	std::vector<uint8_t> partial;
+	// Chunks still needed: the palette and tRNS chunks up to the first IDAT, then the current frame's data.
+	std::deque<chunk_t> chunks;
+	apngDecoder_t::chunkRefs_t palettes;
+	apngDecoder_t::chunkRefs_t transChunks;
+	bool haveControl;
+	bool haveData;
+
+	size_t itemLength(const uint8_t *const data, const size_t length) const;
+	void consume(const uint8_t *const data, const size_t length);
+	void processChunk(chunk_t &&chunk);
+	void finishFrame();
+
+public:
+	apngPushDecoder_t(const callbacks_t &callbacks, const decodeOptions_t &options = {});
+	apngPushDecoder_t(const apngPushDecoder_t &) = delete;
+	apngPushDecoder_t(apngPushDecoder_t &&) = delete;
+	~apngPushDecoder_t() noexcept = default;
+	apngPushDecoder_t &operator =(const apngPushDecoder_t &) = delete;
+	apngPushDecoder_t &operator =(apngPushDecoder_t &&) = delete;
+
+	// Hands the decoder the next length bytes of the file. Throws invalidPNG_t as soon as the data is found to be bad,
+	// after which the decoder can't be used any further.
+	void push(const void *const data, const size_t length);
+	// True once the IEND chunk has been read, and every frame with it.
+	bool finished() const noexcept { return state == state_t::finished; }
+
+	uint32_t width() const noexcept { return decoder.width(); }
+	uint32_t height() const noexcept { return decoder.height(); }
+	bitDepth_t bitDepth() const noexcept { return decoder.bitDepth(); }
+	colourType_t colourType() const noexcept { return decoder.colourType(); }
+	interlace_t interlacing() const noexcept { return decoder.interlacing(); }
+	// Valid from the first frame's callback.
+	pixelFormat_t pixelFormat() const noexcept { return decoder.pixelFormat(); }
+	// Valid from the first frameControl callback.
+	uint32_t loops() const noexcept { return decoder.loops(); }
+	uint32_t frameCount() const noexcept { return decoder.frameCount(); }
+	uint32_t decodedFrames() const noexcept { return decoder.decodedFrames(); }
+};
+
+// Every frame of a batch of images decoded by decodeContext_t::decodeBatch(), held one after another
+// in a single allocation with each frame a whole canvas of its image's size.
+struct APNG_API apngBatch_t final
+{
+	struct frame_t final
+	{
+		fcTL_t frameControl;
+		// Where the frame's pixels start in pixels.
+		size_t offset;
+	};
+
+	struct image_t final
+	{
+		// False when the input couldn't be decoded, in which case it has no frames.
+		bool valid;
+		uint32_t width;
+		uint32_t height;
+		pixelFormat_t pixelFormat;
+		uint32_t loops;
+		// How many bytes each of the image's frames takes up, being width by height pixels of pixelFormat.
+		size_t frameLength;
+		std::vector<frame_t> frames;
+	};
+
+	allocation_t pixels;
+	size_t length;
+	std::vector<image_t> images;
+
+	const uint8_t *frame(const size_t image, const size_t frame) const
+		{ return pixels.get() + images.at(image).frames.at(frame).offset; }
+};
+
+// Holds on to everything decoding needs besides the file itself, so that decoding one small image after another
+// doesn't set it all up again each time: the inflate state, which is reset for each frame rather than created anew,
+// the scanline buffers, and a pool the chunk copies and partially decoded frames are recycled through.
+// Hand it to decoders through decodeOptions_t::context. Only one decode may use a context at a time.
+struct APNG_API decodeContext_t final
+{
+private:
+	std::unique_ptr<zlibStream_t> inflater;
+	// The single-shot inflaters, made as each backend is first used.
+	std::array<std::unique_ptr<inflater_t>, 4> wholeInflaters;
+	std::vector<uint8_t> rowBuffer;
+	std::unique_ptr<poolAllocator_t> pool;
+
+	friend struct apngDecoder_t;
 
-	bool processFrame(stream_t &stream, bitmap_t &frame);
-	uint32_t processDefaultFrame(const chunkList_t &chunks, const bool isSequenceFrame, const chunk_t &controlChunk);
-	void processFrame(const chunkIter_t &chunkBegin, const chunkIter_t &chunkEnd, const uint32_t frameIndex,
-		const chunk_t &controlChunk);
+public:
+	decodeContext_t();
+	decodeContext_t(const decodeContext_t &) = delete;
+	decodeContext_t(decodeContext_t &&) = delete;
+	~decodeContext_t() noexcept;
+	decodeContext_t &operator =(const decodeContext_t &) = delete;
+	decodeContext_t &operator =(decodeContext_t &&) = delete;
+
+	allocator_t &scratchAllocator() noexcept;
+	// Decodes every frame of each input, on the calling thread, into one allocation from options.allocator sized
+	// for the whole batch up front. Inputs that turn out not to be valid, to go
+	// over options.budget or to be too big to hold are marked so rather than failing the batch.
+	apngBatch_t decodeBatch(const std::vector<stream_t *> &inputs, const decodeOptions_t &options = {});
+};
+
+struct APNG_API apng_t final
+{
+private:
+	uint32_t _width;
+	uint32_t _height;
+	bitDepth_t _bitDepth;
+	colourType_t _colourType;
+	interlace_t _interlacing;
+	pixelFormat_t _pixelFormat;
+	uint32_t _loops;
+	bitmap_t *_defaultFrame;
+	std::vector<std::pair<fcTL_t, canvas_t>> _frames;
+	// For each frame, the index of the first frame identical to it, when frames have been deduplicated.
+	std::vector<uint32_t> frameSources;
+	uint64_t _dedupBytesSaved;
+	std::unique_ptr<bitmap_t> defaultFrameStorage;
+	mutable std::vector<std::unique_ptr<bitmap_t>> bitmaps;
+	mutable std::mutex bitmapsLock;
+
+	void dedupFrames();
+
+public:
+	apng_t(stream_t &stream, const decodeOptions_t &options = {});
+
+	uint32_t width() const noexcept { return _width; }
+	uint32_t height() const noexcept { return _height; }
+	bitDepth_t bitDepth() const noexcept { return _bitDepth; }
+	colourType_t colourType() const noexcept { return _colourType; }
+	interlace_t interlacing() const noexcept { return _interlacing; }
+	const bitmap_t *defaultFrame() const noexcept { return _defaultFrame; }
+	pixelFormat_t pixelFormat() const noexcept { return _pixelFormat; }
+	uint32_t loops() const noexcept { return _loops; }
+	// The bytes saved by decodeOptions_t::dedupFrames, counting the bitmaps frames() doesn't need to make.
+	uint64_t dedupBytesSaved() const noexcept { return _dedupBytesSaved; }
+	// The frames as contiguous bitmaps, which are materialized from the canvases the first time this is called.
+	// Frames found to be identical by decodeOptions_t::dedupFrames share one bitmap.
+	std::vector<std::pair<const displayTime_t, const bitmap_t *const>> frames() const;
+	// The frames as the canvases they were decoded into, which share all the rows that don't change between frames.
+	std::vector<std::pair<const displayTime_t, const canvas_t *const>> canvases() const noexcept;
+};
+
+// How the encoder chooses each scanline's filter. none leaves every scanline unfiltered; heuristic picks, one scanline
+// at a time, the filter whose output has the smallest sum of absolute values taken as signed bytes; and exhaustive
+// also deflates each frame with every filter type used throughout, keeping whichever of the six attempts comes out
+// smallest, at around six times the cost.
+enum class filterStrategy_t : uint8_t { none, heuristic, exhaustive };
+
+struct encodeOptions_t final
+{
+	// How many threads to filter and deflate frames on. 0 uses one thread per hardware thread, and the file written
+	// is the same whatever this is set to.
+	uint32_t threads{0};
+	filterStrategy_t filter{filterStrategy_t::heuristic};
+	// zlib's compression level, from 0 (stored) to 9 (smallest).
+	int32_t compressionLevel{Z_DEFAULT_COMPRESSION};
+	// How many times the animation plays, 0 meaning forever.
+	uint32_t loops{0};
+};
+
+// Writes bitmaps out as an APNG. The first frame must fill the whole image, while later frames can cover any region
+// of it. BGRA, premultiplied and host byte order bitmaps are turned back into PNG's own layout as they're written,
+// and every frame has to come out in the same layout as the first: RGBA and BGRA frames can be mixed, for example.
+struct APNG_API apngEncoder_t final
+{
+	struct frame_t final
+	{
+		const bitmap_t *bitmap;
+		uint32_t xOffset;
+		uint32_t yOffset;
+		uint16_t delayN;
+		uint16_t delayD;
+		disposeOp_t disposeOp;
+		blendOp_t blendOp;
+	};
+
+	// Throws invalidPNG_t if the frames can't make a valid APNG of the given size.
+	static void encode(stream_t &stream, const uint32_t width, const uint32_t height, const std::vector<frame_t> &frames,
+		const encodeOptions_t &options = {});
+
+	apngEncoder_t() = delete;
 };
 
 struct APNG_API invalidPNG_t : public std::exception
@@ -331,4 +896,20 @@ public:
 	const char *what() const noexcept { return "Invalid PNG file"; }
 };
 
+// Thrown when an image would take more to decode than decodeOptions_t::budget allows. The image may well be valid.
+struct APNG_API budgetExceeded_t : public std::exception
+{
+public:
+	enum class limit_t : uint8_t { canvasPixels, frames, decodedBytes, compressionRatio, time };
+
+private:
+	limit_t _limit;
+
+public:
+	budgetExceeded_t(const limit_t limit) noexcept : _limit{limit} { }
+	// Which of the budget's limits was gone over.
+	limit_t limit() const noexcept { return _limit; }
+	const char *what() const noexcept;
+};
+
 #endif /*APNG_HXX*/
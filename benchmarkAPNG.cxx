@@ -0,0 +1,275 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <memory>
+#include "apng.hxx"
+#include "stream.hxx"
+#include "crc32.hxx"
+#include "unfilter.hxx"
+#include "utilities.hxx"
+#include "convert.hxx"
+#include "inflate.hxx"
+#include "corpus.hxx"
+
+// Benchmarks each stage of decoding separately over the synthetic corpus from corpus.hxx: CRC checking, inflating,
+// unfiltering and compositing, followed by decoding whole files with apng_t. Every measurement is printed as one
+// line of JSON giving MB/s over the bytes the stage works on and ns per pixel of the frames involved.
+// Inflating is measured with every inflate backend the library was built with, best compared on large frames.
+
+struct benchmarkOptions_t final
+{
+	uint32_t size{256};
+	double minTime{0.2};
+	std::string stage{};
+};
+
+struct measurement_t final
+{
+	size_t iterations;
+	double seconds;
+};
+
+// Runs work until it has taken at least minTime in total.
+template<typename work_t> measurement_t measure(const benchmarkOptions_t &options, work_t &&work)
+{
+	measurement_t result{0, 0};
+	const auto start = std::chrono::steady_clock::now();
+	do
+	{
+		work();
+		++result.iterations;
+		result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	while (result.seconds < options.minTime);
+	return result;
+}
+
+void report(const char *const stage, const corpusFile_t &file, const uint64_t bytes, const uint64_t pixels,
+	const measurement_t &measurement)
+{
+	const double totalBytes = double(bytes) * measurement.iterations;
+	const double totalPixels = double(pixels) * measurement.iterations;
+	printf("{\"stage\": \"%s\", \"file\": \"%s\", \"width\": %u, \"height\": %u, \"frames\": %u, "
+		"\"bytes\": %llu, \"pixels\": %llu, \"iterations\": %zu, \"seconds\": %.6f, \"MBps\": %.2f, "
+		"\"nsPerPixel\": %.3f}\n", stage, file.spec.name.c_str(), file.spec.width, file.spec.height,
+		file.spec.frames, static_cast<unsigned long long>(bytes), static_cast<unsigned long long>(pixels),
+		measurement.iterations, measurement.seconds, totalBytes / measurement.seconds / 1e6,
+		measurement.seconds * 1e9 / totalPixels);
+	fflush(stdout);
+}
+
+void benchmarkCRC(const benchmarkOptions_t &options, const corpusFile_t &file)
+{
+	uint32_t crc = 0;
+	const auto result = measure(options, [&]() { crc32_t::crc(crc, file.png.data(), file.png.size()); });
+	report("crc", file, file.png.size(), file.framePixels, result);
+}
+
+void benchmarkInflate(const benchmarkOptions_t &options, const corpusFile_t &file)
+{
+	uint64_t bytes = 0;
+	for (const auto &scanlines : file.scanlines)
+		bytes += scanlines.size();
+	std::vector<uint8_t> output;
+	const auto result = measure(options, [&]()
+	{
+		for (size_t i = 0; i < file.deflated.size(); ++i)
+		{
+			auto &deflated = file.deflated[i];
+			memoryStream_t source{const_cast<uint8_t *>(deflated.data()), deflated.size()};
+			zlibStream_t inflater{source, zlibStream_t::inflate};
+			stream_t &frameData = inflater;
+			output.resize(file.scanlines[i].size());
+			if (!frameData.read(output.data(), output.size()))
+				throw invalidPNG_t{};
+		}
+	});
+	report("inflate", file, bytes, file.framePixels, result);
+
+	// The single-shot backends inflate each frame whole, straight into memory sized for all of it.
+	const std::pair<const char *, inflateBackend_t> backends[] =
+		{{"inflate-singleShot", inflateBackend_t::singleShot}, {"inflate-libdeflate", inflateBackend_t::libdeflate}};
+	for (const auto &backend : backends)
+	{
+		if (!inflateSupported(backend.second))
+			continue;
+		auto inflater = inflater_t::make(backend.second);
+		const auto backendResult = measure(options, [&]()
+		{
+			for (size_t i = 0; i < file.deflated.size(); ++i)
+			{
+				auto &deflated = file.deflated[i];
+				memoryStream_t source{const_cast<uint8_t *>(deflated.data()), deflated.size()};
+				output.resize(file.scanlines[i].size());
+				if (!inflater->inflate(source, output.data(), output.size()))
+					throw invalidPNG_t{};
+			}
+		});
+		report(backend.first, file, bytes, file.framePixels, backendResult);
+	}
+}
+
+void benchmarkUnfilter(const benchmarkOptions_t &options, const corpusFile_t &file)
+{
+	// Unfiltering works in place, so this runs over the same copy of the scanlines every time. That leaves
+	// different values in them each time round, but the work done doesn't depend on the values.
+	auto frames = file.scanlines;
+	uint64_t bytes = 0;
+	for (const auto &scanlines : frames)
+		bytes += scanlines.size();
+	const unfilter_t &unfilter = unfilter_t::select(file.filterBytesPerPixel);
+	const auto result = measure(options, [&]()
+	{
+		for (size_t i = 0; i < frames.size(); ++i)
+		{
+			const size_t rowLength = file.rowLengths[i];
+			std::vector<uint8_t> zeroRow(rowLength + 1);
+			uint8_t *prevRow = zeroRow.data();
+			for (size_t offset = 0; offset < frames[i].size(); offset += rowLength + 1)
+			{
+				uint8_t *const row = frames[i].data() + offset;
+				unfilter(filterTypes_t(row[0]), row + 1, prevRow + 1, rowLength);
+				prevRow = row;
+			}
+		}
+	});
+	report("unfilter", file, bytes, file.framePixels, result);
+}
+
+pixelFormat_t corpusFormat(const corpusSpec_t &spec) noexcept
+{
+	const bool wide = spec.bitDepth == 16;
+	switch (spec.colourType)
+	{
+		case 0:
+			return wide ? pixelFormat_t::format16bppGrey : pixelFormat_t::format8bppGrey;
+		case 2:
+			return wide ? pixelFormat_t::format48bppRGB : pixelFormat_t::format24bppRGB;
+		case 4:
+			return wide ? pixelFormat_t::format16bppGreyA : pixelFormat_t::format8bppGreyA;
+		default:
+			return wide ? pixelFormat_t::format64bppRGBA : pixelFormat_t::format32bppRGBA;
+	}
+}
+
+// Composits the frames onto a canvas_t the way apngDecoder_t does, starting from frames unfiltered up front.
+// Only formats where a frame's PNG bytes are already its decoded pixels are covered.
+void benchmarkComposite(const benchmarkOptions_t &options, const corpusFile_t &file)
+{
+	const corpusSpec_t &spec = file.spec;
+	if (spec.bitDepth < 8 || spec.colourType == 3)
+		return;
+	const pixelFormat_t format = corpusFormat(spec);
+	std::vector<std::unique_ptr<bitmap_t>> frames;
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < file.scanlines.size(); ++i)
+	{
+		const size_t rowLength = file.rowLengths[i];
+		std::vector<uint8_t> scanlines{file.scanlines[i]};
+		std::vector<uint8_t> zeroRow(rowLength + 1);
+		auto frame = makeUnique<bitmap_t>(file.sizes[i].first, file.sizes[i].second, format);
+		uint8_t *prevRow = zeroRow.data();
+		for (size_t y = 0; y < frame->height(); ++y)
+		{
+			uint8_t *const row = scanlines.data() + (y * (rowLength + 1));
+			unfilterRow(filterTypes_t(row[0]), row + 1, prevRow + 1, rowLength, file.filterBytesPerPixel);
+			memcpy(frame->data() + (y * rowLength), row + 1, rowLength);
+			prevRow = row;
+		}
+		bytes += frame->length();
+		frames.emplace_back(std::move(frame));
+	}
+
+	const auto result = measure(options, [&]()
+	{
+		canvas_t canvas{spec.width, spec.height, format};
+		canvas_t previousCanvas{};
+		for (size_t i = 0; i < frames.size(); ++i)
+		{
+			const uint32_t xOffset = file.offsets[i].first;
+			const uint32_t yOffset = file.offsets[i].second;
+			if (i == 0)
+				canvas = canvas_t{*frames[i]};
+			else
+			{
+				if (spec.disposeOp == disposeOp_t::previous)
+					canvas = previousCanvas;
+				else if (spec.disposeOp != disposeOp_t::none)
+					canvas.clear();
+				if (spec.blendOp == blendOp_t::source || spec.disposeOp == disposeOp_t::background)
+					compositFrame<blendOp_t::source>(*frames[i], canvas, format, false, xOffset, yOffset);
+				else
+					compositFrame<blendOp_t::over>(*frames[i], canvas, format, false, xOffset, yOffset);
+			}
+			if (i == 0 && spec.disposeOp == disposeOp_t::previous)
+				previousCanvas = canvas;
+		}
+	});
+	report("composite", file, bytes, file.framePixels, result);
+}
+
+void benchmarkDecode(const benchmarkOptions_t &options, const corpusFile_t &file)
+{
+	const auto result = measure(options, [&]()
+	{
+		memoryStream_t stream{const_cast<uint8_t *>(file.png.data()), file.png.size()};
+		apng_t image{stream};
+	});
+	report("decode", file, file.png.size(), uint64_t{file.spec.width} * file.spec.height * file.spec.frames, result);
+}
+
+bool parseOptions(const int argc, char **const argv, benchmarkOptions_t &options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string option{argv[i]};
+		if (i + 1 == argc)
+			return false;
+		const char *const value = argv[++i];
+		if (option == "--size")
+			options.size = uint32_t(strtoul(value, nullptr, 10));
+		else if (option == "--min-time")
+			options.minTime = strtod(value, nullptr);
+		else if (option == "--stage")
+			options.stage = value;
+		else
+			return false;
+	}
+	return options.size != 0;
+}
+
+int main(int argc, char **argv) try
+{
+	benchmarkOptions_t options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printf("Usage: %s [--size pixels] [--min-time seconds] [--stage crc|inflate|unfilter|composite|decode]\n",
+			argv[0]);
+		return 1;
+	}
+
+	using stage_t = void (*)(const benchmarkOptions_t &, const corpusFile_t &);
+	const std::pair<const char *, stage_t> stages[] =
+	{
+		{"crc", benchmarkCRC}, {"inflate", benchmarkInflate}, {"unfilter", benchmarkUnfilter},
+		{"composite", benchmarkComposite}, {"decode", benchmarkDecode}
+	};
+	for (const auto &spec : corpusSpecs(options.size))
+	{
+		const corpusFile_t file = generateCorpusFile(spec);
+		for (const auto &stage : stages)
+		{
+			if (options.stage.empty() || options.stage == stage.first)
+				stage.second(options, file);
+		}
+	}
+	return 0;
+}
+catch (invalidPNG_t &error)
+{
+	puts(error.what());
+	return 2;
+}
@@ -0,0 +1,265 @@
+#include <algorithm>
+#include "internals.hxx"
+#include "utilities.hxx"
+#include "blend.hxx"
+
+// Blends pixels of the given number of channels of type T, the last channel being alpha.
+template<typename T, size_t channels, bool blendAlpha> void blendOverScalar(uint8_t *const dst, const uint8_t *const src,
+	const size_t pixels) noexcept
+{
+	using pixel_t = std::array<T, channels>;
+	constexpr T max = std::numeric_limits<T>::max();
+	for (size_t i = 0; i < pixels; ++i)
+	{
+		pixel_t pixel = as<pixel_t>(dst, i);
+		const pixel_t source = as<pixel_t>(src, i);
+		const T alpha = source[channels - 1];
+		for (size_t c = 0; c < channels - 1; ++c)
+			pixel[c] = compOver(pixel[c], source[c], alpha);
+		if (blendAlpha)
+			pixel[channels - 1] = compOver(pixel[channels - 1], max, alpha);
+		copyBack(dst, i, pixel);
+	}
+}
+
+void blendPremultipliedScalar(uint8_t *const dst, const uint8_t *const src, const size_t pixels) noexcept
+{
+	for (size_t i = 0; i < pixels * 4; i += 4)
+	{
+		const uint32_t alpha = src[i + 3];
+		for (size_t c = 0; c < 4; ++c)
+			dst[i + c] = uint8_t(std::min(src[i + c] + (((256U - alpha) * dst[i + c]) >> 8U), 255U));
+	}
+}
+
+#ifdef APNG_X86
+// The kernels work on 16-bit lanes, with 8-bit samples widened to 16 bits first. compOver() computes
+// ((max - alpha + 1) * a >> bits) + ((alpha + 1) * b >> bits), and for 8-bit samples both products fit in a lane.
+// 16-bit samples need the high halves of 32-bit products, which is done without widening by using
+// (65536 - alpha) * a >> 16 == a - ceil(alpha * a / 65536), and treating alpha == 65535 specially in the second term.
+// Like compOver(), 16-bit samples are used in memory order. The alpha lanes are either masked back to the destination's,
+// or blended with the source's alpha lanes set to max.
+
+// Copies each pixel's alpha lane into its colour lanes: every 4th lane for RGBA, every other one for GreyA.
+// The shuffles take this as an immediate, so it has to be a constant expression even when not optimising.
+template<size_t channels> struct alphaShuffle_t final { constexpr static int value = channels == 4 ? 0xFF : 0xF5; };
+
+template<size_t channels> TARGET("sse2") inline __m128i alphaLanesSSE2() noexcept
+{
+	return channels == 4 ? _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1) :
+		_mm_setr_epi16(0, -1, 0, -1, 0, -1, 0, -1);
+}
+
+template<size_t channels, bool blendAlpha> TARGET("sse2") inline __m128i blend8SSE2(const __m128i dst, const __m128i src) noexcept
+{
+	const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, alphaShuffle_t<channels>::value), alphaShuffle_t<channels>::value);
+	const __m128i mask = alphaLanesSSE2<channels>();
+	const __m128i source = blendAlpha ? _mm_or_si128(src, _mm_and_si128(mask, _mm_set1_epi16(0xFF))) : src;
+	const __m128i dstPart = _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_set1_epi16(256), alpha), dst), 8);
+	const __m128i srcPart = _mm_srli_epi16(_mm_mullo_epi16(_mm_add_epi16(alpha, _mm_set1_epi16(1)), source), 8);
+	if (blendAlpha)
+		return _mm_add_epi16(dstPart, srcPart);
+	return _mm_or_si128(_mm_and_si128(mask, dst), _mm_andnot_si128(mask, _mm_add_epi16(dstPart, srcPart)));
+}
+
+// Premultiplied colour already carries the source's share, so only the destination's needs working out.
+TARGET("sse2") inline __m128i blendPremultiplied8SSE2(const __m128i dst, const __m128i src) noexcept
+{
+	const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, 0xFF), 0xFF);
+	const __m128i dstPart = _mm_srli_epi16(_mm_mullo_epi16(_mm_sub_epi16(_mm_set1_epi16(256), alpha), dst), 8);
+	return _mm_add_epi16(src, dstPart);
+}
+
+template<size_t channels, bool blendAlpha> TARGET("sse2") inline __m128i blend16SSE2(const __m128i dst, const __m128i src) noexcept
+{
+	const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(src, alphaShuffle_t<channels>::value), alphaShuffle_t<channels>::value);
+	const __m128i mask = alphaLanesSSE2<channels>();
+	const __m128i source = blendAlpha ? _mm_or_si128(src, mask) : src;
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i ones = _mm_cmpeq_epi16(zero, zero);
+	// dst - hi(alpha * dst) - (lo(alpha * dst) != 0), the comparison result being -1 when lo is 0.
+	const __m128i exact = _mm_cmpeq_epi16(_mm_mullo_epi16(alpha, dst), zero);
+	const __m128i dstPart = _mm_sub_epi16(_mm_add_epi16(_mm_sub_epi16(dst, _mm_mulhi_epu16(alpha, dst)), ones), exact);
+	const __m128i srcPart = _mm_add_epi16(_mm_mulhi_epu16(_mm_sub_epi16(alpha, ones), source),
+		_mm_and_si128(_mm_cmpeq_epi16(alpha, ones), source));
+	if (blendAlpha)
+		return _mm_add_epi16(dstPart, srcPart);
+	return _mm_or_si128(_mm_and_si128(mask, dst), _mm_andnot_si128(mask, _mm_add_epi16(dstPart, srcPart)));
+}
+
+template<size_t channels, bool blendAlpha> TARGET("sse2")
+	void blendOver8SSE2(uint8_t *const dst, const uint8_t *const src, const size_t pixels) noexcept
+{
+	constexpr size_t blockPixels = 16 / channels;
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + blockPixels <= pixels; i += blockPixels)
+	{
+		const size_t offset = i * channels;
+		const __m128i dstBlock = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + offset));
+		const __m128i srcBlock = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + offset));
+		const __m128i low = blend8SSE2<channels, blendAlpha>(_mm_unpacklo_epi8(dstBlock, zero), _mm_unpacklo_epi8(srcBlock, zero));
+		const __m128i high = blend8SSE2<channels, blendAlpha>(_mm_unpackhi_epi8(dstBlock, zero), _mm_unpackhi_epi8(srcBlock, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + offset), _mm_packus_epi16(low, high));
+	}
+	blendOverScalar<uint8_t, channels, blendAlpha>(dst + i * channels, src + i * channels, pixels - i);
+}
+
+template<size_t channels, bool blendAlpha> TARGET("sse2")
+	void blendOver16SSE2(uint8_t *const dst, const uint8_t *const src, const size_t pixels) noexcept
+{
+	constexpr size_t blockPixels = 8 / channels;
+	size_t i = 0;
+	for (; i + blockPixels <= pixels; i += blockPixels)
+	{
+		const size_t offset = i * channels * 2;
+		const __m128i dstBlock = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + offset));
+		const __m128i srcBlock = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + offset));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + offset), blend16SSE2<channels, blendAlpha>(dstBlock, srcBlock));
+	}
+	blendOverScalar<uint16_t, channels, blendAlpha>(dst + i * channels * 2, src + i * channels * 2, pixels - i);
+}
+
+TARGET("sse2") void blendPremultipliedSSE2(uint8_t *const dst, const uint8_t *const src, const size_t pixels) noexcept
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= pixels; i += 4)
+	{
+		const size_t offset = i * 4;
+		const __m128i dstBlock = _mm_loadu_si128(reinterpret_cast<const __m128i *>(dst + offset));
+		const __m128i srcBlock = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + offset));
+		const __m128i low = blendPremultiplied8SSE2(_mm_unpacklo_epi8(dstBlock, zero), _mm_unpacklo_epi8(srcBlock, zero));
+		const __m128i high = blendPremultiplied8SSE2(_mm_unpackhi_epi8(dstBlock, zero), _mm_unpackhi_epi8(srcBlock, zero));
+		// Packing saturates, just as the scalar version clamps.
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + offset), _mm_packus_epi16(low, high));
+	}
+	blendPremultipliedScalar(dst + i * 4, src + i * 4, pixels - i);
+}
+
+template<size_t channels> TARGET("avx2") inline __m256i alphaLanesAVX2() noexcept
+{
+	return channels == 4 ? _mm256_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1) :
+		_mm256_setr_epi16(0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1, 0, -1);
+}
+
+template<size_t channels, bool blendAlpha> TARGET("avx2") inline __m256i blend8AVX2(const __m256i dst, const __m256i src) noexcept
+{
+	const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(src, alphaShuffle_t<channels>::value), alphaShuffle_t<channels>::value);
+	const __m256i mask = alphaLanesAVX2<channels>();
+	const __m256i source = blendAlpha ? _mm256_or_si256(src, _mm256_and_si256(mask, _mm256_set1_epi16(0xFF))) : src;
+	const __m256i dstPart = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_set1_epi16(256), alpha), dst), 8);
+	const __m256i srcPart = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_add_epi16(alpha, _mm256_set1_epi16(1)), source), 8);
+	if (blendAlpha)
+		return _mm256_add_epi16(dstPart, srcPart);
+	return _mm256_blendv_epi8(_mm256_add_epi16(dstPart, srcPart), dst, mask);
+}
+
+TARGET("avx2") inline __m256i blendPremultiplied8AVX2(const __m256i dst, const __m256i src) noexcept
+{
+	const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(src, 0xFF), 0xFF);
+	const __m256i dstPart = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_sub_epi16(_mm256_set1_epi16(256), alpha), dst), 8);
+	return _mm256_add_epi16(src, dstPart);
+}
+
+template<size_t channels, bool blendAlpha> TARGET("avx2") inline __m256i blend16AVX2(const __m256i dst, const __m256i src) noexcept
+{
+	const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(src, alphaShuffle_t<channels>::value), alphaShuffle_t<channels>::value);
+	const __m256i mask = alphaLanesAVX2<channels>();
+	const __m256i source = blendAlpha ? _mm256_or_si256(src, mask) : src;
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_cmpeq_epi16(zero, zero);
+	const __m256i exact = _mm256_cmpeq_epi16(_mm256_mullo_epi16(alpha, dst), zero);
+	const __m256i dstPart = _mm256_sub_epi16(_mm256_add_epi16(_mm256_sub_epi16(dst, _mm256_mulhi_epu16(alpha, dst)), ones), exact);
+	const __m256i srcPart = _mm256_add_epi16(_mm256_mulhi_epu16(_mm256_sub_epi16(alpha, ones), source),
+		_mm256_and_si256(_mm256_cmpeq_epi16(alpha, ones), source));
+	if (blendAlpha)
+		return _mm256_add_epi16(dstPart, srcPart);
+	return _mm256_blendv_epi8(_mm256_add_epi16(dstPart, srcPart), dst, mask);
+}
+
+template<size_t channels, bool blendAlpha> TARGET("avx2")
+	void blendOver8AVX2(uint8_t *const dst, const uint8_t *const src, const size_t pixels) noexcept
+{
+	constexpr size_t blockPixels = 32 / channels;
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + blockPixels <= pixels; i += blockPixels)
+	{
+		const size_t offset = i * channels;
+		const __m256i dstBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + offset));
+		const __m256i srcBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + offset));
+		// Unpacking and packing both work within each 128-bit lane, so the pixel order comes back out unchanged.
+		const __m256i low = blend8AVX2<channels, blendAlpha>(_mm256_unpacklo_epi8(dstBlock, zero), _mm256_unpacklo_epi8(srcBlock, zero));
+		const __m256i high = blend8AVX2<channels, blendAlpha>(_mm256_unpackhi_epi8(dstBlock, zero), _mm256_unpackhi_epi8(srcBlock, zero));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + offset), _mm256_packus_epi16(low, high));
+	}
+	blendOver8SSE2<channels, blendAlpha>(dst + i * channels, src + i * channels, pixels - i);
+}
+
+template<size_t channels, bool blendAlpha> TARGET("avx2")
+	void blendOver16AVX2(uint8_t *const dst, const uint8_t *const src, const size_t pixels) noexcept
+{
+	constexpr size_t blockPixels = 16 / channels;
+	size_t i = 0;
+	for (; i + blockPixels <= pixels; i += blockPixels)
+	{
+		const size_t offset = i * channels * 2;
+		const __m256i dstBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + offset));
+		const __m256i srcBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + offset));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + offset), blend16AVX2<channels, blendAlpha>(dstBlock, srcBlock));
+	}
+	blendOver16SSE2<channels, blendAlpha>(dst + i * channels * 2, src + i * channels * 2, pixels - i);
+}
+TARGET("avx2") void blendPremultipliedAVX2(uint8_t *const dst, const uint8_t *const src, const size_t pixels) noexcept
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 8 <= pixels; i += 8)
+	{
+		const size_t offset = i * 4;
+		const __m256i dstBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(dst + offset));
+		const __m256i srcBlock = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + offset));
+		const __m256i low = blendPremultiplied8AVX2(_mm256_unpacklo_epi8(dstBlock, zero), _mm256_unpacklo_epi8(srcBlock, zero));
+		const __m256i high = blendPremultiplied8AVX2(_mm256_unpackhi_epi8(dstBlock, zero), _mm256_unpackhi_epi8(srcBlock, zero));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + offset), _mm256_packus_epi16(low, high));
+	}
+	blendPremultipliedSSE2(dst + i * 4, src + i * 4, pixels - i);
+}
+#endif
+
+static const blendOver_t scalarKernels{blendOverScalar<uint8_t, 4, false>, blendOverScalar<uint16_t, 4, false>,
+	blendOverScalar<uint8_t, 2, false>, blendOverScalar<uint16_t, 2, false>, blendOverScalar<uint8_t, 4, true>,
+	blendOverScalar<uint16_t, 4, true>, blendOverScalar<uint8_t, 2, true>, blendOverScalar<uint16_t, 2, true>,
+	blendPremultipliedScalar};
+#ifdef APNG_X86
+static const blendOver_t sse2Kernels{blendOver8SSE2<4, false>, blendOver16SSE2<4, false>, blendOver8SSE2<2, false>,
+	blendOver16SSE2<2, false>, blendOver8SSE2<4, true>, blendOver16SSE2<4, true>, blendOver8SSE2<2, true>,
+	blendOver16SSE2<2, true>, blendPremultipliedSSE2};
+static const blendOver_t avx2Kernels{blendOver8AVX2<4, false>, blendOver16AVX2<4, false>, blendOver8AVX2<2, false>,
+	blendOver16AVX2<2, false>, blendOver8AVX2<4, true>, blendOver16AVX2<4, true>, blendOver8AVX2<2, true>,
+	blendOver16AVX2<2, true>, blendPremultipliedAVX2};
+#endif
+
+const blendOver_t &blendOver_t::select() noexcept
+	{ return *select(supportedSIMD()); }
+
+const blendOver_t *blendOver_t::select(const simdLevel_t level) noexcept
+{
+	if (level > supportedSIMD())
+		return nullptr;
+	switch (level)
+	{
+#ifdef APNG_X86
+		case simdLevel_t::avx2:
+			return &avx2Kernels;
+		// There's nothing in SSE4.1 these kernels would benefit from.
+		case simdLevel_t::sse41:
+		case simdLevel_t::sse2:
+			return &sse2Kernels;
+#endif
+		case simdLevel_t::scalar:
+		default:
+			return &scalarKernels;
+	}
+}
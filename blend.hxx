@@ -0,0 +1,61 @@
+#ifndef BLEND_HXX
+#define BLEND_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include "apng.hxx"
+#include "unfilter.hxx"
+
+// Row kernels that blend source pixels over destination pixels for the formats with an alpha channel.
+// They match compOver()'s rounding exactly and leave the destination's alpha as it is, as compNop() does,
+// unless asked to blend alpha too, which computes it as compOver(destination alpha, max, source alpha).
+// Premultiplied pixels are blended as source + compOver()'s destination term, saturating, alpha included.
+struct blendOver_t final
+{
+public:
+	using blendFunc_t = void (*)(uint8_t *const, const uint8_t *const, const size_t);
+
+private:
+	blendFunc_t rgba8[2];
+	blendFunc_t rgba16[2];
+	blendFunc_t greyA8[2];
+	blendFunc_t greyA16[2];
+	blendFunc_t premultiplied;
+
+public:
+	constexpr blendOver_t(const blendFunc_t rgba8Func, const blendFunc_t rgba16Func, const blendFunc_t greyA8Func,
+		const blendFunc_t greyA16Func, const blendFunc_t rgba8AlphaFunc, const blendFunc_t rgba16AlphaFunc,
+		const blendFunc_t greyA8AlphaFunc, const blendFunc_t greyA16AlphaFunc, const blendFunc_t premultipliedFunc) noexcept :
+		rgba8{rgba8Func, rgba8AlphaFunc}, rgba16{rgba16Func, rgba16AlphaFunc}, greyA8{greyA8Func, greyA8AlphaFunc},
+		greyA16{greyA16Func, greyA16AlphaFunc}, premultiplied{premultipliedFunc} { }
+
+	// Returns nullptr for the formats without an alpha channel.
+	blendFunc_t operator ()(const pixelFormat_t format, const bool blendAlpha = false) const noexcept
+	{
+		switch (format)
+		{
+			case pixelFormat_t::format32bppRGBA:
+			case pixelFormat_t::format32bppBGRA:
+				return rgba8[blendAlpha];
+			case pixelFormat_t::format64bppRGBA:
+			case pixelFormat_t::format64bppRGBAHost:
+				return rgba16[blendAlpha];
+			case pixelFormat_t::format8bppGreyA:
+				return greyA8[blendAlpha];
+			case pixelFormat_t::format16bppGreyA:
+			case pixelFormat_t::format16bppGreyAHost:
+				return greyA16[blendAlpha];
+			case pixelFormat_t::format32bppRGBAPremultiplied:
+			case pixelFormat_t::format32bppBGRAPremultiplied:
+				return premultiplied;
+			default:
+				return nullptr;
+		}
+	}
+
+	static const blendOver_t &select() noexcept;
+	// Returns nullptr if the CPU does not support the requested level.
+	static const blendOver_t *select(const simdLevel_t level) noexcept;
+};
+
+#endif /*BLEND_HXX*/
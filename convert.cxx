@@ -0,0 +1,592 @@
+#include <cstring>
+#include "internals.hxx"
+#include "utilities.hxx"
+#include "convert.hxx"
+
+static size_t channelsOf(const pixelFormat_t format) noexcept
+{
+	switch (format)
+	{
+		case pixelFormat_t::format8bppGrey:
+		case pixelFormat_t::format16bppGrey:
+		case pixelFormat_t::format16bppGreyHost:
+			return 1;
+		case pixelFormat_t::format8bppGreyA:
+		case pixelFormat_t::format16bppGreyA:
+		case pixelFormat_t::format16bppGreyAHost:
+			return 2;
+		case pixelFormat_t::format24bppRGB:
+		case pixelFormat_t::format48bppRGB:
+		case pixelFormat_t::format48bppRGBHost:
+			return 3;
+		default:
+			return 4;
+	}
+}
+
+static bool isWide(const pixelFormat_t format) noexcept
+{
+	return format == pixelFormat_t::format16bppGrey || format == pixelFormat_t::format16bppGreyA ||
+		format == pixelFormat_t::format48bppRGB || format == pixelFormat_t::format64bppRGBA;
+}
+
+static size_t bitsOf(const bitDepth_t bitDepth) noexcept
+{
+	switch (bitDepth)
+	{
+		case bitDepth_t::bps1:
+			return 1;
+		case bitDepth_t::bps2:
+			return 2;
+		case bitDepth_t::bps4:
+			return 4;
+		case bitDepth_t::bps16:
+			return 16;
+		case bitDepth_t::bps8:
+		default:
+			return 8;
+	}
+}
+
+struct convertKernels_t final
+{
+	convert_t::convertFunc_t strip16;
+	convert_t::convertFunc_t swap16;
+	// Indexed by the number of input channels less one, then by whether the output is BGRA.
+	convert_t::convertFunc_t expand[4][2];
+	convert_t::convertFunc_t premultiply;
+};
+
+// Maps each byte of packed samples to the bytes they unpack to, PNG packing the leftmost pixel in the high bits.
+template<size_t bits, bool scale> struct unpackTable_t final
+{
+	std::array<std::array<uint8_t, 8 / bits>, 256> values;
+
+	unpackTable_t() noexcept : values{}
+	{
+		constexpr uint8_t mask = (1U << bits) - 1U;
+		for (size_t byte = 0; byte < values.size(); ++byte)
+		{
+			for (size_t i = 0; i < 8 / bits; ++i)
+			{
+				const uint8_t value = (byte >> (8 - bits - (i * bits))) & mask;
+				values[byte][i] = scale ? value * (0xFFU / mask) : value;
+			}
+		}
+	}
+};
+
+// Unpacks a whole byte's worth of samples at a time, ignoring any padding bits at the end of the scanline.
+template<size_t bits, bool scale> void unpackScalar(uint8_t *const dst, const uint8_t *const src, const size_t pixels,
+	const uint16_t *const) noexcept
+{
+	static const unpackTable_t<bits, scale> table{};
+	constexpr size_t pixelsPerByte = 8 / bits;
+	const size_t bytes = pixels / pixelsPerByte;
+	for (size_t i = 0; i < bytes; ++i)
+		memcpy(dst + (i * pixelsPerByte), table.values[src[i]].data(), pixelsPerByte);
+	if (pixels % pixelsPerByte)
+		memcpy(dst + (bytes * pixelsPerByte), table.values[src[bytes]].data(), pixels % pixelsPerByte);
+}
+
+template<bool scale> static convert_t::convertFunc_t unpackKernel(const bitDepth_t bitDepth) noexcept
+{
+	switch (bitDepth)
+	{
+		case bitDepth_t::bps1:
+			return unpackScalar<1, scale>;
+		case bitDepth_t::bps2:
+			return unpackScalar<2, scale>;
+		case bitDepth_t::bps4:
+			return unpackScalar<4, scale>;
+		default:
+			return nullptr;
+	}
+}
+
+// Scales a sub-byte greyscale tRNS value up along with the samples, keeping it an exact match for the same ones.
+static std::array<uint16_t, 3> scaleTrans(const bitDepth_t bitDepth, const uint16_t *const trans) noexcept
+{
+	const uint16_t mask = (1U << bitsOf(bitDepth)) - 1U;
+	const uint16_t value = (trans[0] & mask) * (0xFFU / mask);
+	return {{value, value, value}};
+}
+
+// The high byte of a big-endian sample comes first, so narrowing just takes every other byte.
+void strip16Scalar(uint8_t *const dst, const uint8_t *const src, const size_t samples, const uint16_t *const) noexcept
+{
+	for (size_t i = 0; i < samples; ++i)
+		dst[i] = src[i * 2];
+}
+
+void swap16Scalar(uint8_t *const dst, const uint8_t *const src, const size_t samples, const uint16_t *const) noexcept
+{
+	for (size_t i = 0; i < samples; ++i)
+	{
+		const uint16_t value = read16(src + (i * 2));
+		memcpy(dst + (i * 2), &value, sizeof(uint16_t));
+	}
+}
+
+template<size_t channels, bool bgr> void expandScalar(uint8_t *const dst, const uint8_t *const src, const size_t pixels,
+	const uint16_t *const trans) noexcept
+{
+	// Only the formats without an alpha channel have a tRNS colour, compared as compFrame() does for 8-bit samples.
+	const bool transValid = trans && (channels == 1 || channels == 3);
+	const uint8_t transR = transValid ? uint8_t(trans[0]) : 0;
+	const uint8_t transG = transValid ? uint8_t(channels == 3 ? trans[1] : trans[0]) : 0;
+	const uint8_t transB = transValid ? uint8_t(channels == 3 ? trans[2] : trans[0]) : 0;
+	for (size_t i = 0; i < pixels; ++i)
+	{
+		const uint8_t *const pixel = src + (i * channels);
+		uint8_t *const result = dst + (i * 4);
+		const uint8_t r = pixel[0];
+		const uint8_t g = channels >= 3 ? pixel[1] : r;
+		const uint8_t b = channels >= 3 ? pixel[2] : r;
+		uint8_t a = channels == 4 ? pixel[3] : channels == 2 ? pixel[1] : 0xFFU;
+		if (transValid && r == transR && g == transG && b == transB)
+			a = 0;
+		result[0] = bgr ? b : r;
+		result[1] = g;
+		result[2] = bgr ? r : b;
+		result[3] = a;
+	}
+}
+
+// A 16-bit image with a tRNS colour has to be compared against it before its samples are narrowed.
+template<size_t channels, bool bgr> void expandTrans16Scalar(uint8_t *const dst, const uint8_t *const src,
+	const size_t pixels, const uint16_t *const trans) noexcept
+{
+	for (size_t i = 0; i < pixels; ++i)
+	{
+		const uint8_t *const pixel = src + (i * channels * 2);
+		uint8_t *const result = dst + (i * 4);
+		const bool transparent = read16(pixel) == trans[0] &&
+			(channels == 1 || (read16(pixel + 2) == trans[1] && read16(pixel + 4) == trans[2]));
+		const uint8_t r = pixel[0];
+		const uint8_t g = channels == 3 ? pixel[2] : r;
+		const uint8_t b = channels == 3 ? pixel[4] : r;
+		result[0] = bgr ? b : r;
+		result[1] = g;
+		result[2] = bgr ? r : b;
+		result[3] = transparent ? 0 : 0xFFU;
+	}
+}
+
+// Rounds colour * alpha / 255 to nearest, exactly, for every 8-bit colour and alpha.
+inline uint8_t premultiplySample(const uint8_t colour, const uint8_t alpha) noexcept
+{
+	const uint32_t value = (uint32_t{colour} * alpha) + 128U;
+	return uint8_t((value + (value >> 8U)) >> 8U);
+}
+
+void premultiplyScalar(uint8_t *const dst, const uint8_t *const src, const size_t pixels, const uint16_t *const) noexcept
+{
+	for (size_t i = 0; i < pixels; ++i)
+	{
+		const uint8_t alpha = src[(i * 4) + 3];
+		for (size_t c = 0; c < 3; ++c)
+			dst[(i * 4) + c] = premultiplySample(src[(i * 4) + c], alpha);
+		dst[(i * 4) + 3] = alpha;
+	}
+}
+
+#ifdef APNG_X86
+// All the vector kernels rely on x86 being little-endian: a big-endian sample loaded into a 16-bit lane
+// has its high byte in the lane's low half, and 4 bytes of RGBA or BGRA load as one 32-bit lane with alpha on top.
+TARGET("sse2") void strip16SSE2(uint8_t *const dst, const uint8_t *const src, const size_t samples,
+	const uint16_t *const trans) noexcept
+{
+	const __m128i highBytes = _mm_set1_epi16(0x00FF);
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		const __m128i low = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (i * 2)));
+		const __m128i high = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (i * 2) + 16));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i),
+			_mm_packus_epi16(_mm_and_si128(low, highBytes), _mm_and_si128(high, highBytes)));
+	}
+	strip16Scalar(dst + i, src + (i * 2), samples - i, trans);
+}
+
+TARGET("sse2") void swap16SSE2(uint8_t *const dst, const uint8_t *const src, const size_t samples,
+	const uint16_t *const trans) noexcept
+{
+	size_t i = 0;
+	for (; i + 8 <= samples; i += 8)
+	{
+		const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (i * 2)));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + (i * 2)),
+			_mm_or_si128(_mm_slli_epi16(value, 8), _mm_srli_epi16(value, 8)));
+	}
+	swap16Scalar(dst + (i * 2), src + (i * 2), samples - i, trans);
+}
+
+// Works on 2 pixels widened to 16-bit lanes, the alpha lanes being left as they are.
+TARGET("sse2") inline __m128i premultiply8SSE2(const __m128i pixels) noexcept
+{
+	const __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(pixels, 0xFF), 0xFF);
+	const __m128i value = _mm_add_epi16(_mm_mullo_epi16(pixels, alpha), _mm_set1_epi16(128));
+	const __m128i result = _mm_srli_epi16(_mm_add_epi16(value, _mm_srli_epi16(value, 8)), 8);
+	const __m128i mask = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+	return _mm_or_si128(_mm_and_si128(mask, pixels), _mm_andnot_si128(mask, result));
+}
+
+TARGET("sse2") void premultiplySSE2(uint8_t *const dst, const uint8_t *const src, const size_t pixels,
+	const uint16_t *const trans) noexcept
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 4 <= pixels; i += 4)
+	{
+		const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (i * 4)));
+		const __m128i low = premultiply8SSE2(_mm_unpacklo_epi8(block, zero));
+		const __m128i high = premultiply8SSE2(_mm_unpackhi_epi8(block, zero));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + (i * 4)), _mm_packus_epi16(low, high));
+	}
+	premultiplyScalar(dst + (i * 4), src + (i * 4), pixels - i, trans);
+}
+
+// Builds the byte shuffle that expands the 4 pixels starting at pixel index first of a 16 byte block into RGBA or
+// BGRA, leaving the alpha bytes of formats without alpha as 0 to be filled in afterwards.
+template<size_t channels, bool bgr> TARGET("ssse3") inline __m128i expandShuffle(const size_t first) noexcept
+{
+	alignas(16) int8_t shuffle[16]{};
+	for (size_t i = 0; i < 4; ++i)
+	{
+		const int8_t offset = int8_t((first + i) * channels);
+		const int8_t r = offset;
+		const int8_t g = channels >= 3 ? int8_t(offset + 1) : offset;
+		const int8_t b = channels >= 3 ? int8_t(offset + 2) : offset;
+		shuffle[(i * 4) + 0] = bgr ? b : r;
+		shuffle[(i * 4) + 1] = g;
+		shuffle[(i * 4) + 2] = bgr ? r : b;
+		shuffle[(i * 4) + 3] = channels == 4 ? int8_t(offset + 3) : channels == 2 ? int8_t(offset + 1) : -1;
+	}
+	return _mm_load_si128(reinterpret_cast<const __m128i *>(shuffle));
+}
+
+template<size_t channels, bool bgr> TARGET("ssse3") void expandSSSE3(uint8_t *const dst, const uint8_t *const src,
+	const size_t pixels, const uint16_t *const trans) noexcept
+{
+	// RGB uses 12 of each 16 bytes loaded, every other format the whole lot.
+	constexpr size_t blockPixels = channels == 3 ? 4 : 16 / channels;
+	constexpr size_t outputs = blockPixels / 4;
+	constexpr bool opaque = channels == 1 || channels == 3;
+	__m128i shuffles[outputs];
+	for (size_t i = 0; i < outputs; ++i)
+		shuffles[i] = expandShuffle<channels, bgr>(i * 4);
+	const __m128i alphaBytes = _mm_set1_epi32(int32_t(0xFF000000U));
+	// A pixel matches the tRNS colour when its expanded form, with the alpha filled in, matches the colour's.
+	const bool transValid = opaque && trans;
+	uint8_t transPixel[4]{};
+	if (transValid)
+	{
+		const uint8_t colour[3]{uint8_t(trans[0]), uint8_t(channels == 3 ? trans[1] : trans[0]),
+			uint8_t(channels == 3 ? trans[2] : trans[0])};
+		transPixel[0] = bgr ? colour[2] : colour[0];
+		transPixel[1] = colour[1];
+		transPixel[2] = bgr ? colour[0] : colour[2];
+		transPixel[3] = 0xFFU;
+	}
+	int32_t transValue = 0;
+	memcpy(&transValue, transPixel, sizeof(int32_t));
+	const __m128i transPattern = _mm_set1_epi32(transValue);
+
+	size_t i = 0;
+	for (; (i * channels) + 16 <= pixels * channels; i += blockPixels)
+	{
+		const __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + (i * channels)));
+		for (size_t j = 0; j < outputs; ++j)
+		{
+			__m128i result = _mm_shuffle_epi8(block, shuffles[j]);
+			if (opaque)
+				result = _mm_or_si128(result, alphaBytes);
+			if (transValid)
+				result = _mm_andnot_si128(_mm_and_si128(_mm_cmpeq_epi32(result, transPattern), alphaBytes), result);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + ((i + (j * 4)) * 4)), result);
+		}
+	}
+	expandScalar<channels, bgr>(dst + (i * 4), src + (i * channels), pixels - i, trans);
+}
+
+TARGET("avx2") void strip16AVX2(uint8_t *const dst, const uint8_t *const src, const size_t samples,
+	const uint16_t *const trans) noexcept
+{
+	const __m256i highBytes = _mm256_set1_epi16(0x00FF);
+	size_t i = 0;
+	for (; i + 32 <= samples; i += 32)
+	{
+		const __m256i low = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + (i * 2)));
+		const __m256i high = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + (i * 2) + 32));
+		// Packing works within each 128-bit lane, so the middle two quarters come out swapped.
+		const __m256i packed = _mm256_packus_epi16(_mm256_and_si256(low, highBytes), _mm256_and_si256(high, highBytes));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_permute4x64_epi64(packed, 0xD8));
+	}
+	strip16SSE2(dst + i, src + (i * 2), samples - i, trans);
+}
+
+TARGET("avx2") void swap16AVX2(uint8_t *const dst, const uint8_t *const src, const size_t samples,
+	const uint16_t *const trans) noexcept
+{
+	size_t i = 0;
+	for (; i + 16 <= samples; i += 16)
+	{
+		const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + (i * 2)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + (i * 2)),
+			_mm256_or_si256(_mm256_slli_epi16(value, 8), _mm256_srli_epi16(value, 8)));
+	}
+	swap16SSE2(dst + (i * 2), src + (i * 2), samples - i, trans);
+}
+
+TARGET("avx2") inline __m256i premultiply8AVX2(const __m256i pixels) noexcept
+{
+	const __m256i alpha = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(pixels, 0xFF), 0xFF);
+	const __m256i value = _mm256_add_epi16(_mm256_mullo_epi16(pixels, alpha), _mm256_set1_epi16(128));
+	const __m256i result = _mm256_srli_epi16(_mm256_add_epi16(value, _mm256_srli_epi16(value, 8)), 8);
+	const __m256i mask = _mm256_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1, 0, 0, 0, -1);
+	return _mm256_blendv_epi8(result, pixels, mask);
+}
+
+TARGET("avx2") void premultiplyAVX2(uint8_t *const dst, const uint8_t *const src, const size_t pixels,
+	const uint16_t *const trans) noexcept
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 8 <= pixels; i += 8)
+	{
+		const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + (i * 4)));
+		const __m256i low = premultiply8AVX2(_mm256_unpacklo_epi8(block, zero));
+		const __m256i high = premultiply8AVX2(_mm256_unpackhi_epi8(block, zero));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + (i * 4)), _mm256_packus_epi16(low, high));
+	}
+	premultiplySSE2(dst + (i * 4), src + (i * 4), pixels - i, trans);
+}
+
+// Swaps red and blue, the one expansion that's a pure in-lane shuffle and so gains from the wider registers.
+TARGET("avx2") void swizzleAVX2(uint8_t *const dst, const uint8_t *const src, const size_t pixels,
+	const uint16_t *const trans) noexcept
+{
+	const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+		2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+	size_t i = 0;
+	for (; i + 8 <= pixels; i += 8)
+	{
+		const __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + (i * 4)));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + (i * 4)), _mm256_shuffle_epi8(block, shuffle));
+	}
+	expandSSSE3<4, true>(dst + (i * 4), src + (i * 4), pixels - i, trans);
+}
+#endif
+
+static const convertKernels_t scalarKernels{strip16Scalar, swap16Scalar,
+	{{expandScalar<1, false>, expandScalar<1, true>}, {expandScalar<2, false>, expandScalar<2, true>},
+	{expandScalar<3, false>, expandScalar<3, true>}, {expandScalar<4, false>, expandScalar<4, true>}},
+	premultiplyScalar};
+#ifdef APNG_X86
+// pshufb is SSSE3, which the sse41 level implies, so plain SSE2 only gets the kernels that don't expand pixels.
+static const convertKernels_t sse2Kernels{strip16SSE2, swap16SSE2,
+	{{expandScalar<1, false>, expandScalar<1, true>}, {expandScalar<2, false>, expandScalar<2, true>},
+	{expandScalar<3, false>, expandScalar<3, true>}, {expandScalar<4, false>, expandScalar<4, true>}},
+	premultiplySSE2};
+static const convertKernels_t sse41Kernels{strip16SSE2, swap16SSE2,
+	{{expandSSSE3<1, false>, expandSSSE3<1, true>}, {expandSSSE3<2, false>, expandSSSE3<2, true>},
+	{expandSSSE3<3, false>, expandSSSE3<3, true>}, {expandSSSE3<4, false>, expandSSSE3<4, true>}},
+	premultiplySSE2};
+static const convertKernels_t avx2Kernels{strip16AVX2, swap16AVX2,
+	{{expandSSSE3<1, false>, expandSSSE3<1, true>}, {expandSSSE3<2, false>, expandSSSE3<2, true>},
+	{expandSSSE3<3, false>, expandSSSE3<3, true>}, {expandSSSE3<4, false>, swizzleAVX2}},
+	premultiplyAVX2};
+#endif
+
+static const convertKernels_t &selectKernels(const simdLevel_t level) noexcept
+{
+	if (level > supportedSIMD())
+		return scalarKernels;
+	switch (level)
+	{
+#ifdef APNG_X86
+		case simdLevel_t::avx2:
+			return avx2Kernels;
+		case simdLevel_t::sse41:
+			return sse41Kernels;
+		case simdLevel_t::sse2:
+			return sse2Kernels;
+#endif
+		case simdLevel_t::scalar:
+		default:
+			return scalarKernels;
+	}
+}
+
+convert_t::convert_t(const pixelFormat_t input, const targetFormat_t target, const uint16_t *const trans,
+	const simdLevel_t level) noexcept : _input{input}, _output{outputFormat(input, target)},
+	inputChannels{channelsOf(input)}, inputBits{channelsOf(input) * (isWide(input) ? 16 : 8)}, unpack{}, reduce{},
+	expand{}, premultiply{}, transValid{trans != nullptr}, transValue{}, outputTransValue{},
+	inputBytes{channelsOf(input) * (isWide(input) ? 2 : 1)}, paletteBytes{0}, paletteTable{}
+{
+	const convertKernels_t &kernels = selectKernels(level);
+	const bool wide = isWide(input);
+	if (transValid)
+	{
+		for (size_t i = 0; i < 3; ++i)
+		{
+			transValue[i] = trans[i];
+			// Narrowing the tRNS colour along with the samples can make it match a few more colours than it did.
+			outputTransValue[i] = target == targetFormat_t::strip16 && wide ? trans[i] >> 8U : trans[i];
+		}
+	}
+
+	switch (target)
+	{
+		case targetFormat_t::png:
+			break;
+		case targetFormat_t::host16:
+			if (wide)
+				reduce = kernels.swap16;
+			break;
+		case targetFormat_t::strip16:
+			if (wide)
+				reduce = kernels.strip16;
+			break;
+		case targetFormat_t::rgba8:
+		case targetFormat_t::bgra8:
+		case targetFormat_t::rgba8Premultiplied:
+		case targetFormat_t::bgra8Premultiplied:
+		{
+			const bool bgr = target == targetFormat_t::bgra8 || target == targetFormat_t::bgra8Premultiplied;
+			if (wide && transValid && inputChannels == 1)
+				expand = bgr ? expandTrans16Scalar<1, true> : expandTrans16Scalar<1, false>;
+			else if (wide && transValid && inputChannels == 3)
+				expand = bgr ? expandTrans16Scalar<3, true> : expandTrans16Scalar<3, false>;
+			else
+			{
+				if (wide)
+					reduce = kernels.strip16;
+				if (inputChannels != 4 || bgr)
+					expand = kernels.expand[inputChannels - 1][bgr];
+			}
+			if (target == targetFormat_t::rgba8Premultiplied || target == targetFormat_t::bgra8Premultiplied)
+				premultiply = kernels.premultiply;
+			break;
+		}
+	}
+}
+
+convert_t::convert_t(const bitDepth_t bitDepth, const targetFormat_t target, const uint16_t *const trans,
+	const simdLevel_t level) noexcept :
+	convert_t{pixelFormat_t::format8bppGrey, target, trans ? scaleTrans(bitDepth, trans).data() : nullptr, level}
+{
+	inputBits = bitsOf(bitDepth);
+	unpack = unpackKernel<true>(bitDepth);
+}
+
+convert_t::convert_t(const bitDepth_t bitDepth, const std::vector<std::array<uint8_t, 4>> &palette,
+	const bool paletteAlpha, const targetFormat_t target, const simdLevel_t level) noexcept :
+	convert_t{paletteAlpha ? pixelFormat_t::format32bppRGBA : pixelFormat_t::format24bppRGB, target, nullptr, level}
+{
+	// Running the palette through the conversion every pixel would otherwise get fills the table with output pixels.
+	// Indices past the end of the palette come out as opaque black.
+	std::array<uint8_t, 256 * 4> entries{};
+	for (size_t i = 0; i < 256; ++i)
+	{
+		const std::array<uint8_t, 4> entry = i < palette.size() ? palette[i] : std::array<uint8_t, 4>{{0, 0, 0, 0xFFU}};
+		memcpy(entries.data() + (i * inputBytes), entry.data(), inputBytes);
+	}
+	(*this)(paletteTable.data(), entries.data(), 256, nullptr);
+	paletteBytes = channelsOf(_output);
+	reduce = expand = premultiply = nullptr;
+	inputChannels = 1;
+	inputBits = bitsOf(bitDepth);
+	unpack = unpackKernel<false>(bitDepth);
+}
+
+void convert_t::lookup(uint8_t *const dst, const uint8_t *const indices, const size_t pixels) const noexcept
+{
+	// Keeping the two entry sizes apart lets each copy be a fixed size load and store.
+	if (paletteBytes == 4)
+	{
+		for (size_t i = 0; i < pixels; ++i)
+			memcpy(dst + (i * 4), paletteTable.data() + (size_t{indices[i]} * 4), 4);
+	}
+	else
+	{
+		for (size_t i = 0; i < pixels; ++i)
+			memcpy(dst + (i * 3), paletteTable.data() + (size_t{indices[i]} * 3), 3);
+	}
+}
+
+void convert_t::operator ()(uint8_t *const dst, const uint8_t *const src, const size_t pixels,
+	uint8_t *const scratch) const noexcept
+{
+	const uint8_t *data = src;
+	if (unpack)
+	{
+		uint8_t *const result = expand || paletteBytes ? scratch : dst;
+		unpack(result, data, pixels, nullptr);
+		data = result;
+	}
+	if (paletteBytes)
+		return lookup(dst, data, pixels);
+	if (reduce)
+	{
+		uint8_t *const result = expand ? scratch : dst;
+		reduce(result, data, pixels * inputChannels, nullptr);
+		data = result;
+	}
+	if (expand)
+		expand(dst, data, pixels, transValid ? transValue : nullptr);
+	else if (data == src)
+		memcpy(dst, src, pixels * inputBytes);
+	if (premultiply)
+		premultiply(dst, dst, pixels, nullptr);
+}
+
+pixelFormat_t convert_t::outputFormat(const pixelFormat_t input, const targetFormat_t target) noexcept
+{
+	switch (target)
+	{
+		case targetFormat_t::rgba8:
+			return pixelFormat_t::format32bppRGBA;
+		case targetFormat_t::bgra8:
+			return pixelFormat_t::format32bppBGRA;
+		case targetFormat_t::rgba8Premultiplied:
+			return pixelFormat_t::format32bppRGBAPremultiplied;
+		case targetFormat_t::bgra8Premultiplied:
+			return pixelFormat_t::format32bppBGRAPremultiplied;
+		case targetFormat_t::host16:
+			switch (input)
+			{
+				case pixelFormat_t::format16bppGrey:
+					return pixelFormat_t::format16bppGreyHost;
+				case pixelFormat_t::format16bppGreyA:
+					return pixelFormat_t::format16bppGreyAHost;
+				case pixelFormat_t::format48bppRGB:
+					return pixelFormat_t::format48bppRGBHost;
+				case pixelFormat_t::format64bppRGBA:
+					return pixelFormat_t::format64bppRGBAHost;
+				default:
+					return input;
+			}
+		case targetFormat_t::strip16:
+			switch (input)
+			{
+				case pixelFormat_t::format16bppGrey:
+					return pixelFormat_t::format8bppGrey;
+				case pixelFormat_t::format16bppGreyA:
+					return pixelFormat_t::format8bppGreyA;
+				case pixelFormat_t::format48bppRGB:
+					return pixelFormat_t::format24bppRGB;
+				case pixelFormat_t::format64bppRGBA:
+					return pixelFormat_t::format32bppRGBA;
+				default:
+					return input;
+			}
+		case targetFormat_t::png:
+		default:
+			return input;
+	}
+}
+
+bool convert_t::hasAlpha(const pixelFormat_t format) noexcept
+	{ return channelsOf(format) == 2 || channelsOf(format) == 4; }
@@ -0,0 +1,74 @@
+#ifndef CONVERT_HXX
+#define CONVERT_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <array>
+#include <vector>
+#include "apng.hxx"
+#include "unfilter.hxx"
+
+uint8_t pixelBytes(const pixelFormat_t format);
+
+// Converts unfiltered scanlines from the PNG's own pixel format into the one decodeOptions_t::target asks for.
+// This runs on each scanline as it comes out of the unfilter, so frames are only ever written in their final format.
+// A conversion is made of up to three row kernels run one after the other, chosen once up front for the CPU.
+// Sub-byte greyscale is first unpacked to 8 bits per pixel, and palette images are looked up in a table
+// built from the palette in the output format, after which nothing else needs doing to them.
+struct convert_t final
+{
+public:
+	using convertFunc_t = void (*)(uint8_t *const, const uint8_t *const, const size_t, const uint16_t *const);
+
+private:
+	pixelFormat_t _input;
+	pixelFormat_t _output;
+	size_t inputChannels;
+	size_t inputBits;
+	// Unpacks 1, 2 and 4 bit samples to a byte each, scaling greyscale up to the full 8-bit range.
+	convertFunc_t unpack;
+	// Narrows or byte swaps 16-bit samples, and so works on a count of samples rather than pixels.
+	convertFunc_t reduce;
+	// Expands pixels to RGBA or BGRA, giving those that match the tRNS colour an alpha of 0.
+	convertFunc_t expand;
+	// Premultiplies RGBA or BGRA pixels in place.
+	convertFunc_t premultiply;
+	bool transValid;
+	uint16_t transValue[3];
+	uint16_t outputTransValue[3];
+	size_t inputBytes;
+	size_t paletteBytes;
+	std::array<uint8_t, 256 * 4> paletteTable;
+
+	void lookup(uint8_t *const dst, const uint8_t *const indices, const size_t pixels) const noexcept;
+
+public:
+	// Each constructor falls back to the scalar kernels if the CPU does not support the requested level.
+	convert_t(const pixelFormat_t input, const targetFormat_t target, const uint16_t *const trans,
+		const simdLevel_t level = supportedSIMD()) noexcept;
+	// For greyscale images of 1, 2 or 4 bits per pixel.
+	convert_t(const bitDepth_t bitDepth, const targetFormat_t target, const uint16_t *const trans,
+		const simdLevel_t level = supportedSIMD()) noexcept;
+	// For palette images, given the palette's entries as RGBA and whether a tRNS chunk gave them alpha.
+	convert_t(const bitDepth_t bitDepth, const std::vector<std::array<uint8_t, 4>> &palette, const bool paletteAlpha,
+		const targetFormat_t target, const simdLevel_t level = supportedSIMD()) noexcept;
+
+	pixelFormat_t input() const noexcept { return _input; }
+	pixelFormat_t output() const noexcept { return _output; }
+	bool identity() const noexcept { return !unpack && !reduce && !expand && !premultiply && !paletteBytes; }
+	// The tRNS colour as it appears in the output, or nullptr when there isn't one or the output carries alpha instead.
+	const uint16_t *outputTrans() const noexcept { return transValid && !hasAlpha(_output) ? outputTransValue : nullptr; }
+	// How many bytes a scanline of the given number of pixels takes before conversion.
+	size_t inputLength(const size_t pixels) const noexcept { return ((pixels * inputBits) + 7) / 8; }
+	// How large a scratch row operator () needs for a scanline of the given number of pixels.
+	size_t scratchLength(const size_t pixels) const noexcept
+		{ return (reduce || unpack) && (expand || paletteBytes) ? pixels * inputChannels : 0; }
+	void operator ()(uint8_t *const dst, const uint8_t *const src, const size_t pixels, uint8_t *const scratch) const noexcept;
+
+	// The pixel format decoding an image of the given format to target produces.
+	static pixelFormat_t outputFormat(const pixelFormat_t input, const targetFormat_t target) noexcept;
+	// Whether format has an alpha channel.
+	static bool hasAlpha(const pixelFormat_t format) noexcept;
+};
+
+#endif /*CONVERT_HXX*/
@@ -0,0 +1,303 @@
+#ifndef CORPUS_HXX
+#define CORPUS_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+#include <zlib.h>
+#include "apng.hxx"
+#include "crc32.hxx"
+#include "unfilter.hxx"
+
+// Builds deterministic synthetic APNGs for benchmarking. Each file is described by a corpusSpec_t and always comes
+// out byte for byte the same, so results from different builds and machines are of the same data.
+
+// mixed cycles through all five filter types a scanline at a time.
+enum class filterMix_t : uint8_t { none, sub, up, average, paeth, mixed };
+
+struct corpusSpec_t final
+{
+	std::string name;
+	uint32_t width;
+	uint32_t height;
+	uint8_t bitDepth;
+	uint8_t colourType;
+	filterMix_t filters;
+	uint32_t frames;
+	// Frames after the first cover a 1/regionDivisor by 1/regionDivisor region that moves about the canvas.
+	uint32_t regionDivisor;
+	disposeOp_t disposeOp;
+	blendOp_t blendOp;
+};
+
+struct corpusFile_t final
+{
+	corpusSpec_t spec;
+	std::vector<uint8_t> png;
+	// Each frame's scanlines with their filter type bytes, as they were before being deflated.
+	std::vector<std::vector<uint8_t>> scanlines;
+	// Each frame's zlib stream, as split across its IDAT or fdAT chunks.
+	std::vector<std::vector<uint8_t>> deflated;
+	// How many bytes make up a scanline of each frame, not counting the filter type byte.
+	std::vector<size_t> rowLengths;
+	// Each frame's width and height, and where it sits on the canvas.
+	std::vector<std::pair<uint32_t, uint32_t>> sizes;
+	std::vector<std::pair<uint32_t, uint32_t>> offsets;
+	uint64_t framePixels;
+	size_t filterBytesPerPixel;
+};
+
+inline size_t corpusChannels(const uint8_t colourType) noexcept
+{
+	switch (colourType)
+	{
+		case 2:
+			return 3;
+		case 4:
+			return 2;
+		case 6:
+			return 4;
+		default:
+			return 1;
+	}
+}
+
+inline void corpusWrite32(std::vector<uint8_t> &data, const uint32_t value)
+{
+	for (const uint32_t shift : {24U, 16U, 8U, 0U})
+		data.push_back(uint8_t(value >> shift));
+}
+
+inline void corpusWriteChunk(std::vector<uint8_t> &png, const char *const type, const std::vector<uint8_t> &data)
+{
+	corpusWrite32(png, data.size());
+	const size_t start = png.size();
+	png.insert(png.end(), type, type + 4);
+	png.insert(png.end(), data.begin(), data.end());
+	uint32_t crc = 0;
+	crc32_t::crc(crc, png.data() + start, png.size() - start);
+	corpusWrite32(png, crc);
+}
+
+inline uint8_t filterByte(const filterTypes_t filter, const uint8_t value, const uint8_t left, const uint8_t up,
+	const uint8_t upLeft) noexcept
+{
+	switch (filter)
+	{
+		case filterTypes_t::sub:
+			return value - left;
+		case filterTypes_t::up:
+			return value - up;
+		case filterTypes_t::average:
+			return value - uint8_t((left + up) >> 1U);
+		case filterTypes_t::paeth:
+			return value - filterPaeth(left, up, upLeft);
+		case filterTypes_t::none:
+		default:
+			return value;
+	}
+}
+
+// Smooth gradients with a little noise, so the data compresses about as well as real artwork rather than not at all.
+inline std::vector<uint8_t> corpusFrame(std::minstd_rand &rng, const corpusSpec_t &spec, const uint32_t frame,
+	const uint32_t width, const uint32_t height)
+{
+	const size_t channels = corpusChannels(spec.colourType);
+	const size_t bitsPerPixel = channels * spec.bitDepth;
+	const size_t rowLength = ((width * bitsPerPixel) + 7) / 8;
+	const uint32_t sampleMax = (1U << spec.bitDepth) - 1U;
+	const bool hasAlpha = spec.colourType == 4 || spec.colourType == 6;
+	std::vector<uint8_t> pixels(rowLength * height);
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		uint8_t *const row = pixels.data() + (y * rowLength);
+		for (uint32_t x = 0; x < width; ++x)
+		{
+			for (size_t c = 0; c < channels; ++c)
+			{
+				uint32_t value = (x * (c + 1) * 3) + (y * 2) + (frame * 7) + (rng() & 7U);
+				if (hasAlpha && c == channels - 1)
+					value = (x + y + (frame * 16)) * 2;
+				if (spec.bitDepth == 16)
+				{
+					value = (value * 257U) & 0xFFFFU;
+					const size_t offset = ((x * channels) + c) * 2;
+					row[offset] = uint8_t(value >> 8U);
+					row[offset + 1] = uint8_t(value);
+				}
+				else if (spec.bitDepth == 8)
+					row[(x * channels) + c] = uint8_t(value);
+				else
+				{
+					const size_t bit = x * spec.bitDepth;
+					const uint32_t sample = (value >> (8U - spec.bitDepth)) & sampleMax;
+					row[bit / 8] |= uint8_t(sample << (8U - spec.bitDepth - (bit % 8)));
+				}
+			}
+		}
+	}
+	return pixels;
+}
+
+inline std::vector<uint8_t> corpusFilter(const corpusSpec_t &spec, const std::vector<uint8_t> &pixels,
+	const size_t rowLength, const uint32_t height, const size_t bpp)
+{
+	std::vector<uint8_t> scanlines;
+	scanlines.reserve((rowLength + 1) * height);
+	const std::vector<uint8_t> zeroRow(rowLength);
+	for (uint32_t y = 0; y < height; ++y)
+	{
+		const uint8_t *const row = pixels.data() + (y * rowLength);
+		const uint8_t *const prevRow = y ? row - rowLength : zeroRow.data();
+		const filterTypes_t filter = spec.filters == filterMix_t::mixed ? filterTypes_t(y % 5) :
+			filterTypes_t(spec.filters);
+		scanlines.push_back(uint8_t(filter));
+		for (size_t i = 0; i < rowLength; ++i)
+		{
+			const uint8_t left = i >= bpp ? row[i - bpp] : 0;
+			const uint8_t upLeft = i >= bpp ? prevRow[i - bpp] : 0;
+			scanlines.push_back(filterByte(filter, row[i], left, prevRow[i], upLeft));
+		}
+	}
+	return scanlines;
+}
+
+// FNV-1a, which unlike std::hash<> gives the same seed whichever standard library the corpus is built with.
+inline uint32_t corpusSeed(const std::string &name) noexcept
+{
+	uint32_t hash = 2166136261U;
+	for (const char c : name)
+		hash = (hash ^ uint8_t(c)) * 16777619U;
+	return (hash & 0x7FFFFFFEU) | 1U;
+}
+
+inline corpusFile_t generateCorpusFile(const corpusSpec_t &spec)
+{
+	corpusFile_t file{spec, {}, {}, {}, {}, {}, {}, 0, 0};
+	std::minstd_rand rng{corpusSeed(spec.name)};
+	const size_t bitsPerPixel = corpusChannels(spec.colourType) * spec.bitDepth;
+	file.filterBytesPerPixel = bitsPerPixel < 8 ? 1 : bitsPerPixel / 8;
+
+	std::vector<uint8_t> &png = file.png;
+	png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+	std::vector<uint8_t> header;
+	corpusWrite32(header, spec.width);
+	corpusWrite32(header, spec.height);
+	header.insert(header.end(), {spec.bitDepth, spec.colourType, 0, 0, 0});
+	corpusWriteChunk(png, "IHDR", header);
+	if (spec.colourType == 3)
+	{
+		std::vector<uint8_t> palette;
+		for (uint32_t i = 0; i < (1U << spec.bitDepth); ++i)
+			palette.insert(palette.end(), {uint8_t(i * 3), uint8_t(255 - i), uint8_t(i * 7)});
+		corpusWriteChunk(png, "PLTE", palette);
+	}
+	std::vector<uint8_t> control;
+	corpusWrite32(control, spec.frames);
+	corpusWrite32(control, 0);
+	corpusWriteChunk(png, "acTL", control);
+
+	uint32_t sequence = 0;
+	for (uint32_t frame = 0; frame < spec.frames; ++frame)
+	{
+		const uint32_t width = frame ? std::max(spec.width / spec.regionDivisor, 1U) : spec.width;
+		const uint32_t height = frame ? std::max(spec.height / spec.regionDivisor, 1U) : spec.height;
+		const uint32_t xOffset = ((frame * 37U) % (spec.width - width + 1U));
+		const uint32_t yOffset = ((frame * 23U) % (spec.height - height + 1U));
+		const size_t rowLength = ((width * bitsPerPixel) + 7) / 8;
+
+		std::vector<uint8_t> frameControl;
+		for (const uint32_t value : {sequence++, width, height, xOffset, yOffset})
+			corpusWrite32(frameControl, value);
+		frameControl.insert(frameControl.end(), {0, 1, 0, 30,
+			uint8_t(frame ? uint8_t(spec.disposeOp) : 0U), uint8_t(frame ? uint8_t(spec.blendOp) : 0U)});
+		corpusWriteChunk(png, "fcTL", frameControl);
+
+		const auto pixels = corpusFrame(rng, spec, frame, width, height);
+		file.scanlines.emplace_back(corpusFilter(spec, pixels, rowLength, height, file.filterBytesPerPixel));
+		const auto &scanlines = file.scanlines.back();
+		uLongf length = compressBound(scanlines.size());
+		std::vector<uint8_t> deflated(length);
+		if (compress2(deflated.data(), &length, scanlines.data(), scanlines.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+			throw std::bad_alloc{};
+		deflated.resize(length);
+
+		// Split the data across chunks of at most 64KiB, as encoders commonly do.
+		constexpr size_t chunkLength = 65536;
+		for (size_t offset = 0; offset < deflated.size(); offset += chunkLength)
+		{
+			const size_t amount = std::min(chunkLength, deflated.size() - offset);
+			std::vector<uint8_t> data;
+			if (frame)
+				corpusWrite32(data, sequence++);
+			data.insert(data.end(), deflated.begin() + offset, deflated.begin() + offset + amount);
+			corpusWriteChunk(png, frame ? "fdAT" : "IDAT", data);
+		}
+		file.deflated.emplace_back(std::move(deflated));
+		file.rowLengths.push_back(rowLength);
+		file.sizes.emplace_back(width, height);
+		file.offsets.emplace_back(xOffset, yOffset);
+		file.framePixels += uint64_t{width} * height;
+	}
+	corpusWriteChunk(png, "IEND", {});
+	return file;
+}
+
+// The corpus varies one property at a time from a base 8-bit RGBA animation, so every colour type and bit depth,
+// filter type, frame count, region size and dispose and blend combination is covered without the full cross product.
+inline std::vector<corpusSpec_t> corpusSpecs(const uint32_t size)
+{
+	const corpusSpec_t base{"rgba8", size, size, 8, 6, filterMix_t::mixed, 8, 2, disposeOp_t::none, blendOp_t::over};
+	std::vector<corpusSpec_t> specs{base};
+	const auto vary = [&](const std::string &name, const std::function<void (corpusSpec_t &)> &change)
+	{
+		corpusSpec_t spec{base};
+		spec.name = name;
+		change(spec);
+		specs.push_back(spec);
+	};
+
+	const std::pair<const char *, std::pair<uint8_t, uint8_t>> formats[] =
+	{
+		{"grey1", {1, 0}}, {"grey2", {2, 0}}, {"grey4", {4, 0}}, {"grey8", {8, 0}}, {"grey16", {16, 0}},
+		{"rgb8", {8, 2}}, {"rgb16", {16, 2}}, {"palette1", {1, 3}}, {"palette2", {2, 3}}, {"palette4", {4, 3}},
+		{"palette8", {8, 3}}, {"greyA8", {8, 4}}, {"greyA16", {16, 4}}, {"rgba16", {16, 6}}
+	};
+	for (const auto &format : formats)
+		vary(format.first, [&](corpusSpec_t &spec) { spec.bitDepth = format.second.first; spec.colourType = format.second.second; });
+
+	const std::pair<const char *, filterMix_t> filters[] =
+	{
+		{"rgba8-none", filterMix_t::none}, {"rgba8-sub", filterMix_t::sub}, {"rgba8-up", filterMix_t::up},
+		{"rgba8-average", filterMix_t::average}, {"rgba8-paeth", filterMix_t::paeth}
+	};
+	for (const auto &filter : filters)
+		vary(filter.first, [&](corpusSpec_t &spec) { spec.filters = filter.second; });
+
+	for (const uint32_t frames : {1U, 32U})
+		vary("rgba8-frames" + std::to_string(frames), [&](corpusSpec_t &spec) { spec.frames = frames; });
+	for (const uint32_t divisor : {1U, 8U})
+		vary("rgba8-region" + std::to_string(divisor), [&](corpusSpec_t &spec) { spec.regionDivisor = divisor; });
+
+	const std::pair<const char *, disposeOp_t> disposeOps[] =
+		{{"none", disposeOp_t::none}, {"background", disposeOp_t::background}, {"previous", disposeOp_t::previous}};
+	const std::pair<const char *, blendOp_t> blendOps[] = {{"source", blendOp_t::source}, {"over", blendOp_t::over}};
+	for (const auto &disposeOp : disposeOps)
+	{
+		for (const auto &blendOp : blendOps)
+		{
+			if (disposeOp.second == base.disposeOp && blendOp.second == base.blendOp)
+				continue;
+			vary(std::string{"rgba8-"} + disposeOp.first + "-" + blendOp.first, [&](corpusSpec_t &spec)
+				{ spec.disposeOp = disposeOp.second; spec.blendOp = blendOp.second; });
+		}
+	}
+	return specs;
+}
+
+#endif /*CORPUS_HXX*/
@@ -6,13 +6,194 @@ constexpr uint32_t calcTableC(const uint32_t poly, const uint32_t c, const uint8
 // Generate CRC for byte 'n'
 constexpr uint32_t calcTableC(const uint32_t poly, const uint8_t n) noexcept
 	{ return calcTableC(poly, n, 8); }
+// Carry on the CRC 'c' through 'slice' more zero bytes
+constexpr uint32_t calcSliceC(const uint32_t poly, const uint32_t c, const uint8_t slice) noexcept
+	{ return slice ? calcSliceC(poly, calcTableC(poly, uint8_t(c)) ^ (c >> 8U), slice - 1U) : c; }
+// Generate CRC for byte 'n' followed by 'slice' zero bytes
+constexpr uint32_t calcSliceC(const uint32_t poly, const uint8_t slice, const uint8_t n) noexcept
+	{ return calcSliceC(poly, calcTableC(poly, n), slice); }
 
-template<uint8_t N, uint32_t poly, uint32_t... table> struct calcTable
+template<uint8_t slice, uint8_t N, uint32_t poly, uint32_t... table> struct calcTable
 {
 	constexpr static std::array<const uint32_t, sizeof...(table) + N + 1> value =
-		calcTable<N - 1, poly, calcTableC(poly, N), table...>::value;
+		calcTable<slice, N - 1, poly, calcSliceC(poly, slice, N), table...>::value;
 };
-template<uint32_t poly, uint32_t... table> struct calcTable<0, poly, table...>
-	{ constexpr static std::array<const uint32_t, sizeof...(table) + 1> value = { calcTableC(poly, 0), table... }; };
+template<uint8_t slice, uint32_t poly, uint32_t... table> struct calcTable<slice, 0, poly, table...>
+{
+	constexpr static std::array<const uint32_t, sizeof...(table) + 1> value =
+		{ calcSliceC(poly, slice, 0), table... };
+};
+
+std::array<std::array<const uint32_t, 256>, 16> crc32_t::crcTables
+{{
+	calcTable<0, 255, poly>::value, calcTable<1, 255, poly>::value,
+	calcTable<2, 255, poly>::value, calcTable<3, 255, poly>::value,
+	calcTable<4, 255, poly>::value, calcTable<5, 255, poly>::value,
+	calcTable<6, 255, poly>::value, calcTable<7, 255, poly>::value,
+	calcTable<8, 255, poly>::value, calcTable<9, 255, poly>::value,
+	calcTable<10, 255, poly>::value, calcTable<11, 255, poly>::value,
+	calcTable<12, 255, poly>::value, calcTable<13, 255, poly>::value,
+	calcTable<14, 255, poly>::value, calcTable<15, 255, poly>::value
+}};
+
+// The CRC is bit-reflected, so words are always assembled little endian regardless of the host.
+inline uint32_t readLE32(const uint8_t *const data) noexcept
+{
+	return uint32_t{data[0]} | (uint32_t{data[1]} << 8U) |
+		(uint32_t{data[2]} << 16U) | (uint32_t{data[3]} << 24U);
+}
+
+uint32_t crc32_t::bytewise(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept
+{
+	const auto &table = crcTables[0];
+	while (dataLen--)
+		crc = table[uint8_t(crc ^ *data++)] ^ (crc >> 8U);
+	return crc;
+}
 
-std::array<const uint32_t, 256> crc32_t::crcTable = calcTable<255, poly>::value;
+uint32_t crc32_t::slicing8(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept
+{
+	const auto &tables = crcTables;
+	for (; dataLen >= 8; dataLen -= 8, data += 8)
+	{
+		const uint32_t one = readLE32(data) ^ crc;
+		const uint32_t two = readLE32(data + 4);
+		crc = tables[7][uint8_t(one)] ^ tables[6][uint8_t(one >> 8U)] ^
+			tables[5][uint8_t(one >> 16U)] ^ tables[4][one >> 24U] ^
+			tables[3][uint8_t(two)] ^ tables[2][uint8_t(two >> 8U)] ^
+			tables[1][uint8_t(two >> 16U)] ^ tables[0][two >> 24U];
+	}
+	return bytewise(crc, data, dataLen);
+}
+
+uint32_t crc32_t::slicing16(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept
+{
+	const auto &tables = crcTables;
+	for (; dataLen >= 16; dataLen -= 16, data += 16)
+	{
+		const uint32_t one = readLE32(data) ^ crc;
+		const uint32_t two = readLE32(data + 4);
+		const uint32_t three = readLE32(data + 8);
+		const uint32_t four = readLE32(data + 12);
+		crc = tables[15][uint8_t(one)] ^ tables[14][uint8_t(one >> 8U)] ^
+			tables[13][uint8_t(one >> 16U)] ^ tables[12][one >> 24U] ^
+			tables[11][uint8_t(two)] ^ tables[10][uint8_t(two >> 8U)] ^
+			tables[9][uint8_t(two >> 16U)] ^ tables[8][two >> 24U] ^
+			tables[7][uint8_t(three)] ^ tables[6][uint8_t(three >> 8U)] ^
+			tables[5][uint8_t(three >> 16U)] ^ tables[4][three >> 24U] ^
+			tables[3][uint8_t(four)] ^ tables[2][uint8_t(four >> 8U)] ^
+			tables[1][uint8_t(four >> 16U)] ^ tables[0][four >> 24U];
+	}
+	return bytewise(crc, data, dataLen);
+}
+
+#ifdef APNG_X86
+TARGET("sse2") inline __m128i loadBlock(const uint8_t *const block) noexcept
+	{ return _mm_loadu_si128(reinterpret_cast<const __m128i *>(block)); }
+
+TARGET("sse2,pclmul") inline __m128i fold(const __m128i value, const __m128i constants, const __m128i next) noexcept
+{
+	return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(value, constants, 0x00),
+		_mm_clmulepi64_si128(value, constants, 0x11)), next);
+}
+
+// This is the folding algorithm from Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+// Instruction" paper, using its constants for the bit-reflected CRC-32 polynomial. Four 128-bit accumulators
+// are folded forward 64 bytes at a time, then down into one, and finally Barrett reduced to 32 bits.
+TARGET("sse4.1,pclmul") uint32_t crc32_t::clmul(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept
+{
+	if (dataLen < 64)
+		return slicing8(crc, data, dataLen);
+	alignas(16) static const uint64_t k1k2[] = {UINT64_C(0x0154442bd4), UINT64_C(0x01c6e41596)};
+	alignas(16) static const uint64_t k3k4[] = {UINT64_C(0x01751997d0), UINT64_C(0x00ccaa009e)};
+	alignas(16) static const uint64_t k5k0[] = {UINT64_C(0x0163cd6124), UINT64_C(0x0000000000)};
+	alignas(16) static const uint64_t polyMu[] = {UINT64_C(0x01db710641), UINT64_C(0x01f7011641)};
+	__m128i x1 = _mm_xor_si128(loadBlock(data), _mm_cvtsi32_si128(int32_t(crc)));
+	__m128i x2 = loadBlock(data + 16);
+	__m128i x3 = loadBlock(data + 32);
+	__m128i x4 = loadBlock(data + 48);
+	data += 64;
+	dataLen -= 64;
+
+	__m128i constants = _mm_load_si128(reinterpret_cast<const __m128i *>(k1k2));
+	for (; dataLen >= 64; dataLen -= 64, data += 64)
+	{
+		x1 = fold(x1, constants, loadBlock(data));
+		x2 = fold(x2, constants, loadBlock(data + 16));
+		x3 = fold(x3, constants, loadBlock(data + 32));
+		x4 = fold(x4, constants, loadBlock(data + 48));
+	}
+
+	constants = _mm_load_si128(reinterpret_cast<const __m128i *>(k3k4));
+	x1 = fold(x1, constants, x2);
+	x1 = fold(x1, constants, x3);
+	x1 = fold(x1, constants, x4);
+	for (; dataLen >= 16; dataLen -= 16, data += 16)
+		x1 = fold(x1, constants, loadBlock(data));
+
+	// Fold 128 bits down to 64
+	const __m128i mask32 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), _mm_clmulepi64_si128(x1, constants, 0x10));
+	constants = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(k5k0));
+	x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask32), constants, 0x00), _mm_srli_si128(x1, 4));
+
+	// Barrett reduce to 32 bits
+	constants = _mm_load_si128(reinterpret_cast<const __m128i *>(polyMu));
+	__m128i reduced = _mm_clmulepi64_si128(_mm_and_si128(x1, mask32), constants, 0x10);
+	reduced = _mm_clmulepi64_si128(_mm_and_si128(reduced, mask32), constants, 0x00);
+	crc = uint32_t(_mm_extract_epi32(_mm_xor_si128(x1, reduced), 1));
+	return slicing8(crc, data, dataLen);
+}
+
+static bool detectCLMUL() noexcept
+{
+#ifdef _MSC_VER
+	std::array<int, 4> regs{};
+	__cpuid(regs.data(), 1);
+	return (regs[2] & (1 << 1)) && (regs[2] & (1 << 19));
+#else
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1");
+#endif
+}
+#else
+uint32_t crc32_t::clmul(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept
+	{ return slicing16(crc, data, dataLen); }
+static bool detectCLMUL() noexcept { return false; }
+#endif
+
+bool crc32_t::supported(const crcEngine_t engine) noexcept
+{
+	static const bool clmulSupported = detectCLMUL();
+	return engine != crcEngine_t::clmul || clmulSupported;
+}
+
+crc32_t::crcFunc_t crc32_t::engine(const crcEngine_t engine) noexcept
+{
+	switch (engine)
+	{
+		case crcEngine_t::clmul:
+			return clmul;
+		case crcEngine_t::slicing16:
+			return slicing16;
+		case crcEngine_t::slicing8:
+			return slicing8;
+		case crcEngine_t::bytewise:
+		default:
+			return bytewise;
+	}
+}
+
+void crc32_t::crc(uint32_t &crc, const uint8_t *data, size_t dataLen) noexcept
+{
+	static const crcFunc_t fastest = engine(supported(crcEngine_t::clmul) ? crcEngine_t::clmul : crcEngine_t::slicing16);
+	crc = ~fastest(~crc, data, dataLen);
+}
+
+bool crc32_t::crc(const crcEngine_t crcEngine, uint32_t &crc, const uint8_t *data, size_t dataLen) noexcept
+{
+	if (!supported(crcEngine))
+		return false;
+	crc = ~engine(crcEngine)(~crc, data, dataLen);
+	return true;
+}
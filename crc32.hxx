@@ -7,23 +7,33 @@ constexpr uint32_t calcPolynomial(const uint8_t bit) noexcept { return 1U << (31
 template<typename T, typename... U> constexpr typename std::enable_if<sizeof...(U) != 0, uint32_t>::type
 	calcPolynomial(T bit, U... bits) noexcept { return calcPolynomial(bit) | calcPolynomial(bits...); }
 
+// bytewise is the classic one table lookup per byte, slicing8 and slicing16 look up 8 or 16 bytes at once
+// in as many tables, and clmul folds 64 bytes at a time using carry-less multiplication (PCLMULQDQ).
+enum class crcEngine_t : uint8_t { bytewise, slicing8, slicing16, clmul };
+
 struct crc32_t final
 {
 private:
+	using crcFunc_t = uint32_t (*)(uint32_t, const uint8_t *, size_t);
 	constexpr static uint32_t poly = calcPolynomial(0, 1, 2, 4, 5, 7, 8, 10, 11, 12, 16, 22, 23, 26);
 	static_assert(poly == 0xEDB88320u, "Polynomial calculation failure");
-	static std::array<const uint32_t, 256> crcTable;
+	// crcTables[n] holds the CRC of each byte value followed by n zero bytes.
+	static std::array<std::array<const uint32_t, 256>, 16> crcTables;
+
+	static uint32_t bytewise(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept;
+	static uint32_t slicing8(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept;
+	static uint32_t slicing16(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept;
+	static uint32_t clmul(uint32_t crc, const uint8_t *data, size_t dataLen) noexcept;
+	static crcFunc_t engine(const crcEngine_t engine) noexcept;
 
 public:
 	template<size_t N> static void crc(uint32_t &crc, const std::array<uint8_t, N> &data) noexcept
 		{ crc32_t::crc(crc, data.data(), data.size()); }
-	static void crc(uint32_t &crc, const uint8_t *data, size_t dataLen) noexcept
-	{
-		crc ^= UINT32_C(0xFFFFFFFF);
-		while (dataLen--)
-			crc = crcTable[uint8_t(crc ^ *data++)] ^ (crc >> 8U);
-		crc ^= UINT32_C(0xFFFFFFFF);
-	}
+	// Uses the fastest engine the CPU supports, the CPU only being probed the first time.
+	static void crc(uint32_t &crc, const uint8_t *data, size_t dataLen) noexcept;
+	// Returns false, leaving crc untouched, if the CPU does not support the requested engine.
+	static bool crc(const crcEngine_t engine, uint32_t &crc, const uint8_t *data, size_t dataLen) noexcept;
+	static bool supported(const crcEngine_t engine) noexcept;
 
 	crc32_t() = delete;
 };
@@ -0,0 +1,144 @@
+#include <algorithm>
+#include <cstring>
+#include "downscale.hxx"
+#include "convert.hxx"
+
+// Whether the format has an alpha channel, always its last sample, that its colours aren't premultiplied by.
+static bool straightAlpha(const pixelFormat_t format) noexcept
+{
+	switch (format)
+	{
+		case pixelFormat_t::format8bppGreyA:
+		case pixelFormat_t::format16bppGreyA:
+		case pixelFormat_t::format16bppGreyAHost:
+		case pixelFormat_t::format32bppRGBA:
+		case pixelFormat_t::format32bppBGRA:
+		case pixelFormat_t::format64bppRGBA:
+		case pixelFormat_t::format64bppRGBAHost:
+			return true;
+		default:
+			return false;
+	}
+}
+
+downscaler_t::downscaler_t(bitmap_t &scaledFrame, const frameRegion_t &frameRegion, const uint8_t scaleShift,
+	const bool samplePoints) : frame{scaledFrame}, region{frameRegion}, shift{scaleShift}, pointSample{samplePoints},
+	samples{pixelBytes(scaledFrame.format())}, sampleBytes{1}, bigEndian{false}, weightAlpha{false}, sums{},
+	rowBuffer{}, rowsSummed{0}
+{
+	switch (frame.format())
+	{
+		case pixelFormat_t::format16bppGrey:
+		case pixelFormat_t::format16bppGreyA:
+		case pixelFormat_t::format48bppRGB:
+		case pixelFormat_t::format64bppRGBA:
+			bigEndian = true;
+			// fall through
+		case pixelFormat_t::format16bppGreyHost:
+		case pixelFormat_t::format16bppGreyAHost:
+		case pixelFormat_t::format48bppRGBHost:
+		case pixelFormat_t::format64bppRGBAHost:
+			sampleBytes = 2;
+			samples /= 2;
+			break;
+		default:
+			break;
+	}
+	weightAlpha = !pointSample && straightAlpha(frame.format());
+	sums.resize(size_t(frame.width()) * samples);
+	rowBuffer.resize(size_t(region.width) * samples * sampleBytes);
+}
+
+uint32_t downscaler_t::readSample(const uint8_t *const sample) const noexcept
+{
+	if (sampleBytes == 1)
+		return sample[0];
+	else if (bigEndian)
+		return uint32_t(sample[0] << 8U) | sample[1];
+	uint16_t value;
+	memcpy(&value, sample, sizeof(value));
+	return value;
+}
+
+void downscaler_t::writeSample(uint8_t *const sample, const uint32_t value) const noexcept
+{
+	if (sampleBytes == 1)
+		sample[0] = uint8_t(value);
+	else if (bigEndian)
+	{
+		sample[0] = uint8_t(value >> 8U);
+		sample[1] = uint8_t(value);
+	}
+	else
+	{
+		const uint16_t hostValue = uint16_t(value);
+		memcpy(sample, &hostValue, sizeof(hostValue));
+	}
+}
+
+void downscaler_t::rowDone(const uint32_t y) noexcept
+{
+	const uint32_t mask = (1U << shift) - 1U;
+	const uint32_t firstBlock = region.xOffset >> shift;
+	const size_t pixelLength = samples * sampleBytes;
+	// Point sampling only takes the first of the frame's pixels in each block.
+	if (!pointSample || !rowsSummed)
+	{
+		for (uint32_t x = 0; x < region.width; ++x)
+		{
+			const uint32_t imageX = region.xOffset + x;
+			if (pointSample && x && (imageX & mask))
+				continue;
+			uint64_t *const sum = sums.data() + (size_t((imageX >> shift) - firstBlock) * samples);
+			const uint8_t *const pixel = rowBuffer.data() + (x * pixelLength);
+			const uint32_t alpha = weightAlpha ? readSample(pixel + ((samples - 1) * sampleBytes)) : 1U;
+			for (size_t sample = 0; sample < samples; ++sample)
+			{
+				const uint32_t value = readSample(pixel + (sample * sampleBytes));
+				sum[sample] += weightAlpha && sample + 1 != samples ? uint64_t{value} * alpha : value;
+			}
+		}
+	}
+	++rowsSummed;
+	const uint32_t imageY = region.yOffset + y;
+	if (((imageY + 1U) & mask) == 0 || y + 1U == region.height)
+		emitRow((imageY >> shift) - (region.yOffset >> shift));
+}
+
+void downscaler_t::emitRow(const uint32_t y) noexcept
+{
+	const uint32_t firstBlock = region.xOffset >> shift;
+	const uint64_t frameEnd = uint64_t{region.xOffset} + region.width;
+	uint8_t *const row = frame.data() + (size_t(y) * frame.width() * samples * sampleBytes);
+	for (uint32_t x = 0; x < frame.width(); ++x)
+	{
+		// Blocks at the frame's edges may only be partly covered by it.
+		const uint64_t blockStart = uint64_t{firstBlock + x} << shift;
+		const uint64_t blockEnd = uint64_t{firstBlock + x + 1U} << shift;
+		const uint32_t columns = uint32_t(std::min(blockEnd, frameEnd) - std::max<uint64_t>(blockStart, region.xOffset));
+		const uint64_t count = pointSample ? 1U : columns * rowsSummed;
+		uint64_t *const sum = sums.data() + (size_t(x) * samples);
+		uint8_t *const pixel = row + (size_t(x) * samples * sampleBytes);
+		// Weighted colours are divided by the total alpha they were weighted by, and are 0 where that's nothing.
+		const uint64_t alpha = weightAlpha ? sum[samples - 1] : 0U;
+		for (size_t sample = 0; sample < samples; ++sample)
+		{
+			if (weightAlpha && sample + 1 != samples)
+				writeSample(pixel + (sample * sampleBytes), alpha ? uint32_t((sum[sample] + (alpha / 2U)) / alpha) : 0U);
+			else
+				writeSample(pixel + (sample * sampleBytes), uint32_t((sum[sample] + (count / 2U)) / count));
+		}
+	}
+	std::fill(sums.begin(), sums.end(), 0U);
+	rowsSummed = 0;
+}
+
+void downscaler_t::scale(const bitmap_t &source) noexcept
+{
+	const size_t rowLength = rowBuffer.size();
+	for (uint32_t y = 0; y < region.height; ++y)
+	{
+		memcpy(rowBuffer.data(), source.data() + (y * rowLength), rowLength);
+		rowDone(y);
+	}
+}
@@ -0,0 +1,71 @@
+#ifndef DOWNSCALE_HXX
+#define DOWNSCALE_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include "apng.hxx"
+
+// Where a frame lies in the image at full size, as its fcTL gives it.
+struct frameRegion_t final
+{
+	uint32_t width, height;
+	uint32_t xOffset, yOffset;
+};
+
+// How big something spanning length pixels of the full size image is once scaled down by 2^shift, rounding up.
+inline uint32_t scaledLength(const uint64_t length, const uint8_t shift) noexcept
+	{ return uint32_t((length + (uint64_t{1} << shift) - 1U) >> shift); }
+
+// The part of the scaled down image a frame covers: every block of 2^shift by 2^shift pixels of the image
+// the frame has any pixels in.
+inline frameRegion_t scaledRegion(const frameRegion_t &region, const uint8_t shift) noexcept
+{
+	const uint32_t xOffset = region.xOffset >> shift;
+	const uint32_t yOffset = region.yOffset >> shift;
+	return {scaledLength(uint64_t{region.xOffset} + region.width, shift) - xOffset,
+		scaledLength(uint64_t{region.yOffset} + region.height, shift) - yOffset, xOffset, yOffset};
+}
+
+// Box-filters a frame's rows down by a power of two as they're decoded, one full size row at a time. The boxes are
+// the image's blocks rather than the frame's, so a frame that doesn't start on a block boundary still lines up with
+// the canvas, and each output pixel averages whichever of the frame's pixels fall in its block. Colours with straight
+// alpha are weighted by it, so the colour of transparent pixels doesn't bleed into the edges of what's shown. Images
+// with a tRNS colour are point sampled instead, as averaging would turn the transparent colour into colours that aren't.
+struct downscaler_t final
+{
+private:
+	bitmap_t &frame;
+	const frameRegion_t region;
+	const uint8_t shift;
+	const bool pointSample;
+	size_t samples;
+	uint8_t sampleBytes;
+	bool bigEndian;
+	// Whether the last sample is alpha that the colour samples aren't premultiplied by.
+	bool weightAlpha;
+	std::vector<uint64_t> sums;
+	std::vector<uint8_t> rowBuffer;
+	uint32_t rowsSummed;
+
+	uint32_t readSample(const uint8_t *const sample) const noexcept;
+	void writeSample(uint8_t *const sample, const uint32_t value) const noexcept;
+	void emitRow(const uint32_t y) noexcept;
+
+public:
+	// frame must be the size of scaledRegion(region, shift), and in the format the rows are converted into.
+	downscaler_t(bitmap_t &frame, const frameRegion_t &region, const uint8_t shift, const bool pointSample);
+	downscaler_t(const downscaler_t &) = delete;
+	downscaler_t(downscaler_t &&) = delete;
+	~downscaler_t() noexcept = default;
+	downscaler_t &operator =(const downscaler_t &) = delete;
+	downscaler_t &operator =(downscaler_t &&) = delete;
+
+	// Where to put full size row y of the frame, as handed to rowDone() once it's there.
+	uint8_t *row(const uint32_t) noexcept { return rowBuffer.data(); }
+	void rowDone(const uint32_t y) noexcept;
+	// Scales down a whole full size frame at once, such as one that's been deinterlaced.
+	void scale(const bitmap_t &source) noexcept;
+};
+
+#endif /*DOWNSCALE_HXX*/
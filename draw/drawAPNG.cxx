@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #ifdef _WINDOWS
 	#include <windows.h>
 #endif
@@ -19,55 +20,14 @@
 
 #include "drawAPNG.hxx"
 
-template<typename T> struct pngRGB_t
-{
-	T r;
-	T g;
-	T b;
-};
-
-template<typename T> struct pngRGBA_t final : public pngRGB_t<T>
-	{ T a; };
-
-using pngRGB8_t = pngRGB_t<uint8_t>;
-using pngRGB16_t = pngRGB_t<uint16_t>;
-using pngRGBA8_t = pngRGBA_t<uint8_t>;
-using pngRGBA16_t = pngRGBA_t<uint16_t>;
-
-constexpr uint8_t toByte(uint16_t val) noexcept { return uint8_t(val >> 8); }
+// Every window's animation is played from this one scheduler's timer thread.
+static playbackScheduler_t scheduler;
 
-QRgb copyRGB8(const pngRGB8_t colour) noexcept
-	{ return qRgb(colour.r, colour.g, colour.b); }
-QRgb copyRGB16(const pngRGB16_t colour) noexcept
-	//{ return QColor(QRgba64::fromRgba64(colour.r, colour.g, colour.b, 0xFFFF)); }
-	{ return qRgb(toByte(colour.r), toByte(colour.g), toByte(colour.b)); }
-QRgb copyRGBA8(const pngRGBA8_t colour) noexcept
-	{ return qRgba(colour.r, colour.g, colour.b, colour.a); }
-QRgb copyRGBA16(const pngRGBA16_t colour) noexcept
-	//{ return QColor(QRgba64::fromRgba64(colour.r, colour.g, colour.b, colour.a)); }
-	{ return qRgba(toByte(colour.r), toByte(colour.g), toByte(colour.b), toByte(colour.a)); }
-
-template<typename T, QRgb copyFunc(const T)> void copyFrame(const bitmap_t *const frame, QImage &dest) noexcept
-{
-	const T *const data = reinterpret_cast<const T *>(frame->data());
-	const uint32_t height = frame->height();
-	const uint32_t width = frame->width();
-	for (uint32_t y = 0; y < height; ++y)
-	{
-		for (uint32_t x = 0; x < width; ++x)
-			dest.setPixel(x, y, copyFunc(data[x + (y * width)]));
-	}
-}
-
-drawAPNG_t::drawAPNG_t(QWidget *parent) noexcept : QMainWindow(parent), leave(false)
+drawAPNG_t::drawAPNG_t(QWidget *parent) noexcept : QMainWindow(parent), animation(0)
 	{ window.setupUi(this); }
 
 drawAPNG_t::~drawAPNG_t() noexcept
-{
-	leave = true;
-	if (animateThread.joinable())
-		animateThread.join();
-}
+	{ scheduler.stop(animation); }
 
 void drawAPNG_t::image(std::unique_ptr<apng_t> &&image) noexcept
 {
@@ -76,66 +36,40 @@ void drawAPNG_t::image(std::unique_ptr<apng_t> &&image) noexcept
 	if (!isMaximized())
 		resize(image->width(), image->height());
 	apng.swap(image);
-	for (const auto &frame : apng->frames())
+	for (const auto &frame : apng->canvases())
 	{
 		QImage frameImage = QImage(apng->width(), apng->height(), pixelFormat(apng->pixelFormat()));
 		frameImage.fill(QColor(0, 0, 0, 0));
 		processFrame(frame.second, frameImage);
 		frames.emplace_back(std::move(QPixmap::fromImage(frameImage)));
-		displayTimings.emplace_back(frame.first);
 	}
-	animateThread = std::thread([this]() noexcept { animate(); });
+	try
+	{
+		animation = scheduler.play(*apng, [this](const uint32_t frame) noexcept
+			{ window.image->setPixmap(frames[frame]); });
+	}
+	catch (std::bad_alloc &)
+		{ window.image->setPixmap(frames[0]); }
 }
 
 QImage::Format drawAPNG_t::pixelFormat(const pixelFormat_t format) const noexcept
 {
 	switch (format)
 	{
-		/*case pixelFormat_t::format8bppGrey:
-			return QImage::Format_Grayscale8;*/
-		case pixelFormat_t::format24bppRGB:
-		case pixelFormat_t::format48bppRGB:
-			return QImage::Format_RGB888;
-		case pixelFormat_t::format32bppRGBA:
-		case pixelFormat_t::format64bppRGBA:
-			return QImage::Format_RGBA8888;
+		case pixelFormat_t::format32bppRGBAPremultiplied:
+			return QImage::Format_RGBA8888_Premultiplied;
 		default:
 			return QImage::Format_Invalid;
 	}
 }
 
-void drawAPNG_t::processFrame(const bitmap_t *const frame, QImage &dest) noexcept
-{
-	switch (frame->format())
-	{
-		case pixelFormat_t::format24bppRGB:
-			return copyFrame<pngRGB8_t, copyRGB8>(frame, dest);
-		case pixelFormat_t::format48bppRGB:
-			return copyFrame<pngRGB16_t, copyRGB16>(frame, dest);
-		case pixelFormat_t::format32bppRGBA:
-			return copyFrame<pngRGBA8_t, copyRGBA8>(frame, dest);
-		case pixelFormat_t::format64bppRGBA:
-			return copyFrame<pngRGBA16_t, copyRGBA16>(frame, dest);
-		default:
-			break;
-	}
-}
-
-void drawAPNG_t::animate() noexcept
+// The frames are decoded straight into the QImage's format, so they only need copying a row at a time.
+void drawAPNG_t::processFrame(const canvas_t *const frame, QImage &dest) noexcept
 {
-	const uint32_t loopMax = apng->loops();
-	uint32_t frame = 0, loop = 0;
-
-	while (!leave && (loopMax == 0 || loop < loopMax))
-	{
-		window.image->setPixmap(frames[frame]);
-		displayTimings[frame].waitFor();
-		if (++frame == frames.size())
-		{
-			frame = 0;
-			++loop;
-		}
-	}
+	if (pixelFormat(frame->format()) != dest.format())
+		return;
+	for (uint32_t y = 0; y < frame->height(); ++y)
+		memcpy(dest.scanLine(y), frame->row(y), frame->rowLength());
 }
 
 int main(int argc, char **argv) noexcept
@@ -153,7 +87,9 @@ int main(int argc, char **argv) noexcept
 		try
 		{
 			fileStream_t file(argv[fileIdx], O_RDONLY | O_NOCTTY);
-			std::unique_ptr<apng_t> pngFile(new apng_t(file));
+			decodeOptions_t options;
+			options.target = targetFormat_t::rgba8Premultiplied;
+			std::unique_ptr<apng_t> pngFile(new apng_t(file, options));
 			window.image(std::move(pngFile));
 		}
 		catch (invalidPNG_t &error)
@@ -2,9 +2,8 @@
 #define DRAW_APNG__HXX
 
 #include <stdint.h>
-#include <thread>
-#include <atomic>
 #include <apng.hxx>
+#include <scheduler.hxx>
 #include "ui_drawAPNG.h"
 
 class drawAPNG_t final : public QMainWindow
@@ -13,15 +12,12 @@ class drawAPNG_t final : public QMainWindow
 
 private:
 	Ui::drawAPNG_t window;
-	std::atomic<bool> leave;
-	std::thread animateThread;
+	uint64_t animation;
 	std::unique_ptr<apng_t> apng;
 	std::vector<QPixmap> frames;
-	std::vector<displayTime_t> displayTimings;
 
 	QImage::Format pixelFormat(const pixelFormat_t format) const noexcept;
-	void processFrame(const bitmap_t *const frame, QImage &dest) noexcept;
-	void animate() noexcept;
+	void processFrame(const canvas_t *const frame, QImage &dest) noexcept;
 
 public:
 	explicit drawAPNG_t(QWidget *parent = nullptr) noexcept;
@@ -0,0 +1,37 @@
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include "corpus.hxx"
+
+// Writes the benchmark corpus out as files, for use with other tools or to check it's what's expected.
+int main(int argc, char **argv)
+{
+	if (argc < 2 || argc > 3)
+	{
+		printf("Usage: %s directory [size]\n", argv[0]);
+		return 1;
+	}
+	const uint32_t size = argc == 3 ? uint32_t(strtoul(argv[2], nullptr, 10)) : 256;
+	if (!size)
+		return 1;
+
+	for (const auto &spec : corpusSpecs(size))
+	{
+		const corpusFile_t file = generateCorpusFile(spec);
+		const std::string fileName = std::string{argv[1]} + "/" + spec.name + ".png";
+		FILE *const output = fopen(fileName.c_str(), "wb");
+		if (!output)
+		{
+			perror(fileName.c_str());
+			return 2;
+		}
+		const bool written = fwrite(file.png.data(), 1, file.png.size(), output) == file.png.size();
+		if (fclose(output) || !written)
+		{
+			perror(fileName.c_str());
+			return 2;
+		}
+		printf("%s: %zu bytes, %u frames\n", fileName.c_str(), file.png.size(), spec.frames);
+	}
+	return 0;
+}
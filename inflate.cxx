@@ -0,0 +1,161 @@
+#include <limits>
+#include <vector>
+#include <zlib.h>
+#ifdef APNG_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+#include "utilities.hxx"
+#include "inflate.hxx"
+
+constexpr static size_t maxBlock = std::numeric_limits<uInt>::max();
+#ifdef APNG_LIBDEFLATE
+constexpr static bool haveLibdeflate = true;
+#else
+constexpr static bool haveLibdeflate = false;
+#endif
+
+bool inflateSupported(const inflateBackend_t backend) noexcept
+	{ return backend != inflateBackend_t::libdeflate || haveLibdeflate; }
+
+inflateBackend_t selectBackend(const inflateBackend_t backend) noexcept
+{
+	if (backend == inflateBackend_t::automatic)
+		return inflateSupported(inflateBackend_t::libdeflate) ? inflateBackend_t::libdeflate :
+			inflateBackend_t::singleShot;
+	return inflateSupported(backend) ? backend : inflateBackend_t::singleShot;
+}
+
+// Inflates with zlib straight into the output, handing inflate() as much input and output as it will take at once
+// so it spends nearly all its time in its fast loop rather than stopping every few KiB.
+struct zlibInflater_t final : public inflater_t
+{
+private:
+	z_stream stream;
+	// Only used for sources that don't hold their data in memory.
+	std::vector<uint8_t> buffer;
+
+public:
+	zlibInflater_t() : stream{}, buffer{}
+	{
+		if (inflateInit(&stream) != Z_OK)
+			throw zlibError_t{};
+	}
+	zlibInflater_t(const zlibInflater_t &) = delete;
+	zlibInflater_t(zlibInflater_t &&) = delete;
+	~zlibInflater_t() noexcept final override { inflateEnd(&stream); }
+	zlibInflater_t &operator =(const zlibInflater_t &) = delete;
+	zlibInflater_t &operator =(zlibInflater_t &&) = delete;
+
+	bool inflate(stream_t &source, uint8_t *const output, const size_t length) final override
+	{
+		if (inflateReset(&stream) != Z_OK)
+			throw zlibError_t{};
+		// inflateReset() leaves the input alone, which would otherwise still point into the last source when its
+		// stream ended before its data did or failed partway through.
+		stream.next_in = nullptr;
+		stream.avail_in = 0;
+		size_t produced = 0;
+		while (produced < length)
+		{
+			if (!stream.avail_in)
+			{
+				size_t amount = 0;
+				const uint8_t *data = source.view(maxBlock, amount);
+				if (!data)
+				{
+					buffer.resize(8_KiB);
+					if (source.atEOF() || !source.read(buffer.data(), buffer.size(), amount))
+						return false;
+					data = buffer.data();
+				}
+				if (!amount)
+					return false;
+				stream.next_in = const_cast<uint8_t *>(data);
+				stream.avail_in = uInt(amount);
+			}
+			const size_t space = length - produced < maxBlock ? length - produced : maxBlock;
+			stream.next_out = output + produced;
+			stream.avail_out = uInt(space);
+			const int result = ::inflate(&stream, Z_NO_FLUSH);
+			produced += space - stream.avail_out;
+			if (result == Z_STREAM_END)
+				break;
+			else if (result != Z_OK && result != Z_BUF_ERROR)
+				return false;
+		}
+		return produced == length;
+	}
+};
+
+#ifdef APNG_LIBDEFLATE
+// libdeflate only inflates whole streams held in one block of memory, so data split across several chunks is
+// gathered up first. Streams holding more than the frame's scanlines are rare enough to hand to zlib instead.
+struct libdeflateInflater_t final : public inflater_t
+{
+private:
+	libdeflate_decompressor *decompressor;
+	std::vector<uint8_t> input;
+	std::unique_ptr<zlibInflater_t> fallback;
+
+public:
+	libdeflateInflater_t() : decompressor{libdeflate_alloc_decompressor()}, input{}, fallback{}
+	{
+		if (!decompressor)
+			throw std::bad_alloc{};
+	}
+	libdeflateInflater_t(const libdeflateInflater_t &) = delete;
+	libdeflateInflater_t(libdeflateInflater_t &&) = delete;
+	~libdeflateInflater_t() noexcept final override { libdeflate_free_decompressor(decompressor); }
+	libdeflateInflater_t &operator =(const libdeflateInflater_t &) = delete;
+	libdeflateInflater_t &operator =(libdeflateInflater_t &&) = delete;
+
+	bool inflate(stream_t &source, uint8_t *const output, const size_t length) final override
+	{
+		size_t amount = 0;
+		const uint8_t *data = source.view(std::numeric_limits<size_t>::max(), amount);
+		if (!data || !source.atEOF())
+		{
+			input.assign(data, data + (data ? amount : 0));
+			while (!source.atEOF())
+			{
+				data = source.view(std::numeric_limits<size_t>::max(), amount);
+				if (data)
+					input.insert(input.end(), data, data + amount);
+				else
+				{
+					const size_t used = input.size();
+					input.resize(used + 64_KiB);
+					if (!source.read(input.data() + used, 64_KiB, amount))
+						return false;
+					input.resize(used + amount);
+				}
+			}
+			data = input.data();
+			amount = input.size();
+		}
+
+		size_t produced = 0;
+		const libdeflate_result result = libdeflate_zlib_decompress(decompressor, data, amount, output, length,
+			&produced);
+		if (result == LIBDEFLATE_SUCCESS)
+			return produced == length;
+		else if (result != LIBDEFLATE_INSUFFICIENT_SPACE)
+			return false;
+		if (!fallback)
+			fallback = makeUnique<zlibInflater_t>();
+		memoryStream_t stream{const_cast<uint8_t *>(data), amount};
+		return fallback->inflate(stream, output, length);
+	}
+};
+#endif
+
+std::unique_ptr<inflater_t> inflater_t::make(const inflateBackend_t backend)
+{
+#ifdef APNG_LIBDEFLATE
+	if (backend == inflateBackend_t::libdeflate)
+		return makeUnique<libdeflateInflater_t>();
+#else
+	(void)backend;
+#endif
+	return makeUnique<zlibInflater_t>();
+}
@@ -0,0 +1,25 @@
+#ifndef INFLATE_HXX
+#define INFLATE_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <memory>
+#include "apng.hxx"
+
+// Inflates a frame's zlib stream whole with as few calls as possible, into memory already sized for all of it.
+// Inflaters keep their state between frames, so one can be reused for frame after frame on the same thread.
+struct inflater_t
+{
+	virtual ~inflater_t() noexcept = default;
+	// Inflates the zlib stream source holds into the length bytes at output, returning false if the stream is invalid
+	// or ends before filling them. Anything the stream holds past length bytes is ignored, as the streaming path does.
+	virtual bool inflate(stream_t &source, uint8_t *const output, const size_t length) = 0;
+
+	// Makes the inflater for a single-shot backend, which must be one selectBackend() can give other than streaming.
+	static std::unique_ptr<inflater_t> make(const inflateBackend_t backend);
+};
+
+// Turns automatic into the fastest backend there is, and backends the library wasn't built with into singleShot.
+inflateBackend_t selectBackend(const inflateBackend_t backend) noexcept;
+
+#endif /*INFLATE_HXX*/
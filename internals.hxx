@@ -12,4 +12,15 @@
 #define NS_BEGIN(name) namespace name {
 #define NS_END() }
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+	#define APNG_X86
+	#include <immintrin.h>
+	#ifdef _MSC_VER
+		#include <intrin.h>
+		#define TARGET(isa)
+	#else
+		#define TARGET(isa) __attribute__((target(isa)))
+	#endif
+#endif
+
 #endif /*INTERNALS_HXX*/
@@ -1,38 +1,100 @@
 #include <chrono>
 #include <thread>
+#include <stdexcept>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <unordered_set>
+#include <unordered_map>
 #include <memory.h>
 #include "crc32.hxx"
 #include "utilities.hxx"
 #include "apng.hxx"
+#include "threadPool.hxx"
+#include "blend.hxx"
+#include "allocator.hxx"
+#include "inflate.hxx"
+#include "downscale.hxx"
 
 bool chunkType_t::operator ==(const uint8_t *const value) const noexcept
 	{ return memcmp(value, _type.data(), _type.size()) == 0; }
 bool chunkType_t::operator !=(const uint8_t *const value) const noexcept
 	{ return memcmp(value, _type.data(), _type.size()) != 0; }
 
+constexpr static const chunkType_t typeIHDR{'I', 'H', 'D', 'R'};
+constexpr static const chunkType_t typePLTE{'P', 'L', 'T', 'E'};
+constexpr static const chunkType_t typeTRNS{'t', 'R', 'N', 'S'};
+constexpr static const chunkType_t typeACTL{'a', 'c', 'T', 'L'};
+constexpr static const chunkType_t typeIDAT{'I', 'D', 'A', 'T'};
+constexpr static const chunkType_t typeFCTL{'f', 'c', 'T', 'L'};
+constexpr static const chunkType_t typeFDAT{'f', 'd', 'A', 'T'};
+constexpr static const chunkType_t typeIEND{'I', 'E', 'N', 'D'};
+
+bool isIHDR(const chunk_t &chunk) noexcept { return chunk.type() == typeIHDR; }
+bool isPLTE(const chunk_t &chunk) noexcept { return chunk.type() == typePLTE; }
+bool isTRNS(const chunk_t &chunk) noexcept { return chunk.type() == typeTRNS; }
+bool isACTL(const chunk_t &chunk) noexcept { return chunk.type() == typeACTL; }
+bool isIDAT(const chunk_t &chunk) noexcept { return chunk.type() == typeIDAT; }
+bool isFCTL(const chunk_t &chunk) noexcept { return chunk.type() == typeFCTL; }
+bool isIEND(const chunk_t &chunk) noexcept { return chunk.type() == typeIEND; }
+bool isFDAT(const chunk_t &chunk) noexcept { return chunk.type() == typeFDAT; }
+
 chunk_t &chunk_t::operator =(chunk_t &&chunk) noexcept
 {
 	_length = chunk._length;
 	_chunkType = chunk._chunkType;
-	_chunkData.swap(chunk._chunkData);
+	_chunkStorage.swap(chunk._chunkStorage);
+	std::swap(_chunkData, chunk._chunkData);
 	return *this;
 }
 
-chunk_t chunk_t::loadChunk(stream_t &stream)
+// Bit 5 of the first type byte being clear marks a chunk as critical. APNG's chunks are all marked ancillary
+// so that plain PNG decoders ignore them, but the animation can't be decoded without them.
+bool chunk_t::isCritical() const noexcept
+{
+	return !(_chunkType.type()[0] & 0x20U) || _chunkType == typeACTL ||
+		_chunkType == typeFCTL || _chunkType == typeFDAT;
+}
+
+chunk_t chunk_t::loadChunk(stream_t &stream, const crcCheck_t crcCheck, const bool skipPixelData,
+	decodeStats_t *const stats, allocator_t *const allocator)
 {
 	chunk_t chunk;
 	if (!stream.read(chunk._length) ||
 		!stream.read(chunk._chunkType.type()))
 		throw invalidPNG_t{};
 	swap(chunk._length);
-	chunk._chunkData = makeUnique<uint8_t []>(chunk._length);
+	if (stats)
+		stats->bytesIn += uint64_t{chunk._length} + 12;
+	if (skipPixelData && crcCheck == crcCheck_t::none &&
+		(chunk._chunkType == typeIDAT || chunk._chunkType == typeFDAT))
+	{
+		if (!stream.skip(size_t{chunk._length} + 4))
+			throw invalidPNG_t{};
+		return chunk;
+	}
+	size_t viewLength = 0;
+	chunk._chunkData = stream.view(chunk._length, viewLength);
+	if (chunk._chunkData && viewLength != chunk._length)
+		throw invalidPNG_t{};
+	else if (!chunk._chunkData)
+	{
+		chunk._chunkStorage = allocateFrom(allocator, chunk._length);
+		chunk._chunkData = chunk._chunkStorage.get();
+		if (!stream.read(chunk._chunkStorage.get(), chunk._length))
+			throw invalidPNG_t{};
+	}
 	uint32_t crcRead, crcCalc;
-	if (!stream.read(chunk._chunkData.get(), chunk._length) ||
-		!stream.read(crcRead))
+	if (!stream.read(crcRead))
 		throw invalidPNG_t{};
+	if (crcCheck == crcCheck_t::none || (crcCheck == crcCheck_t::criticalOnly && !chunk.isCritical()))
+		return chunk;
 	swap(crcRead);
+	const auto start = stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
 	crc32_t::crc(crcCalc = 0, chunk._chunkType.type());
-	crc32_t::crc(crcCalc, chunk._chunkData.get(), chunk._length);
+	crc32_t::crc(crcCalc, chunk._chunkData, chunk._length);
+	if (stats)
+		stats->stageTimes[decodeStats_t::crc] += std::chrono::steady_clock::now() - start;
 	if (crcCalc != crcRead)
 		throw invalidPNG_t{};
 	return chunk;
@@ -88,30 +150,37 @@ public:
 		return true;
 	}
 
+	// Hands out the rest of the current chunk in place, so inflate reads the chunk data directly.
+	const uint8_t *view(const size_t valueLen, size_t &actualLen) final override
+	{
+		if (atEOF())
+			return nullptr;
+		if (isSequence && pos == 0)
+		{
+			const uint32_t sequenceNum = read32(_chunks[chunk]->data());
+			if (sequenceNum != ++sequenceIndex)
+				throw invalidPNG_t{};
+		}
+
+		const uint8_t *const buffer = data() + pos;
+		const size_t chunkDelta = length() - pos;
+		actualLen = valueLen > chunkDelta ? chunkDelta : valueLen;
+		if (actualLen == chunkDelta)
+		{
+			++chunk;
+			pos = 0;
+		}
+		else
+			pos += actualLen;
+		return buffer;
+	}
+
 	bool atEOF() const noexcept final override { return chunk == _chunks.size(); }
 };
 
 constexpr static const std::array<uint8_t, 8> pngSig =
 	{ 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
 
-constexpr static const chunkType_t typeIHDR{'I', 'H', 'D', 'R'};
-constexpr static const chunkType_t typePLTE{'P', 'L', 'T', 'E'};
-constexpr static const chunkType_t typeTRNS{'t', 'R', 'N', 'S'};
-constexpr static const chunkType_t typeACTL{'a', 'c', 'T', 'L'};
-constexpr static const chunkType_t typeIDAT{'I', 'D', 'A', 'T'};
-constexpr static const chunkType_t typeFCTL{'f', 'c', 'T', 'L'};
-constexpr static const chunkType_t typeFDAT{'f', 'd', 'A', 'T'};
-constexpr static const chunkType_t typeIEND{'I', 'E', 'N', 'D'};
-
-bool isIHDR(const chunk_t &chunk) noexcept { return chunk.type() == typeIHDR; }
-bool isPLTE(const chunk_t &chunk) noexcept { return chunk.type() == typePLTE; }
-bool isTRNS(const chunk_t &chunk) noexcept { return chunk.type() == typeTRNS; }
-bool isACTL(const chunk_t &chunk) noexcept { return chunk.type() == typeACTL; }
-bool isIDAT(const chunk_t &chunk) noexcept { return chunk.type() == typeIDAT; }
-bool isFCTL(const chunk_t &chunk) noexcept { return chunk.type() == typeFCTL; }
-bool isIEND(const chunk_t &chunk) noexcept { return chunk.type() == typeIEND; }
-bool isFDAT(const chunk_t &chunk) noexcept { return chunk.type() == typeFDAT; }
-
 constexpr static uint64_t uint64Max = std::numeric_limits<uint64_t>::max();
 
 inline uint64_t safeMul(const uint64_t a, const uint64_t b) noexcept
@@ -126,40 +195,170 @@ inline uint64_t safeMul(const uint64_t a, const uint64_t b) noexcept
 	return a * b;
 }
 
+inline uint64_t safeAdd(const uint64_t a, const uint64_t b) noexcept
+	{ return b >= uint64Max - a ? uint64Max : a + b; }
+
 template<typename ...values_t> uint64_t safeMul(const uint64_t a, const uint64_t b, values_t &&...values) noexcept
 	{ return safeMul(safeMul(a, b), values...); }
 
-bitmap_t::bitmap_t(const uint32_t width, const uint32_t height, const pixelFormat_t format) :
-	_data{}, _width(width), _height(height), _format(format), transValueValid(false), transValue{}
-{
-	uint8_t bytes;
-	if (_format == pixelFormat_t::format8bppGrey)
-		bytes = 1;
-	else if (_format == pixelFormat_t::format16bppGrey)
-		bytes = 2;
-	else if (_format == pixelFormat_t::format24bppRGB)
-		bytes = 3;
-	else if (_format == pixelFormat_t::format32bppRGBA)
-		bytes = 4;
-	else if (_format == pixelFormat_t::format48bppRGB)
-		bytes = 6;
-	else if (_format == pixelFormat_t::format64bppRGBA)
-		bytes = 8;
-	else
-		throw invalidPNG_t{};
-	const uint64_t length = safeMul(width, height, bytes);
+uint8_t pixelBytes(const pixelFormat_t format)
+{
+	switch (format)
+	{
+		case pixelFormat_t::format8bppGrey:
+			return 1;
+		case pixelFormat_t::format16bppGrey:
+		case pixelFormat_t::format16bppGreyHost:
+		case pixelFormat_t::format8bppGreyA:
+			return 2;
+		case pixelFormat_t::format24bppRGB:
+			return 3;
+		case pixelFormat_t::format32bppRGBA:
+		case pixelFormat_t::format32bppBGRA:
+		case pixelFormat_t::format32bppRGBAPremultiplied:
+		case pixelFormat_t::format32bppBGRAPremultiplied:
+		case pixelFormat_t::format16bppGreyA:
+		case pixelFormat_t::format16bppGreyAHost:
+			return 4;
+		case pixelFormat_t::format48bppRGB:
+		case pixelFormat_t::format48bppRGBHost:
+			return 6;
+		case pixelFormat_t::format64bppRGBA:
+		case pixelFormat_t::format64bppRGBAHost:
+			return 8;
+	}
+	throw invalidPNG_t{};
+}
+
+bitmap_t::bitmap_t(const uint32_t width, const uint32_t height, const pixelFormat_t format,
+	allocator_t *const allocator, const bool clear) : _data{}, _width(width), _height(height), _format(format),
+	transValueValid(false), transValue{}
+{
+	const uint64_t length = safeMul(width, height, pixelBytes(format));
 	if (length == uint64Max)
 		throw std::bad_alloc{};
-	_data = makeUnique<uint8_t []>(length);
-	memset(_data.get(), 0, length);
+	_data = allocateFrom(allocator, length);
+	if (clear)
+		memset(_data.get(), 0, length);
 }
 
-apng_t::apng_t(stream_t &stream) : _defaultFrame{}, transColourValid{false}, transColour{}
+bitmap_t::bitmap_t(const bitmap_t &bitmap) : _data{allocateFrom(bitmap._data.get_deleter().allocator, bitmap.length())},
+	_width(bitmap._width),
+	_height(bitmap._height), _format(bitmap._format), transValueValid(bitmap.transValueValid), transValue{}
 {
-	chunkList_t chunks;
+	memcpy(_data.get(), bitmap.data(), length());
+	memcpy(transValue, bitmap.transValue, sizeof(transValue));
+}
+
+size_t bitmap_t::length() const noexcept
+	{ return size_t(_width) * _height * pixelBytes(_format); }
+
+canvas_t::canvas_t(const uint32_t width, const uint32_t height, const pixelFormat_t format,
+	allocator_t *const rowAllocator) : _width{width}, _height{height}, _format{format}, _rowLength{}, rows{}, zeroRow{},
+	allocator{rowAllocator}
+{
+	const uint64_t rowLength = safeMul(width, pixelBytes(format));
+	if (rowLength == uint64Max || safeMul(rowLength, height) == uint64Max)
+		throw std::bad_alloc{};
+	_rowLength = rowLength;
+	zeroRow = allocRows(1);
+	memset(zeroRow.get(), 0, _rowLength);
+	rows.resize(height, zeroRow);
+}
+
+canvas_t::canvas_t(const bitmap_t &bitmap, allocator_t *const rowAllocator) :
+	canvas_t{bitmap.width(), bitmap.height(), bitmap.format(), rowAllocator}
+	{ memcpy(detachRows(0, _height, false), bitmap.data(), length()); }
+
+canvas_t::row_t canvas_t::allocRows(const uint32_t count) const
+{
+	allocation_t block = allocateFrom(allocator, _rowLength * count);
+	const deallocator_t deallocator = block.get_deleter();
+	return row_t{block.release(), deallocator};
+}
+
+void canvas_t::clear() noexcept
+{
+	for (auto &row : rows)
+		row = zeroRow;
+}
+
+uint8_t *canvas_t::detachRows(const uint32_t y, const uint32_t count, const bool keepContents)
+{
+	if (!count)
+		return nullptr;
+	// The rows all alias the one new block, which is freed once the last of them goes.
+	const row_t block = allocRows(count);
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		row_t row{block, block.get() + (_rowLength * i)};
+		if (keepContents)
+			memcpy(row.get(), rows[y + i].get(), _rowLength);
+		rows[y + i] = std::move(row);
+	}
+	return block.get();
+}
+
+std::unique_ptr<bitmap_t> canvas_t::materialize() const
+{
+	auto bitmap = makeUnique<bitmap_t>(_width, _height, _format, allocator, false);
+	materialize(*bitmap);
+	return bitmap;
+}
+
+void canvas_t::materialize(bitmap_t &bitmap) const noexcept
+{
+	if (bitmap.width() != _width || bitmap.height() != _height || bitmap.format() != _format)
+		return;
+	for (uint32_t y = 0; y < _height; ++y)
+		memcpy(bitmap.data() + (_rowLength * y), rows[y].get(), _rowLength);
+}
+
+apngDecoder_t::apngDecoder_t(const decodeOptions_t &options) : chunks{}, transColourValid{false}, transColour{},
+	palette{}, paletteAlpha{false}, unfilter{}, target{options.target}, inflateBackend{selectBackend(options.inflate)},
+	scaleShift{uint8_t(options.downscale)}, convert{}, progress{options.progress},
+	observer{options.observer}, allocator{options.allocator}, scratchAllocator{options.scratchAllocator},
+	context{options.context}, defaultIsFrame{false}, defaultChunks{}, frameControls{}, frameChunks{}, _keyframes{},
+	budget{options.budget}, budgetStart{}, budgetDecoding{false}, budgetDecodedBytes{0}, budgetScanlineBytes{0}, budgetCompressedBytes{0},
+	framesDecoded{0}, canvas{}, previousCanvas{}
+{
+	if (budget.maxTime.count())
+		budgetStart = std::chrono::steady_clock::now();
+	if (context && !scratchAllocator)
+		scratchAllocator = &context->scratchAllocator();
+}
+
+apngDecoder_t::apngDecoder_t(stream_t &stream, const decodeOptions_t &options) : apngDecoder_t{options}
+{
+	const auto start = std::chrono::steady_clock::now();
+	const auto crcTime = observer ? observer->stats.stageTimes[decodeStats_t::crc] : std::chrono::nanoseconds{};
 	checkSig(stream);
+	loadHeader(chunk_t::loadChunk(stream, options.crcCheck, false, chunkStats(), scratchAllocator));
+	loadChunks(stream, options.crcCheck);
+	if (observer)
+	{
+		decodeStats_t &stats = observer->stats;
+		stats.bytesIn += pngSig.size();
+		// The CRCs were checked as the chunks were loaded, so that time comes back off loading them.
+		stats.stageTimes[decodeStats_t::chunkLoading] += std::chrono::steady_clock::now() - start -
+			(stats.stageTimes[decodeStats_t::crc] - crcTime);
+		observer->chunksLoaded(stats);
+	}
+}
+
+apngDecoder_t::~apngDecoder_t() noexcept = default;
+
+uint32_t apngDecoder_t::width() const noexcept { return scaledLength(_width, scaleShift); }
+uint32_t apngDecoder_t::height() const noexcept { return scaledLength(_height, scaleShift); }
+
+frameRegion_t apngDecoder_t::frameRegion(const uint32_t index) const noexcept
+{
+	const fcTL_t &fcTL = frameControls[index];
+	return {fcTL.width(), fcTL.height(), fcTL.xOffset(), fcTL.yOffset()};
+}
 
-	chunk_t header = chunk_t::loadChunk(stream);
+void apngDecoder_t::loadHeader(const chunk_t &header)
+{
 	if (!isIHDR(header) || header.length() != 13)
 		throw invalidPNG_t{};
 	const auto headerData = header.data();
@@ -171,29 +370,51 @@ apng_t::apng_t(stream_t &stream) : _defaultFrame{}, transColourValid{false}, tra
 		throw invalidPNG_t{};
 	_interlacing = {headerData[12]};
 	validateHeader();
+	if (budget.maxCanvasPixels && uint64_t{width()} * height() > budget.maxCanvasPixels)
+		throw budgetExceeded_t{budgetExceeded_t::limit_t::canvasPixels};
+	unfilter = &unfilter_t::select(bytesPerPixel());
+}
 
-	while (!stream.atEOF())
-		chunks.emplace_back(chunk_t::loadChunk(stream));
-
+// Reads the palette and tRNS chunks, which between them settle the format frames are decoded from.
+void apngDecoder_t::loadColour(const chunkRefs_t &palettes, const chunkRefs_t &transChunks)
+{
 	if (_colourType == colourType_t::palette || _colourType == colourType_t::rgb || _colourType == colourType_t::rgba)
 	{
-		auto palettes = extract(chunks, isPLTE);
 		if ((_colourType == colourType_t::palette && palettes.size() != 1) || palettes.size() > 1)
 			throw invalidPNG_t{};
 		if (!palettes.empty())
 		{
-			const chunk_t *palette = palettes[0];
-			if ((palette->length() % 3) != 0)
+			const chunk_t *const chunk = palettes[0];
+			const size_t entries = chunk->length() / 3;
+			if ((chunk->length() % 3) != 0 || !entries || entries > 256)
 				throw invalidPNG_t{};
-			// process palette.
+			const auto data = chunk->data();
+			palette.resize(entries);
+			for (size_t i = 0; i < entries; ++i)
+				palette[i] = {{data[(i * 3)], data[(i * 3) + 1], data[(i * 3) + 2], 0xFFU}};
 		}
 	}
-	else if (contains(chunks, isPLTE))
+	else if (!palettes.empty())
 		throw invalidPNG_t{};
 
+	if (_colourType == colourType_t::palette)
+	{
+		if (transChunks.size() > 1)
+			throw invalidPNG_t{};
+		if (!transChunks.empty())
+		{
+			const chunk_t *trans = transChunks[0];
+			if (trans->length() > palette.size())
+				throw invalidPNG_t{};
+			const auto alpha = trans->data();
+			for (size_t i = 0; i < trans->length(); ++i)
+				palette[i][3] = alpha[i];
+			paletteAlpha = true;
+		}
+	}
+
 	if (_colourType == colourType_t::rgb || _colourType == colourType_t::greyscale)
 	{
-		auto transChunks = extract(chunks, isTRNS);
 		if (transChunks.size() > 1)
 			throw invalidPNG_t{};
 		if (!transChunks.empty())
@@ -215,11 +436,31 @@ apng_t::apng_t(stream_t &stream) : _defaultFrame{}, transColourValid{false}, tra
 		}
 	}
 
+	const uint16_t *const trans = transColourValid ? transColour : nullptr;
+	if (_colourType == colourType_t::palette)
+		convert = makeUnique<const convert_t>(_bitDepth, palette, paletteAlpha, target);
+	else if (_bitDepth != bitDepth_t::bps8 && _bitDepth != bitDepth_t::bps16)
+		convert = makeUnique<const convert_t>(_bitDepth, target, trans);
+	else
+		convert = makeUnique<const convert_t>(pngFormat(), target, trans);
+}
+
+void apngDecoder_t::loadChunks(stream_t &stream, const crcCheck_t crcCheck, const bool skipPixelData)
+{
+	while (!stream.atEOF())
+	{
+		chunks.emplace_back(chunk_t::loadChunk(stream, crcCheck, skipPixelData, chunkStats(), scratchAllocator));
+		checkTime();
+	}
+	loadColour(extract(chunks, isPLTE), extract(chunks, isTRNS));
+
+	if (chunks.empty())
+		throw invalidPNG_t{};
 	const chunk_t &end = chunks.back();
-	chunks.pop_back();
 	if (!isIEND(end) || end.length() != 0)
 		throw invalidPNG_t{};
-	else if (!contains(chunks, isIDAT))
+	chunks.pop_back();
+	if (!contains(chunks, isIDAT))
 		throw invalidPNG_t{};
 
 	const chunk_t *const acTL = extractFirst(chunks, isACTL);
@@ -227,18 +468,52 @@ apng_t::apng_t(stream_t &stream) : _defaultFrame{}, transColourValid{false}, tra
 		throw invalidPNG_t{};
 	controlChunk = acTL_t::reinterpret(*acTL);
 	controlChunk.check(chunks);
+	checkFrameCount();
 
 	if (isAfter(acTL, extractFirst(chunks, isIDAT)) || !contains(chunks, isFCTL))
 		throw invalidPNG_t{};
 	const auto fcTLChunks = extractIters(chunks, isFCTL);
-	const chunk_t &fcTL = *fcTLChunks[0];
-	uint32_t i = processDefaultFrame(chunks, isBefore(&fcTL, extractFirst(chunks, isIDAT)), fcTL);
+	if (controlChunk.frames() > fcTLChunks.size())
+		throw invalidPNG_t{};
+	defaultChunks = extract(chunks, isIDAT);
+	defaultIsFrame = isBefore(&*fcTLChunks[0], defaultChunks[0]);
+
+	// Parse and validate every frame's control chunk now, so only the pixel data is left to decode on demand.
 	const uint32_t lastFrame = controlChunk.frames() - 1;
-	for (; i < controlChunk.frames(); ++i)
-		processFrame(fcTLChunks[i], (i == lastFrame ? chunks.end() : fcTLChunks[i + 1]), i, *fcTLChunks[i]);
+	for (uint32_t i = 0; i < controlChunk.frames(); ++i)
+	{
+		fcTL_t fcTL = fcTL_t::reinterpret(*fcTLChunks[i], i);
+		fcTL.check(_width, _height, i == 0);
+		frameControls.emplace_back(fcTL);
+		indexFrame(i);
+		if (i == 0 && defaultIsFrame)
+			frameChunks.emplace_back(defaultChunks);
+		else
+			frameChunks.emplace_back(extract(fcTLChunks[i], i == lastFrame ? chunks.cend() : fcTLChunks[i + 1], isFDAT));
+		chargeFrame(i);
+		chargeFrameData(i);
+	}
 }
 
-void apng_t::checkSig(stream_t &stream)
+// A frame is a keyframe when compositing it doesn't look at the canvas the frames before it left: the first frame,
+// any frame disposing to background, as the canvas is cleared before that frame is drawn, and any frame replacing
+// the whole canvas. Disposing to previous restores a canvas from before the frame, so those frames never are.
+void apngDecoder_t::indexFrame(const uint32_t index)
+{
+	const fcTL_t &fcTL = frameControls[index];
+	const bool wholeCanvas = fcTL.width() == _width && fcTL.height() == _height;
+	if (index == 0 || (fcTL.disposeOp() != disposeOp_t::previous &&
+		(fcTL.disposeOp() == disposeOp_t::background || (wholeCanvas && fcTL.blendOp() == blendOp_t::source))))
+		_keyframes.push_back(index);
+}
+
+uint32_t apngDecoder_t::keyframeFor(const uint32_t index) const noexcept
+{
+	const auto keyframe = std::upper_bound(_keyframes.begin(), _keyframes.end(), index);
+	return keyframe == _keyframes.begin() ? 0 : *(keyframe - 1);
+}
+
+void apngDecoder_t::checkSig(stream_t &stream)
 {
 	std::array<uint8_t, 8> sig{};
 	stream.read(sig);
@@ -246,7 +521,7 @@ void apng_t::checkSig(stream_t &stream)
 		throw invalidPNG_t{};
 }
 
-void apng_t::validateHeader()
+void apngDecoder_t::validateHeader()
 {
 	if (!_width || !_height || (_width >> 31U) || (_height >> 31U))
 		throw invalidPNG_t{};
@@ -260,7 +535,9 @@ void apng_t::validateHeader()
 		throw invalidPNG_t{};
 }
 
-pixelFormat_t apng_t::pixelFormat() const
+pixelFormat_t apngDecoder_t::pixelFormat() const noexcept { return convert->output(); }
+
+pixelFormat_t apngDecoder_t::pngFormat() const
 {
 	if (_colourType == colourType_t::rgb)
 	{
@@ -277,7 +554,7 @@ pixelFormat_t apng_t::pixelFormat() const
 			return pixelFormat_t::format64bppRGBA;
 	}
 	else if (_colourType == colourType_t::palette)
-		return pixelFormat_t::format24bppRGB;
+		return paletteAlpha ? pixelFormat_t::format32bppRGBA : pixelFormat_t::format24bppRGB;
 	else if (_colourType == colourType_t::greyscale)
 	{
 		if (_bitDepth == bitDepth_t::bps8 || _bitDepth == bitDepth_t::bps4 ||
@@ -297,138 +574,936 @@ pixelFormat_t apng_t::pixelFormat() const
 	throw invalidPNG_t{};
 }
 
-bool apng_t::processFrame(stream_t &stream, bitmap_t &frame)
+// This is the filter algorithms' notion of a pixel's size, which is rounded up to 1 byte for sub-byte formats.
+uint8_t apngDecoder_t::bytesPerPixel() const noexcept
 {
-	void *const data = frame.data();
-	const bitmapRegion_t region(frame.width(), frame.height());
+	uint8_t channels = 1;
 	if (_colourType == colourType_t::rgb)
+		channels = 3;
+	else if (_colourType == colourType_t::rgba)
+		channels = 4;
+	else if (_colourType == colourType_t::greyscaleAlpha)
+		channels = 2;
+	return _bitDepth == bitDepth_t::bps16 ? channels * 2 : channels;
+}
+
+template<typename rows_t> bool apngDecoder_t::processFrame(rows_t rows, const frameRegion_t &region, bitmap_t &frame,
+	const passCallback_t &passDone, decodeStats_t *const stats, decodeContext_t *const frameContext) const
+{
+	const bool interlaced = _interlacing == interlace_t::adam7;
+	const size_t length = rowBufferLength(*convert, region.width, interlaced);
+	allocation_t frameRowBuffer{};
+	uint8_t *rowBuffer = nullptr;
+	if (frameContext)
 	{
-		if (_bitDepth == bitDepth_t::bps8)
-			return copyFrame<pngRGB8_t, readRGB>(stream, data, region);
-		else if (_bitDepth == bitDepth_t::bps16)
-			return copyFrame<pngRGB16_t, readRGB>(stream, data, region);
+		if (frameContext->rowBuffer.size() < length)
+			frameContext->rowBuffer.resize(length);
+		rowBuffer = frameContext->rowBuffer.data();
 	}
-	else if (_colourType == colourType_t::rgba)
+	else
 	{
-		if (_bitDepth == bitDepth_t::bps8)
-			return copyFrame<pngRGBA8_t, readRGBA>(stream, data, region);
-		else if (_bitDepth == bitDepth_t::bps16)
-			return copyFrame<pngRGBA16_t, readRGBA>(stream, data, region);
+		frameRowBuffer = allocateFrom(nullptr, length);
+		rowBuffer = frameRowBuffer.get();
 	}
-	else if (_colourType == colourType_t::greyscale)
+	const bool pointSample = convert->outputTrans() != nullptr;
+
+	if (interlaced)
 	{
-		// 1, 2, 4 here..
-		/*else*/
-		if (_bitDepth == bitDepth_t::bps8)
-			return copyFrame<pngGrey8_t, readGrey>(stream, data, region);
-		else if (_bitDepth == bitDepth_t::bps16)
-			return copyFrame<pngGrey16_t, readGrey>(stream, data, region);
+		// Every pass spans the whole frame, so a frame being scaled down is deinterlaced at full size first.
+		std::unique_ptr<bitmap_t> fullFrame{};
+		std::unique_ptr<downscaler_t> downscaler{};
+		if (scaleShift)
+		{
+			fullFrame = makeUnique<bitmap_t>(region.width, region.height, frame.format(), scratchAllocator, false);
+			downscaler = makeUnique<downscaler_t>(frame, region, scaleShift, pointSample);
+		}
+		bitmap_t &fullSize = fullFrame ? *fullFrame : frame;
+		::passCallback_t framePassDone{};
+		if (passDone)
+			framePassDone = [&](const uint8_t pass)
+			{
+				if (downscaler)
+					downscaler->scale(fullSize);
+				passDone(pass, frame);
+			};
+		const bool result = stats ?
+			copyInterlacedFrame(rows, fullSize, *unfilter, *convert, framePassDone, rowBuffer, rowStats_t{*stats}) :
+			copyInterlacedFrame(rows, fullSize, *unfilter, *convert, framePassDone, rowBuffer);
+		if (result && downscaler && !passDone)
+			downscaler->scale(fullSize);
+		return result;
 	}
-	else if (_colourType == colourType_t::greyscaleAlpha)
+	if (scaleShift)
 	{
-		if (_bitDepth == bitDepth_t::bps8)
-			return copyFrame<pngGreyA8_t, readGreyA>(stream, data, region);
-		else if (_bitDepth == bitDepth_t::bps16)
-			return copyFrame<pngGreyA16_t, readGreyA>(stream, data, region);
+		downscaler_t downscaler{frame, region, scaleShift, pointSample};
+		if (stats)
+			return copyFrame(rows, downscaler, region.width, region.height, *unfilter, *convert, rowBuffer,
+				rowStats_t{*stats});
+		return copyFrame(rows, downscaler, region.width, region.height, *unfilter, *convert, rowBuffer);
 	}
-	return false;
+	bitmapOutput_t output{frame.data(), frame.width() * size_t{pixelBytes(frame.format())}};
+	if (stats)
+		return copyFrame(rows, output, region.width, region.height, *unfilter, *convert, rowBuffer,
+			rowStats_t{*stats});
+	return copyFrame(rows, output, region.width, region.height, *unfilter, *convert, rowBuffer);
 }
 
-uint32_t apng_t::processDefaultFrame(const chunkList_t &chunks, const bool isSequenceFrame, const chunk_t &controlChunk)
+// How many bytes a frame's scanlines inflate to, filter type bytes included.
+static uint64_t scanlinesLength(const convert_t &convert, const uint32_t width, const uint32_t height,
+	const bool interlaced) noexcept
 {
-	chunkStream_t chunkStream(extract(chunks, isIDAT));
-	zlibStream_t frameData{chunkStream, zlibStream_t::inflate};
-	auto frame = makeUnique<bitmap_t>(_width, _height, pixelFormat());
-	_defaultFrame = frame.get();
-	if (isSequenceFrame)
+	if (!interlaced)
+		return safeMul(convert.inputLength(width) + 1, height);
+	uint64_t length = 0;
+	for (const adam7Pass_t &adam7 : adam7Passes)
 	{
-		fcTL_t fcTL = fcTL_t::reinterpret(controlChunk, 0);
-		fcTL.check(_width, _height, true);
-		_frames.emplace_back(std::make_pair(fcTL, std::move(frame)));
+		const uint32_t passWidth = width > adam7.x ? (width - adam7.x + adam7.xStep - 1) / adam7.xStep : 0;
+		const uint32_t passHeight = height > adam7.y ? (height - adam7.y + adam7.yStep - 1) / adam7.yStep : 0;
+		const uint64_t passLength = passWidth ? safeMul(convert.inputLength(passWidth) + 1, passHeight) : 0;
+		if (passLength == uint64Max)
+			return uint64Max;
+		length += passLength;
+	}
+	return length;
+}
+
+void apngDecoder_t::checkFrameCount() const
+{
+	if (budget.maxFrames && frameCount() > budget.maxFrames)
+		throw budgetExceeded_t{budgetExceeded_t::limit_t::frames};
+}
+
+void apngDecoder_t::checkTime() const
+{
+	if (budget.maxTime.count() && std::chrono::steady_clock::now() - budgetStart > budget.maxTime)
+		throw budgetExceeded_t{budgetExceeded_t::limit_t::time};
+}
+
+void apngDecoder_t::startDecoding() noexcept
+{
+	if (budgetDecoding)
+		return;
+	budgetDecoding = true;
+	if (budget.maxTime.count())
+		budgetStart = std::chrono::steady_clock::now();
+}
+
+// Canvases are copied a row at a time, so a tiny frame on a wide canvas still costs whole rows, and every frame's
+// canvas has a table of rows even where it shares all of them. A canvas kept to dispose to previous costs a table too.
+void apngDecoder_t::chargeFrame(const uint32_t index)
+{
+	if (!budget.maxDecodedBytes)
+		return;
+	const frameRegion_t region = scaledRegion(frameRegion(index), scaleShift);
+	const uint8_t pixelLength = pixelBytes(pixelFormat());
+	const uint64_t rowTable = safeMul(height(), sizeof(std::shared_ptr<uint8_t>));
+	uint64_t bytes = safeAdd(safeMul(region.width, region.height, pixelLength),
+		safeMul(region.height, width(), pixelLength));
+	bytes = safeAdd(bytes, rowTable);
+	if (frameControls[index].disposeOp() == disposeOp_t::previous)
+		bytes = safeAdd(bytes, rowTable);
+	budgetDecodedBytes = safeAdd(budgetDecodedBytes, bytes);
+	if (budgetDecodedBytes > budget.maxDecodedBytes)
+		throw budgetExceeded_t{budgetExceeded_t::limit_t::decodedBytes};
+}
+
+// Deflate can't do better than about 1032:1, so a frame claiming to inflate to far more than its data is either
+// truncated or a decompression bomb, and either way isn't worth allocating for.
+void apngDecoder_t::chargeFrameData(const uint32_t index)
+{
+	if (!budget.maxCompressionRatio)
+		return;
+	const frameRegion_t region = frameRegion(index);
+	budgetScanlineBytes = safeAdd(budgetScanlineBytes, scanlinesLength(*convert, region.width, region.height,
+		_interlacing == interlace_t::adam7));
+	// fdAT chunks start with their sequence number.
+	for (const chunk_t *const chunk : frameChunks[index])
+		budgetCompressedBytes += isFDAT(*chunk) ? std::max<uint32_t>(chunk->length(), 4) - 4 : chunk->length();
+	if (budgetScanlineBytes > safeMul(budgetCompressedBytes, budget.maxCompressionRatio))
+		throw budgetExceeded_t{budgetExceeded_t::limit_t::compressionRatio};
+}
+
+// A context's inflate state is reset for each frame, rather than being set up from scratch. The single-shot
+// backends inflate the frame whole into scratch memory first, and its scanlines are then unfiltered in place.
+void apngDecoder_t::inflateFrame(stream_t &chunkStream, const frameRegion_t &region, bitmap_t &frame,
+	const passCallback_t &passDone, decodeStats_t *const stats, decodeContext_t *const frameContext) const
+{
+	if (inflateBackend == inflateBackend_t::streaming)
+	{
+		if (frameContext)
+		{
+			zlibStream_t &frameData = *frameContext->inflater;
+			frameData.reset(chunkStream);
+			if (!processFrame(streamRows_t{frameData}, region, frame, passDone, stats, frameContext))
+				throw invalidPNG_t{};
+		}
+		else
+		{
+			zlibStream_t frameData{chunkStream, zlibStream_t::inflate};
+			if (!processFrame(streamRows_t{frameData}, region, frame, passDone, stats, nullptr))
+				throw invalidPNG_t{};
+		}
+		return;
+	}
+
+	const uint64_t length = scanlinesLength(*convert, region.width, region.height, _interlacing == interlace_t::adam7);
+	if (length >= std::numeric_limits<size_t>::max())
+		throw std::bad_alloc{};
+	allocation_t scanlines = allocateFrom(scratchAllocator, length);
+	std::unique_ptr<inflater_t> frameInflater{};
+	inflater_t *inflater = nullptr;
+	if (frameContext)
+	{
+		auto &contextInflater = frameContext->wholeInflaters[size_t(inflateBackend)];
+		if (!contextInflater)
+			contextInflater = inflater_t::make(inflateBackend);
+		inflater = contextInflater.get();
 	}
 	else
-		defaultFrameStorage = std::move(frame);
+	{
+		frameInflater = inflater_t::make(inflateBackend);
+		inflater = frameInflater.get();
+	}
 
-	if (!processFrame(frameData, *_defaultFrame))
+	const auto start = std::chrono::steady_clock::now();
+	if (!inflater->inflate(chunkStream, scanlines.get(), length))
+		throw invalidPNG_t{};
+	if (stats)
+		stats->stageTimes[decodeStats_t::inflate] += std::chrono::steady_clock::now() - start;
+	if (!processFrame(bufferRows_t{scanlines.get(), size_t(length)}, region, frame, passDone, stats, frameContext))
 		throw invalidPNG_t{};
+}
 
-	// Return what the first unread animation frame index is.
-	return isSequenceFrame ? 1 : 0;
+std::unique_ptr<bitmap_t> apngDecoder_t::decodeDefaultFrame() const
+	{ return decodeDefaultFrame({}, nullptr, allocator, context); }
+
+// Decoding overwrites every pixel of a frame, so its bitmap doesn't need clearing first.
+std::unique_ptr<bitmap_t> apngDecoder_t::decodeDefaultFrame(const passCallback_t &passDone,
+	decodeStats_t *const stats, allocator_t *const frameAllocator, decodeContext_t *const frameContext) const
+{
+	chunkStream_t chunkStream{chunkStream_t::chunkList_t{defaultChunks}};
+	auto frame = makeUnique<bitmap_t>(width(), height(), pixelFormat(), frameAllocator, false);
+	inflateFrame(chunkStream, {_width, _height, 0, 0}, *frame, passDone, stats, frameContext);
+	return frame;
 }
 
-template<blendOp_t::_blendOp_t op> void compositFrame(const bitmap_t &source, bitmap_t &destination, const pixelFormat_t pixelFormat, const fcTL_t &fcTL) noexcept
+std::unique_ptr<bitmap_t> apngDecoder_t::decodePartial(const uint32_t index, const passCallback_t &passDone,
+	decodeStats_t *const stats, decodeContext_t *const frameContext) const
 {
-	const uint32_t xOffset = fcTL.xOffset();
-	const uint32_t yOffset = fcTL.yOffset();
-	if (pixelFormat == pixelFormat_t::format24bppRGB)
-		compFrame(compRGB<pngRGB8_t, op>, source, destination, xOffset, yOffset);
-	else if (pixelFormat == pixelFormat_t::format48bppRGB)
-		compFrame(compRGB<pngRGB16_t, op>, source, destination, xOffset, yOffset);
-	else if (pixelFormat == pixelFormat_t::format32bppRGBA)
-		compFrame(compRGBA<pngRGBA8_t, op>, source, destination, xOffset, yOffset);
-	else if (pixelFormat == pixelFormat_t::format64bppRGBA)
-		compFrame(compRGBA<pngRGBA16_t, op>, source, destination, xOffset, yOffset);
-	else if (pixelFormat == pixelFormat_t::format8bppGrey)
-		compFrame(compGrey<pngGrey8_t, op>, source, destination, xOffset, yOffset);
-	else if (pixelFormat == pixelFormat_t::format16bppGrey)
-		compFrame(compGrey<pngGrey16_t, op>, source, destination, xOffset, yOffset);
-	else if (pixelFormat == pixelFormat_t::format8bppGreyA)
-		compFrame(compGreyA<pngGreyA8_t, op>, source, destination, xOffset, yOffset);
-	else if (pixelFormat == pixelFormat_t::format16bppGreyA)
-		compFrame(compGreyA<pngGreyA16_t, op>, source, destination, xOffset, yOffset);
+	if (index == 0 && defaultIsFrame)
+		return decodeDefaultFrame(passDone, stats, scratchAllocator, frameContext);
+	const fcTL_t &fcTL = frameControls[index];
+	chunkStream_t chunkStream{chunkStream_t::chunkList_t{frameChunks[index]}, true, fcTL.sequenceIndex()};
+	const frameRegion_t region = frameRegion(index);
+	const frameRegion_t scaled = scaledRegion(region, scaleShift);
+	auto partialFrame = makeUnique<bitmap_t>(scaled.width, scaled.height, pixelFormat(), scratchAllocator, false);
+	if (convert->outputTrans())
+		partialFrame->transparent(convert->outputTrans());
+	inflateFrame(chunkStream, region, *partialFrame, passDone, stats, frameContext);
+	return partialFrame;
 }
 
-void apng_t::processFrame(const chunkIter_t &chunkBegin, const chunkIter_t &chunkEnd, const uint32_t frameIndex,
-	const chunk_t &controlChunk)
+void apngDecoder_t::composit(const uint32_t index, const bitmap_t &partialFrame, canvas_t &destination) const
 {
 	const pixelFormat_t format = pixelFormat();
-	fcTL_t fcTL = fcTL_t::reinterpret(controlChunk, frameIndex);
-	fcTL.check(_width, _height, frameIndex == 0);
+	const bool blendAlpha = target != targetFormat_t::png;
+	const fcTL_t &fcTL = frameControls[index];
+
+	// disposeOp_t::none builds on the canvas as it stands, disposeOp_t::previous restores the last canvas
+	// not itself built by disposing to previous, and otherwise the canvas is cleared. As the canvas shares
+	// its rows, none of these copy any pixels; only the rows the frame then covers get duplicated.
+	if (index == 0 && defaultIsFrame)
+		destination = canvas_t{partialFrame, allocator};
+	else
+	{
+		if (!destination.valid())
+			destination = canvas_t{width(), height(), format, allocator};
+		if (fcTL.disposeOp() == disposeOp_t::previous && index != 0)
+			destination = previousCanvas;
+		else if (fcTL.disposeOp() != disposeOp_t::none || index == 0)
+			destination.clear();
+
+		// A frame scaled down covers every block of the image it has pixels in.
+		const frameRegion_t region = scaledRegion(frameRegion(index), scaleShift);
+		if (fcTL.blendOp() == blendOp_t::source || fcTL.disposeOp() == disposeOp_t::background)
+			::compositFrame<blendOp_t::source>(partialFrame, destination, format, blendAlpha, region.xOffset,
+				region.yOffset);
+		else
+			::compositFrame<blendOp_t::over>(partialFrame, destination, format, blendAlpha, region.xOffset,
+				region.yOffset);
+	}
+}
 
-	chunkStream_t chunkStream(extract(chunkBegin, chunkEnd, isFDAT), true, fcTL.sequenceIndex());
-	zlibStream_t frameData(chunkStream, zlibStream_t::inflate);
-	bitmap_t partialFrame(fcTL.width(), fcTL.height(), format);
-	if (!processFrame(frameData, partialFrame))
+void apngDecoder_t::compositFrame(const uint32_t index, const bitmap_t &partialFrame, decodeStats_t *const stats)
+{
+	const fcTL_t &fcTL = frameControls[index];
+	if (stats)
+	{
+		const auto start = std::chrono::steady_clock::now();
+		composit(index, partialFrame, canvas);
+		stats->stageTimes[decodeStats_t::composite] += std::chrono::steady_clock::now() - start;
+		++stats->disposeOps[fcTL.disposeOp()];
+		++stats->blendOps[fcTL.blendOp()];
+	}
+	else
+		composit(index, partialFrame, canvas);
+
+	// Only keep hold of this canvas if the next frame is going to need it.
+	const uint32_t next = index + 1;
+	if (fcTL.disposeOp() != disposeOp_t::previous && next < frameCount() &&
+		frameControls[next].disposeOp() == disposeOp_t::previous)
+		previousCanvas = canvas;
+	framesDecoded = next;
+}
+
+const canvas_t &apngDecoder_t::seek(const uint32_t index)
+{
+	if (index >= frameCount())
+		throw std::out_of_range{"APNG frame index out of range"};
+	// Asking for the frame most recently decoded costs nothing, otherwise decoding carries on from there unless
+	// that means going backwards or there's a keyframe between here and there, in which case it restarts from that.
+	const uint32_t keyframe = keyframeFor(index);
+	if (framesDecoded > index + 1 || framesDecoded < keyframe)
+		framesDecoded = keyframe;
+	while (framesDecoded <= index)
+		decodeNextFrame();
+	return canvas;
+}
+
+// How much memory the distinct rows of the given canvases take up, counting rows they share just the once.
+static uint64_t canvasMemory(const std::vector<const canvas_t *> &canvases)
+{
+	std::unordered_set<const uint8_t *> rows;
+	uint64_t memory = 0;
+	for (const canvas_t *const canvas : canvases)
+	{
+		for (uint32_t y = 0; y < canvas->height(); ++y)
+		{
+			if (rows.insert(canvas->row(y)).second)
+				memory += canvas->rowLength();
+		}
+	}
+	return memory;
+}
+
+// Hands a frame's statistics to the observer once the frame is composited, given how many bytes
+// of partially decoded frames, this one's included, are being held on to at this point.
+void apngDecoder_t::observeFrame(const uint32_t index, decodeStats_t &stats, const uint64_t partialBytes)
+{
+	stats.peakBitmapMemory = partialBytes + canvasMemory({&canvas, &previousCanvas});
+	observer->stats += stats;
+	observer->frameEnd(index, stats);
+}
+
+void apngDecoder_t::decodeNextFrame()
+{
+	const uint32_t index = framesDecoded;
+	startDecoding();
+	checkTime();
+	decodeStats_t frameStats{};
+	decodeStats_t *const stats = observer ? &frameStats : nullptr;
+	if (observer)
+		observer->frameBegin(index, frameControls[index]);
+	std::unique_ptr<bitmap_t> partialFrame;
+	// Each preview is composited onto a copy of the canvas, which only duplicates the rows the frame covers.
+	if (progress && _interlacing == interlace_t::adam7)
+		partialFrame = decodePartial(index, [&](const uint8_t pass, const bitmap_t &preview)
+		{
+			canvas_t previewCanvas{canvas};
+			composit(index, preview, previewCanvas);
+			progress(index, pass, previewCanvas);
+		}, stats, context);
+	else
+		partialFrame = decodePartial(index, {}, stats, context);
+	compositFrame(index, *partialFrame, stats);
+	if (observer)
+		observeFrame(index, frameStats, partialFrame->length());
+}
+
+void apngDecoder_t::decodeFrames(const frameCallback_t &callback, const uint32_t threads)
+{
+	framesDecoded = 0;
+	startDecoding();
+	const uint32_t workers = threads ? threads : threadPool_t::hardwareThreads();
+	if (workers == 1 || frameCount() == 1)
+	{
+		for (uint32_t i = 0; i < frameCount(); ++i)
+			callback(i, frame(i));
+		return;
+	}
+
+	struct pendingFrame_t
+	{
+		std::unique_ptr<bitmap_t> frame;
+		std::exception_ptr error;
+		decodeStats_t stats{};
+		bool done{false};
+	};
+
+	std::vector<pendingFrame_t> pending(frameCount());
+	std::mutex pendingLock;
+	std::condition_variable frameDone;
+	uint32_t submitted = 0;
+	// How many bytes of decoded frames are waiting to be composited, only kept track of for the observer.
+	uint64_t pendingBytes = 0;
+
+	const auto decode = [&](const uint32_t index) noexcept
+	{
+		pendingFrame_t &result = pending[index];
+		std::unique_ptr<bitmap_t> frame;
+		std::exception_ptr error;
+		// Nothing else touches the frame's statistics until it's marked done.
+		try
+			{ frame = decodePartial(index, {}, observer ? &result.stats : nullptr); }
+		catch (...)
+			{ error = std::current_exception(); }
+		std::lock_guard<std::mutex> lock{pendingLock};
+		if (observer && frame)
+			pendingBytes += frame->length();
+		result.frame = std::move(frame);
+		result.error = error;
+		result.done = true;
+		frameDone.notify_all();
+	};
+	const auto waitFor = [&](const uint32_t index) -> pendingFrame_t &
+	{
+		std::unique_lock<std::mutex> lock{pendingLock};
+		frameDone.wait(lock, [&]() { return pending[index].done; });
+		return pending[index];
+	};
+
+	// The pool is declared last so, even when unwinding, its workers finish before anything they use goes away.
+	threadPool_t pool{workers};
+	// Limit how far decoding runs ahead of compositing so at most a few partial frames per thread are held at once.
+	const uint32_t window = uint32_t(pool.size()) * 2;
+	for (uint32_t i = 0; i < frameCount(); ++i)
+	{
+		for (; submitted < frameCount() && submitted < i + window; ++submitted)
+		{
+			const uint32_t index = submitted;
+			checkTime();
+			if (observer)
+				observer->frameBegin(index, frameControls[index]);
+			pool.submit([&decode, index]() { decode(index); });
+		}
+		pendingFrame_t &result = waitFor(i);
+		if (result.error)
+			std::rethrow_exception(result.error);
+		if (observer)
+		{
+			compositFrame(i, *result.frame, &result.stats);
+			std::unique_lock<std::mutex> lock{pendingLock};
+			const uint64_t partialBytes = pendingBytes;
+			pendingBytes -= result.frame->length();
+			lock.unlock();
+			observeFrame(i, result.stats, partialBytes);
+		}
+		else
+			compositFrame(i, *result.frame);
+		result.frame.reset();
+		callback(i, canvas);
+	}
+}
+
+decodeContext_t::decodeContext_t() : inflater{makeUnique<zlibStream_t>(zlibStream_t::inflate)}, wholeInflaters{}, rowBuffer{},
+	pool{makeUnique<poolAllocator_t>()} { }
+
+decodeContext_t::~decodeContext_t() noexcept = default;
+
+allocator_t &decodeContext_t::scratchAllocator() noexcept { return *pool; }
+
+apngBatch_t decodeContext_t::decodeBatch(const std::vector<stream_t *> &inputs, const decodeOptions_t &options)
+{
+	decodeOptions_t batchOptions{options};
+	batchOptions.context = this;
+	apngBatch_t batch{allocation_t{}, 0, {}};
+	std::vector<std::unique_ptr<apngDecoder_t>> decoders;
+
+	// Every input's chunks are read first to find out how much space the whole batch needs.
+	std::vector<uint64_t> lengths;
+	for (stream_t *const input : inputs)
+	{
+		apngBatch_t::image_t image{false, 0, 0, pixelFormat_t::format8bppGrey, 0, 0, {}};
+		std::unique_ptr<apngDecoder_t> decoder;
+		uint64_t length = 0;
+		try
+		{
+			decoder = makeUnique<apngDecoder_t>(*input, batchOptions);
+			image.width = decoder->width();
+			image.height = decoder->height();
+			image.pixelFormat = decoder->pixelFormat();
+			image.loops = decoder->loops();
+			const uint64_t frameLength = safeMul(image.width, image.height, pixelBytes(image.pixelFormat));
+			length = safeMul(frameLength, decoder->frameCount());
+			// An image too big to ever be held is as good as invalid.
+			if (length > std::numeric_limits<size_t>::max())
+				throw std::bad_alloc{};
+			image.frameLength = frameLength;
+			for (uint32_t i = 0; i < decoder->frameCount(); ++i)
+				image.frames.push_back({decoder->frameControl(i), 0});
+			image.valid = true;
+		}
+		catch (invalidPNG_t &)
+			{ decoder.reset(); }
+		catch (budgetExceeded_t &)
+			{ decoder.reset(); }
+		catch (std::bad_alloc &)
+			{ decoder.reset(); }
+		if (!image.valid)
+		{
+			image.frames.clear();
+			length = 0;
+		}
+		batch.images.emplace_back(std::move(image));
+		decoders.emplace_back(std::move(decoder));
+		lengths.push_back(length);
+	}
+
+	// When the whole batch can't be allocated at once, the biggest image left is dropped until it can be.
+	for (;;)
+	{
+		uint64_t length = 0;
+		for (const uint64_t imageLength : lengths)
+			length = safeAdd(length, imageLength);
+		if (length <= std::numeric_limits<size_t>::max())
+		{
+			try
+			{
+				batch.pixels = allocateFrom(options.allocator, size_t(length));
+				batch.length = size_t(length);
+				break;
+			}
+			catch (std::bad_alloc &)
+			{
+				if (!length)
+					throw;
+			}
+		}
+		const size_t largest = size_t(std::max_element(lengths.begin(), lengths.end()) - lengths.begin());
+		batch.images[largest].valid = false;
+		batch.images[largest].frames.clear();
+		decoders[largest].reset();
+		lengths[largest] = 0;
+	}
+	size_t offset = 0;
+	for (auto &image : batch.images)
+	{
+		for (auto &frame : image.frames)
+		{
+			frame.offset = offset;
+			offset += image.frameLength;
+		}
+	}
+
+	for (size_t i = 0; i < decoders.size(); ++i)
+	{
+		apngBatch_t::image_t &image = batch.images[i];
+		if (!decoders[i])
+			continue;
+		try
+		{
+			for (uint32_t j = 0; j < image.frames.size(); ++j)
+			{
+				const canvas_t &frame = decoders[i]->frame(j);
+				uint8_t *const pixels = batch.pixels.get() + image.frames[j].offset;
+				for (uint32_t y = 0; y < frame.height(); ++y)
+					memcpy(pixels + (y * frame.rowLength()), frame.row(y), frame.rowLength());
+			}
+		}
+		catch (invalidPNG_t &)
+		{
+			image.valid = false;
+			image.frames.clear();
+		}
+		catch (budgetExceeded_t &)
+		{
+			image.valid = false;
+			image.frames.clear();
+		}
+		catch (std::bad_alloc &)
+		{
+			image.valid = false;
+			image.frames.clear();
+		}
+		// Each image's chunks and canvases are let go of as soon as it's done.
+		decoders[i].reset();
+	}
+	return batch;
+}
+
+apngInfo_t apngDecoder_t::probe(stream_t &stream, const crcCheck_t crcCheck)
+{
+	decodeOptions_t options;
+	options.crcCheck = crcCheck;
+	apngDecoder_t decoder{options};
+	decoder.checkSig(stream);
+	decoder.loadHeader(chunk_t::loadChunk(stream, crcCheck));
+	decoder.loadChunks(stream, crcCheck, true);
+
+	std::chrono::nanoseconds duration{};
+	for (const auto &fcTL : decoder.frameControls)
+		duration += fcTL.delay();
+	return {decoder._width, decoder._height, decoder._bitDepth, decoder._colourType, decoder._interlacing,
+		decoder.frameCount(), decoder.loops(), decoder.defaultIsFrame, std::move(decoder.frameControls), duration,
+		std::move(decoder._keyframes)};
+}
+
+// Reads from a span of memory that only lives for the duration of apngPushDecoder_t::push(). It deliberately
+// doesn't offer view(), so chunk_t::loadChunk() gives each chunk its own copy of its data.
+struct spanStream_t final : public stream_t
+{
+private:
+	const uint8_t *const data;
+	const size_t length;
+	size_t pos;
+
+public:
+	spanStream_t(const uint8_t *const span, const size_t spanLength) noexcept : stream_t{}, data{span},
+		length{spanLength}, pos{0} { }
+
+	bool read(void *const value, const size_t valueLen, size_t &countRead) noexcept final override
+	{
+		countRead = std::min(valueLen, length - pos);
+		memcpy(value, data + pos, countRead);
+		pos += countRead;
+		return true;
+	}
+
+	bool atEOF() const noexcept final override { return pos == length; }
+};
+
+apngPushDecoder_t::apngPushDecoder_t(const callbacks_t &pushCallbacks, const decodeOptions_t &options) :
+	decoder{options}, callbacks{pushCallbacks}, crcCheck{options.crcCheck}, state{state_t::signature}, partial{},
+	chunks{}, palettes{}, transChunks{}, haveControl{false}, haveData{false} { }
+
+// How many bytes the signature or next chunk takes up, as far as the bytes available so far can tell.
+size_t apngPushDecoder_t::itemLength(const uint8_t *const data, const size_t length) const
+{
+	if (state == state_t::signature)
+		return pngSig.size();
+	else if (length < 4)
+		return 12;
+	const uint32_t chunkLength = read32(data);
+	if (chunkLength >> 31U)
 		throw invalidPNG_t{};
-	if (transColourValid)
-		partialFrame.transparent(transColour);
-
-	// This constructs a disposeOp_t::background initialised bitmap anyway.
-	auto frame = makeUnique<bitmap_t>(_width, _height, format);
-	if (fcTL.disposeOp() == disposeOp_t::none && frameIndex != 0)
-		compositFrame<blendOp_t::source>(*_frames.back().second, *frame, format, fcTL_t{});
-	else if (fcTL.disposeOp() == disposeOp_t::previous)
-	{
-		auto source = _frames.end();
-		// Only if there are frames to backtrack over.
-		if (source != _frames.begin())
+	return size_t{chunkLength} + 12;
+}
+
+void apngPushDecoder_t::push(const void *const data, const size_t length)
+{
+	const uint8_t *bytes = static_cast<const uint8_t *>(data);
+	size_t remaining = length;
+	while (remaining)
+	{
+		if (state == state_t::finished)
+			throw invalidPNG_t{};
+		// A chunk left incomplete by the last push is finished off first, and whole chunks are then parsed
+		// straight out of data, leaving only the start of any chunk it ends part way through to be held on to.
+		if (!partial.empty())
 		{
-			// Find the first frame that doesn't have disposeOp_t::previous, or is simply the first frame.
-			while (--source != _frames.begin() && source->first.disposeOp() == disposeOp_t::previous)
-				continue;
-			// And composit it in as the basis of this frame.
-			compositFrame<blendOp_t::source>(*source->second, *frame, format, fcTL_t());
+			size_t needed = itemLength(partial.data(), partial.size());
+			while (partial.size() < needed && remaining)
+			{
+				const size_t amount = std::min(needed - partial.size(), remaining);
+				partial.insert(partial.end(), bytes, bytes + amount);
+				bytes += amount;
+				remaining -= amount;
+				needed = itemLength(partial.data(), partial.size());
+			}
+			if (partial.size() < needed)
+				return;
+			consume(partial.data(), partial.size());
+			partial.clear();
+		}
+		else
+		{
+			const size_t needed = itemLength(bytes, remaining);
+			if (remaining < needed)
+			{
+				partial.assign(bytes, bytes + remaining);
+				return;
+			}
+			consume(bytes, needed);
+			bytes += needed;
+			remaining -= needed;
 		}
 	}
+}
 
-	if (fcTL.blendOp() == blendOp_t::source || fcTL.disposeOp() == disposeOp_t::background)
-		compositFrame<blendOp_t::source>(partialFrame, *frame, format, fcTL);
+void apngPushDecoder_t::consume(const uint8_t *const data, const size_t length)
+{
+	spanStream_t stream{data, length};
+	if (state == state_t::signature)
+	{
+		decoder.checkSig(stream);
+		state = state_t::header;
+	}
 	else
-		compositFrame<blendOp_t::over>(partialFrame, *frame, format, fcTL);
-	_frames.emplace_back(std::make_pair(fcTL, std::move(frame)));
+		processChunk(chunk_t::loadChunk(stream, crcCheck, false, decoder.chunkStats(), decoder.scratchAllocator));
 }
 
-std::vector<std::pair<const displayTime_t, const bitmap_t *const>> apng_t::frames() const noexcept
+// Validates chunks in the same way apngDecoder_t::loadChunks() does, but as each one arrives.
+// A frame's data is known to be complete once the next frame's fcTL chunk or the IEND chunk turns up.
+void apngPushDecoder_t::processChunk(chunk_t &&chunk)
 {
+	decoder.checkTime();
+	if (state == state_t::header)
+	{
+		decoder.loadHeader(chunk);
+		state = state_t::chunks;
+		if (callbacks.header)
+			callbacks.header();
+		return;
+	}
+
+	const uint32_t frames = decoder.frameControls.size();
+	if (isIEND(chunk))
+	{
+		if (chunk.length() || !haveData || !frames || frames != decoder.frameCount())
+			throw invalidPNG_t{};
+		finishFrame();
+		state = state_t::finished;
+	}
+	else if (isPLTE(chunk) || isTRNS(chunk))
+	{
+		if (haveData)
+			throw invalidPNG_t{};
+		chunks.emplace_back(std::move(chunk));
+		(isPLTE(chunks.back()) ? palettes : transChunks).push_back(&chunks.back());
+	}
+	else if (isACTL(chunk))
+	{
+		if (haveControl || haveData)
+			throw invalidPNG_t{};
+		decoder.controlChunk = acTL_t::reinterpret(chunk);
+		if (!decoder.frameCount())
+			throw invalidPNG_t{};
+		decoder.checkFrameCount();
+		haveControl = true;
+	}
+	else if (isFCTL(chunk))
+	{
+		// The first frame has to be the default image, so its IDAT chunks must come before any later frame.
+		if (!haveControl || frames == decoder.frameCount() || (frames && !haveData))
+			throw invalidPNG_t{};
+		fcTL_t fcTL = fcTL_t::reinterpret(chunk, frames);
+		fcTL.check(decoder._width, decoder._height, frames == 0);
+		if (!frames)
+			decoder.defaultIsFrame = !haveData;
+		decoder.frameControls.emplace_back(fcTL);
+		decoder.indexFrame(frames);
+		decoder.frameChunks.emplace_back();
+		// Until the colour chunks are in, what the first frame decodes to isn't known.
+		if (haveData)
+			decoder.chargeFrame(frames);
+		if (callbacks.frameControl)
+			callbacks.frameControl(frames, decoder.frameControls.back());
+		if (frames)
+			finishFrame();
+	}
+	else if (isIDAT(chunk))
+	{
+		// IDAT chunks have to run on from each other, and can only be the first frame's if its fcTL came first.
+		if (!haveControl || frames > 1 || (frames && !decoder.defaultIsFrame))
+			throw invalidPNG_t{};
+		if (!haveData)
+		{
+			decoder.loadColour(palettes, transChunks);
+			palettes.clear();
+			transChunks.clear();
+			chunks.clear();
+			haveData = true;
+			if (frames)
+				decoder.chargeFrame(0);
+		}
+		// The default image is only decoded when it's also the first frame.
+		if (frames)
+		{
+			chunks.emplace_back(std::move(chunk));
+			decoder.defaultChunks.push_back(&chunks.back());
+			decoder.frameChunks[0].push_back(&chunks.back());
+		}
+	}
+	else if (isFDAT(chunk))
+	{
+		if (!haveData || !frames || (frames == 1 && decoder.defaultIsFrame))
+			throw invalidPNG_t{};
+		chunks.emplace_back(std::move(chunk));
+		decoder.frameChunks.back().push_back(&chunks.back());
+	}
+}
+
+// Decodes and composits the frame whose data has just been completed, then lets go of its data.
+void apngPushDecoder_t::finishFrame()
+{
+	const uint32_t index = decoder.framesDecoded;
+	decoder.chargeFrameData(index);
+	decoder.decodeNextFrame();
+	decoder.frameChunks[index].clear();
+	decoder.defaultChunks.clear();
+	chunks.clear();
+	if (callbacks.frame)
+		callbacks.frame(index, decoder.canvas);
+}
+
+apng_t::apng_t(stream_t &stream, const decodeOptions_t &options) : _defaultFrame{}, _frames{}, frameSources{},
+	_dedupBytesSaved{0}, defaultFrameStorage{}, bitmaps{}, bitmapsLock{}
+{
+	apngDecoder_t decoder{stream, options};
+	_width = decoder.width();
+	_height = decoder.height();
+	_bitDepth = decoder.bitDepth();
+	_colourType = decoder.colourType();
+	_interlacing = decoder.interlacing();
+	_pixelFormat = decoder.pixelFormat();
+	_loops = decoder.loops();
+
+	decoder.decodeFrames([&](const uint32_t index, const canvas_t &frame)
+		{ _frames.emplace_back(decoder.frameControl(index), frame); }, options.threads);
+	defaultFrameStorage = decoder.defaultIsFirstFrame() ? _frames.front().second.materialize() :
+		decoder.decodeDefaultFrame();
+	_defaultFrame = defaultFrameStorage.get();
+	if (options.dedupFrames)
+		dedupFrames();
+
+	// Every frame's canvas is kept, so they all count towards the memory decoding ends up holding.
+	if (options.observer)
+	{
+		std::vector<const canvas_t *> canvases;
+		for (const auto &frame : _frames)
+			canvases.push_back(&frame.second);
+		decodeStats_t &stats = options.observer->stats;
+		stats.peakBitmapMemory = std::max(stats.peakBitmapMemory, canvasMemory(canvases) + _defaultFrame->length());
+		for (size_t i = 0; i < frameSources.size(); ++i)
+			stats.framesDeduplicated += frameSources[i] != i;
+		stats.dedupBytesSaved += _dedupBytesSaved;
+	}
+}
+
+// Hashes a canvas's pixels as the CRC of its rows' CRCs. Canvases share most of their rows, so each distinct row's
+// CRC is worked out once and remembered in rowHashes.
+static uint32_t canvasHash(const canvas_t &canvas, std::unordered_map<const uint8_t *, uint32_t> &rowHashes)
+{
+	uint32_t hash = 0;
+	for (uint32_t y = 0; y < canvas.height(); ++y)
+	{
+		const uint8_t *const row = canvas.row(y);
+		auto rowHash = rowHashes.find(row);
+		if (rowHash == rowHashes.end())
+		{
+			uint32_t crc = 0;
+			crc32_t::crc(crc, row, canvas.rowLength());
+			rowHash = rowHashes.emplace(row, crc).first;
+		}
+		const std::array<uint8_t, 4> hashBytes{{uint8_t(rowHash->second), uint8_t(rowHash->second >> 8),
+			uint8_t(rowHash->second >> 16), uint8_t(rowHash->second >> 24)}};
+		crc32_t::crc(hash, hashBytes);
+	}
+	return hash;
+}
+
+static bool sameCanvas(const canvas_t &a, const canvas_t &b) noexcept
+{
+	for (uint32_t y = 0; y < a.height(); ++y)
+	{
+		if (!a.sharesRow(b, y) && memcmp(a.row(y), b.row(y), a.rowLength()) != 0)
+			return false;
+	}
+	return true;
+}
+
+// Finds frames whose canvas matches an earlier frame's, confirming each hash match by comparing the pixels, and has
+// them share that frame's rows so the rows only they held are freed.
+void apng_t::dedupFrames()
+{
+	std::unordered_map<const uint8_t *, uint32_t> rowHashes;
+	std::unordered_multimap<uint32_t, uint32_t> canvasHashes;
+	std::vector<const canvas_t *> canvases;
+	for (const auto &frame : _frames)
+		canvases.push_back(&frame.second);
+	const uint64_t memoryBefore = canvasMemory(canvases);
+
+	frameSources.resize(_frames.size());
+	uint32_t duplicates = 0;
+	for (uint32_t i = 0; i < _frames.size(); ++i)
+	{
+		canvas_t &canvas = _frames[i].second;
+		const uint32_t hash = canvasHash(canvas, rowHashes);
+		frameSources[i] = i;
+		const auto matches = canvasHashes.equal_range(hash);
+		for (auto match = matches.first; match != matches.second; ++match)
+		{
+			if (sameCanvas(canvas, _frames[match->second].second))
+			{
+				frameSources[i] = match->second;
+				break;
+			}
+		}
+		if (frameSources[i] == i)
+			canvasHashes.emplace(hash, i);
+		else
+		{
+			canvas = _frames[frameSources[i]].second;
+			++duplicates;
+		}
+	}
+	_dedupBytesSaved = memoryBefore - canvasMemory(canvases) + uint64_t{duplicates} * _frames.front().second.length();
+}
+
+std::vector<std::pair<const displayTime_t, const bitmap_t *const>> apng_t::frames() const
+{
+	std::lock_guard<std::mutex> lock{bitmapsLock};
+	if (bitmaps.empty())
+	{
+		for (size_t i = 0; i < _frames.size(); ++i)
+		{
+			if (frameSources.empty() || frameSources[i] == i)
+				bitmaps.emplace_back(_frames[i].second.materialize());
+			else
+				bitmaps.emplace_back();
+		}
+	}
+
 	std::vector<std::pair<const displayTime_t, const bitmap_t *const>> frameArray;
+	for (size_t i = 0; i < _frames.size(); ++i)
+	{
+		const fcTL_t &fcTL = _frames[i].first;
+		const size_t source = frameSources.empty() ? i : frameSources[i];
+		frameArray.emplace_back(std::make_pair(displayTime_t(fcTL.delayN(), fcTL.delayD()), bitmaps[source].get()));
+	}
+	return frameArray;
+}
+
+std::vector<std::pair<const displayTime_t, const canvas_t *const>> apng_t::canvases() const noexcept
+{
+	std::vector<std::pair<const displayTime_t, const canvas_t *const>> frameArray;
 	for (const auto &frame : _frames)
 	{
 		const fcTL_t &fcTL = frame.first;
-		frameArray.emplace_back(std::make_pair(displayTime_t(fcTL.delayN(), fcTL.delayD()), frame.second.get()));
+		frameArray.emplace_back(std::make_pair(displayTime_t(fcTL.delayN(), fcTL.delayD()), &frame.second));
 	}
 	return frameArray;
 }
 
+decodeStats_t &decodeStats_t::operator +=(const decodeStats_t &stats) noexcept
+{
+	for (size_t i = 0; i < stageTimes.size(); ++i)
+		stageTimes[i] += stats.stageTimes[i];
+	bytesIn += stats.bytesIn;
+	bytesInflated += stats.bytesInflated;
+	bytesOut += stats.bytesOut;
+	for (size_t i = 0; i < filterTypes.size(); ++i)
+		filterTypes[i] += stats.filterTypes[i];
+	for (size_t i = 0; i < disposeOps.size(); ++i)
+		disposeOps[i] += stats.disposeOps[i];
+	for (size_t i = 0; i < blendOps.size(); ++i)
+		blendOps[i] += stats.blendOps[i];
+	peakBitmapMemory = std::max(peakBitmapMemory, stats.peakBitmapMemory);
+	framesDeduplicated += stats.framesDeduplicated;
+	dedupBytesSaved += stats.dedupBytesSaved;
+	return *this;
+}
+
 acTL_t::acTL_t(const uint8_t *const data) noexcept : _frames{read32(&data[0])}, _loops{read32(&data[4])} { }
 
 void acTL_t::check(const std::vector<chunk_t> &chunks) const
@@ -448,6 +1523,12 @@ fcTL_t::fcTL_t(const uint8_t *const data, const uint32_t frame) noexcept : _fram
 	_width{read32(&data[4])}, _height{read32(&data[8])}, _xOffset{read32(&data[12])}, _yOffset{read32(&data[16])},
 	_delayN{read16(&data[20])}, _delayD{read16(&data[22])}, _disposeOp{data[24]}, _blendOp{data[25]} { }
 
+std::chrono::nanoseconds fcTL_t::delay() const noexcept
+{
+	const uint64_t denominator = _delayD ? _delayD : 100;
+	return std::chrono::nanoseconds{(uint64_t{_delayN} * 1000000000U) / denominator};
+}
+
 fcTL_t fcTL_t::reinterpret(const chunk_t &chunk, const uint32_t frame)
 {
 	if (chunk.length() != 26)
@@ -457,7 +1538,7 @@ fcTL_t fcTL_t::reinterpret(const chunk_t &chunk, const uint32_t frame)
 
 void fcTL_t::check(const uint32_t pngWidth, const uint32_t pngHeight, const bool first)
 {
-	if (!_width || !_height || (_xOffset + _width) > pngWidth || (_yOffset + _height) > pngHeight)
+	if (!_width || !_height || uint64_t{_xOffset} + _width > pngWidth || uint64_t{_yOffset} + _height > pngHeight)
 		throw invalidPNG_t{};
 	if (first)
 	{
@@ -475,9 +1556,29 @@ void fcTL_t::check(const uint32_t pngWidth, const uint32_t pngHeight, const bool
 		_delayD = 100;
 }
 
+std::chrono::nanoseconds displayTime_t::delay() const noexcept
+{
+	const uint64_t denominator = delayD ? delayD : 100;
+	return std::chrono::nanoseconds{(uint64_t{delayN} * 1000000000U) / denominator};
+}
+
 void displayTime_t::waitFor() const noexcept
+	{ std::this_thread::sleep_for(delay()); }
+
+const char *budgetExceeded_t::what() const noexcept
 {
-	const std::chrono::seconds num(delayN);
-	const std::chrono::nanoseconds N(num);
-	std::this_thread::sleep_for(N / delayD);
+	switch (_limit)
+	{
+		case limit_t::canvasPixels:
+			return "PNG canvas exceeds the decode budget";
+		case limit_t::frames:
+			return "APNG frame count exceeds the decode budget";
+		case limit_t::decodedBytes:
+			return "APNG frames decode to more than the decode budget";
+		case limit_t::compressionRatio:
+			return "APNG compression ratio exceeds the decode budget";
+		case limit_t::time:
+			return "APNG decode took longer than the decode budget";
+	}
+	return "Decode budget exceeded";
 }
@@ -0,0 +1,163 @@
+#include "scheduler.hxx"
+
+using namespace std::chrono;
+
+playbackScheduler_t::playbackScheduler_t() : animations{}, deadlines{}, nextID{1}, showingID{0}, lock{}, wake{},
+	shown{}, stopping{false}, timer{} { timer = std::thread{[this]() noexcept { run(); }}; }
+
+playbackScheduler_t::~playbackScheduler_t() noexcept
+{
+	{
+		std::lock_guard<std::mutex> guard{lock};
+		stopping = true;
+	}
+	wake.notify_one();
+	timer.join();
+}
+
+// Whether the animation's current frame is the last it will show.
+bool playbackScheduler_t::lastFrame(const animation_t &animation) noexcept
+{
+	return animation.loops && animation.stats.loopsCompleted + 1 == animation.loops &&
+		animation.frame + 1 == animation.delays.size();
+}
+
+void playbackScheduler_t::run() noexcept
+{
+	std::unique_lock<std::mutex> guard{lock};
+	while (!stopping)
+	{
+		if (deadlines.empty())
+		{
+			wake.wait(guard);
+			continue;
+		}
+		const deadline_t next = deadlines.top();
+		if (steady_clock::now() < next.first)
+		{
+			wake.wait_until(guard, next.first);
+			continue;
+		}
+		deadlines.pop();
+		const auto entry = animations.find(next.second);
+		// Animations that have been stopped leave their deadlines behind in the heap.
+		if (entry == animations.end())
+			continue;
+		const uint64_t id = entry->first;
+		animation_t &animation = entry->second;
+
+		// Skip past any frames whose successors are already due, so a late animation catches up rather than
+		// falling further behind, but always show the very last frame.
+		const auto now = steady_clock::now();
+		while (!lastFrame(animation) && animation.deadline + animation.delays[animation.frame] <= now)
+		{
+			animation.deadline += animation.delays[animation.frame];
+			if (++animation.frame == animation.delays.size())
+			{
+				animation.frame = 0;
+				++animation.stats.loopsCompleted;
+			}
+			++animation.stats.missedDeadlines;
+		}
+		const nanoseconds lateness = duration_cast<nanoseconds>(now - animation.deadline);
+		if (lateness > animation.stats.maxLateness)
+			animation.stats.maxLateness = lateness;
+		++animation.stats.framesShown;
+
+		const uint32_t frame = animation.frame;
+		const bool finished = lastFrame(animation);
+		if (finished)
+			animation.stats.loopsCompleted = animation.loops;
+		else
+		{
+			// The next deadline follows on from this frame's, not from now, so lateness never carries forward.
+			animation.deadline += animation.delays[frame];
+			if (++animation.frame == animation.delays.size())
+			{
+				animation.frame = 0;
+				++animation.stats.loopsCompleted;
+			}
+			deadlines.emplace(animation.deadline, id);
+		}
+
+		// The animation can't be erased while showingID names it, so it's safe to call into it unlocked.
+		showingID = id;
+		guard.unlock();
+		animation.showFrame(frame);
+		if (finished && animation.finished)
+			animation.finished(animation.stats);
+		guard.lock();
+		showingID = 0;
+		if (finished || animation.stopped)
+			animations.erase(id);
+		shown.notify_all();
+	}
+	animations.clear();
+}
+
+uint64_t playbackScheduler_t::play(std::vector<nanoseconds> delays, const uint32_t loops, showFrame_t showFrame,
+	finished_t finished)
+{
+	if (delays.empty())
+		return 0;
+	for (auto &delay : delays)
+	{
+		if (delay <= nanoseconds::zero())
+			delay = milliseconds{10};
+	}
+	std::lock_guard<std::mutex> guard{lock};
+	const uint64_t id = nextID++;
+	const timePoint_t start = steady_clock::now();
+	animations.emplace(id, animation_t{std::move(delays), loops, std::move(showFrame), std::move(finished), 0,
+		false, start, {0, 0, nanoseconds::zero(), 0}});
+	deadlines.emplace(start, id);
+	wake.notify_one();
+	return id;
+}
+
+uint64_t playbackScheduler_t::play(const apng_t &image, showFrame_t showFrame, finished_t finished)
+{
+	std::vector<nanoseconds> delays;
+	for (const auto &frame : image.canvases())
+		delays.emplace_back(frame.first.delay());
+	return play(std::move(delays), image.loops(), std::move(showFrame), std::move(finished));
+}
+
+bool playbackScheduler_t::stop(const uint64_t id) noexcept
+{
+	std::unique_lock<std::mutex> guard{lock};
+	const bool calledFromTimer = std::this_thread::get_id() == timer.get_id();
+	// Wait out any frame being shown for the animation on the timer thread.
+	while (!calledFromTimer && showingID == id)
+		shown.wait(guard);
+	const auto entry = animations.find(id);
+	if (entry == animations.end() || entry->second.stopped)
+		return false;
+	if (calledFromTimer && showingID == id)
+		entry->second.stopped = true;
+	else
+		animations.erase(entry);
+	return true;
+}
+
+bool playbackScheduler_t::playing(const uint64_t id) noexcept
+{
+	std::lock_guard<std::mutex> guard{lock};
+	const auto entry = animations.find(id);
+	return entry != animations.end() && !entry->second.stopped;
+}
+
+playbackScheduler_t::playbackStats_t playbackScheduler_t::stats(const uint64_t id) noexcept
+{
+	std::lock_guard<std::mutex> guard{lock};
+	const auto entry = animations.find(id);
+	if (entry == animations.end())
+		return {0, 0, nanoseconds::zero(), 0};
+	return entry->second.stats;
+}
+
+size_t playbackScheduler_t::animationCount() noexcept
+{
+	std::lock_guard<std::mutex> guard{lock};
+	return animations.size();
+}
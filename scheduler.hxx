@@ -0,0 +1,91 @@
+#ifndef SCHEDULER__HXX
+#define SCHEDULER__HXX
+
+#include <cstdint>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "apng.hxx"
+
+// Plays any number of animations from a single timer thread. Each frame's deadline is worked out from when its
+// animation started and the fcTL delays of the frames before it, rather than from when the previous frame happened
+// to be shown, so timing errors don't build up over a long animation. When the timer thread falls behind, frames
+// whose successors are already due are skipped rather than shown late, and counted as missed deadlines.
+struct APNG_API playbackScheduler_t final
+{
+public:
+	using timePoint_t = std::chrono::steady_clock::time_point;
+	// Called on the timer thread with the index of the frame to show. It's shared by every animation being played,
+	// so this must be quick and must not throw; it may call stop() and play() itself.
+	using showFrame_t = std::function<void (uint32_t frame)>;
+
+	struct playbackStats_t final
+	{
+		uint64_t framesShown;
+		// Frames skipped because the next frame was already due by the time they were reached.
+		uint64_t missedDeadlines;
+		// How far behind its deadline the latest frame shown was.
+		std::chrono::nanoseconds maxLateness;
+		uint32_t loopsCompleted;
+	};
+	// Called on the timer thread once an animation has shown its last frame, with how its playback went.
+	using finished_t = std::function<void (const playbackStats_t &stats)>;
+
+private:
+	struct animation_t final
+	{
+		std::vector<std::chrono::nanoseconds> delays;
+		uint32_t loops;
+		showFrame_t showFrame;
+		finished_t finished;
+		uint32_t frame;
+		bool stopped;
+		timePoint_t deadline;
+		playbackStats_t stats;
+	};
+	using deadline_t = std::pair<timePoint_t, uint64_t>;
+
+	std::map<uint64_t, animation_t> animations;
+	std::priority_queue<deadline_t, std::vector<deadline_t>, std::greater<deadline_t>> deadlines;
+	uint64_t nextID;
+	uint64_t showingID;
+	std::mutex lock;
+	std::condition_variable wake;
+	std::condition_variable shown;
+	bool stopping;
+	std::thread timer;
+
+	void run() noexcept;
+	static bool lastFrame(const animation_t &animation) noexcept;
+
+public:
+	playbackScheduler_t();
+	playbackScheduler_t(const playbackScheduler_t &) = delete;
+	playbackScheduler_t(playbackScheduler_t &&) = delete;
+	// Stops every animation still playing before joining the timer thread.
+	~playbackScheduler_t() noexcept;
+	playbackScheduler_t &operator =(const playbackScheduler_t &) = delete;
+	playbackScheduler_t &operator =(playbackScheduler_t &&) = delete;
+
+	// Starts an animation whose frames are shown for the given times, the first frame straight away, with a time of
+	// 0 meaning 10ms as it does in fcTL. It plays loops times over, 0 meaning forever, and the identifier returned
+	// refers to it until it finishes or is stopped; it's 0 when there are no frames to play.
+	uint64_t play(std::vector<std::chrono::nanoseconds> delays, const uint32_t loops, showFrame_t showFrame,
+		finished_t finished = {});
+	// Starts playing an image's frames with their fcTL delays, honouring its loop count.
+	uint64_t play(const apng_t &image, showFrame_t showFrame, finished_t finished = {});
+	// Stops an animation, returning false if it had already finished. Once this returns, showFrame won't be called
+	// for the animation again and isn't being run for it, unless stop() was called from within that very call.
+	bool stop(const uint64_t id) noexcept;
+	bool playing(const uint64_t id) noexcept;
+	// The animation's statistics so far, or all zeros once it has finished; finished gets the final ones.
+	playbackStats_t stats(const uint64_t id) noexcept;
+	size_t animationCount() noexcept;
+};
+
+#endif /*SCHEDULER__HXX*/
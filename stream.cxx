@@ -1,17 +1,32 @@
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <memory.h>
 #include <cerrno>
 #include <system_error>
+#include <limits>
 
 #include "internals.hxx"
 #include "stream.hxx"
 
+bool stream_t::skip(const size_t length)
+{
+	std::array<uint8_t, 4_KiB> buffer;
+	for (size_t remaining = length; remaining; )
+	{
+		const size_t amount = remaining < buffer.size() ? remaining : buffer.size();
+		if (!read(buffer.data(), amount))
+			return false;
+		remaining -= amount;
+	}
+	return true;
+}
+
 fileStream_t::fileStream_t(const char *const fileName, const int32_t mode) : fd(-1), eof(false)
 {
 	struct stat fileStat{};
-	fd = open(fileName, mode);
+	fd = open(fileName, mode, 0666);
 	if (fd == -1 || fstat(fd, &fileStat) != 0)
 		throw std::system_error(errno, std::system_category());
 	length = fileStat.st_size;
@@ -31,6 +46,37 @@ bool fileStream_t::read(void *const value, const size_t valueLen, size_t &countR
 	return true;
 }
 
+bool fileStream_t::write(const void *const value, const size_t valueLen)
+{
+	const auto data = static_cast<const uint8_t *>(value);
+	for (size_t written = 0; written < valueLen; )
+	{
+		const ssize_t ret = ::write(fd, data + written, valueLen - written);
+		if (ret < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			throw std::system_error(errno, std::system_category());
+		}
+		written += size_t(ret);
+	}
+	return true;
+}
+
+bool fileStream_t::skip(const size_t skipLength)
+{
+	if (eof)
+		return !skipLength;
+	const off_t pos = lseek(fd, off_t(skipLength), SEEK_CUR);
+	if (pos < 0)
+		throw std::system_error(errno, std::system_category());
+	// lseek() happily goes past the end of the file, which here means the file has been cut short.
+	if (size_t(pos) > length)
+		return false;
+	eof = length == size_t(pos);
+	return true;
+}
+
 void fileStream_t::swap(fileStream_t &stream) noexcept
 {
 	std::swap(fd, stream.fd);
@@ -51,6 +97,24 @@ bool memoryStream_t::read(void *const value, const size_t valueLen, size_t &coun
 	return true;
 }
 
+const uint8_t *memoryStream_t::view(const size_t valueLen, size_t &countRead) noexcept
+{
+	if (!memory || atEOF())
+		return nullptr;
+	const auto data = reinterpret_cast<const uint8_t *>(memory + pos);
+	countRead = valueLen > (length - pos) ? length - pos : valueLen;
+	pos += countRead;
+	return data;
+}
+
+bool memoryStream_t::skip(const size_t skipLength) noexcept
+{
+	if (skipLength > length - pos)
+		return false;
+	pos += skipLength;
+	return true;
+}
+
 void memoryStream_t::swap(memoryStream_t &stream) noexcept
 {
 	std::swap(memory, stream.memory);
@@ -58,6 +122,31 @@ void memoryStream_t::swap(memoryStream_t &stream) noexcept
 	std::swap(pos, stream.pos);
 }
 
+std::pair<void *, size_t> mmapStream_t::mapFile(const char *const fileName)
+{
+	struct stat fileStat{};
+	const int fd = open(fileName, O_RDONLY | O_NOCTTY);
+	if (fd == -1 || fstat(fd, &fileStat) != 0)
+	{
+		const int error = errno;
+		if (fd != -1)
+			close(fd);
+		throw std::system_error(error, std::system_category());
+	}
+	const size_t length = fileStat.st_size;
+	// mmap() refuses zero length mappings, and an empty file is just a stream that's already at EOF.
+	void *mapping = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+	const int error = errno;
+	close(fd);
+	if (mapping == MAP_FAILED)
+		throw std::system_error(error, std::system_category());
+	if (mapping)
+		posix_madvise(mapping, length, POSIX_MADV_SEQUENTIAL);
+	return {mapping, length};
+}
+
+mmapStream_t::~mmapStream_t() noexcept { if (mapping) munmap(mapping, mappingLength); }
+
 zlibStream_t::zlibStream_t(stream_t &sourceStream, const mode_t streamMode) : stream_t{},
 	source{&sourceStream}, mode{streamMode}, stream{}, bufferUsed{}, bufferAvail{},
 	bufferIn{}, bufferOut{}, eos{false}
@@ -70,6 +159,29 @@ zlibStream_t::zlibStream_t(stream_t &sourceStream, const mode_t streamMode) : st
 	}
 }
 
+zlibStream_t::zlibStream_t(const mode_t streamMode) : stream_t{}, source{nullptr}, mode{streamMode}, stream{},
+	bufferUsed{}, bufferAvail{}, bufferIn{}, bufferOut{}, eos{true}
+{
+	memset(&stream, 0, sizeof(z_stream));
+	if (mode == inflate)
+	{
+		if (inflateInit(&stream) != Z_OK)
+			throw zlibError_t();
+	}
+}
+
+void zlibStream_t::reset(stream_t &sourceStream)
+{
+	if (mode == inflate && inflateReset(&stream) != Z_OK)
+		throw zlibError_t();
+	source = &sourceStream;
+	stream.next_in = nullptr;
+	stream.avail_in = 0;
+	bufferUsed = 0;
+	bufferAvail = 0;
+	eos = false;
+}
+
 zlibStream_t::~zlibStream_t() noexcept
 {
 	if (mode == inflate)
@@ -86,9 +198,16 @@ bool zlibStream_t::read(void *const value, const size_t valueLen, size_t &countR
 		if (!stream.avail_in && bufferUsed == bufferAvail && !eos)
 		{
 			size_t amount = 0;
-			if (!source->read(bufferIn, chunkLen, amount))
-				return false;
-			stream.next_in = bufferIn;
+			// Inflate straight out of the source's memory when it has some, only copying into bufferIn otherwise.
+			const uint8_t *const data = source->view(std::numeric_limits<uInt>::max(), amount);
+			if (data)
+				stream.next_in = const_cast<uint8_t *>(data);
+			else
+			{
+				if (!source->read(bufferIn, chunkLen, amount))
+					return false;
+				stream.next_in = bufferIn;
+			}
 			stream.avail_in = amount;
 			bufferAvail = 0;
 		}
@@ -100,7 +219,8 @@ bool zlibStream_t::read(void *const value, const size_t valueLen, size_t &countR
 			const int ret = ::inflate(&stream, Z_NO_FLUSH);
 			bufferAvail = chunkLen - stream.avail_out;
 			bufferUsed = 0;
-			if (ret == Z_STREAM_ERROR || ret == Z_NEED_DICT)
+			// Corrupt data can't be got past, and would otherwise have this go round forever making no progress.
+			if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR)
 				return false;
 			else if (ret == Z_STREAM_END)
 				eos = true;
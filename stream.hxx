@@ -36,6 +36,12 @@ public:
 	virtual bool read(void *const, const size_t, size_t &) { throw notImplemented_t(); }
 	virtual bool write(const void *const, const size_t) { throw notImplemented_t(); }
 	virtual bool atEOF() const { throw notImplemented_t(); }
+	// Returns a pointer to the next (up to) length bytes of the stream's own memory and advances past them,
+	// or nullptr if the stream does not hold its data in memory and read() must be used instead.
+	virtual const uint8_t *view(const size_t, size_t &) { return nullptr; }
+	// Advances past the next length bytes without handing them out, seeking rather than reading where the stream
+	// can. Returns false if the stream ends first.
+	virtual bool skip(const size_t length);
 
 	stream_t(const stream_t &) = delete;
 	stream_t &operator =(const stream_t &) = delete;
@@ -51,13 +57,17 @@ private:
 	fileStream_t() noexcept : stream_t{}, fd{-1}, length{}, eof{true} { }
 
 public:
+	// mode takes open()'s flags, so opening with O_WRONLY | O_CREAT | O_TRUNC gives a stream to write a file out to.
+	// Files created are readable and writable by everyone the umask allows.
 	fileStream_t(const char *const fileName, const int32_t mode);
 	fileStream_t(fileStream_t &&stream) noexcept : fileStream_t{} { swap(stream); }
 	~fileStream_t() noexcept final override;
 	void operator =(fileStream_t &&stream) noexcept { swap(stream); }
 
 	bool read(void *const value, const size_t valueLen, size_t &countRead) final override;
+	bool write(const void *const value, const size_t valueLen) final override;
 	bool atEOF() const noexcept final override { return eof; }
+	bool skip(const size_t skipLength) final override;
 
 	void swap(fileStream_t &stream) noexcept;
 	fileStream_t(const fileStream_t &) = delete;
@@ -83,6 +93,8 @@ public:
 
 	bool read(void *const value, const size_t valueLen, size_t &countRead) noexcept final override;
 	bool atEOF() const noexcept final override { return pos == length; }
+	const uint8_t *view(const size_t valueLen, size_t &countRead) noexcept final override;
+	bool skip(const size_t skipLength) noexcept final override;
 
 	void swap(memoryStream_t &stream) noexcept;
 	memoryStream_t(const memoryStream_t &) = delete;
@@ -91,6 +103,28 @@ public:
 
 inline void swap(memoryStream_t &a, memoryStream_t &b) noexcept { a.swap(b); }
 
+// Maps a whole file read-only so chunks can be viewed in place rather than copied out of it.
+// The stream must outlive any chunks loaded from it.
+struct APNG_API mmapStream_t final : public memoryStream_t
+{
+private:
+	void *mapping;
+	size_t mappingLength;
+
+	mmapStream_t(const std::pair<void *, size_t> &map) noexcept : memoryStream_t{map.first, map.second},
+		mapping{map.first}, mappingLength{map.second} { }
+	static std::pair<void *, size_t> mapFile(const char *const fileName);
+
+public:
+	mmapStream_t(const char *const fileName) : mmapStream_t{mapFile(fileName)} { }
+	~mmapStream_t() noexcept final override;
+
+	mmapStream_t(const mmapStream_t &) = delete;
+	mmapStream_t(mmapStream_t &&) = delete;
+	mmapStream_t &operator =(const mmapStream_t &) = delete;
+	mmapStream_t &operator =(mmapStream_t &&) = delete;
+};
+
 struct APNG_API zlibStream_t : public stream_t
 {
 public:
@@ -112,12 +146,16 @@ private:
 
 public:
 	zlibStream_t(stream_t &sourceStream, const mode_t streamMode);
+	// Sets up the zlib state without a source, which reset() then has to give it before it's read from.
+	explicit zlibStream_t(const mode_t streamMode);
 	zlibStream_t(const zlibStream_t &stream) noexcept : zlibStream_t{} { clone(stream); }
 	~zlibStream_t() noexcept override;
 	void operator =(const zlibStream_t &stream) noexcept { clone(stream); }
 
 	bool read(void *const value, const size_t valueLen, size_t &countRead) final override;
 	bool atEOF() const noexcept final override { return eos; }
+	// Starts over on a new source, resetting the zlib state rather than setting it up again from scratch.
+	void reset(stream_t &sourceStream);
 
 	void clone(const zlibStream_t &stream) noexcept;
 	zlibStream_t(zlibStream_t &&) = delete;
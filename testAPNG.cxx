@@ -3,12 +3,259 @@
 #include <unistd.h>
 #include <crunch++.h>
 #include <memory>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
 #include <system_error>
+#include <zlib.h>
 #include "apng.hxx"
 #include "crc32.hxx"
+#include "unfilter.hxx"
+#include "blend.hxx"
+#include "convert.hxx"
+#include "utilities.hxx"
+#include "allocator.hxx"
+#include "scheduler.hxx"
 
 class apngTests final : public testsuit
 {
+private:
+	// A test image, held as one byte per sample for sub-byte images and as each pixel's bytes otherwise.
+	struct testImage_t final
+	{
+		uint32_t width, height;
+		uint8_t bitDepth, colourType;
+		size_t pixelLength;
+		std::vector<uint8_t> pixels;
+		std::vector<uint8_t> palette;
+	};
+
+	static void write32(std::vector<uint8_t> &data, const uint32_t value)
+	{
+		for (const uint32_t shift : {24U, 16U, 8U, 0U})
+			data.push_back(uint8_t(value >> shift));
+	}
+
+	static void writeChunk(std::vector<uint8_t> &png, const char *const type, const std::vector<uint8_t> &data)
+	{
+		write32(png, data.size());
+		const size_t start = png.size();
+		png.insert(png.end(), type, type + 4);
+		png.insert(png.end(), data.begin(), data.end());
+		uint32_t crc = 0;
+		crc32_t::crc(crc, png.data() + start, png.size() - start);
+		write32(png, crc);
+	}
+
+	// Packs the pixels at the given coordinates into a scanline, filtering it with Up against previous.
+	static void packRow(const testImage_t &image, const uint32_t y, const uint32_t x, const uint32_t xStep,
+		std::vector<uint8_t> &previous, std::vector<uint8_t> &scanlines)
+	{
+		std::vector<uint8_t> row;
+		uint32_t bit = 0;
+		for (uint32_t i = x; i < image.width; i += xStep)
+		{
+			const uint8_t *const pixel = image.pixels.data() + (((y * image.width) + i) * image.pixelLength);
+			if (image.bitDepth < 8)
+			{
+				if (!(bit % 8))
+					row.push_back(0);
+				row.back() |= uint8_t(pixel[0] << (8U - image.bitDepth - (bit % 8)));
+				bit += image.bitDepth;
+			}
+			else
+				row.insert(row.end(), pixel, pixel + image.pixelLength);
+		}
+		previous.resize(row.size());
+		scanlines.push_back(2);
+		for (size_t i = 0; i < row.size(); ++i)
+			scanlines.push_back(uint8_t(row[i] - previous[i]));
+		previous = row;
+	}
+
+	// Builds a single frame APNG of the image, optionally Adam7 interlaced, with trailing appended to its IDAT
+	// after the end of the zlib stream.
+	static std::vector<uint8_t> makeAPNG(const testImage_t &image, const bool interlaced,
+		const std::vector<uint8_t> &trailing = {})
+	{
+		std::vector<uint8_t> scanlines;
+		if (interlaced)
+		{
+			for (const auto &pass : adam7Passes)
+			{
+				std::vector<uint8_t> previous;
+				for (uint32_t y = pass.y; pass.x < image.width && y < image.height; y += pass.yStep)
+					packRow(image, y, pass.x, pass.xStep, previous, scanlines);
+			}
+		}
+		else
+		{
+			std::vector<uint8_t> previous;
+			for (uint32_t y = 0; y < image.height; ++y)
+				packRow(image, y, 0, 1, previous, scanlines);
+		}
+
+		std::vector<uint8_t> png{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		std::vector<uint8_t> header;
+		write32(header, image.width);
+		write32(header, image.height);
+		header.insert(header.end(), {image.bitDepth, image.colourType, 0, 0, uint8_t(interlaced ? 1 : 0)});
+		writeChunk(png, "IHDR", header);
+		if (!image.palette.empty())
+			writeChunk(png, "PLTE", image.palette);
+		std::vector<uint8_t> control;
+		write32(control, 1);
+		write32(control, 0);
+		writeChunk(png, "acTL", control);
+		std::vector<uint8_t> frameControl;
+		for (const uint32_t value : {0U, image.width, image.height, 0U, 0U})
+			write32(frameControl, value);
+		frameControl.insert(frameControl.end(), {0, 1, 0, 1, 0, 0});
+		writeChunk(png, "fcTL", frameControl);
+		uLongf length = compressBound(scanlines.size());
+		std::vector<uint8_t> compressed(length);
+		if (compress(compressed.data(), &length, scanlines.data(), scanlines.size()) != Z_OK)
+			return {};
+		compressed.resize(length);
+		compressed.insert(compressed.end(), trailing.begin(), trailing.end());
+		writeChunk(png, "IDAT", compressed);
+		writeChunk(png, "IEND", {});
+		return png;
+	}
+
+	// Builds a single frame APNG declaring a canvas of any size, with an empty zlib stream for its pixels. Its chunks
+	// are all valid, so it gets as far as decoding the frame before being found out.
+	static std::vector<uint8_t> makeOversized(const uint32_t width, const uint32_t height, const uint8_t bitDepth,
+		const uint32_t xOffset = 0, const uint32_t yOffset = 0)
+	{
+		std::vector<uint8_t> png{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+		std::vector<uint8_t> header;
+		write32(header, width);
+		write32(header, height);
+		header.insert(header.end(), {bitDepth, 6, 0, 0, 0});
+		writeChunk(png, "IHDR", header);
+		std::vector<uint8_t> control;
+		write32(control, 1);
+		write32(control, 0);
+		writeChunk(png, "acTL", control);
+		std::vector<uint8_t> frameControl;
+		for (const uint32_t value : {0U, width, height, xOffset, yOffset})
+			write32(frameControl, value);
+		frameControl.insert(frameControl.end(), {0, 1, 0, 1, 0, 0});
+		writeChunk(png, "fcTL", frameControl);
+		writeChunk(png, "IDAT", {0x78, 0x9C, 0x03, 0x00, 0x00, 0x00, 0x00, 0x01});
+		writeChunk(png, "IEND", {});
+		return png;
+	}
+
+	// Collects everything written to it, so an encoded image can be read straight back without going through a file.
+	struct bufferStream_t final : public stream_t
+	{
+		std::vector<uint8_t> data{};
+
+		bool write(const void *const value, const size_t valueLen) final override
+		{
+			const auto *const bytes = static_cast<const uint8_t *>(value);
+			data.insert(data.end(), bytes, bytes + valueLen);
+			return true;
+		}
+	};
+
+	// Encodes the frames into memory, to be read back through a memoryStream_t.
+	static std::vector<uint8_t> encodeImage(const uint32_t width, const uint32_t height,
+		const std::vector<apngEncoder_t::frame_t> &frames, const encodeOptions_t &options = {})
+	{
+		bufferStream_t stream;
+		apngEncoder_t::encode(stream, width, height, frames, options);
+		return std::move(stream.data);
+	}
+
+	static testImage_t makeImage(std::minstd_rand &rng, const uint32_t width, const uint32_t height,
+		const uint8_t bitDepth, const uint8_t colourType)
+	{
+		const size_t channels = colourType == 2 ? 3 : colourType == 4 ? 2 : colourType == 6 ? 4 : 1;
+		testImage_t image{width, height, bitDepth, colourType, bitDepth < 8 ? 1 : channels * (bitDepth / 8), {}, {}};
+		image.pixels.resize(width * height * image.pixelLength);
+		for (auto &value : image.pixels)
+			value = uint8_t(rng()) & uint8_t(bitDepth < 8 ? (1U << bitDepth) - 1U : 0xFFU);
+		if (colourType == 3)
+		{
+			image.palette.resize((1U << bitDepth) * 3);
+			for (auto &value : image.palette)
+				value = uint8_t(rng());
+		}
+		return image;
+	}
+
+	static std::unique_ptr<bitmap_t> decodeImage(std::vector<uint8_t> &png, const targetFormat_t target,
+		const progressCallback_t &progress = {})
+	{
+		memoryStream_t stream{png.data(), png.size()};
+		decodeOptions_t options;
+		options.target = target;
+		options.progress = progress;
+		apngDecoder_t decoder{stream, options};
+		return decoder.frame(0).materialize();
+	}
+
+	// Box-filters a full size frame down by 2^shift the way decodeOptions_t::downscale should, giving every sample.
+	// With alpha, the last sample is alpha and the colour samples are weighted by it.
+	static std::vector<uint32_t> boxFilter(const bitmap_t &frame, const uint8_t shift, const size_t sampleBytes,
+		const bool alpha)
+	{
+		const uint32_t block = 1U << shift;
+		const size_t samples = pixelBytes(frame.format()) / sampleBytes;
+		const auto sampleAt = [&](const uint32_t x, const uint32_t y, const size_t sample) -> uint32_t
+		{
+			const uint8_t *const value = frame.data() +
+				((((size_t{y} * frame.width()) + x) * samples) + sample) * sampleBytes;
+			return sampleBytes == 1 ? value[0] : uint32_t(value[0] << 8U) | value[1];
+		};
+		std::vector<uint32_t> result;
+		for (uint32_t blockY = 0; blockY < frame.height(); blockY += block)
+		{
+			for (uint32_t blockX = 0; blockX < frame.width(); blockX += block)
+			{
+				uint64_t alphaSum = 0;
+				for (uint32_t y = blockY; alpha && y < std::min(blockY + block, frame.height()); ++y)
+				{
+					for (uint32_t x = blockX; x < std::min(blockX + block, frame.width()); ++x)
+						alphaSum += sampleAt(x, y, samples - 1);
+				}
+				for (size_t sample = 0; sample < samples; ++sample)
+				{
+					const bool weighted = alpha && sample + 1 != samples;
+					uint64_t sum = 0, count = 0;
+					for (uint32_t y = blockY; y < std::min(blockY + block, frame.height()); ++y)
+					{
+						for (uint32_t x = blockX; x < std::min(blockX + block, frame.width()); ++x, ++count)
+							sum += weighted ? uint64_t{sampleAt(x, y, sample)} * sampleAt(x, y, samples - 1) :
+								sampleAt(x, y, sample);
+					}
+					if (weighted)
+						result.push_back(alphaSum ? uint32_t((sum + (alphaSum / 2)) / alphaSum) : 0U);
+					else
+						result.push_back(uint32_t((sum + (count / 2)) / count));
+				}
+			}
+		}
+		return result;
+	}
+
+	static std::vector<uint32_t> samplesOf(const bitmap_t &frame, const size_t sampleBytes)
+	{
+		std::vector<uint32_t> result;
+		for (size_t i = 0; i < frame.length(); i += sampleBytes)
+			result.push_back(sampleBytes == 1 ? frame.data()[i] : uint32_t(frame.data()[i] << 8U) | frame.data()[i + 1]);
+		return result;
+	}
+
 public:
 	void testFileStream()
 	{
@@ -52,10 +299,1457 @@ public:
 		}
 	}
 
+	void testMmapStream()
+	{
+		try
+		{
+			mmapStream_t pngFile("loading_16.png");
+			apng_t image(pngFile);
+			assertEqual(image.width(), 16);
+			assertEqual(image.height(), 16);
+			assertTrue(pngFile.atEOF());
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testCRCCheck()
+	{
+		struct stat fileStat;
+		const int32_t fd = open("loading_16.png", O_RDONLY | O_NOCTTY);
+		assertNotEqual(fd, -1);
+		assertEqual(fstat(fd, &fileStat), 0);
+		std::vector<uint8_t> file(fileStat.st_size);
+		assertEqual(read(fd, file.data(), file.size()), ssize_t(file.size()));
+		close(fd);
+
+		// Insert an ancillary tEXt chunk with a bad CRC straight after the IHDR chunk.
+		const std::array<uint8_t, 17> textChunk
+			{0x00, 0x00, 0x00, 0x05, 't', 'E', 'X', 't', 'a', 0x00, 'b', 'c', 'd', 0xDE, 0xAD, 0xBE, 0xEF};
+		file.insert(file.begin() + 33, textChunk.begin(), textChunk.end());
+		const auto loads = [&](const crcCheck_t crcCheck) -> bool
+		{
+			memoryStream_t stream(file.data(), file.size());
+			decodeOptions_t options;
+			options.crcCheck = crcCheck;
+			try { apng_t image(stream, options); }
+			catch (invalidPNG_t &) { return false; }
+			return true;
+		};
+		assertFalse(loads(crcCheck_t::strict));
+		assertTrue(loads(crcCheck_t::criticalOnly));
+		assertTrue(loads(crcCheck_t::none));
+
+		// Now break the IHDR chunk's CRC too.
+		file[29] ^= 0xFF;
+		assertFalse(loads(crcCheck_t::strict));
+		assertFalse(loads(crcCheck_t::criticalOnly));
+		assertTrue(loads(crcCheck_t::none));
+	}
+
+	void testParallelDecode()
+	{
+		try
+		{
+			mmapStream_t serialFile("loading_16.png");
+			apng_t serial(serialFile);
+			mmapStream_t parallelFile("loading_16.png");
+			decodeOptions_t options;
+			options.threads = 4;
+			apng_t parallel(parallelFile, options);
+
+			const auto serialFrames = serial.frames();
+			const auto parallelFrames = parallel.frames();
+			assertEqual(parallelFrames.size(), serialFrames.size());
+			for (size_t i = 0; i < serialFrames.size(); ++i)
+			{
+				const bitmap_t &expected = *serialFrames[i].second;
+				const bitmap_t &frame = *parallelFrames[i].second;
+				assertEqual(frame.length(), expected.length());
+				assertEqual(memcmp(frame.data(), expected.data(), frame.length()), 0);
+			}
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testCanvasSharing()
+	{
+		canvas_t canvas{4, 8, pixelFormat_t::format32bppRGBA};
+		assertEqual(canvas.rowLength(), 16);
+		uint8_t *const rows = canvas.detachRows(0, 8);
+		for (size_t i = 0; i < canvas.length(); ++i)
+			rows[i] = uint8_t(i);
+
+		canvas_t copy{canvas};
+		for (uint32_t y = 0; y < 8; ++y)
+			assertTrue(copy.sharesRow(canvas, y));
+		uint8_t *const region = copy.detachRows(2, 3);
+		region[0] = 0xFF;
+		for (uint32_t y = 0; y < 8; ++y)
+			assertEqual(copy.sharesRow(canvas, y), y < 2 || y >= 5);
+		assertEqual(canvas.row(2)[0], 32);
+		assertEqual(copy.row(2)[0], 0xFF);
+		assertEqual(copy.row(3)[0], 48);
+
+		const auto bitmap = copy.materialize();
+		assertEqual(bitmap->data()[32], 0xFF);
+		assertEqual(memcmp(bitmap->data(), canvas.row(0), 32), 0);
+		for (uint32_t y = 3; y < 8; ++y)
+			assertEqual(memcmp(bitmap->data() + (y * 16), canvas.row(y), 16), 0);
+
+		copy.clear();
+		for (uint32_t y = 1; y < 8; ++y)
+			assertTrue(copy.row(y) == copy.row(0));
+		assertEqual(copy.row(7)[15], 0);
+	}
+
+	void testDecoder()
+	{
+		// Each frame is opaque where it's drawn with blendOp_t::source, and either opaque or fully transparent where
+		// it's blended over an opaque part of the canvas, so the canvases can be worked out here without depending
+		// on how blending rounds.
+		struct testFrame_t final
+		{
+			uint32_t width, height, xOffset, yOffset;
+			disposeOp_t disposeOp;
+			blendOp_t blendOp;
+		};
+		const std::vector<testFrame_t> layout
+		{
+			{12, 10, 0, 0, disposeOp_t::none, blendOp_t::source},
+			{5, 4, 2, 3, disposeOp_t::none, blendOp_t::over},
+			{6, 6, 6, 4, disposeOp_t::background, blendOp_t::source},
+			{4, 3, 7, 5, disposeOp_t::none, blendOp_t::over},
+			{3, 5, 9, 5, disposeOp_t::none, blendOp_t::source}
+		};
+
+		try
+		{
+			std::minstd_rand rng{3};
+			std::vector<std::unique_ptr<bitmap_t>> bitmaps;
+			std::vector<apngEncoder_t::frame_t> frames;
+			std::vector<std::vector<uint8_t>> expected;
+			std::vector<uint8_t> canvas(12 * 10 * 4);
+			for (const auto &frame : layout)
+			{
+				bitmaps.emplace_back(makeUnique<bitmap_t>(frame.width, frame.height, pixelFormat_t::format32bppRGBA));
+				uint8_t *const pixels = bitmaps.back()->data();
+				for (size_t i = 0; i < bitmaps.back()->length(); i += 4)
+				{
+					for (size_t j = 0; j < 3; ++j)
+						pixels[i + j] = uint8_t(rng());
+					pixels[i + 3] = frame.blendOp == blendOp_t::over && rng() % 2 ? 0 : 255;
+				}
+				frames.push_back({bitmaps.back().get(), frame.xOffset, frame.yOffset, 1, 10, frame.disposeOp,
+					frame.blendOp});
+
+				if (frame.disposeOp == disposeOp_t::background)
+					std::fill(canvas.begin(), canvas.end(), 0);
+				for (uint32_t y = 0; y < frame.height; ++y)
+				{
+					for (uint32_t x = 0; x < frame.width; ++x)
+					{
+						const uint8_t *const pixel = pixels + (((y * frame.width) + x) * 4);
+						if (pixel[3])
+							std::copy(pixel, pixel + 4,
+								canvas.begin() + ((((frame.yOffset + y) * 12) + frame.xOffset + x) * 4));
+					}
+				}
+				expected.push_back(canvas);
+			}
+			auto png = encodeImage(12, 10, frames);
+
+			memoryStream_t decoderFile{png.data(), png.size()};
+			apngDecoder_t decoder(decoderFile);
+			assertEqual(decoder.frameCount(), layout.size());
+
+			const auto checkFrame = [&](const uint32_t index)
+			{
+				const auto frame = decoder.frame(index).materialize();
+				assertEqual(frame->length(), expected[index].size());
+				assertEqual(memcmp(frame->data(), expected[index].data(), frame->length()), 0);
+			};
+			// In order, then repeated, then out of order which forces decoding to restart.
+			for (uint32_t i = 0; i < decoder.frameCount(); ++i)
+				checkFrame(i);
+			checkFrame(decoder.frameCount() - 1);
+			checkFrame(1);
+			checkFrame(0);
+			assertEqual(decoder.decodedFrames(), 1);
+			assertTrue(&decoder.nextFrame() == &decoder.frame(1));
+
+			memoryStream_t imageFile{png.data(), png.size()};
+			apng_t image(imageFile);
+			const auto imageFrames = image.frames();
+			assertEqual(imageFrames.size(), expected.size());
+			for (size_t i = 0; i < imageFrames.size(); ++i)
+				assertEqual(memcmp(imageFrames[i].second->data(), expected[i].data(), expected[i].size()), 0);
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testTargetFormats()
+	{
+		try
+		{
+			const auto decode = [](const targetFormat_t target)
+			{
+				mmapStream_t file("loading_16.png");
+				decodeOptions_t options;
+				options.target = target;
+				return std::unique_ptr<apng_t>{new apng_t{file, options}};
+			};
+			const auto rgba = decode(targetFormat_t::rgba8);
+			const auto bgra = decode(targetFormat_t::bgra8);
+			const auto strip = decode(targetFormat_t::strip16);
+			assertTrue(rgba->pixelFormat() == pixelFormat_t::format32bppRGBA);
+			assertTrue(bgra->pixelFormat() == pixelFormat_t::format32bppBGRA);
+			// loading_16.png is already 8-bit RGBA, so narrowing has nothing to do.
+			assertTrue(strip->pixelFormat() == pixelFormat_t::format32bppRGBA);
+
+			const auto rgbaFrames = rgba->frames();
+			const auto bgraFrames = bgra->frames();
+			const auto stripFrames = strip->frames();
+			assertEqual(bgraFrames.size(), rgbaFrames.size());
+			for (size_t i = 0; i < rgbaFrames.size(); ++i)
+			{
+				const bitmap_t &expected = *rgbaFrames[i].second;
+				const bitmap_t &frame = *bgraFrames[i].second;
+				assertEqual(frame.length(), expected.length());
+				for (size_t j = 0; j < frame.length(); j += 4)
+				{
+					assertEqual(frame.data()[j], expected.data()[j + 2]);
+					assertEqual(frame.data()[j + 1], expected.data()[j + 1]);
+					assertEqual(frame.data()[j + 2], expected.data()[j]);
+					assertEqual(frame.data()[j + 3], expected.data()[j + 3]);
+				}
+				assertEqual(memcmp(stripFrames[i].second->data(), expected.data(), expected.length()), 0);
+			}
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testInterlaced()
+	{
+		std::minstd_rand rng{0x41444D37};
+		const std::pair<uint8_t, uint8_t> formats[] =
+			{{8, 2}, {16, 2}, {8, 6}, {16, 6}, {8, 4}, {1, 0}, {2, 0}, {4, 0}, {16, 0}, {1, 3}, {4, 3}, {8, 3}};
+		const std::pair<uint32_t, uint32_t> sizes[] = {{1, 1}, {2, 3}, {5, 1}, {9, 9}, {13, 17}, {33, 6}};
+		try
+		{
+			for (const auto &format : formats)
+			{
+				for (const auto &size : sizes)
+				{
+					const auto image = makeImage(rng, size.first, size.second, format.first, format.second);
+					auto png = makeAPNG(image, false);
+					auto interlacedPNG = makeAPNG(image, true);
+					for (const auto target : {targetFormat_t::png, targetFormat_t::rgba8})
+					{
+						const auto expected = decodeImage(png, target);
+						const auto frame = decodeImage(interlacedPNG, target);
+						assertEqual(frame->length(), expected->length());
+						assertEqual(memcmp(frame->data(), expected->data(), frame->length()), 0);
+					}
+				}
+			}
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testProgressive()
+	{
+		std::minstd_rand rng{0x50524F47};
+		auto png = makeAPNG(makeImage(rng, 21, 19, 8, 2), true);
+		try
+		{
+			const auto expected = decodeImage(png, targetFormat_t::png);
+			const size_t rowLength = expected->width() * 3;
+			uint8_t passes = 0;
+			const auto frame = decodeImage(png, targetFormat_t::png,
+				[&](const uint32_t index, const uint8_t pass, const canvas_t &preview)
+				{
+					assertEqual(index, 0);
+					assertEqual(pass, ++passes);
+					// Each pixel should be a copy of the top left pixel of the block it falls in after this pass.
+					const adam7Pass_t &adam7 = adam7Passes[pass - 1];
+					for (uint32_t y = 0; y < preview.height(); ++y)
+					{
+						const uint8_t *const row = preview.row(y);
+						const uint8_t *const expectedRow = expected->data() + ((y - (y % adam7.blockHeight)) * rowLength);
+						for (uint32_t x = 0; x < preview.width(); ++x)
+							assertEqual(memcmp(row + (x * 3), expectedRow + ((x - (x % adam7.blockWidth)) * 3), 3), 0);
+					}
+				});
+			assertEqual(passes, 7);
+			assertEqual(memcmp(frame->data(), expected->data(), expected->length()), 0);
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testPushDecoder()
+	{
+		try
+		{
+			std::vector<uint8_t> file;
+			{
+				fileStream_t pngFile("loading_16.png", O_RDONLY | O_NOCTTY);
+				std::array<uint8_t, 4096> buffer;
+				size_t amount = 0;
+				while (pngFile.read(buffer.data(), buffer.size(), amount) && amount)
+					file.insert(file.end(), buffer.begin(), buffer.begin() + amount);
+			}
+			memoryStream_t expectedFile{file.data(), file.size()};
+			apngDecoder_t expected{expectedFile};
+
+			for (const size_t step : {size_t{1}, size_t{7}, size_t{4096}, file.size()})
+			{
+				bool header = false;
+				uint32_t frameControls = 0;
+				uint32_t frames = 0;
+				size_t pushed = 0;
+				size_t firstFrameAt = 0;
+				apngPushDecoder_t::callbacks_t callbacks;
+				callbacks.header = [&]() { header = true; };
+				callbacks.frameControl = [&](const uint32_t index, const fcTL_t &)
+				{
+					assertTrue(header);
+					assertEqual(index, frameControls++);
+				};
+				callbacks.frame = [&](const uint32_t index, const canvas_t &frame)
+				{
+					assertEqual(index, frames++);
+					if (!index)
+						firstFrameAt = pushed;
+					const auto bitmap = frame.materialize();
+					const auto expectedBitmap = expected.frame(index).materialize();
+					assertEqual(bitmap->length(), expectedBitmap->length());
+					assertEqual(memcmp(bitmap->data(), expectedBitmap->data(), bitmap->length()), 0);
+				};
+
+				apngPushDecoder_t decoder{callbacks};
+				for (size_t offset = 0; offset < file.size(); offset += step)
+				{
+					pushed = std::min(offset + step, file.size());
+					assertFalse(decoder.finished());
+					decoder.push(file.data() + offset, pushed - offset);
+				}
+				assertTrue(decoder.finished());
+				assertEqual(decoder.width(), expected.width());
+				assertEqual(frames, expected.frameCount());
+				assertEqual(frameControls, expected.frameCount());
+				// The first frame should come out long before the rest of the file has been pushed.
+				if (step < file.size())
+					assertTrue(firstFrameAt < file.size() / 2);
+			}
+
+			apngPushDecoder_t decoder{{}};
+			decoder.push(file.data(), file.size());
+			assertTrue(decoder.finished());
+			bool threw = false;
+			try
+				{ decoder.push(file.data(), 1); }
+			catch (invalidPNG_t &)
+				{ threw = true; }
+			assertTrue(threw);
+
+			// A second fcTL before any IDAT leaves the first frame without data, which must be caught rather than
+			// finishing that frame off before its colour chunks have been loaded.
+			std::vector<uint8_t> noData{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+			std::vector<uint8_t> header;
+			write32(header, 4);
+			write32(header, 4);
+			header.insert(header.end(), {8, 6, 0, 0, 0});
+			writeChunk(noData, "IHDR", header);
+			std::vector<uint8_t> control;
+			write32(control, 2);
+			write32(control, 0);
+			writeChunk(noData, "acTL", control);
+			for (const uint32_t sequence : {0U, 1U})
+			{
+				std::vector<uint8_t> frameControl;
+				for (const uint32_t value : {sequence, 4U, 4U, 0U, 0U})
+					write32(frameControl, value);
+				frameControl.insert(frameControl.end(), {0, 1, 0, 1, 0, 0});
+				writeChunk(noData, "fcTL", frameControl);
+			}
+			apngPushDecoder_t noDataDecoder{{}};
+			threw = false;
+			try
+				{ noDataDecoder.push(noData.data(), noData.size()); }
+			catch (invalidPNG_t &)
+				{ threw = true; }
+			assertTrue(threw);
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testProbe()
+	{
+		try
+		{
+			mmapStream_t decoderFile("loading_16.png");
+			apngDecoder_t decoder(decoderFile);
+			for (const auto crcCheck : {crcCheck_t::none, crcCheck_t::strict})
+			{
+				fileStream_t pngFile("loading_16.png", O_RDONLY | O_NOCTTY);
+				const apngInfo_t info = apngDecoder_t::probe(pngFile, crcCheck);
+				assertEqual(info.width, decoder.width());
+				assertEqual(info.height, decoder.height());
+				assertTrue(info.colourType == decoder.colourType());
+				assertEqual(info.frames, decoder.frameCount());
+				assertEqual(info.loops, decoder.loops());
+				assertEqual(info.defaultIsFirstFrame, decoder.defaultIsFirstFrame());
+				assertEqual(info.frameControls.size(), decoder.frameCount());
+				std::chrono::nanoseconds duration{};
+				for (uint32_t i = 0; i < info.frames; ++i)
+				{
+					const fcTL_t &expected = decoder.frameControl(i);
+					assertEqual(info.frameControls[i].width(), expected.width());
+					assertEqual(info.frameControls[i].xOffset(), expected.xOffset());
+					assertEqual(info.frameControls[i].delayN(), expected.delayN());
+					duration += expected.delay();
+				}
+				assertTrue(info.duration == duration);
+			}
+
+			// Corrupting the image data should only be noticed when its CRCs are checked,
+			// while cutting the file short should always be.
+			const int32_t fd = open("loading_16.png", O_RDONLY | O_NOCTTY);
+			assertTrue(fd != -1);
+			struct stat fileStat;
+			assertEqual(fstat(fd, &fileStat), 0);
+			std::vector<uint8_t> file(fileStat.st_size);
+			assertEqual(read(fd, file.data(), file.size()), ssize_t(file.size()));
+			close(fd);
+			const uint8_t idat[4]{'I', 'D', 'A', 'T'};
+			const auto data = std::search(file.begin(), file.end(), idat, idat + 4);
+			assertTrue(data != file.end());
+			data[8] ^= 0xFFU;
+			memoryStream_t corrupted{file.data(), file.size()};
+			assertEqual(apngDecoder_t::probe(corrupted).frames, decoder.frameCount());
+			const auto probeFails = [&](const size_t length, const crcCheck_t crcCheck)
+			{
+				memoryStream_t stream{file.data(), length};
+				try
+					{ apngDecoder_t::probe(stream, crcCheck); }
+				catch (invalidPNG_t &)
+					{ return true; }
+				return false;
+			};
+			assertTrue(probeFails(file.size(), crcCheck_t::strict));
+			assertTrue(probeFails(size_t(data - file.begin()) + 8, crcCheck_t::none));
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testObserver()
+	{
+		struct observer_t final : public decodeObserver_t
+		{
+			uint32_t chunksLoadedCalls{0};
+			uint32_t begun{0};
+			uint32_t ended{0};
+			void chunksLoaded(const decodeStats_t &) final override { ++chunksLoadedCalls; }
+			void frameBegin(const uint32_t, const fcTL_t &) final override { ++begun; }
+			void frameEnd(const uint32_t, const decodeStats_t &) final override { ++ended; }
+		};
+
+		try
+		{
+			mmapStream_t decoderFile("loading_16.png");
+			apngDecoder_t decoder(decoderFile);
+			struct stat fileStat;
+			assertEqual(stat("loading_16.png", &fileStat), 0);
+			uint64_t scanlines = 0;
+			uint64_t pixels = 0;
+			for (uint32_t i = 0; i < decoder.frameCount(); ++i)
+			{
+				scanlines += decoder.frameControl(i).height();
+				pixels += uint64_t{decoder.frameControl(i).width()} * decoder.frameControl(i).height();
+			}
+
+			for (const uint32_t threads : {1U, 4U})
+			{
+				observer_t observer;
+				decodeOptions_t options;
+				options.threads = threads;
+				options.observer = &observer;
+				mmapStream_t pngFile("loading_16.png");
+				apng_t image(pngFile, options);
+				const decodeStats_t &stats = observer.stats;
+				assertEqual(observer.chunksLoadedCalls, 1);
+				assertEqual(observer.begun, decoder.frameCount());
+				assertEqual(observer.ended, decoder.frameCount());
+				assertEqual(stats.bytesIn, uint64_t(fileStat.st_size));
+				uint64_t filtered = 0;
+				for (const uint64_t count : stats.filterTypes)
+					filtered += count;
+				assertEqual(filtered, scanlines);
+				assertEqual(stats.bytesOut, pixels * 4);
+				assertTrue(stats.bytesInflated > stats.bytesOut / 4);
+				assertEqual(stats.disposeOps[0] + stats.disposeOps[1] + stats.disposeOps[2], decoder.frameCount());
+				assertEqual(stats.blendOps[0] + stats.blendOps[1], decoder.frameCount());
+				assertTrue(stats.stageTimes[decodeStats_t::inflate].count() > 0);
+				assertTrue(stats.stageTimes[decodeStats_t::crc].count() > 0);
+				assertTrue(stats.peakBitmapMemory >= uint64_t{image.width()} * image.height() * 4);
+			}
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testAllocators()
+	{
+		arenaAllocator_t arena{4096};
+		const auto first = static_cast<uint8_t *>(arena.allocate(10));
+		const auto second = static_cast<uint8_t *>(arena.allocate(100));
+		assertEqual(reinterpret_cast<uintptr_t>(second) % alignof(std::max_align_t), 0);
+		assertTrue(second >= first + 10);
+		assertNotNull(arena.allocate(10000));
+		assertTrue(arena.capacity() >= 14096);
+		arena.reset();
+		assertTrue(arena.allocate(10) == first);
+
+		poolAllocator_t pool;
+		void *const block = pool.allocate(1000);
+		pool.deallocate(block, 1000);
+		assertTrue(pool.allocate(900) == block);
+		pool.deallocate(block, 900);
+		pool.trim();
+
+		struct countingAllocator_t final : public allocator_t
+		{
+			poolAllocator_t pool{};
+			std::atomic<size_t> allocations{0};
+			std::atomic<size_t> live{0};
+
+			void *allocate(const size_t length) final override
+			{
+				++allocations;
+				++live;
+				return pool.allocate(length);
+			}
+
+			void deallocate(void *const data, const size_t length) noexcept final override
+			{
+				--live;
+				pool.deallocate(data, length);
+			}
+		};
+
+		try
+		{
+			fileStream_t expectedFile("loading_16.png", O_RDONLY | O_NOCTTY);
+			apng_t expected(expectedFile);
+			const auto expectedFrames = expected.frames();
+			countingAllocator_t allocator;
+			for (const uint32_t threads : {1U, 4U})
+			{
+				decodeOptions_t options;
+				options.threads = threads;
+				options.allocator = &allocator;
+				options.scratchAllocator = &arena;
+				{
+					// A file stream makes the chunks copy their data, so the scratch arena is used for them too.
+					fileStream_t pngFile("loading_16.png", O_RDONLY | O_NOCTTY);
+					apng_t image(pngFile, options);
+					const auto frames = image.frames();
+					assertEqual(frames.size(), expectedFrames.size());
+					for (size_t i = 0; i < frames.size(); ++i)
+					{
+						assertEqual(frames[i].second->length(), expectedFrames[i].second->length());
+						assertEqual(memcmp(frames[i].second->data(), expectedFrames[i].second->data(),
+							frames[i].second->length()), 0);
+					}
+					assertTrue(allocator.live > 0);
+				}
+				assertTrue(allocator.allocations > 0);
+				assertEqual(allocator.live.load(), 0);
+				assertTrue(arena.capacity() > 0);
+				arena.reset();
+			}
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testDecodeContext()
+	{
+		try
+		{
+			mmapStream_t expectedFile("loading_16.png");
+			apngDecoder_t expected(expectedFile);
+			std::minstd_rand rng{17};
+			auto interlaced = makeAPNG(makeImage(rng, 37, 23, 8, 6), true);
+			const auto expectedInterlaced = decodeImage(interlaced, targetFormat_t::png);
+			std::vector<uint8_t> garbage{0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n', 0, 0, 0, 0};
+
+			decodeContext_t context;
+			decodeOptions_t options;
+			options.context = &context;
+			// Decoding the same files again and again through one context must give the same frames every time.
+			for (size_t pass = 0; pass < 3; ++pass)
+			{
+				mmapStream_t pngFile("loading_16.png");
+				apng_t image(pngFile, options);
+				const auto frames = image.canvases();
+				assertEqual(frames.size(), expected.frameCount());
+				for (uint32_t i = 0; i < expected.frameCount(); ++i)
+				{
+					const auto bitmap = frames[i].second->materialize();
+					const auto expectedBitmap = expected.frame(i).materialize();
+					assertEqual(memcmp(bitmap->data(), expectedBitmap->data(), bitmap->length()), 0);
+				}
+				memoryStream_t interlacedStream{interlaced.data(), interlaced.size()};
+				apngDecoder_t decoder{interlacedStream, options};
+				const auto bitmap = decoder.frame(0).materialize();
+				assertEqual(memcmp(bitmap->data(), expectedInterlaced->data(), bitmap->length()), 0);
+			}
+
+			mmapStream_t batchFile("loading_16.png");
+			memoryStream_t garbageStream{garbage.data(), garbage.size()};
+			memoryStream_t interlacedStream{interlaced.data(), interlaced.size()};
+			const apngBatch_t batch = context.decodeBatch({&batchFile, &garbageStream, &interlacedStream});
+			assertEqual(batch.images.size(), 3);
+			assertTrue(batch.images[0].valid);
+			assertFalse(batch.images[1].valid);
+			assertTrue(batch.images[2].valid);
+			assertEqual(batch.images[0].frames.size(), expected.frameCount());
+			assertEqual(batch.length, (batch.images[0].frameLength * expected.frameCount()) +
+				expectedInterlaced->length());
+			for (uint32_t i = 0; i < expected.frameCount(); ++i)
+			{
+				const auto expectedBitmap = expected.frame(i).materialize();
+				assertEqual(batch.images[0].frameLength, expectedBitmap->length());
+				assertEqual(memcmp(batch.frame(0, i), expectedBitmap->data(), expectedBitmap->length()), 0);
+			}
+			assertEqual(memcmp(batch.frame(2, 0), expectedInterlaced->data(), expectedInterlaced->length()), 0);
+
+			// Images too big to hold, whether or not their size fits in a size_t, are marked invalid like any other.
+			auto huge = makeOversized(1U << 30U, 1U << 30U, 8);
+			auto overflowing = makeOversized(0x7FFFFFFFU, 0x7FFFFFFFU, 16);
+			memoryStream_t hugeStream{huge.data(), huge.size()};
+			memoryStream_t overflowingStream{overflowing.data(), overflowing.size()};
+			memoryStream_t validStream{interlaced.data(), interlaced.size()};
+			const apngBatch_t hugeBatch = context.decodeBatch({&hugeStream, &validStream, &overflowingStream});
+			assertEqual(hugeBatch.images.size(), 3);
+			assertFalse(hugeBatch.images[0].valid);
+			assertTrue(hugeBatch.images[1].valid);
+			assertFalse(hugeBatch.images[2].valid);
+			assertEqual(hugeBatch.length, expectedInterlaced->length());
+			assertEqual(memcmp(hugeBatch.frame(1, 0), expectedInterlaced->data(), expectedInterlaced->length()), 0);
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testEncoder()
+	{
+		try
+		{
+			mmapStream_t expectedFile("loading_16.png");
+			apngDecoder_t expected(expectedFile);
+			std::vector<std::unique_ptr<bitmap_t>> bitmaps;
+			std::vector<apngEncoder_t::frame_t> frames;
+			for (uint32_t i = 0; i < expected.frameCount(); ++i)
+			{
+				bitmaps.emplace_back(expected.frame(i).materialize());
+				const fcTL_t &control = expected.frameControl(i);
+				frames.push_back({bitmaps.back().get(), 0, 0, control.delayN(), control.delayD(), disposeOp_t::none,
+					blendOp_t::source});
+			}
+
+			// The file written must not depend on how many threads wrote it.
+			encodeOptions_t options;
+			options.threads = 1;
+			const auto serial = encodeImage(expected.width(), expected.height(), frames, options);
+			options.threads = 4;
+			auto parallel = encodeImage(expected.width(), expected.height(), frames, options);
+			assertEqual(serial.size(), parallel.size());
+			assertEqual(memcmp(serial.data(), parallel.data(), serial.size()), 0);
+			{
+				memoryStream_t encodedFile{parallel.data(), parallel.size()};
+				apng_t image(encodedFile);
+				const auto decoded = image.frames();
+				assertEqual(decoded.size(), expected.frameCount());
+				for (uint32_t i = 0; i < expected.frameCount(); ++i)
+					assertEqual(memcmp(decoded[i].second->data(), bitmaps[i]->data(), bitmaps[i]->length()), 0);
+			}
+
+			// Trying every filter type can only make the file smaller.
+			options.filter = filterStrategy_t::exhaustive;
+			assertTrue(encodeImage(expected.width(), expected.height(), frames, options).size() <= serial.size());
+
+			// A BGRA frame covering part of the image, blended over opaque pixels, should come back out as RGBA.
+			std::minstd_rand rng{18};
+			bitmap_t background{9, 7, pixelFormat_t::format32bppRGBA};
+			bitmap_t region{4, 3, pixelFormat_t::format32bppBGRA};
+			for (auto *bitmap : {&background, &region})
+			{
+				for (size_t i = 0; i < bitmap->length(); ++i)
+					bitmap->data()[i] = (i & 3U) == 3 ? 255 : uint8_t(rng());
+			}
+			auto png = encodeImage(9, 7, {{&background, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source},
+				{&region, 3, 2, 1, 10, disposeOp_t::none, blendOp_t::over}}, options);
+			memoryStream_t encodedFile{png.data(), png.size()};
+			apngDecoder_t decoder(encodedFile);
+			assertEqual(decoder.frameCount(), 2);
+			assertEqual(decoder.frameControl(1).xOffset(), 3);
+			assertEqual(decoder.frameControl(1).yOffset(), 2);
+			const auto first = decoder.frame(0).materialize();
+			assertEqual(memcmp(first->data(), background.data(), background.length()), 0);
+			const canvas_t &second = decoder.frame(1);
+			for (uint32_t y = 0; y < 7; ++y)
+			{
+				for (uint32_t x = 0; x < 9; ++x)
+				{
+					const uint8_t *const pixel = second.row(y) + (x * 4);
+					const bool inRegion = x >= 3 && x < 7 && y >= 2 && y < 5;
+					const uint8_t *const source = inRegion ? region.data() + ((((y - 2) * 4) + (x - 3)) * 4) :
+						background.data() + (((y * 9) + x) * 4);
+					assertEqual(pixel[0], source[inRegion ? 2 : 0]);
+					assertEqual(pixel[1], source[1]);
+					assertEqual(pixel[2], source[inRegion ? 0 : 2]);
+					assertEqual(pixel[3], 255);
+				}
+			}
+
+			// The first frame has to cover the whole image.
+			bool threw = false;
+			try
+				{ encodeImage(9, 7, {{&region, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source}}); }
+			catch (invalidPNG_t &)
+				{ threw = true; }
+			assertTrue(threw);
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testInflateBackends()
+	{
+		try
+		{
+			assertTrue(inflateSupported(inflateBackend_t::automatic));
+			assertTrue(inflateSupported(inflateBackend_t::streaming));
+			assertTrue(inflateSupported(inflateBackend_t::singleShot));
+			mmapStream_t expectedFile("loading_16.png");
+			decodeOptions_t expectedOptions;
+			expectedOptions.inflate = inflateBackend_t::streaming;
+			apngDecoder_t expected(expectedFile, expectedOptions);
+			std::minstd_rand rng{19};
+			auto interlaced = makeAPNG(makeImage(rng, 37, 23, 16, 2), true);
+			const auto expectedInterlaced = decodeImage(interlaced, targetFormat_t::png);
+			// A block type of 3 straight after the zlib header is invalid, whichever backend reads it.
+			auto corrupt = makeAPNG(makeImage(rng, 16, 16, 8, 6), false);
+			const auto idat = std::search(corrupt.begin(), corrupt.end(), std::begin("IDAT"), std::end("IDAT") - 1);
+			assertTrue(idat != corrupt.end());
+			std::fill(idat + 6, idat + 10, 0xFF);
+			// Data left over after the end of the zlib stream mustn't carry over into the next frame inflated.
+			const auto trailingImage = makeImage(rng, 16, 16, 8, 6);
+			auto trailing = makeAPNG(trailingImage, false, std::vector<uint8_t>(12, 0xA5));
+			auto untrailed = makeAPNG(trailingImage, false);
+			const auto expectedTrailing = decodeImage(untrailed, targetFormat_t::png);
+
+			for (const auto backend : {inflateBackend_t::streaming, inflateBackend_t::singleShot,
+				inflateBackend_t::libdeflate})
+			{
+				decodeOptions_t options;
+				options.inflate = backend;
+				decodeContext_t context;
+				for (decodeContext_t *const frameContext : {static_cast<decodeContext_t *>(nullptr), &context})
+				{
+					options.context = frameContext;
+					mmapStream_t pngFile("loading_16.png");
+					apngDecoder_t decoder(pngFile, options);
+					for (uint32_t i = 0; i < expected.frameCount(); ++i)
+					{
+						const auto bitmap = decoder.frame(i).materialize();
+						const auto expectedBitmap = expected.frame(i).materialize();
+						assertEqual(memcmp(bitmap->data(), expectedBitmap->data(), bitmap->length()), 0);
+					}
+					memoryStream_t interlacedStream{interlaced.data(), interlaced.size()};
+					apngDecoder_t interlacedDecoder{interlacedStream, options};
+					const auto bitmap = interlacedDecoder.frame(0).materialize();
+					assertEqual(memcmp(bitmap->data(), expectedInterlaced->data(), bitmap->length()), 0);
+
+					decodeOptions_t corruptOptions{options};
+					corruptOptions.crcCheck = crcCheck_t::none;
+					memoryStream_t corruptStream{corrupt.data(), corrupt.size()};
+					apngDecoder_t corruptDecoder{corruptStream, corruptOptions};
+					bool threw = false;
+					try
+						{ corruptDecoder.frame(0); }
+					catch (invalidPNG_t &)
+						{ threw = true; }
+					assertTrue(threw);
+
+					memoryStream_t trailingStream{trailing.data(), trailing.size()};
+					apngDecoder_t trailingDecoder{trailingStream, options};
+					const auto trailingBitmap = trailingDecoder.frame(0).materialize();
+					assertEqual(memcmp(trailingBitmap->data(), expectedTrailing->data(), trailingBitmap->length()), 0);
+					memoryStream_t nextStream{interlaced.data(), interlaced.size()};
+					apngDecoder_t nextDecoder{nextStream, options};
+					const auto nextBitmap = nextDecoder.frame(0).materialize();
+					assertEqual(memcmp(nextBitmap->data(), expectedInterlaced->data(), nextBitmap->length()), 0);
+				}
+			}
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testScheduler()
+	{
+		using namespace std::chrono;
+		playbackScheduler_t scheduler;
+		std::mutex lock;
+		std::condition_variable done;
+
+		// Two loops of three frames come out in order, finishing on the last frame with every frame accounted for.
+		std::vector<uint32_t> shown;
+		bool finished = false;
+		playbackScheduler_t::playbackStats_t finalStats{};
+		const auto start = steady_clock::now();
+		steady_clock::time_point lastShown;
+		const uint64_t id = scheduler.play({milliseconds{10}, milliseconds{10}, milliseconds{10}}, 2,
+			[&](const uint32_t frame)
+			{
+				std::lock_guard<std::mutex> guard{lock};
+				shown.push_back(frame);
+				lastShown = steady_clock::now();
+			},
+			[&](const playbackScheduler_t::playbackStats_t &stats)
+			{
+				std::lock_guard<std::mutex> guard{lock};
+				finalStats = stats;
+				finished = true;
+				done.notify_one();
+			});
+		assertTrue(id != 0);
+		{
+			std::unique_lock<std::mutex> guard{lock};
+			assertTrue(done.wait_for(guard, seconds{5}, [&]() { return finished; }));
+			assertEqual(finalStats.loopsCompleted, 2);
+			assertEqual(finalStats.framesShown + finalStats.missedDeadlines, 6);
+			assertEqual(finalStats.framesShown, shown.size());
+			assertEqual(shown.back(), 2);
+			// The last frame is due 50ms in, as the deadlines are absolute rather than each relative to the last.
+			assertTrue(lastShown - start >= milliseconds{50});
+		}
+		for (uint32_t i = 0; i < 100 && scheduler.playing(id); ++i)
+			std::this_thread::sleep_for(milliseconds{1});
+		assertFalse(scheduler.playing(id));
+		assertFalse(scheduler.stop(id));
+
+		// A frame that holds up the timer thread makes the frames due meanwhile get skipped and reported.
+		finished = false;
+		std::atomic<uint32_t> lastFrame{0};
+		scheduler.play(std::vector<nanoseconds>(8, milliseconds{5}), 1, [&](const uint32_t frame)
+			{
+				if (frame == 0)
+					std::this_thread::sleep_for(milliseconds{40});
+				lastFrame = frame;
+			},
+			[&](const playbackScheduler_t::playbackStats_t &stats)
+			{
+				std::lock_guard<std::mutex> guard{lock};
+				finalStats = stats;
+				finished = true;
+				done.notify_one();
+			});
+		{
+			std::unique_lock<std::mutex> guard{lock};
+			assertTrue(done.wait_for(guard, seconds{5}, [&]() { return finished; }));
+			assertTrue(finalStats.missedDeadlines >= 5);
+			assertTrue(finalStats.maxLateness > nanoseconds::zero());
+			assertEqual(finalStats.framesShown + finalStats.missedDeadlines, 8);
+			assertEqual(lastFrame.load(), 7);
+		}
+		for (uint32_t i = 0; i < 100 && scheduler.animationCount(); ++i)
+			std::this_thread::sleep_for(milliseconds{1});
+
+		// Many endless animations share the one timer thread, and none are called after being stopped.
+		std::vector<uint64_t> ids;
+		std::atomic<uint32_t> calls{0};
+		std::atomic<bool> stopped{false};
+		std::atomic<bool> calledAfterStop{false};
+		for (uint32_t i = 0; i < 100; ++i)
+			ids.push_back(scheduler.play({milliseconds{1 + i % 7}, milliseconds{2}}, 0, [&](const uint32_t)
+			{
+				++calls;
+				if (stopped)
+					calledAfterStop = true;
+			}));
+		assertEqual(scheduler.animationCount(), 100);
+		std::this_thread::sleep_for(milliseconds{30});
+		for (const uint64_t animation : ids)
+		{
+			assertTrue(scheduler.playing(animation));
+			assertTrue(scheduler.stats(animation).framesShown != 0);
+			assertTrue(scheduler.stop(animation));
+		}
+		stopped = true;
+		assertEqual(scheduler.animationCount(), 0);
+		assertTrue(calls >= 100);
+		std::this_thread::sleep_for(milliseconds{10});
+		assertFalse(calledAfterStop);
+
+		// An animation can stop itself, and images play with their own frame delays.
+		std::atomic<uint32_t> selfCalls{0};
+		uint64_t selfID = 0;
+		{
+			std::lock_guard<std::mutex> guard{lock};
+			selfID = scheduler.play({milliseconds{1}}, 0, [&](const uint32_t)
+			{
+				std::lock_guard<std::mutex> guard{lock};
+				++selfCalls;
+				assertTrue(scheduler.stop(selfID));
+			});
+		}
+		for (uint32_t i = 0; i < 1000 && !selfCalls; ++i)
+			std::this_thread::sleep_for(milliseconds{1});
+		std::this_thread::sleep_for(milliseconds{10});
+		assertEqual(selfCalls.load(), 1);
+		assertFalse(scheduler.playing(selfID));
+		try
+		{
+			mmapStream_t pngFile("loading_16.png");
+			apng_t image{pngFile};
+			std::atomic<uint32_t> frames{0};
+			const uint64_t imageID = scheduler.play(image, [&](const uint32_t frame)
+			{
+				if (frame < image.canvases().size())
+					++frames;
+			});
+			for (uint32_t i = 0; i < 1000 && !frames; ++i)
+				std::this_thread::sleep_for(milliseconds{1});
+			assertTrue(frames != 0);
+			scheduler.stop(imageID);
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+		assertEqual(scheduler.play({}, 0, [](const uint32_t) { }), 0);
+	}
+
+	void testDedup()
+	{
+		try
+		{
+			// A ping-pong between two frames, with a held frame and a frame that only appears once.
+			std::minstd_rand rng{21};
+			std::vector<std::unique_ptr<bitmap_t>> bitmaps;
+			for (uint32_t i = 0; i < 3; ++i)
+			{
+				bitmaps.emplace_back(makeUnique<bitmap_t>(23, 17, pixelFormat_t::format32bppRGBA));
+				for (size_t j = 0; j < bitmaps.back()->length(); ++j)
+					bitmaps.back()->data()[j] = uint8_t(rng());
+			}
+			std::vector<apngEncoder_t::frame_t> frames;
+			for (const uint32_t bitmap : {0U, 1U, 0U, 0U, 1U, 2U})
+				frames.push_back({bitmaps[bitmap].get(), 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source});
+			auto png = encodeImage(23, 17, frames);
+
+			memoryStream_t plainFile{png.data(), png.size()};
+			apng_t plain{plainFile};
+			assertEqual(plain.dedupBytesSaved(), 0);
+			decodeObserver_t observer;
+			decodeOptions_t options;
+			options.dedupFrames = true;
+			options.observer = &observer;
+			memoryStream_t dedupFile{png.data(), png.size()};
+			apng_t dedup{dedupFile, options};
+
+			const auto plainFrames = plain.frames();
+			const auto dedupFrames = dedup.frames();
+			const auto canvases = dedup.canvases();
+			assertEqual(dedupFrames.size(), 6);
+			for (size_t i = 0; i < dedupFrames.size(); ++i)
+			{
+				const bitmap_t &bitmap = *dedupFrames[i].second;
+				assertEqual(memcmp(bitmap.data(), plainFrames[i].second->data(), bitmap.length()), 0);
+				assertTrue(dedupFrames[i].first.delay() == plainFrames[i].first.delay());
+			}
+			assertTrue(dedupFrames[2].second == dedupFrames[0].second);
+			assertTrue(dedupFrames[3].second == dedupFrames[0].second);
+			assertTrue(dedupFrames[4].second == dedupFrames[1].second);
+			assertTrue(dedupFrames[1].second != dedupFrames[0].second);
+			assertTrue(dedupFrames[5].second != dedupFrames[1].second);
+			for (uint32_t y = 0; y < 17; ++y)
+				assertTrue(canvases[4].second->sharesRow(*canvases[1].second, y));
+
+			assertEqual(observer.stats.framesDeduplicated, 3);
+			assertEqual(observer.stats.dedupBytesSaved, dedup.dedupBytesSaved());
+			// The bitmaps frames() no longer makes for the three duplicates, and at least the rows of frames 2 and 4.
+			assertTrue(dedup.dedupBytesSaved() >= 5 * bitmaps[0]->length());
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testDownscale()
+	{
+		try
+		{
+			// Whole frames, interlaced or not and of each sample size, come out as their box-filtered full size frame.
+			std::minstd_rand rng{22};
+			for (const auto &format : {std::make_pair<uint8_t, uint8_t>(8, 6), std::make_pair<uint8_t, uint8_t>(16, 2),
+				std::make_pair<uint8_t, uint8_t>(4, 0)})
+			{
+				const auto image = makeImage(rng, 37, 23, format.first, format.second);
+				const size_t sampleBytes = format.first == 16 ? 2 : 1;
+				for (const bool interlaced : {false, true})
+				{
+					auto png = makeAPNG(image, interlaced);
+					const auto full = decodeImage(png, targetFormat_t::png);
+					for (const auto downscale : {downscale_t::half, downscale_t::quarter, downscale_t::eighth})
+					{
+						const uint8_t shift = uint8_t(downscale);
+						memoryStream_t stream{png.data(), png.size()};
+						decodeOptions_t options;
+						options.downscale = downscale;
+						apngDecoder_t decoder{stream, options};
+						assertEqual(decoder.width(), (37U + (1U << shift) - 1U) >> shift);
+						assertEqual(decoder.height(), (23U + (1U << shift) - 1U) >> shift);
+						const auto frame = decoder.frame(0).materialize();
+						assertEqual(frame->width(), decoder.width());
+						assertTrue(samplesOf(*frame, sampleBytes) ==
+							boxFilter(*full, shift, sampleBytes, format.second == 6));
+					}
+				}
+			}
+
+			// Transparent pixels don't darken the colour of the opaque ones they're averaged with.
+			testImage_t edge{2, 2, 8, 6, 4, {255, 0, 0, 255, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, {}};
+			auto edgePNG = makeAPNG(edge, false);
+			{
+				memoryStream_t stream{edgePNG.data(), edgePNG.size()};
+				decodeOptions_t options;
+				options.downscale = downscale_t::half;
+				apngDecoder_t decoder{stream, options};
+				assertTrue(samplesOf(*decoder.frame(0).materialize(), 1) == std::vector<uint32_t>({255, 0, 0, 64}));
+			}
+
+			// A frame covering part of the image lands on the same blocks of the smaller canvas it did at full size.
+			bitmap_t background{37, 23, pixelFormat_t::format32bppRGBA};
+			bitmap_t region{10, 7, pixelFormat_t::format32bppRGBA};
+			for (auto *bitmap : {&background, &region})
+			{
+				for (size_t i = 0; i < bitmap->length(); ++i)
+					bitmap->data()[i] = uint8_t(rng());
+			}
+			auto file = encodeImage(37, 23, {{&background, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source},
+				{&region, 3, 5, 1, 10, disposeOp_t::none, blendOp_t::source}});
+			memoryStream_t fullFile{file.data(), file.size()};
+			apng_t full{fullFile};
+			decodeOptions_t options;
+			options.downscale = downscale_t::quarter;
+			options.threads = 2;
+			memoryStream_t scaledFile{file.data(), file.size()};
+			apng_t scaled{scaledFile, options};
+			// Decoding as the file arrives scales frames down just the same.
+			uint32_t pushedFrames = 0;
+			apngPushDecoder_t::callbacks_t callbacks;
+			callbacks.frame = [&](const uint32_t index, const canvas_t &canvas)
+			{
+				const auto bitmap = canvas.materialize();
+				const bitmap_t &expectedBitmap = *scaled.frames()[index].second;
+				assertEqual(bitmap->length(), expectedBitmap.length());
+				assertEqual(memcmp(bitmap->data(), expectedBitmap.data(), bitmap->length()), 0);
+				++pushedFrames;
+			};
+			apngPushDecoder_t pushDecoder{callbacks, options};
+			pushDecoder.push(file.data(), file.size());
+			assertEqual(pushedFrames, 2);
+			assertEqual(scaled.width(), 10);
+			assertEqual(scaled.height(), 6);
+			const auto expected = boxFilter(*full.frames()[1].second, 2, 1, true);
+			const auto frame = samplesOf(*scaled.frames()[1].second, 1);
+			assertEqual(frame.size(), expected.size());
+			// Blocks wholly inside or outside the frame are exact, while those along its edges are approximations.
+			for (const auto &block : {std::make_pair(1U, 2U), std::make_pair(2U, 2U), std::make_pair(0U, 0U),
+				std::make_pair(9U, 5U), std::make_pair(5U, 1U)})
+			{
+				const size_t offset = ((block.second * 10U) + block.first) * 4U;
+				for (size_t i = offset; i < offset + 4; ++i)
+					assertEqual(frame[i], expected[i]);
+			}
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	void testSeek()
+	{
+		struct frameCounter_t final : public decodeObserver_t
+		{
+			std::vector<uint32_t> decoded{};
+			void frameBegin(const uint32_t index, const fcTL_t &) final override { decoded.push_back(index); }
+		};
+
+		try
+		{
+			std::minstd_rand rng{23};
+			bitmap_t full{16, 12, pixelFormat_t::format32bppRGBA};
+			bitmap_t part{5, 4, pixelFormat_t::format32bppRGBA};
+			for (auto *bitmap : {&full, &part})
+			{
+				for (size_t i = 0; i < bitmap->length(); ++i)
+					bitmap->data()[i] = uint8_t(rng());
+			}
+			// Frames 3 and 5 start afresh, one by replacing the whole canvas and the other by clearing it first.
+			auto png = encodeImage(16, 12,
+			{
+				{&full, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source},
+				{&part, 2, 2, 1, 10, disposeOp_t::none, blendOp_t::over},
+				{&part, 9, 7, 1, 10, disposeOp_t::previous, blendOp_t::over},
+				{&full, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source},
+				{&part, 4, 1, 1, 10, disposeOp_t::none, blendOp_t::over},
+				{&part, 6, 3, 1, 10, disposeOp_t::background, blendOp_t::over},
+				{&part, 1, 8, 1, 10, disposeOp_t::previous, blendOp_t::source},
+				{&part, 11, 0, 1, 10, disposeOp_t::none, blendOp_t::over}
+			});
+
+			memoryStream_t expectedFile{png.data(), png.size()};
+			apngDecoder_t expected{expectedFile};
+			std::vector<std::unique_ptr<bitmap_t>> frames;
+			for (uint32_t i = 0; i < expected.frameCount(); ++i)
+				frames.emplace_back(expected.frame(i).materialize());
+			assertTrue(expected.keyframes() == std::vector<uint32_t>({0, 3, 5}));
+			assertEqual(expected.keyframeFor(4), 3);
+			assertEqual(expected.keyframeFor(7), 5);
+			{
+				memoryStream_t probeFile{png.data(), png.size()};
+				assertTrue(apngDecoder_t::probe(probeFile).keyframes == expected.keyframes());
+			}
+
+			// Seeking straight to a frame only decodes from its keyframe, and comes out the same in any order.
+			frameCounter_t counter;
+			decodeOptions_t options;
+			options.observer = &counter;
+			memoryStream_t seekFile{png.data(), png.size()};
+			apngDecoder_t decoder{seekFile, options};
+			decoder.seek(4);
+			assertTrue(counter.decoded == std::vector<uint32_t>({3, 4}));
+			for (const uint32_t index : {7U, 2U, 6U, 6U, 0U, 5U, 3U, 1U, 4U})
+			{
+				counter.decoded.clear();
+				const auto bitmap = decoder.seek(index).materialize();
+				assertEqual(memcmp(bitmap->data(), frames[index]->data(), bitmap->length()), 0);
+				assertTrue(counter.decoded.size() <= 3);
+			}
+
+			mmapStream_t loadingFile("loading_16.png");
+			apngDecoder_t loading{loadingFile};
+			mmapStream_t loadingSeekFile("loading_16.png");
+			apngDecoder_t loadingSeek{loadingSeekFile};
+			for (uint32_t i = 0; i < loading.frameCount(); ++i)
+			{
+				const auto bitmap = loadingSeek.seek(loading.frameCount() - 1 - i).materialize();
+				const auto expectedBitmap = loading.frame(loading.frameCount() - 1 - i).materialize();
+				assertEqual(memcmp(bitmap->data(), expectedBitmap->data(), bitmap->length()), 0);
+			}
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
+	// Decodes the image with the budget, giving which limit it went over or -1 when it was decoded.
+	static int budgetLimit(std::vector<uint8_t> &png, const decodeBudget_t &budget)
+	{
+		decodeOptions_t options;
+		options.budget = budget;
+		memoryStream_t stream{png.data(), png.size()};
+		try
+			{ apng_t image{stream, options}; }
+		catch (budgetExceeded_t &error)
+			{ return int(error.limit()); }
+		return -1;
+	}
+
+	static int pushBudgetLimit(const std::vector<uint8_t> &png, const decodeBudget_t &budget)
+	{
+		decodeOptions_t options;
+		options.budget = budget;
+		apngPushDecoder_t decoder{{}, options};
+		try
+			{ decoder.push(png.data(), png.size()); }
+		catch (budgetExceeded_t &error)
+			{ return int(error.limit()); }
+		return -1;
+	}
+
+	void testBudget()
+	{
+		using limit_t = budgetExceeded_t::limit_t;
+		try
+		{
+			// A file of a few dozen bytes declaring the biggest canvas a PNG can have is stopped at its IHDR.
+			auto bomb = makeOversized(0x7FFFFFFFU, 0x7FFFFFFFU, 8);
+			decodeBudget_t budget;
+			budget.maxCanvasPixels = 4096 * 4096;
+			assertEqual(budgetLimit(bomb, budget), int(limit_t::canvasPixels));
+			assertEqual(pushBudgetLimit(bomb, budget), int(limit_t::canvasPixels));
+
+			std::minstd_rand rng{25};
+			std::vector<uint8_t> noise = makeAPNG(makeImage(rng, 64, 64, 8, 6), false);
+			testImage_t blank = makeImage(rng, 256, 256, 8, 6);
+			std::fill(blank.pixels.begin(), blank.pixels.end(), 0);
+			std::vector<uint8_t> flat = makeAPNG(blank, false);
+			assertEqual(budgetLimit(noise, {}), -1);
+
+			// The frame costs its own pixels, the canvas rows it's drawn on and its canvas's table of rows.
+			const uint64_t noiseBytes = (64 * 64 * 4 * 2) + (64 * sizeof(std::shared_ptr<uint8_t>));
+			budget = {};
+			budget.maxDecodedBytes = noiseBytes - 1;
+			assertEqual(budgetLimit(noise, budget), int(limit_t::decodedBytes));
+			assertEqual(pushBudgetLimit(noise, budget), int(limit_t::decodedBytes));
+			budget.maxDecodedBytes = noiseBytes;
+			assertEqual(budgetLimit(noise, budget), -1);
+			assertEqual(pushBudgetLimit(noise, budget), -1);
+
+			// A blank frame inflates to hundreds of times its size, which random noise never does.
+			budget = {};
+			budget.maxCompressionRatio = 100;
+			assertEqual(budgetLimit(flat, budget), int(limit_t::compressionRatio));
+			assertEqual(pushBudgetLimit(flat, budget), int(limit_t::compressionRatio));
+			assertEqual(budgetLimit(noise, budget), -1);
+			assertEqual(pushBudgetLimit(noise, budget), -1);
+			{
+				decodeOptions_t options;
+				options.budget = budget;
+				decodeContext_t context;
+				memoryStream_t flatStream{flat.data(), flat.size()};
+				memoryStream_t noiseStream{noise.data(), noise.size()};
+				const apngBatch_t batch = context.decodeBatch({&flatStream, &noiseStream}, options);
+				assertEqual(batch.images.size(), 2);
+				assertFalse(batch.images[0].valid);
+				assertTrue(batch.images[1].valid);
+			}
+
+			budget = {};
+			budget.maxTime = std::chrono::nanoseconds{1};
+			assertEqual(budgetLimit(noise, budget), int(limit_t::time));
+
+			// Each image in a batch has the whole time budget for decoding its frames, however long reading the
+			// other images' chunks took beforehand.
+			struct slowLoader_t final : public decodeObserver_t
+			{
+				void chunksLoaded(const decodeStats_t &) final override
+					{ std::this_thread::sleep_for(std::chrono::milliseconds{200}); }
+			};
+			{
+				slowLoader_t slowLoader;
+				decodeOptions_t options;
+				options.budget.maxTime = std::chrono::milliseconds{500};
+				options.observer = &slowLoader;
+				decodeContext_t context;
+				std::vector<memoryStream_t> streams;
+				for (size_t i = 0; i < 3; ++i)
+					streams.emplace_back(noise.data(), noise.size());
+				const apngBatch_t batch = context.decodeBatch({&streams[0], &streams[1], &streams[2]}, options);
+				for (const auto &image : batch.images)
+					assertTrue(image.valid);
+			}
+
+			// A 1x1 frame on a wide canvas still costs a whole row of the canvas, which apng_t keeps for every frame.
+			{
+				bitmap_t wide{65536, 1, pixelFormat_t::format32bppRGBA};
+				bitmap_t dot{1, 1, pixelFormat_t::format32bppRGBA};
+				memset(wide.data(), 0, wide.length());
+				memset(dot.data(), 0xFF, dot.length());
+				std::vector<apngEncoder_t::frame_t> frames{{&wide, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source}};
+				for (uint32_t i = 1; i < 1000; ++i)
+					frames.push_back({&dot, i * 65, 0, 1, 10, disposeOp_t::none, blendOp_t::source});
+				auto png = encodeImage(65536, 1, frames);
+				budget = {};
+				budget.maxCanvasPixels = 65536;
+				budget.maxDecodedBytes = 1024 * 1024;
+				budget.maxCompressionRatio = 1100;
+				assertEqual(budgetLimit(png, budget), int(limit_t::decodedBytes));
+			}
+
+			bitmap_t frame{16, 12, pixelFormat_t::format32bppRGBA};
+			for (size_t i = 0; i < frame.length(); ++i)
+				frame.data()[i] = uint8_t(rng());
+			auto png = encodeImage(16, 12,
+			{
+				{&frame, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::source},
+				{&frame, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::over},
+				{&frame, 0, 0, 1, 10, disposeOp_t::none, blendOp_t::over}
+			});
+			budget = {};
+			budget.maxFrames = 2;
+			assertEqual(budgetLimit(png, budget), int(limit_t::frames));
+			budget.maxFrames = 3;
+			assertEqual(budgetLimit(png, budget), -1);
+
+			// A frame offset that wraps around once the frame's width is added to it is rejected, not drawn with.
+			auto wrapping = png;
+			const char fcTLType[] = "fcTL";
+			auto fcTL = std::search(wrapping.begin(), wrapping.end(), fcTLType, fcTLType + 4);
+			fcTL = std::search(fcTL + 4, wrapping.end(), fcTLType, fcTLType + 4);
+			assertTrue(fcTL != wrapping.end());
+			const size_t fcTLOffset = size_t(fcTL - wrapping.begin());
+			std::vector<uint8_t> wrappedOffset;
+			write32(wrappedOffset, 0xFFFFFFF8U);
+			std::copy(wrappedOffset.begin(), wrappedOffset.end(), wrapping.begin() + fcTLOffset + 16);
+			uint32_t crc = 0;
+			crc32_t::crc(crc, wrapping.data() + fcTLOffset, 30);
+			std::vector<uint8_t> fcTLCRC;
+			write32(fcTLCRC, crc);
+			std::copy(fcTLCRC.begin(), fcTLCRC.end(), wrapping.begin() + fcTLOffset + 30);
+			bool threw = false;
+			try
+			{
+				memoryStream_t stream{wrapping.data(), wrapping.size()};
+				apng_t image{stream};
+			}
+			catch (invalidPNG_t &)
+				{ threw = true; }
+			assertTrue(threw);
+			threw = false;
+			try
+			{
+				apngPushDecoder_t decoder{{}};
+				decoder.push(wrapping.data(), wrapping.size());
+			}
+			catch (invalidPNG_t &)
+				{ threw = true; }
+			assertTrue(threw);
+		}
+		catch (std::system_error &error)
+		{
+			fail(error.what());
+		}
+		catch (invalidPNG_t &error)
+		{
+			fail(error.what());
+		}
+	}
+
 	void registerTests() final override
 	{
 		CXX_TEST(testFileStream)
 		CXX_TEST(testMemoryStream)
+		CXX_TEST(testMmapStream)
+		CXX_TEST(testCRCCheck)
+		CXX_TEST(testParallelDecode)
+		CXX_TEST(testCanvasSharing)
+		CXX_TEST(testDecoder)
+		CXX_TEST(testTargetFormats)
+		CXX_TEST(testInterlaced)
+		CXX_TEST(testProgressive)
+		CXX_TEST(testPushDecoder)
+		CXX_TEST(testProbe)
+		CXX_TEST(testObserver)
+		CXX_TEST(testAllocators)
+		CXX_TEST(testDecodeContext)
+		CXX_TEST(testEncoder)
+		CXX_TEST(testInflateBackends)
+		CXX_TEST(testScheduler)
+		CXX_TEST(testDedup)
+		CXX_TEST(testDownscale)
+		CXX_TEST(testSeek)
+		CXX_TEST(testBudget)
 	}
 };
 
@@ -72,9 +1766,74 @@ public:
 		assertEqual(int32_t(crcCalc), int32_t(testData1.second));
 	}
 
+	void checkEngine(const crcEngine_t engine)
+	{
+		if (!crc32_t::supported(engine))
+			skip("CPU does not support this CRC engine");
+		uint32_t crcCalc = 0;
+		assertTrue(crc32_t::crc(engine, crcCalc, testData1.first.data(), testData1.first.size()));
+		assertEqual(int32_t(crcCalc), int32_t(testData1.second));
+
+		// Check lengths either side of each engine's block sizes, at every alignment,
+		// and that the CRC carries on correctly from one call to the next.
+		std::minstd_rand rng{0x43524332};
+		std::vector<uint8_t> data(1024 + 16);
+		for (auto &value : data)
+			value = uint8_t(rng());
+		for (size_t offset = 0; offset < 16; ++offset)
+		{
+			for (const size_t length : {0, 1, 7, 8, 15, 16, 17, 63, 64, 65, 127, 128, 200, 1023, 1024})
+			{
+				uint32_t expected = 0;
+				uint32_t actual = 0;
+				crc32_t::crc(crcEngine_t::bytewise, expected, data.data() + offset, length);
+				crc32_t::crc(engine, actual, data.data() + offset, length / 3);
+				crc32_t::crc(engine, actual, data.data() + offset + length / 3, length - length / 3);
+				assertEqual(int32_t(actual), int32_t(expected));
+			}
+		}
+	}
+
+	void testBytewise() { checkEngine(crcEngine_t::bytewise); }
+	void testSlicing8() { checkEngine(crcEngine_t::slicing8); }
+	void testSlicing16() { checkEngine(crcEngine_t::slicing16); }
+	void testCLMUL() { checkEngine(crcEngine_t::clmul); }
+
+	// Not pass/fail, but reports each engine's throughput over a buffer the size of a large IDAT run.
+	void testThroughput()
+	{
+		std::vector<uint8_t> data(4 * 1024 * 1024);
+		std::minstd_rand rng{0x43524332};
+		for (auto &value : data)
+			value = uint8_t(rng());
+		const std::pair<crcEngine_t, const char *> engines[] =
+		{
+			{crcEngine_t::bytewise, "bytewise"}, {crcEngine_t::slicing8, "slicing8"},
+			{crcEngine_t::slicing16, "slicing16"}, {crcEngine_t::clmul, "clmul"}
+		};
+		for (const auto &engine : engines)
+		{
+			if (!crc32_t::supported(engine.first))
+				continue;
+			uint32_t crcCalc = 0;
+			const size_t rounds = 8;
+			const auto start = std::chrono::steady_clock::now();
+			for (size_t i = 0; i < rounds; ++i)
+				crc32_t::crc(engine.first, crcCalc, data.data(), data.size());
+			const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+			printf("CRC32 %-10s %8.1f MB/s (%08x)\n", engine.second,
+				double(data.size() * rounds) / time.count() / 1e6, crcCalc);
+		}
+	}
+
 	void registerTests() final override
 	{
 		CXX_TEST(testCRC32)
+		CXX_TEST(testBytewise)
+		CXX_TEST(testSlicing8)
+		CXX_TEST(testSlicing16)
+		CXX_TEST(testCLMUL)
+		CXX_TEST(testThroughput)
 	}
 };
 
@@ -88,8 +1847,510 @@ const std::pair<std::array<uint8_t, 17>, uint32_t> crc32Tests::testData1
 	0xC6DE3ED3
 };
 
+class unfilterTests final : public testsuit
+{
+private:
+	void checkKernels(const simdLevel_t level)
+	{
+		if (!unfilter_t::select(1, level))
+			skip("CPU does not support this SIMD level");
+		// Fixed seed so any failure is reproducible.
+		std::minstd_rand rng{0x41504E47U};
+		std::uniform_int_distribution<uint16_t> byte{0, 255};
+		for (const size_t bpp : {1U, 2U, 3U, 4U, 6U, 8U})
+		{
+			const unfilter_t *const kernels = unfilter_t::select(bpp, level);
+			assertNotNull(kernels);
+			assertEqual(kernels->bpp(), bpp);
+			for (const auto filter : {filterTypes_t::none, filterTypes_t::sub, filterTypes_t::up,
+				filterTypes_t::average, filterTypes_t::paeth})
+			{
+				for (const size_t pixels : {1U, 2U, 5U, 15U, 16U, 17U, 31U, 32U, 33U, 100U, 1023U})
+				{
+					const size_t length = pixels * bpp;
+					std::vector<uint8_t> row(length), prevRow(length);
+					for (size_t i = 0; i < length; ++i)
+					{
+						row[i] = uint8_t(byte(rng));
+						prevRow[i] = uint8_t(byte(rng));
+					}
+					std::vector<uint8_t> expected{row};
+					unfilterRow(filter, expected.data(), prevRow.data(), length, bpp);
+					(*kernels)(filter, row.data(), prevRow.data(), length);
+					assertTrue(row == expected);
+				}
+			}
+		}
+	}
+
+public:
+	void testScalar() { checkKernels(simdLevel_t::scalar); }
+	void testSSE2() { checkKernels(simdLevel_t::sse2); }
+	void testSSE41() { checkKernels(simdLevel_t::sse41); }
+	void testAVX2() { checkKernels(simdLevel_t::avx2); }
+
+	void registerTests() final override
+	{
+		CXX_TEST(testScalar)
+		CXX_TEST(testSSE2)
+		CXX_TEST(testSSE41)
+		CXX_TEST(testAVX2)
+	}
+};
+
+class compositeTests final : public testsuit
+{
+private:
+	constexpr static uint32_t benchWidth = 512;
+	constexpr static uint32_t benchHeight = 512;
+	static const std::array<std::pair<pixelFormat_t, size_t>, 5> alphaFormats;
+
+	static std::vector<uint8_t> randomPixels(std::minstd_rand &rng, const size_t length)
+	{
+		std::vector<uint8_t> data(length);
+		for (auto &value : data)
+		{
+			// Bias towards the extremes so fully transparent and fully opaque pixels get checked too.
+			const uint32_t choice = rng() % 8;
+			value = choice == 0 ? 0 : choice == 1 ? 0xFF : uint8_t(rng());
+		}
+		return data;
+	}
+
+	static std::unique_ptr<bitmap_t> randomBitmap(std::minstd_rand &rng, const pixelFormat_t format)
+	{
+		auto bitmap = std::unique_ptr<bitmap_t>{new bitmap_t{benchWidth, benchHeight, format}};
+		const auto pixels = randomPixels(rng, bitmap->length());
+		memcpy(bitmap->data(), pixels.data(), bitmap->length());
+		return bitmap;
+	}
+
+	template<typename function_t> static double megapixelRate(const function_t &composite)
+	{
+		constexpr size_t rounds = 8;
+		const auto start = std::chrono::steady_clock::now();
+		for (size_t i = 0; i < rounds; ++i)
+			composite();
+		const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+		return double(benchWidth * benchHeight * rounds) / time.count() / 1e6;
+	}
+
+	template<typename T> static double perPixelRate(T compFunc(const T, const T, const typename T::type),
+		const pixelFormat_t format, std::minstd_rand &rng)
+	{
+		const auto source = randomBitmap(rng, format);
+		canvas_t canvas{benchWidth, benchHeight, format};
+		return megapixelRate([&]() { compFrame(compFunc, *source, canvas, 0, 0); });
+	}
+
+	static double kernelRate(const blendOver_t::blendFunc_t kernel, const pixelFormat_t format, std::minstd_rand &rng)
+	{
+		const auto source = randomBitmap(rng, format);
+		canvas_t canvas{benchWidth, benchHeight, format};
+		uint8_t *const rows = canvas.detachRows(0, benchHeight);
+		return megapixelRate([&]() { kernel(rows, source->data(), size_t{benchWidth} * benchHeight); });
+	}
+
+	static double copyRate(const pixelFormat_t format, std::minstd_rand &rng)
+	{
+		const auto source = randomBitmap(rng, format);
+		canvas_t canvas{benchWidth, benchHeight, format};
+		return megapixelRate([&]()
+		{
+			uint8_t *const rows = canvas.detachRows(0, benchHeight, false);
+			for (uint32_t y = 0; y < benchHeight; ++y)
+				memcpy(rows + (y * canvas.rowLength()), source->data() + (y * canvas.rowLength()), canvas.rowLength());
+		});
+	}
+
+	static double perPixelRate(const pixelFormat_t format, std::minstd_rand &rng)
+	{
+		switch (format)
+		{
+			case pixelFormat_t::format8bppGrey:
+				return perPixelRate(compGrey<pngGrey8_t, blendOp_t::over>, format, rng);
+			case pixelFormat_t::format16bppGrey:
+				return perPixelRate(compGrey<pngGrey16_t, blendOp_t::over>, format, rng);
+			case pixelFormat_t::format8bppGreyA:
+				return perPixelRate(compGreyA<pngGreyA8_t, blendOp_t::over>, format, rng);
+			case pixelFormat_t::format16bppGreyA:
+				return perPixelRate(compGreyA<pngGreyA16_t, blendOp_t::over>, format, rng);
+			case pixelFormat_t::format24bppRGB:
+				return perPixelRate(compRGB<pngRGB8_t, blendOp_t::over>, format, rng);
+			case pixelFormat_t::format48bppRGB:
+				return perPixelRate(compRGB<pngRGB16_t, blendOp_t::over>, format, rng);
+			case pixelFormat_t::format32bppRGBA:
+				return perPixelRate(compRGBA<pngRGBA8_t, blendOp_t::over>, format, rng);
+			case pixelFormat_t::format64bppRGBA:
+				return perPixelRate(compRGBA<pngRGBA16_t, blendOp_t::over>, format, rng);
+			default:
+				break;
+		}
+		return 0;
+	}
+
+	void checkKernels(const simdLevel_t level)
+	{
+		const blendOver_t *const kernels = blendOver_t::select(level);
+		if (!kernels)
+			skip("CPU does not support this SIMD level");
+		const blendOver_t &reference = *blendOver_t::select(simdLevel_t::scalar);
+		std::minstd_rand rng{0x424C4E44};
+		for (const auto &format : alphaFormats)
+		{
+			for (const bool blendAlpha : {false, true})
+			{
+				for (const size_t pixels : {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 100, 1023})
+				{
+					const size_t length = pixels * format.second;
+					const auto source = randomPixels(rng, length);
+					auto expected = randomPixels(rng, length);
+					auto actual = expected;
+					reference(format.first, blendAlpha)(expected.data(), source.data(), pixels);
+					(*kernels)(format.first, blendAlpha)(actual.data(), source.data(), pixels);
+					assertTrue(expected == actual);
+				}
+			}
+		}
+	}
+
+public:
+	void testScalar() { checkKernels(simdLevel_t::scalar); }
+	void testSSE2() { checkKernels(simdLevel_t::sse2); }
+	void testAVX2() { checkKernels(simdLevel_t::avx2); }
+
+	// Not pass/fail, but reports how many megapixels a second each format composites at through the per-pixel
+	// compFrame() path, through the blend kernels at each SIMD level, and as a blendOp_t::source row copy.
+	void testThroughput()
+	{
+		std::minstd_rand rng{0x424C4E44};
+		const std::pair<pixelFormat_t, const char *> formats[] =
+		{
+			{pixelFormat_t::format8bppGrey, "Grey8"}, {pixelFormat_t::format16bppGrey, "Grey16"},
+			{pixelFormat_t::format8bppGreyA, "GreyA8"}, {pixelFormat_t::format16bppGreyA, "GreyA16"},
+			{pixelFormat_t::format24bppRGB, "RGB8"}, {pixelFormat_t::format48bppRGB, "RGB16"},
+			{pixelFormat_t::format32bppRGBA, "RGBA8"}, {pixelFormat_t::format64bppRGBA, "RGBA16"}
+		};
+		const std::pair<simdLevel_t, const char *> levels[] =
+			{{simdLevel_t::scalar, "scalar"}, {simdLevel_t::sse2, "SSE2"}, {simdLevel_t::avx2, "AVX2"}};
+		for (const auto &format : formats)
+		{
+			printf("Composite %-8s per-pixel %7.1f MP/s", format.second, perPixelRate(format.first, rng));
+			for (const auto &level : levels)
+			{
+				const blendOver_t *const kernels = blendOver_t::select(level.first);
+				if (kernels && (*kernels)(format.first))
+					printf(", %s %7.1f MP/s", level.second, kernelRate((*kernels)(format.first), format.first, rng));
+			}
+			printf(", source copy %7.1f MP/s\n", copyRate(format.first, rng));
+		}
+	}
+
+	void registerTests() final override
+	{
+		CXX_TEST(testScalar)
+		CXX_TEST(testSSE2)
+		CXX_TEST(testAVX2)
+		CXX_TEST(testThroughput)
+	}
+};
+
+const std::array<std::pair<pixelFormat_t, size_t>, 5> compositeTests::alphaFormats
+{{
+	{pixelFormat_t::format32bppRGBA, 4}, {pixelFormat_t::format64bppRGBA, 8},
+	{pixelFormat_t::format8bppGreyA, 2}, {pixelFormat_t::format16bppGreyA, 4},
+	{pixelFormat_t::format32bppRGBAPremultiplied, 4}
+}};
+
+class convertTests final : public testsuit
+{
+private:
+	constexpr static uint32_t benchPixels = 512 * 512;
+	static const std::array<pixelFormat_t, 8> pngFormats;
+	static const std::array<targetFormat_t, 7> targets;
+
+	static std::vector<uint8_t> randomPixels(std::minstd_rand &rng, const size_t length)
+	{
+		std::vector<uint8_t> data(length);
+		for (auto &value : data)
+			value = uint8_t(rng());
+		return data;
+	}
+
+	void checkKernels(const simdLevel_t level)
+	{
+		if (level > supportedSIMD())
+			skip("CPU does not support this SIMD level");
+		std::minstd_rand rng{0x434F4E56};
+		for (const auto format : pngFormats)
+		{
+			for (const auto target : targets)
+			{
+				for (const bool withTrans : {false, true})
+				{
+					const size_t inputBytes = pixelBytes(format);
+					const bool wide = inputBytes == 2 * pixelBytes(convert_t::outputFormat(format, targetFormat_t::strip16));
+					const uint16_t transMask = wide ? 0xFFFF : 0xFF;
+					const uint16_t trans[3]{uint16_t(rng() & transMask), uint16_t(rng() & transMask),
+						uint16_t(rng() & transMask)};
+					const convert_t reference{format, target, withTrans ? trans : nullptr, simdLevel_t::scalar};
+					const convert_t convert{format, target, withTrans ? trans : nullptr, level};
+					assertTrue(convert.output() == reference.output());
+					const size_t outputBytes = pixelBytes(convert.output());
+					for (const size_t pixels : {1, 2, 3, 4, 5, 7, 8, 9, 15, 16, 17, 31, 32, 33, 100, 1023})
+					{
+						auto source = randomPixels(rng, pixels * inputBytes);
+						// Plant some pixels matching the tRNS colour, as it's otherwise unlikely to turn up.
+						for (size_t i = 0; withTrans && i < pixels; i += 3)
+						{
+							for (size_t j = 0; j < inputBytes; j += wide ? 2 : 1)
+							{
+								const uint16_t value = trans[(j / (wide ? 2 : 1)) % 3];
+								if (wide)
+									source[(i * inputBytes) + j] = uint8_t(value >> 8U);
+								source[(i * inputBytes) + j + (wide ? 1 : 0)] = uint8_t(value);
+							}
+						}
+						std::vector<uint8_t> scratch(convert.scratchLength(pixels) + 1);
+						std::vector<uint8_t> expected(pixels * outputBytes);
+						std::vector<uint8_t> actual(pixels * outputBytes);
+						reference(expected.data(), source.data(), pixels, scratch.data());
+						convert(actual.data(), source.data(), pixels, scratch.data());
+						assertTrue(expected == actual);
+					}
+				}
+			}
+		}
+	}
+
+public:
+	void testScalar() { checkKernels(simdLevel_t::scalar); }
+	void testSSE2() { checkKernels(simdLevel_t::sse2); }
+	void testSSE41() { checkKernels(simdLevel_t::sse41); }
+	void testAVX2() { checkKernels(simdLevel_t::avx2); }
+
+	void testPremultiply()
+	{
+		const uint16_t trans[3]{0x10, 0x20, 0x30};
+		const convert_t convert{pixelFormat_t::format24bppRGB, targetFormat_t::bgra8Premultiplied, trans};
+		assertTrue(convert.output() == pixelFormat_t::format32bppBGRAPremultiplied);
+		assertTrue(convert.outputTrans() == nullptr);
+		const uint8_t source[6]{0x10, 0x20, 0x30, 0x10, 0x20, 0x31};
+		uint8_t result[8]{};
+		convert(result, source, 2, nullptr);
+		const uint8_t expected[8]{0, 0, 0, 0, 0x31, 0x20, 0x10, 0xFF};
+		assertEqual(memcmp(result, expected, sizeof(result)), 0);
+
+		const convert_t premultiply{pixelFormat_t::format32bppRGBA, targetFormat_t::rgba8Premultiplied, nullptr};
+		for (uint32_t alpha = 0; alpha < 256; ++alpha)
+		{
+			std::vector<uint8_t> pixels(256 * 4);
+			for (uint32_t colour = 0; colour < 256; ++colour)
+			{
+				pixels[colour * 4] = uint8_t(colour);
+				pixels[(colour * 4) + 3] = uint8_t(alpha);
+			}
+			std::vector<uint8_t> output(pixels.size());
+			premultiply(output.data(), pixels.data(), 256, nullptr);
+			for (uint32_t colour = 0; colour < 256; ++colour)
+			{
+				assertEqual(output[colour * 4], uint8_t(((colour * alpha) + 127) / 255));
+				assertEqual(output[(colour * 4) + 3], alpha);
+			}
+		}
+	}
+
+	void testUnpack()
+	{
+		std::minstd_rand rng{0x554E504B};
+		for (const uint8_t bits : {1, 2, 4})
+		{
+			const bitDepth_t depth{bits};
+			const uint32_t mask = (1U << bits) - 1U;
+			const uint16_t trans[3]{uint16_t(mask / 2U), 0, 0};
+			const convert_t grey{depth, targetFormat_t::png, trans};
+			const convert_t greyRGBA{depth, targetFormat_t::rgba8, trans};
+			assertTrue(grey.output() == pixelFormat_t::format8bppGrey);
+			assertTrue(greyRGBA.output() == pixelFormat_t::format32bppRGBA);
+			assertNotNull(grey.outputTrans());
+			assertEqual(grey.outputTrans()[0], (mask / 2U) * (0xFFU / mask));
+			for (const size_t pixels : {1, 2, 3, 7, 8, 9, 33, 1023})
+			{
+				assertEqual(grey.inputLength(pixels), ((pixels * bits) + 7) / 8);
+				const auto source = randomPixels(rng, grey.inputLength(pixels));
+				std::vector<uint8_t> scratch(greyRGBA.scratchLength(pixels) + 1);
+				std::vector<uint8_t> output(pixels);
+				std::vector<uint8_t> outputRGBA(pixels * 4);
+				grey(output.data(), source.data(), pixels, nullptr);
+				greyRGBA(outputRGBA.data(), source.data(), pixels, scratch.data());
+				for (size_t i = 0; i < pixels; ++i)
+				{
+					const uint32_t bit = i * bits;
+					const uint32_t value = (source[bit / 8] >> (8U - bits - (bit % 8))) & mask;
+					assertEqual(output[i], value * (0xFFU / mask));
+					assertEqual(outputRGBA[i * 4], output[i]);
+					assertEqual(outputRGBA[(i * 4) + 3], value == trans[0] ? 0 : 0xFFU);
+				}
+			}
+		}
+	}
+
+	void testPalette()
+	{
+		std::minstd_rand rng{0x504C5445};
+		std::vector<std::array<uint8_t, 4>> palette(200);
+		for (auto &entry : palette)
+			entry = {{uint8_t(rng()), uint8_t(rng()), uint8_t(rng()), uint8_t(rng())}};
+		for (const uint8_t bits : {1, 2, 4, 8})
+		{
+			const bitDepth_t depth{bits};
+			for (const bool paletteAlpha : {false, true})
+			{
+				for (const auto target : targets)
+				{
+					const convert_t convert{depth, palette, paletteAlpha, target};
+					// A palette conversion gives the same pixels as converting the palette's own entries would.
+					const convert_t entries{paletteAlpha ? pixelFormat_t::format32bppRGBA :
+						pixelFormat_t::format24bppRGB, target, nullptr};
+					assertTrue(convert.output() == entries.output());
+					assertTrue(convert.outputTrans() == nullptr);
+					const size_t outputBytes = pixelBytes(convert.output());
+					for (const size_t pixels : {1, 3, 8, 9, 100, 1023})
+					{
+						const auto source = randomPixels(rng, convert.inputLength(pixels));
+						std::vector<uint8_t> scratch(convert.scratchLength(pixels) + 1);
+						std::vector<uint8_t> output(pixels * outputBytes);
+						convert(output.data(), source.data(), pixels, scratch.data());
+						for (size_t i = 0; i < pixels; ++i)
+						{
+							const uint32_t bit = i * bits;
+							const uint8_t index = (source[bit / 8] >> (8U - bits - (bit % 8))) & ((1U << bits) - 1U);
+							const std::array<uint8_t, 4> entry = index < palette.size() ? palette[index] :
+								std::array<uint8_t, 4>{{0, 0, 0, 0xFFU}};
+							std::vector<uint8_t> expected(outputBytes);
+							std::vector<uint8_t> entryScratch(entries.scratchLength(1) + 1);
+							entries(expected.data(), entry.data(), 1, entryScratch.data());
+							assertEqual(memcmp(output.data() + (i * outputBytes), expected.data(), outputBytes), 0);
+						}
+					}
+				}
+			}
+		}
+	}
+
+	// Not pass/fail, but reports how fast converting a scanline to each target runs at each SIMD level,
+	// against the plain copy that decoding to targetFormat_t::png does.
+	void testThroughput()
+	{
+		std::minstd_rand rng{0x434F4E56};
+		const std::pair<pixelFormat_t, const char *> formats[] =
+		{
+			{pixelFormat_t::format8bppGrey, "Grey8"}, {pixelFormat_t::format24bppRGB, "RGB8"},
+			{pixelFormat_t::format32bppRGBA, "RGBA8"}, {pixelFormat_t::format64bppRGBA, "RGBA16"}
+		};
+		const std::pair<targetFormat_t, const char *> conversions[] =
+		{
+			{targetFormat_t::png, "copy"}, {targetFormat_t::rgba8, "RGBA8"}, {targetFormat_t::bgra8, "BGRA8"},
+			{targetFormat_t::bgra8Premultiplied, "BGRA8 premultiplied"}, {targetFormat_t::host16, "host16"},
+			{targetFormat_t::strip16, "strip16"}
+		};
+		const std::pair<simdLevel_t, const char *> levels[] =
+			{{simdLevel_t::scalar, "scalar"}, {simdLevel_t::sse2, "SSE2"}, {simdLevel_t::sse41, "SSE4.1"},
+			{simdLevel_t::avx2, "AVX2"}};
+		for (const auto &format : formats)
+		{
+			const auto source = randomPixels(rng, benchPixels * pixelBytes(format.first));
+			for (const auto &conversion : conversions)
+			{
+				if (conversion.first != targetFormat_t::png &&
+					convert_t{format.first, conversion.first, nullptr, simdLevel_t::scalar}.identity())
+					continue;
+				printf("Convert %-6s to %-19s", format.second, conversion.second);
+				for (const auto &level : levels)
+				{
+					if (level.first > supportedSIMD())
+						continue;
+					const convert_t convert{format.first, conversion.first, nullptr, level.first};
+					std::vector<uint8_t> output(benchPixels * pixelBytes(convert.output()));
+					std::vector<uint8_t> scratch(convert.scratchLength(benchPixels) + 1);
+					constexpr size_t rounds = 8;
+					const auto start = std::chrono::steady_clock::now();
+					for (size_t i = 0; i < rounds; ++i)
+						convert(output.data(), source.data(), benchPixels, scratch.data());
+					const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+					printf(" %s %7.1f MP/s", level.second, double(benchPixels * rounds) / time.count() / 1e6);
+				}
+				printf("\n");
+			}
+		}
+	}
+
+	// Not pass/fail, but reports how fast palette and sub-byte greyscale scanlines convert,
+	// against the 8-bit RGB path producing the same output format.
+	void testPaletteThroughput()
+	{
+		std::minstd_rand rng{0x504C5445};
+		std::vector<std::array<uint8_t, 4>> palette(256);
+		for (auto &entry : palette)
+			entry = {{uint8_t(rng()), uint8_t(rng()), uint8_t(rng()), uint8_t(rng())}};
+		for (const auto target : {targetFormat_t::png, targetFormat_t::rgba8})
+		{
+			const std::pair<convert_t, const char *> conversions[] =
+			{
+				{{pixelFormat_t::format24bppRGB, target, nullptr}, "RGB8"},
+				{{bitDepth_t{8}, palette, false, target}, "palette 8-bit"},
+				{{bitDepth_t{8}, palette, true, target}, "palette 8-bit + tRNS"},
+				{{bitDepth_t{4}, palette, true, target}, "palette 4-bit + tRNS"},
+				{{bitDepth_t{1}, palette, true, target}, "palette 1-bit + tRNS"},
+				{{bitDepth_t{4}, target, nullptr}, "grey 4-bit"},
+				{{bitDepth_t{1}, target, nullptr}, "grey 1-bit"}
+			};
+			for (const auto &conversion : conversions)
+			{
+				const convert_t &convert = conversion.first;
+				const auto source = randomPixels(rng, convert.inputLength(benchPixels));
+				std::vector<uint8_t> output(benchPixels * pixelBytes(convert.output()));
+				std::vector<uint8_t> scratch(convert.scratchLength(benchPixels) + 1);
+				constexpr size_t rounds = 8;
+				const auto start = std::chrono::steady_clock::now();
+				for (size_t i = 0; i < rounds; ++i)
+					convert(output.data(), source.data(), benchPixels, scratch.data());
+				const std::chrono::duration<double> time = std::chrono::steady_clock::now() - start;
+				printf("Convert %-20s to %-5s %7.1f MP/s\n", conversion.second,
+					target == targetFormat_t::png ? "png" : "RGBA8", double(benchPixels * rounds) / time.count() / 1e6);
+			}
+		}
+	}
+
+	void registerTests() final override
+	{
+		CXX_TEST(testScalar)
+		CXX_TEST(testSSE2)
+		CXX_TEST(testSSE41)
+		CXX_TEST(testAVX2)
+		CXX_TEST(testPremultiply)
+		CXX_TEST(testThroughput)
+		CXX_TEST(testUnpack)
+		CXX_TEST(testPalette)
+		CXX_TEST(testPaletteThroughput)
+	}
+};
+
+const std::array<pixelFormat_t, 8> convertTests::pngFormats
+{{
+	pixelFormat_t::format8bppGrey, pixelFormat_t::format16bppGrey, pixelFormat_t::format8bppGreyA,
+	pixelFormat_t::format16bppGreyA, pixelFormat_t::format24bppRGB, pixelFormat_t::format32bppRGBA,
+	pixelFormat_t::format48bppRGB, pixelFormat_t::format64bppRGBA
+}};
+
+const std::array<targetFormat_t, 7> convertTests::targets
+{{
+	targetFormat_t::png, targetFormat_t::rgba8, targetFormat_t::bgra8, targetFormat_t::rgba8Premultiplied,
+	targetFormat_t::bgra8Premultiplied, targetFormat_t::host16, targetFormat_t::strip16
+}};
+
 CRUNCH_API void registerCXXTests() noexcept;
 void registerCXXTests() noexcept
 {
-	registerTestClasses<apngTests, crc32Tests>();
+	registerTestClasses<apngTests, crc32Tests, unfilterTests, compositeTests, convertTests>();
 }
@@ -1,26 +1,273 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
 #include <system_error>
 #include "apng.hxx"
 
-int main(int argc, char **argv) noexcept try
+// Decodes a batch of APNGs on every hardware thread, for validating a corpus of assets and for capacity planning.
+// Inputs are files, directories, which are searched recursively for .png and .apng files, and manifests given as
+// @file listing one path per line. Every file that fails to decode gets a line of JSON saying why, as does every
+// file with --verbose, and a final line of JSON sums up the throughput and the spread of per-file latencies.
+// Files are handed out to one worker per hardware thread through a shared atomic counter rather than a work-stealing
+// pool; as every file is independent, taking the next one whenever a worker is free balances the load just as well.
+
+struct readOptions_t final
+{
+	uint32_t threads{0};
+	bool verbose{false};
+	targetFormat_t target{targetFormat_t::png};
+	std::vector<std::string> files{};
+};
+
+struct result_t final
 {
-	if (argc != 2)
-		return 1;
+	bool valid{false};
+	uint64_t bytes{0};
+	uint32_t width{0};
+	uint32_t height{0};
+	uint32_t frames{0};
+	double seconds{0};
+	std::string error{};
+};
 
-	fileStream_t pngFile(argv[1], O_RDONLY | O_NOCTTY);
-	apng_t image(pngFile);
-	printf("Sucessfully read %s (%ux%u)\n", argv[1], image.width(), image.height());
+static bool hasExtension(const std::string &name, const char *const extension)
+{
+	const size_t length = strlen(extension);
+	return name.size() > length && strcasecmp(name.c_str() + name.size() - length, extension) == 0;
+}
 
-	return 0;
+static void addDirectory(const std::string &path, std::vector<std::string> &files)
+{
+	DIR *const dir = opendir(path.c_str());
+	if (!dir)
+		throw std::system_error{errno, std::system_category(), path};
+	std::vector<std::string> entries;
+	while (const dirent *const entry = readdir(dir))
+	{
+		if (strcmp(entry->d_name, ".") && strcmp(entry->d_name, ".."))
+			entries.emplace_back(path + '/' + entry->d_name);
+	}
+	closedir(dir);
+	// Directory order is arbitrary, so sort to keep runs over the same corpus comparable.
+	std::sort(entries.begin(), entries.end());
+	for (const auto &entry : entries)
+	{
+		struct stat info;
+		if (stat(entry.c_str(), &info))
+			continue;
+		if (S_ISDIR(info.st_mode))
+			addDirectory(entry, files);
+		else if (hasExtension(entry, ".png") || hasExtension(entry, ".apng"))
+			files.emplace_back(entry);
+	}
 }
-catch (std::system_error &error)
+
+static void addManifest(const std::string &path, std::vector<std::string> &files)
 {
-	puts(error.what());
-	return 2;
+	FILE *const manifest = fopen(path.c_str(), "r");
+	if (!manifest)
+		throw std::system_error{errno, std::system_category(), path};
+	std::string line;
+	for (int c = fgetc(manifest); c != EOF || !line.empty(); c = fgetc(manifest))
+	{
+		if (c == '\n' || c == EOF)
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			if (!line.empty() && line[0] != '#')
+				files.emplace_back(line);
+			line.clear();
+			if (c == EOF)
+				break;
+		}
+		else
+			line += char(c);
+	}
+	fclose(manifest);
+}
+
+static void addInput(const std::string &input, std::vector<std::string> &files)
+{
+	struct stat info;
+	if (input[0] == '@')
+		addManifest(input.substr(1), files);
+	else if (!stat(input.c_str(), &info) && S_ISDIR(info.st_mode))
+		addDirectory(input, files);
+	else
+		files.emplace_back(input);
+}
+
+static bool parseOptions(const int argc, char **const argv, readOptions_t &options)
+{
+	for (int i = 1; i < argc; ++i)
+	{
+		const std::string option{argv[i]};
+		if (option == "--verbose")
+			options.verbose = true;
+		else if (option == "--threads" || option == "--target")
+		{
+			if (i + 1 == argc)
+				return false;
+			const std::string value{argv[++i]};
+			if (option == "--threads")
+				options.threads = uint32_t(strtoul(value.c_str(), nullptr, 10));
+			else if (value == "png")
+				options.target = targetFormat_t::png;
+			else if (value == "rgba8")
+				options.target = targetFormat_t::rgba8;
+			else if (value == "bgra8")
+				options.target = targetFormat_t::bgra8;
+			else
+				return false;
+		}
+		else if (option.size() > 2 && option.compare(0, 2, "--") == 0)
+			return false;
+		else
+			addInput(option, options.files);
+	}
+	return !options.files.empty();
+}
+
+// Writes a string out as a JSON string, escaping what needs escaping.
+static void printJSON(const std::string &value)
+{
+	putchar('"');
+	for (const char c : value)
+	{
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (uint8_t(c) < 0x20)
+			printf("\\u%04x", uint8_t(c));
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void printResult(const std::string &file, const result_t &result)
+{
+	printf("{\"file\": ");
+	printJSON(file);
+	printf(", \"valid\": %s, \"bytes\": %llu, \"width\": %u, \"height\": %u, \"frames\": %u, \"ms\": %.3f",
+		result.valid ? "true" : "false", static_cast<unsigned long long>(result.bytes), result.width, result.height,
+		result.frames, result.seconds * 1e3);
+	if (!result.valid)
+	{
+		printf(", \"error\": ");
+		printJSON(result.error);
+	}
+	printf("}\n");
+}
+
+static result_t decodeFile(const std::string &file, const readOptions_t &options)
+{
+	result_t result;
+	const auto start = std::chrono::steady_clock::now();
+	try
+	{
+		mmapStream_t pngFile(file.c_str());
+		decodeOptions_t decodeOptions;
+		decodeOptions.target = options.target;
+		apng_t image(pngFile, decodeOptions);
+		struct stat info;
+		if (!stat(file.c_str(), &info))
+			result.bytes = uint64_t(info.st_size);
+		result.width = image.width();
+		result.height = image.height();
+		result.frames = uint32_t(image.canvases().size());
+		result.valid = true;
+	}
+	catch (std::system_error &error)
+		{ result.error = error.what(); }
+	catch (invalidPNG_t &error)
+		{ result.error = error.what(); }
+	catch (std::bad_alloc &)
+		{ result.error = "Out of memory"; }
+	// Anything else, such as a zlibError_t, still only fails this one file.
+	catch (std::exception &error)
+		{ result.error = error.what(); }
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
+
+// The nearest-rank percentile of the sorted latencies, in milliseconds.
+static double percentile(const std::vector<double> &latencies, const double fraction)
+{
+	if (latencies.empty())
+		return 0;
+	const size_t rank = size_t(fraction * double(latencies.size()) + 0.999999);
+	return latencies[std::min(std::max<size_t>(rank, 1), latencies.size()) - 1] * 1e3;
+}
+
+int main(int argc, char **argv) try
+{
+	readOptions_t options;
+	if (!parseOptions(argc, argv, options))
+	{
+		fprintf(stderr, "Usage: %s [--threads count] [--target png|rgba8|bgra8] [--verbose] file|directory|@manifest...\n",
+			argv[0]);
+		return 2;
+	}
+
+	const uint32_t hardwareThreads = std::max(std::thread::hardware_concurrency(), 1U);
+	const size_t threads = std::min<size_t>(options.threads ? options.threads : hardwareThreads, options.files.size());
+	std::vector<result_t> results(options.files.size());
+	// Each worker takes the next file as soon as it's free, so a few large files don't hold the rest up.
+	std::atomic<size_t> next{0};
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> workers;
+	for (size_t i = 0; i < threads; ++i)
+		workers.emplace_back([&]()
+		{
+			for (size_t file = next++; file < options.files.size(); file = next++)
+				results[file] = decodeFile(options.files[file], options);
+		});
+	for (auto &worker : workers)
+		worker.join();
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	uint64_t bytes = 0, frames = 0, pixels = 0;
+	size_t failures = 0;
+	std::vector<double> latencies;
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const result_t &result = results[i];
+		if (options.verbose || !result.valid)
+			printResult(options.files[i], result);
+		if (!result.valid)
+		{
+			++failures;
+			continue;
+		}
+		bytes += result.bytes;
+		frames += result.frames;
+		pixels += uint64_t{result.width} * result.height * result.frames;
+		latencies.push_back(result.seconds);
+	}
+	std::sort(latencies.begin(), latencies.end());
+	printf("{\"files\": %zu, \"failures\": %zu, \"threads\": %zu, \"seconds\": %.6f, \"bytes\": %llu, "
+		"\"frames\": %llu, \"MBps\": %.2f, \"framesPerSecond\": %.2f, \"megapixelsPerSecond\": %.2f, "
+		"\"latencyMs\": {\"p50\": %.3f, \"p90\": %.3f, \"p99\": %.3f, \"max\": %.3f}}\n", results.size(), failures,
+		threads, seconds, static_cast<unsigned long long>(bytes), static_cast<unsigned long long>(frames),
+		double(bytes) / seconds / 1e6, double(frames) / seconds, double(pixels) / seconds / 1e6,
+		percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+		latencies.empty() ? 0.0 : latencies.back() * 1e3);
+	return failures ? 1 : 0;
 }
-catch (invalidPNG_t &error)
+catch (std::exception &error)
 {
-	puts(error.what());
-	return 1;
+	// Even a failure to read the inputs is reported as JSON, so whatever reads the output can tell what went wrong.
+	printf("{\"error\": ");
+	printJSON(error.what());
+	printf("}\n");
+	return 2;
 }
@@ -0,0 +1,52 @@
+#include "threadPool.hxx"
+
+threadPool_t::threadPool_t(const uint32_t threads) : workers{}, tasks{}, tasksLock{}, tasksAvailable{}, stopping{false}
+{
+	const uint32_t count = threads ? threads : hardwareThreads();
+	workers.reserve(count);
+	for (uint32_t i = 0; i < count; ++i)
+		workers.emplace_back([this]() { worker(); });
+}
+
+threadPool_t::~threadPool_t() noexcept
+{
+	{
+		std::lock_guard<std::mutex> lock{tasksLock};
+		stopping = true;
+	}
+	tasksAvailable.notify_all();
+	for (auto &thread : workers)
+		thread.join();
+}
+
+void threadPool_t::submit(task_t task)
+{
+	{
+		std::lock_guard<std::mutex> lock{tasksLock};
+		tasks.emplace_back(std::move(task));
+	}
+	tasksAvailable.notify_one();
+}
+
+void threadPool_t::worker() noexcept
+{
+	while (true)
+	{
+		task_t task;
+		{
+			std::unique_lock<std::mutex> lock{tasksLock};
+			tasksAvailable.wait(lock, [this]() { return stopping || !tasks.empty(); });
+			if (tasks.empty())
+				return;
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		task();
+	}
+}
+
+uint32_t threadPool_t::hardwareThreads() noexcept
+{
+	const uint32_t threads = std::thread::hardware_concurrency();
+	return threads ? threads : 1;
+}
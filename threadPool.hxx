@@ -0,0 +1,44 @@
+#ifndef THREAD_POOL_HXX
+#define THREAD_POOL_HXX
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads that run submitted tasks in the order they were submitted.
+// Tasks must not throw; anything a task needs to report has to be captured by the task itself.
+struct threadPool_t final
+{
+public:
+	using task_t = std::function<void ()>;
+
+private:
+	std::vector<std::thread> workers;
+	std::deque<task_t> tasks;
+	std::mutex tasksLock;
+	std::condition_variable tasksAvailable;
+	bool stopping;
+
+	void worker() noexcept;
+
+public:
+	// A thread count of 0 means one thread per hardware thread.
+	threadPool_t(const uint32_t threads);
+	threadPool_t(const threadPool_t &) = delete;
+	threadPool_t(threadPool_t &&) = delete;
+	// Any tasks still queued are run before the workers are joined.
+	~threadPool_t() noexcept;
+	threadPool_t &operator =(const threadPool_t &) = delete;
+	threadPool_t &operator =(threadPool_t &&) = delete;
+
+	size_t size() const noexcept { return workers.size(); }
+	void submit(task_t task);
+
+	static uint32_t hardwareThreads() noexcept;
+};
+
+#endif /*THREAD_POOL_HXX*/
@@ -0,0 +1,419 @@
+#include <cstring>
+#include <array>
+#include "internals.hxx"
+#include "unfilter.hxx"
+
+simdLevel_t detectSIMD() noexcept
+{
+#if defined(APNG_X86) && defined(_MSC_VER)
+	std::array<int, 4> regs{};
+	__cpuid(regs.data(), 0);
+	const int maxLeaf = regs[0];
+	__cpuid(regs.data(), 1);
+	const bool sse2 = regs[3] & (1 << 26);
+	const bool sse41 = (regs[2] & (1 << 9)) && (regs[2] & (1 << 19));
+	// AVX2 also needs the OS to save the upper halves of the YMM registers for us.
+	const bool osAVX = (regs[2] & (1 << 27)) && (regs[2] & (1 << 28)) && (_xgetbv(0) & 6U) == 6U;
+	bool avx2 = false;
+	if (maxLeaf >= 7 && osAVX)
+	{
+		__cpuidex(regs.data(), 7, 0);
+		avx2 = regs[1] & (1 << 5);
+	}
+	if (avx2 && sse41)
+		return simdLevel_t::avx2;
+	else if (sse41 && sse2)
+		return simdLevel_t::sse41;
+	else if (sse2)
+		return simdLevel_t::sse2;
+#elif defined(APNG_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("sse4.1"))
+		return simdLevel_t::avx2;
+	else if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1"))
+		return simdLevel_t::sse41;
+	else if (__builtin_cpu_supports("sse2"))
+		return simdLevel_t::sse2;
+#endif
+	return simdLevel_t::scalar;
+}
+
+#ifdef APNG_X86
+// Sub, Average and Paeth have a serial dependency on the pixel to the left, so apart from the
+// power-of-two Sub cases which can be done as a prefix sum, these work one whole pixel at a time.
+// Pixels are moved between memory and the vector registers via a general purpose register, assembling the odd-sized
+// 3 and 6 byte pixels from naturally sized pieces so they don't stall on store forwarding through a temporary.
+template<size_t bpp> inline uint64_t loadBytes(const uint8_t *const data) noexcept
+{
+	uint32_t low = 0;
+	uint16_t high = 0;
+	if (bpp == 8)
+	{
+		uint64_t value = 0;
+		memcpy(&value, data, sizeof(uint64_t));
+		return value;
+	}
+	else if (bpp == 6)
+	{
+		memcpy(&low, data, sizeof(uint32_t));
+		memcpy(&high, data + 4, sizeof(uint16_t));
+		return low | (uint64_t{high} << 32U);
+	}
+	else if (bpp == 4)
+	{
+		memcpy(&low, data, sizeof(uint32_t));
+		return low;
+	}
+	else if (bpp == 3)
+	{
+		memcpy(&high, data, sizeof(uint16_t));
+		return high | (uint32_t{data[2]} << 16U);
+	}
+	else if (bpp == 2)
+	{
+		memcpy(&high, data, sizeof(uint16_t));
+		return high;
+	}
+	return data[0];
+}
+
+template<size_t bpp> inline void storeBytes(uint8_t *const data, const uint64_t value) noexcept
+{
+	const auto low = uint32_t(value);
+	const auto high = uint16_t(value);
+	if (bpp == 8)
+		memcpy(data, &value, sizeof(uint64_t));
+	else if (bpp == 6)
+	{
+		const auto upper = uint16_t(value >> 32U);
+		memcpy(data, &low, sizeof(uint32_t));
+		memcpy(data + 4, &upper, sizeof(uint16_t));
+	}
+	else if (bpp == 4)
+		memcpy(data, &low, sizeof(uint32_t));
+	else if (bpp == 3)
+	{
+		memcpy(data, &high, sizeof(uint16_t));
+		data[2] = uint8_t(value >> 16U);
+	}
+	else if (bpp == 2)
+		memcpy(data, &high, sizeof(uint16_t));
+	else
+		data[0] = uint8_t(value);
+}
+
+#if defined(__x86_64__) || defined(_M_X64)
+template<size_t bpp> TARGET("sse2") inline __m128i loadPixel(const uint8_t *const data) noexcept
+	{ return _mm_cvtsi64_si128(int64_t(loadBytes<bpp>(data))); }
+template<size_t bpp> TARGET("sse2") inline void storePixel(uint8_t *const data, const __m128i pixel) noexcept
+	{ storeBytes<bpp>(data, uint64_t(_mm_cvtsi128_si64(pixel))); }
+#else
+template<size_t bpp> TARGET("sse2") inline __m128i loadPixel(const uint8_t *const data) noexcept
+{
+	const uint64_t value = loadBytes<bpp>(data);
+	return _mm_loadl_epi64(reinterpret_cast<const __m128i *>(&value));
+}
+
+template<size_t bpp> TARGET("sse2") inline void storePixel(uint8_t *const data, const __m128i pixel) noexcept
+{
+	uint64_t value = 0;
+	_mm_storel_epi64(reinterpret_cast<__m128i *>(&value), pixel);
+	storeBytes<bpp>(data, value);
+}
+#endif
+
+inline void unfilterSubTail(uint8_t *const row, const size_t offset, const size_t length, const size_t bpp) noexcept
+{
+	for (size_t i = offset < bpp ? bpp : offset; i < length; ++i)
+		row[i] += row[i - bpp];
+}
+
+inline void unfilterUpTail(uint8_t *const row, const uint8_t *const prevRow, const size_t offset,
+	const size_t length) noexcept
+{
+	for (size_t i = offset; i < length; ++i)
+		row[i] += prevRow[i];
+}
+
+TARGET("sse2") void unfilterUpSSE2(uint8_t *const row, const uint8_t *const prevRow, const size_t length, const size_t)
+{
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16)
+	{
+		const __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+		const __m128i up = _mm_loadu_si128(reinterpret_cast<const __m128i *>(prevRow + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), _mm_add_epi8(value, up));
+	}
+	unfilterUpTail(row, prevRow, i, length);
+}
+
+TARGET("avx2") void unfilterUpAVX2(uint8_t *const row, const uint8_t *const prevRow, const size_t length, const size_t)
+{
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32)
+	{
+		const __m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+		const __m256i up = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(prevRow + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(row + i), _mm256_add_epi8(value, up));
+	}
+	unfilterUpTail(row, prevRow, i, length);
+}
+
+// Computes the running sum of every bpp'th byte within the vector.
+template<size_t bpp> TARGET("sse2") inline __m128i prefixSum(__m128i value) noexcept
+{
+	value = _mm_add_epi8(value, _mm_slli_si128(value, bpp));
+	if (bpp < 8)
+		value = _mm_add_epi8(value, _mm_slli_si128(value, bpp * 2));
+	if (bpp < 4)
+		value = _mm_add_epi8(value, _mm_slli_si128(value, bpp * 4));
+	if (bpp < 2)
+		value = _mm_add_epi8(value, _mm_slli_si128(value, bpp * 8));
+	return value;
+}
+
+// Replicates the last pixel in the vector across the whole vector.
+template<size_t bpp> TARGET("sse2") inline __m128i broadcastLast(const __m128i value) noexcept
+{
+	if (bpp == 8)
+		return _mm_unpackhi_epi64(value, value);
+	else if (bpp == 4)
+		return _mm_shuffle_epi32(value, 0xFF);
+	else if (bpp == 2)
+		return _mm_shuffle_epi32(_mm_shufflehi_epi16(value, 0xFF), 0xFF);
+	return _mm_shuffle_epi32(_mm_shufflehi_epi16(_mm_unpackhi_epi8(value, value), 0xFF), 0xFF);
+}
+
+template<size_t bpp> TARGET("sse2") void unfilterSubSSE2(uint8_t *const row, const uint8_t *const,
+	const size_t length, const size_t)
+{
+	__m128i carry = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= length; i += 16)
+	{
+		__m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i *>(row + i));
+		value = _mm_add_epi8(prefixSum<bpp>(value), carry);
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(row + i), value);
+		carry = broadcastLast<bpp>(value);
+	}
+	unfilterSubTail(row, i, length, bpp);
+}
+
+template<size_t bpp> TARGET("sse2") void unfilterSubPixelSSE2(uint8_t *const row, const uint8_t *const,
+	const size_t length, const size_t)
+{
+	__m128i left = _mm_setzero_si128();
+	for (size_t i = 0; i < length; i += bpp)
+	{
+		left = _mm_add_epi8(left, loadPixel<bpp>(row + i));
+		storePixel<bpp>(row + i, left);
+	}
+}
+
+template<size_t bpp> TARGET("avx2") inline __m256i broadcastLastAVX2(const __m256i value) noexcept
+{
+	if (bpp == 8)
+		return _mm256_shuffle_epi32(value, 0xEE);
+	else if (bpp == 4)
+		return _mm256_shuffle_epi32(value, 0xFF);
+	else if (bpp == 2)
+		return _mm256_shuffle_epi8(value, _mm256_set1_epi16(0x0F0E));
+	return _mm256_shuffle_epi8(value, _mm256_set1_epi8(15));
+}
+
+template<size_t bpp> TARGET("avx2") void unfilterSubAVX2(uint8_t *const row, const uint8_t *const,
+	const size_t length, const size_t)
+{
+	__m256i carry = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= length; i += 32)
+	{
+		__m256i value = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(row + i));
+		// Prefix sum each 128-bit lane, then carry the low lane's last pixel over into the high lane.
+		value = _mm256_add_epi8(value, _mm256_slli_si256(value, bpp));
+		if (bpp < 8)
+			value = _mm256_add_epi8(value, _mm256_slli_si256(value, bpp * 2));
+		if (bpp < 4)
+			value = _mm256_add_epi8(value, _mm256_slli_si256(value, bpp * 4));
+		if (bpp < 2)
+			value = _mm256_add_epi8(value, _mm256_slli_si256(value, bpp * 8));
+		const __m256i lowLast = broadcastLastAVX2<bpp>(value);
+		value = _mm256_add_epi8(value, _mm256_permute2x128_si256(lowLast, lowLast, 0x08));
+		value = _mm256_add_epi8(value, carry);
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(row + i), value);
+		const __m256i last = broadcastLastAVX2<bpp>(value);
+		carry = _mm256_permute2x128_si256(last, last, 0x11);
+	}
+	unfilterSubTail(row, i, length, bpp);
+}
+
+template<size_t bpp> TARGET("sse2") void unfilterAverageSSE2(uint8_t *const row, const uint8_t *const prevRow,
+	const size_t length, const size_t)
+{
+	const __m128i ones = _mm_set1_epi8(1);
+	__m128i left = _mm_setzero_si128();
+	for (size_t i = 0; i < length; i += bpp)
+	{
+		const __m128i up = loadPixel<bpp>(prevRow + i);
+		// _mm_avg_epu8() rounds up, so take back the carry when the sum was odd.
+		__m128i average = _mm_avg_epu8(left, up);
+		average = _mm_sub_epi8(average, _mm_and_si128(_mm_xor_si128(left, up), ones));
+		left = _mm_add_epi8(loadPixel<bpp>(row + i), average);
+		storePixel<bpp>(row + i, left);
+	}
+}
+
+TARGET("sse2") inline __m128i abs16SSE2(const __m128i value) noexcept
+	{ return _mm_max_epi16(value, _mm_sub_epi16(_mm_setzero_si128(), value)); }
+TARGET("sse2") inline __m128i ifThenElseSSE2(const __m128i mask, const __m128i a, const __m128i b) noexcept
+	{ return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b)); }
+
+// The Paeth kernels widen each pixel to 16-bit lanes so the predictor distances can't overflow.
+// a is the pixel to the left, b the pixel above and c the pixel above and to the left.
+template<size_t bpp> TARGET("sse2") void unfilterPaethSSE2(uint8_t *const row, const uint8_t *const prevRow,
+	const size_t length, const size_t)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero;
+	__m128i c = zero;
+	for (size_t i = 0; i < length; i += bpp)
+	{
+		const __m128i b = _mm_unpacklo_epi8(loadPixel<bpp>(prevRow + i), zero);
+		__m128i distA = _mm_sub_epi16(b, c);
+		__m128i distB = _mm_sub_epi16(a, c);
+		__m128i distC = _mm_add_epi16(distA, distB);
+		distA = abs16SSE2(distA);
+		distB = abs16SSE2(distB);
+		distC = abs16SSE2(distC);
+		const __m128i smallest = _mm_min_epi16(distC, _mm_min_epi16(distA, distB));
+		__m128i nearest = ifThenElseSSE2(_mm_cmpeq_epi16(smallest, distC), c, b);
+		nearest = ifThenElseSSE2(_mm_cmpeq_epi16(smallest, distB), b, nearest);
+		nearest = ifThenElseSSE2(_mm_cmpeq_epi16(smallest, distA), a, nearest);
+		const __m128i value = _mm_add_epi8(loadPixel<bpp>(row + i), _mm_packus_epi16(nearest, nearest));
+		storePixel<bpp>(row + i, value);
+		a = _mm_unpacklo_epi8(value, zero);
+		c = b;
+	}
+}
+
+template<size_t bpp> TARGET("ssse3,sse4.1") void unfilterPaethSSE41(uint8_t *const row, const uint8_t *const prevRow,
+	const size_t length, const size_t)
+{
+	const __m128i zero = _mm_setzero_si128();
+	__m128i a = zero;
+	__m128i c = zero;
+	for (size_t i = 0; i < length; i += bpp)
+	{
+		const __m128i b = _mm_cvtepu8_epi16(loadPixel<bpp>(prevRow + i));
+		__m128i distA = _mm_sub_epi16(b, c);
+		__m128i distB = _mm_sub_epi16(a, c);
+		__m128i distC = _mm_add_epi16(distA, distB);
+		distA = _mm_abs_epi16(distA);
+		distB = _mm_abs_epi16(distB);
+		distC = _mm_abs_epi16(distC);
+		const __m128i smallest = _mm_min_epi16(distC, _mm_min_epi16(distA, distB));
+		__m128i nearest = _mm_blendv_epi8(b, c, _mm_cmpeq_epi16(smallest, distC));
+		nearest = _mm_blendv_epi8(nearest, b, _mm_cmpeq_epi16(smallest, distB));
+		nearest = _mm_blendv_epi8(nearest, a, _mm_cmpeq_epi16(smallest, distA));
+		const __m128i value = _mm_add_epi8(loadPixel<bpp>(row + i), _mm_packus_epi16(nearest, nearest));
+		storePixel<bpp>(row + i, value);
+		a = _mm_cvtepu8_epi16(value);
+		c = b;
+	}
+}
+#endif
+
+static size_t bppIndex(const size_t bpp) noexcept
+{
+	switch (bpp)
+	{
+		case 2:
+			return 1;
+		case 3:
+			return 2;
+		case 4:
+			return 3;
+		case 6:
+			return 4;
+		case 8:
+			return 5;
+		default:
+			return 0;
+	}
+}
+
+using unfilterSet_t = std::array<unfilter_t, 6>;
+
+static const unfilterSet_t scalarKernels
+{{
+	{1, unfilterSub, unfilterUp, unfilterAverage, unfilterPaeth},
+	{2, unfilterSub, unfilterUp, unfilterAverage, unfilterPaeth},
+	{3, unfilterSub, unfilterUp, unfilterAverage, unfilterPaeth},
+	{4, unfilterSub, unfilterUp, unfilterAverage, unfilterPaeth},
+	{6, unfilterSub, unfilterUp, unfilterAverage, unfilterPaeth},
+	{8, unfilterSub, unfilterUp, unfilterAverage, unfilterPaeth}
+}};
+
+#ifdef APNG_X86
+// With only one or two bytes per pixel there's nothing for Average and Paeth to gain from SIMD.
+static const unfilterSet_t sse2Kernels
+{{
+	{1, unfilterSubSSE2<1>, unfilterUpSSE2, unfilterAverage, unfilterPaeth},
+	{2, unfilterSubSSE2<2>, unfilterUpSSE2, unfilterAverage, unfilterPaeth},
+	{3, unfilterSubPixelSSE2<3>, unfilterUpSSE2, unfilterAverageSSE2<3>, unfilterPaethSSE2<3>},
+	{4, unfilterSubSSE2<4>, unfilterUpSSE2, unfilterAverageSSE2<4>, unfilterPaethSSE2<4>},
+	{6, unfilterSubPixelSSE2<6>, unfilterUpSSE2, unfilterAverageSSE2<6>, unfilterPaethSSE2<6>},
+	{8, unfilterSubSSE2<8>, unfilterUpSSE2, unfilterAverageSSE2<8>, unfilterPaethSSE2<8>}
+}};
+
+static const unfilterSet_t sse41Kernels
+{{
+	{1, unfilterSubSSE2<1>, unfilterUpSSE2, unfilterAverage, unfilterPaeth},
+	{2, unfilterSubSSE2<2>, unfilterUpSSE2, unfilterAverage, unfilterPaeth},
+	{3, unfilterSubPixelSSE2<3>, unfilterUpSSE2, unfilterAverageSSE2<3>, unfilterPaethSSE41<3>},
+	{4, unfilterSubSSE2<4>, unfilterUpSSE2, unfilterAverageSSE2<4>, unfilterPaethSSE41<4>},
+	{6, unfilterSubPixelSSE2<6>, unfilterUpSSE2, unfilterAverageSSE2<6>, unfilterPaethSSE41<6>},
+	{8, unfilterSubSSE2<8>, unfilterUpSSE2, unfilterAverageSSE2<8>, unfilterPaethSSE41<8>}
+}};
+
+// Average and Paeth stay on the SSE4.1 kernels as each step only ever works on one pixel.
+static const unfilterSet_t avx2Kernels
+{{
+	{1, unfilterSubAVX2<1>, unfilterUpAVX2, unfilterAverage, unfilterPaeth},
+	{2, unfilterSubAVX2<2>, unfilterUpAVX2, unfilterAverage, unfilterPaeth},
+	{3, unfilterSubPixelSSE2<3>, unfilterUpAVX2, unfilterAverageSSE2<3>, unfilterPaethSSE41<3>},
+	{4, unfilterSubAVX2<4>, unfilterUpAVX2, unfilterAverageSSE2<4>, unfilterPaethSSE41<4>},
+	{6, unfilterSubPixelSSE2<6>, unfilterUpAVX2, unfilterAverageSSE2<6>, unfilterPaethSSE41<6>},
+	{8, unfilterSubAVX2<8>, unfilterUpAVX2, unfilterAverageSSE2<8>, unfilterPaethSSE41<8>}
+}};
+#endif
+
+simdLevel_t supportedSIMD() noexcept
+{
+	static const simdLevel_t level = detectSIMD();
+	return level;
+}
+
+const unfilter_t &unfilter_t::select(const size_t bpp) noexcept
+	{ return *select(bpp, supportedSIMD()); }
+
+const unfilter_t *unfilter_t::select(const size_t bpp, const simdLevel_t level) noexcept
+{
+	if (level > supportedSIMD())
+		return nullptr;
+	const size_t index = bppIndex(bpp);
+	switch (level)
+	{
+#ifdef APNG_X86
+		case simdLevel_t::avx2:
+			return &avx2Kernels[index];
+		case simdLevel_t::sse41:
+			return &sse41Kernels[index];
+		case simdLevel_t::sse2:
+			return &sse2Kernels[index];
+#endif
+		case simdLevel_t::scalar:
+		default:
+			return &scalarKernels[index];
+	}
+}
@@ -0,0 +1,163 @@
+#ifndef UNFILTER_HXX
+#define UNFILTER_HXX
+
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+
+enum class filterTypes_t : uint8_t { none, sub, up, average, paeth };
+
+inline uint8_t filterPaeth(const uint8_t a, const uint8_t b, const uint8_t c) noexcept
+{
+	const int16_t pred = a + b - c;
+	const uint16_t absA = abs(pred - a);
+	const uint16_t absB = abs(pred - b);
+	const uint16_t absC = abs(pred - c);
+
+	if (absA <= absB && absA <= absC)
+		return a;
+	else if (absB <= absC)
+		return b;
+	return c;
+}
+
+// The unfilter functions operate on the raw bytes of a scanline, and so are independent of the pixel format
+// other than the number of bytes per pixel (bpp) which determines which byte is to the "left" of the current one.
+inline void unfilterSub(uint8_t *const row, const uint8_t *const, const size_t length, const size_t bpp) noexcept
+{
+	for (size_t i = bpp; i < length; ++i)
+		row[i] += row[i - bpp];
+}
+
+inline void unfilterUp(uint8_t *const row, const uint8_t *const prevRow, const size_t length, const size_t) noexcept
+{
+	for (size_t i = 0; i < length; ++i)
+		row[i] += prevRow[i];
+}
+
+inline void unfilterAverage(uint8_t *const row, const uint8_t *const prevRow, const size_t length, const size_t bpp) noexcept
+{
+	for (size_t i = 0; i < bpp; ++i)
+		row[i] += prevRow[i] >> 1U;
+	for (size_t i = bpp; i < length; ++i)
+		row[i] += uint8_t((row[i - bpp] + prevRow[i]) >> 1U);
+}
+
+inline void unfilterPaeth(uint8_t *const row, const uint8_t *const prevRow, const size_t length, const size_t bpp) noexcept
+{
+	// With no left or upper-left pixel, the Paeth predictor always picks the pixel above.
+	for (size_t i = 0; i < bpp; ++i)
+		row[i] += prevRow[i];
+	for (size_t i = bpp; i < length; ++i)
+		row[i] += filterPaeth(row[i - bpp], prevRow[i], prevRow[i - bpp]);
+}
+
+inline void unfilterRow(const filterTypes_t filter, uint8_t *const row, const uint8_t *const prevRow,
+	const size_t length, const size_t bpp) noexcept
+{
+	switch (filter)
+	{
+		case filterTypes_t::sub:
+			return unfilterSub(row, prevRow, length, bpp);
+		case filterTypes_t::up:
+			return unfilterUp(row, prevRow, length, bpp);
+		case filterTypes_t::average:
+			return unfilterAverage(row, prevRow, length, bpp);
+		case filterTypes_t::paeth:
+			return unfilterPaeth(row, prevRow, length, bpp);
+		// This treats unknown or invalid filter types as filterTypes_t::none.
+		case filterTypes_t::none:
+		default:
+			return;
+	}
+}
+
+// The reverse of unfilterRow(), filtering row into filtered for writing.
+inline void filterRow(const filterTypes_t filter, uint8_t *const filtered, const uint8_t *const row,
+	const uint8_t *const prevRow, const size_t length, const size_t bpp) noexcept
+{
+	const size_t start = bpp < length ? bpp : length;
+	switch (filter)
+	{
+		case filterTypes_t::sub:
+			for (size_t i = 0; i < start; ++i)
+				filtered[i] = row[i];
+			for (size_t i = bpp; i < length; ++i)
+				filtered[i] = row[i] - row[i - bpp];
+			return;
+		case filterTypes_t::up:
+			for (size_t i = 0; i < length; ++i)
+				filtered[i] = row[i] - prevRow[i];
+			return;
+		case filterTypes_t::average:
+			for (size_t i = 0; i < start; ++i)
+				filtered[i] = row[i] - (prevRow[i] >> 1U);
+			for (size_t i = bpp; i < length; ++i)
+				filtered[i] = row[i] - uint8_t((row[i - bpp] + prevRow[i]) >> 1U);
+			return;
+		case filterTypes_t::paeth:
+			for (size_t i = 0; i < start; ++i)
+				filtered[i] = row[i] - prevRow[i];
+			for (size_t i = bpp; i < length; ++i)
+				filtered[i] = row[i] - filterPaeth(row[i - bpp], prevRow[i], prevRow[i - bpp]);
+			return;
+		case filterTypes_t::none:
+		default:
+			for (size_t i = 0; i < length; ++i)
+				filtered[i] = row[i];
+			return;
+	}
+}
+
+enum class simdLevel_t : uint8_t { scalar, sse2, sse41, avx2 };
+
+simdLevel_t detectSIMD() noexcept;
+// As detectSIMD(), but only probes the CPU the first time.
+simdLevel_t supportedSIMD() noexcept;
+
+// A set of unfilter kernels specialised for one bytes-per-pixel value and instruction set.
+// select() picks the fastest set the running CPU supports, the CPU only being probed the first time.
+struct unfilter_t final
+{
+public:
+	using unfilterFunc_t = void (*)(uint8_t *const, const uint8_t *const, const size_t, const size_t);
+
+private:
+	size_t _bpp;
+	unfilterFunc_t sub;
+	unfilterFunc_t up;
+	unfilterFunc_t average;
+	unfilterFunc_t paeth;
+
+public:
+	constexpr unfilter_t(const size_t bpp, const unfilterFunc_t subFunc, const unfilterFunc_t upFunc,
+		const unfilterFunc_t averageFunc, const unfilterFunc_t paethFunc) noexcept : _bpp{bpp}, sub{subFunc},
+		up{upFunc}, average{averageFunc}, paeth{paethFunc} { }
+
+	size_t bpp() const noexcept { return _bpp; }
+	void operator ()(const filterTypes_t filter, uint8_t *const row, const uint8_t *const prevRow,
+		const size_t length) const noexcept
+	{
+		switch (filter)
+		{
+			case filterTypes_t::sub:
+				return sub(row, prevRow, length, _bpp);
+			case filterTypes_t::up:
+				return up(row, prevRow, length, _bpp);
+			case filterTypes_t::average:
+				return average(row, prevRow, length, _bpp);
+			case filterTypes_t::paeth:
+				return paeth(row, prevRow, length, _bpp);
+			// This treats unknown or invalid filter types as filterTypes_t::none.
+			case filterTypes_t::none:
+			default:
+				return;
+		}
+	}
+
+	static const unfilter_t &select(const size_t bpp) noexcept;
+	// Returns nullptr if the CPU does not support the requested level.
+	static const unfilter_t *select(const size_t bpp, const simdLevel_t level) noexcept;
+};
+
+#endif /*UNFILTER_HXX*/
@@ -3,27 +3,17 @@
 
 #include <cstdint>
 #include <cstdlib>
+#include <cstring>
 #include <limits>
+#include <utility>
+#include <array>
+#include <algorithm>
+#include <functional>
+#include <chrono>
 #include "stream.hxx"
-
-struct bitmapRegion_t final
-{
-private:
-	const uint32_t _width, _height;
-
-public:
-	constexpr bitmapRegion_t(const uint32_t width, const uint32_t height) noexcept : _width(width), _height(height) { }
-	bitmapRegion_t(const bitmapRegion_t &region) noexcept = default;
-	bitmapRegion_t(bitmapRegion_t &&region) noexcept = default;
-	~bitmapRegion_t() noexcept = default;
-
-	uint32_t width() const noexcept { return _width; }
-	uint32_t height() const noexcept { return _height; }
-
-	bitmapRegion_t() = delete;
-	bitmapRegion_t &operator =(const bitmapRegion_t &) = delete;
-	bitmapRegion_t &operator =(bitmapRegion_t &&region) = delete;
-};
+#include "unfilter.hxx"
+#include "convert.hxx"
+#include "blend.hxx"
 
 inline uint16_t read16(const uint8_t *const value) noexcept
 	{ return uint16_t(value[0] << 8U) | uint16_t(value[1]); }
@@ -255,116 +245,212 @@ using pngGrey16_t = pngGrey_t<uint16_t>;
 using pngGreyA8_t = pngGreyA_t<uint8_t>;
 using pngGreyA16_t = pngGreyA_t<uint16_t>;
 
-template<typename T> bool readRGB(stream_t &stream, T &pixel)
-	{ return stream.read(pixel.r) && stream.read(pixel.g) && stream.read(pixel.b); }
-template<typename T> bool readRGBA(stream_t &stream, T &pixel)
-	{ return readRGB(stream, pixel) && stream.read(pixel.a); }
-template<typename T> bool readGrey(stream_t &stream, T &pixel)
-	{ return stream.read(pixel.v); }
-template<typename T> bool readGreyA(stream_t &stream, T &pixel)
-	{ return readGrey(stream, pixel) && stream.read(pixel.a); }
-
-template<typename T> T safeIndex(const T *const data, int32_t index, int32_t offset) noexcept
-	{ return index >= 0 && offset >= 0 ? data[index + offset] : T{}; }
-template<typename T> auto filterFunc_t() noexcept -> T (*)(const T *const, const bitmapRegion_t &, const uint32_t, const uint32_t) noexcept;
-template<typename T> using filter_t = decltype(filterFunc_t<T>());
-enum class filterTypes_t : uint8_t { none, sub, up, average, paeth };
-
-template<typename T> T filterSub(const T *const data, const bitmapRegion_t &frame, const uint32_t x, const uint32_t y) noexcept
-	{ return safeIndex(data, x - 1, y * frame.width()); }
-template<typename T> T filterUp(const T *const data, const bitmapRegion_t &frame, const uint32_t x, const uint32_t y) noexcept
-	{ return safeIndex(data, x, (y - 1) * frame.width()); }
-
-template<typename T> T filterAverage(const T *const data, const bitmapRegion_t &frame, const uint32_t x, const uint32_t y) noexcept
+// The scanline loops below are templated on how they gather statistics. noRowStats_t does nothing at all, so decoding
+// that isn't being observed runs exactly the loops it would without them, while rowStats_t times each step of each row.
+struct noRowStats_t final
 {
-	const T left = safeIndex(data, x - 1, y * frame.width());
-	const T up = safeIndex(data, x, (y - 1) * frame.width());
-	return (up >> 1U) + (left >> 1U) + ((up & left) & 1U);
-}
+	void begin() noexcept { }
+	void inflated(const size_t) noexcept { }
+	void unfiltered(const uint8_t) noexcept { }
+	void converted(const size_t) noexcept { }
+};
 
-inline uint8_t filterPaeth(const uint8_t a, const uint8_t b, const uint8_t c) noexcept
+struct rowStats_t final
 {
-	const int16_t pred = a + b - c;
-	const uint16_t absA = abs(pred - a);
-	const uint16_t absB = abs(pred - b);
-	const uint16_t absC = abs(pred - c);
-
-	if (absA <= absB && absA <= absC)
-		return a;
-	else if (absB <= absC)
-		return b;
-	return c;
-}
+private:
+	using clock_t = std::chrono::steady_clock;
+	decodeStats_t &stats;
+	clock_t::time_point last;
 
-inline uint16_t filterPaeth(const uint16_t a, const uint16_t b, const uint16_t c) noexcept
-{
-	const uint16_t upper = filterPaeth(uint8_t(a >> 8U), uint8_t(b >> 8U), uint8_t(c >> 8U));
-	const uint16_t lower = filterPaeth(uint8_t(a), uint8_t(b), uint8_t(c));
-	return uint16_t(upper << 8U) | lower;
-}
+	void lap(const decodeStats_t::stage_t stage) noexcept
+	{
+		const auto now = clock_t::now();
+		stats.stageTimes[stage] += std::chrono::duration_cast<std::chrono::nanoseconds>(now - last);
+		last = now;
+	}
 
-template<typename T> pngRGB_t<T> filterPaeth(const pngRGB_t<T> &a, const pngRGB_t<T> &b, const pngRGB_t<T> &c) noexcept
-	{ return {filterPaeth(a.r, b.r, c.r), filterPaeth(a.g, b.g, c.g), filterPaeth(a.b, b.b, c.b)}; }
-template<typename T> pngGrey_t<T> filterPaeth(const pngGrey_t<T> &a, const pngGrey_t<T> &b, const pngGrey_t<T> &c) noexcept
-	{ return {filterPaeth(a.v, b.v, c.v)}; }
+public:
+	rowStats_t(decodeStats_t &decodeStats) noexcept : stats{decodeStats}, last{} { }
+	void begin() noexcept { last = clock_t::now(); }
+	void inflated(const size_t bytes) noexcept
+	{
+		lap(decodeStats_t::inflate);
+		stats.bytesInflated += bytes;
+	}
+	void unfiltered(const uint8_t filter) noexcept
+	{
+		lap(decodeStats_t::unfilter);
+		if (filter < stats.filterTypes.size())
+			++stats.filterTypes[filter];
+	}
+	void converted(const size_t bytes) noexcept
+	{
+		lap(decodeStats_t::convert);
+		stats.bytesOut += bytes;
+	}
+};
 
-template<typename T> pngRGBA_t<T> filterPaeth(const pngRGBA_t<T> &a, const pngRGBA_t<T> &b, const pngRGBA_t<T> &c) noexcept
+// How large a row buffer copyFrame() or copyInterlacedFrame() needs for a frame of the given width.
+inline size_t rowBufferLength(const convert_t &convert, const uint32_t width, const bool interlaced)
 {
-	using pngRGBn_t = typename pngRGBA_t<T>::pngRGBn_t;
-	return {filterPaeth(static_cast<const pngRGBn_t &>(a), static_cast<const pngRGBn_t &>(b), static_cast<const pngRGBn_t &>(c)), filterPaeth(a.a, b.a, c.a)};
+	const size_t length = ((convert.inputLength(width) + 1) * 2) + convert.scratchLength(width);
+	return interlaced ? length + (width * pixelBytes(convert.output())) : length;
 }
 
-template<typename T> pngGreyA_t<T> filterPaeth(const pngGreyA_t<T> &a, const pngGreyA_t<T> &b, const pngGreyA_t<T> &c) noexcept
+// Where copyFrame() and copyInterlacedFrame() get each scanline from, along with its leading filter type byte.
+// streamRows_t inflates each into the half of the row buffer it's handed, while bufferRows_t hands out scanlines
+// in place from a frame already inflated whole, so they are unfiltered where they lie without being copied.
+struct streamRows_t final
 {
-	using pngGreyN_t = typename pngGreyA_t<T>::pngGreyN_t;
-	return {filterPaeth(static_cast<const pngGreyN_t &>(a), static_cast<const pngGreyN_t &>(b), static_cast<const pngGreyN_t &>(c)), filterPaeth(a.a, b.a, c.a)};
-}
+	stream_t &stream;
 
-template<typename T> T filterPaeth(const T *const data, const bitmapRegion_t &frame, const uint32_t x, const uint32_t y) noexcept
-{
-	const T left = safeIndex(data, x - 1, y * frame.width());
-	const T up = safeIndex(data, x, (y - 1) * frame.width());
-	const T upLeft = safeIndex(data, x - 1, (y - 1) * frame.width());
-	return filterPaeth(left, up, upLeft);
-}
+	uint8_t *next(uint8_t *const row, const size_t length) { return stream.read(row, length) ? row : nullptr; }
+};
 
-template<typename T> filter_t<T> selectFilter(const filterTypes_t filter) noexcept
+struct bufferRows_t final
 {
-	switch (filter)
+	uint8_t *data;
+	size_t remaining;
+
+	uint8_t *next(uint8_t *const, const size_t length) noexcept
 	{
-		case filterTypes_t::sub:
-			return filterSub<T>;
-		case filterTypes_t::up:
-			return filterUp<T>;
-		case filterTypes_t::average:
-			return filterAverage<T>;
-		case filterTypes_t::paeth:
-			return filterPaeth<T>;
-		case filterTypes_t::none:
-		default:
+		if (length > remaining)
 			return nullptr;
+		uint8_t *const row = data;
+		data += length;
+		remaining -= length;
+		return row;
 	}
-}
+};
 
-template<typename T, bool copyFunc(stream_t &, T &)> bool copyFrame(stream_t &stream, void *const dataPtr, const bitmapRegion_t frame)
+// Where copyFrame() converts each scanline into, which is either straight into the frame's bitmap or, when
+// decoding scaled down, a row buffer the scanline is box-filtered from once it's there.
+struct bitmapOutput_t final
 {
-	const auto data = static_cast<T *>(dataPtr);
-	const uint32_t width = frame.width();
-	const uint32_t height = frame.height();
+	uint8_t *const data;
+	const size_t rowLength;
+
+	uint8_t *row(const uint32_t y) noexcept { return data + (y * rowLength); }
+	void rowDone(const uint32_t) noexcept { }
+};
+
+template<typename rows_t, typename output_t, typename stats_t = noRowStats_t> inline bool copyFrame(rows_t rows,
+	output_t &&output, const uint32_t width, const uint32_t height, const unfilter_t &unfilter,
+	const convert_t &convert, uint8_t *const rowBuffer, stats_t stats = {})
+{
+	const size_t rowLength = convert.inputLength(width);
+	const size_t frameRowLength = width * pixelBytes(convert.output());
+	// Each scanline comes with its leading filter type byte, alternating between the halves of the row buffer when
+	// it has to be copied out, then is unfiltered in place against the previous scanline and converted into the frame.
+	// The first scanline is unfiltered as if the one before it were all zeros.
+	uint8_t *const rowBuffers[2] = {rowBuffer, rowBuffer + rowLength + 1};
+	const uint8_t *prevRow = rowBuffers[1];
+	uint8_t *const scratch = rowBuffer + ((rowLength + 1) * 2);
+	memset(rowBuffers[1], 0, rowLength + 1);
+
+	stats.begin();
 	for (uint32_t y = 0; y < height; ++y)
 	{
-		filterTypes_t filter;
-		if (!stream.read(filter))
+		uint8_t *const row = rows.next(rowBuffers[y & 1U], rowLength + 1);
+		if (!row)
 			return false;
-		// This treats unknown or invalid filter types as filterTypes_t::none.
-		filter_t<T> filterFunc = selectFilter<T>(filter);
+		stats.inflated(rowLength + 1);
+		unfilter(filterTypes_t(row[0]), row + 1, prevRow + 1, rowLength);
+		stats.unfiltered(row[0]);
+		convert(output.row(y), row + 1, width, scratch);
+		output.rowDone(y);
+		stats.converted(frameRowLength);
+		prevRow = row;
+	}
+	return true;
+}
 
-		for (uint32_t x = 0; x < width; ++x)
+// Where each of the seven Adam7 passes starts and how far apart its pixels are, along with the size of the block
+// each of its pixels covers until later passes fill in the rest. After each pass the image is a grid of such blocks.
+struct adam7Pass_t final
+{
+	uint8_t x, y;
+	uint8_t xStep, yStep;
+	uint8_t blockWidth, blockHeight;
+};
+
+constexpr static std::array<adam7Pass_t, 7> adam7Passes
+{{
+	{0, 0, 8, 8, 8, 8}, {4, 0, 8, 8, 4, 8}, {0, 4, 4, 8, 4, 4}, {2, 0, 4, 4, 2, 4},
+	{0, 2, 2, 4, 2, 2}, {1, 0, 2, 2, 1, 2}, {0, 1, 1, 2, 1, 1}
+}};
+
+using passCallback_t = std::function<void (const uint8_t pass)>;
+
+// Decodes an Adam7 interlaced frame, where each pass is a small image of its own with scanlines filtered
+// independently of the other passes. With passDone, every pixel is also replicated across its block, and passDone
+// is called with the pass number from 1 to 7 once each pass is in, so the frame always holds a coarse preview.
+template<typename rows_t, typename stats_t = noRowStats_t> inline bool copyInterlacedFrame(rows_t rows,
+	bitmap_t &frame, const unfilter_t &unfilter, const convert_t &convert, const passCallback_t &passDone,
+	uint8_t *const rowBuffer, stats_t stats = {})
+{
+	const uint32_t width = frame.width();
+	const uint32_t height = frame.height();
+	const size_t pixelLength = pixelBytes(frame.format());
+	const size_t frameRowLength = width * pixelLength;
+	// No pass's scanlines are longer than the frame's, so the buffers are sized for those.
+	const size_t rowLength = convert.inputLength(width);
+	const size_t scratchLength = convert.scratchLength(width);
+	uint8_t *const rowBuffers[2] = {rowBuffer, rowBuffer + rowLength + 1};
+	uint8_t *const scratch = rowBuffer + ((rowLength + 1) * 2);
+	uint8_t *const pixels = scratch + scratchLength;
+	uint8_t *const data = frame.data();
+
+	stats.begin();
+	for (size_t pass = 0; pass < adam7Passes.size(); ++pass)
+	{
+		const adam7Pass_t &adam7 = adam7Passes[pass];
+		// Passes that have no pixels in an image this small have no scanlines, not even filter type bytes.
+		const uint32_t passWidth = width > adam7.x ? (width - adam7.x + adam7.xStep - 1) / adam7.xStep : 0;
+		const uint32_t passHeight = height > adam7.y ? (height - adam7.y + adam7.yStep - 1) / adam7.yStep : 0;
+		const size_t passRowLength = convert.inputLength(passWidth);
+		// The first scanline of every pass is unfiltered as if the one before it were all zeros.
+		const uint8_t *prevRow = rowBuffers[1];
+		memset(rowBuffers[1], 0, passRowLength + 1);
+		for (uint32_t j = 0; passWidth && j < passHeight; ++j)
 		{
-			if (!copyFunc(stream, data[x + (y * width)]))
+			uint8_t *const row = rows.next(rowBuffers[j & 1U], passRowLength + 1);
+			if (!row)
 				return false;
-			if (filterFunc)
-				data[x + (y * width)] += filterFunc(data, frame, x, y);
+			stats.inflated(passRowLength + 1);
+			unfilter(filterTypes_t(row[0]), row + 1, prevRow + 1, passRowLength);
+			stats.unfiltered(row[0]);
+			convert(pixels, row + 1, passWidth, scratch);
+			const uint32_t y = adam7.y + (j * adam7.yStep);
+			uint8_t *const frameRow = data + (y * frameRowLength);
+			if (!passDone)
+			{
+				for (uint32_t i = 0; i < passWidth; ++i)
+					memcpy(frameRow + ((adam7.x + (i * adam7.xStep)) * pixelLength), pixels + (i * pixelLength),
+						pixelLength);
+			}
+			else
+			{
+				for (uint32_t i = 0; i < passWidth; ++i)
+				{
+					const uint32_t x = adam7.x + (i * adam7.xStep);
+					const uint32_t blockWidth = std::min<uint32_t>(adam7.blockWidth, width - x);
+					for (uint32_t k = 0; k < blockWidth; ++k)
+						memcpy(frameRow + ((x + k) * pixelLength), pixels + (i * pixelLength), pixelLength);
+				}
+				// Every row of a band of blocks is the same, so the rest of the band is a copy of this row.
+				const uint32_t blockHeight = std::min<uint32_t>(adam7.blockHeight, height - y);
+				for (uint32_t k = 1; k < blockHeight; ++k)
+					memcpy(frameRow + (k * frameRowLength), frameRow, frameRowLength);
+			}
+			stats.converted(passWidth * pixelLength);
+			prevRow = row;
+		}
+		// The time spent on the preview isn't part of any decoding stage.
+		if (passDone)
+		{
+			passDone(uint8_t(pass + 1));
+			stats.begin();
 		}
 	}
 	return true;
@@ -428,28 +514,69 @@ template<typename T> inline void copyBack(uint8_t *const data, const size_t inde
 	memcpy(data + offset, &value, sizeof(T));
 }
 
-template<typename T> void compFrame(T compFunc(const T, const T, const typename T::type), const bitmap_t &source, bitmap_t &destination,
-	const uint32_t xOffset, const uint32_t yOffset) noexcept
+template<typename T> void compFrame(T compFunc(const T, const T, const typename T::type), const bitmap_t &source, canvas_t &destination,
+	const uint32_t xOffset, const uint32_t yOffset)
 {
-	if ((source.width() + xOffset) > destination.width() || (source.height() + yOffset) > destination.height())
+	if (uint64_t{source.width()} + xOffset > destination.width() ||
+		uint64_t{source.height()} + yOffset > destination.height())
 		return;
 	const uint32_t width = source.width();
 	const uint32_t height = source.height();
 	const T trans = source.transparent<T>();
 	const typename T::type max = std::numeric_limits<typename T::type>::max();
+	// Only the rows the frame covers get written, and they are contiguous once detached.
+	uint8_t *const rows = destination.detachRows(yOffset, height);
 
 	for (uint32_t y = 0; y < height; ++y)
 	{
 		for (uint32_t x = 0; x < width; ++x)
 		{
 			const uint32_t offsetSrc = x + (y * width);
-			const uint32_t offsetDst = (x + xOffset) + ((y + yOffset) * destination.width());
+			const uint32_t offsetDst = (x + xOffset) + (y * destination.width());
 			const auto srcValue = as<T>(source.data(), offsetSrc);
-			const auto dstValue = as<T>(destination.data(), offsetDst);
+			const auto dstValue = as<T>(rows, offsetDst);
 			const auto result = compFunc(dstValue, srcValue, source.hasTransparency() && trans == srcValue ? 0 : max);
-			copyBack(destination.data(), offsetDst, result);
+			copyBack(rows, offsetDst, result);
+		}
+	}
+}
+
+// Composits a decoded frame onto the canvas at the given offset, as blendOp_t op says to.
+template<blendOp_t::_blendOp_t op> void compositFrame(const bitmap_t &source, canvas_t &destination,
+	const pixelFormat_t pixelFormat, const bool blendAlpha, const uint32_t xOffset, const uint32_t yOffset)
+{
+	if (uint64_t{source.width()} + xOffset > destination.width() ||
+		uint64_t{source.height()} + yOffset > destination.height())
+		return;
+	const size_t pixelLength = pixelBytes(pixelFormat);
+	const size_t sourceLength = source.width() * pixelLength;
+	const size_t offset = xOffset * pixelLength;
+
+	// Replacing pixels outright, or blending pixels carrying their own alpha, both work a whole row at a time.
+	const auto blendOver = blendOver_t::select()(pixelFormat, blendAlpha);
+	if (op == blendOp_t::source || blendOver)
+	{
+		// The old contents of rows that are about to be entirely replaced don't need copying.
+		const bool replaceRows = op == blendOp_t::source && source.width() == destination.width();
+		uint8_t *const rows = destination.detachRows(yOffset, source.height(), !replaceRows);
+		for (uint32_t y = 0; y < source.height(); ++y)
+		{
+			uint8_t *const row = rows + (y * destination.rowLength()) + offset;
+			const uint8_t *const sourceRow = source.data() + (y * sourceLength);
+			if (op == blendOp_t::source)
+				memcpy(row, sourceRow, sourceLength);
+			else
+				blendOver(row, sourceRow, source.width());
 		}
 	}
+	else if (pixelFormat == pixelFormat_t::format24bppRGB)
+		compFrame(compRGB<pngRGB8_t, op>, source, destination, xOffset, yOffset);
+	else if (pixelFormat == pixelFormat_t::format48bppRGB || pixelFormat == pixelFormat_t::format48bppRGBHost)
+		compFrame(compRGB<pngRGB16_t, op>, source, destination, xOffset, yOffset);
+	else if (pixelFormat == pixelFormat_t::format8bppGrey)
+		compFrame(compGrey<pngGrey8_t, op>, source, destination, xOffset, yOffset);
+	else if (pixelFormat == pixelFormat_t::format16bppGrey || pixelFormat == pixelFormat_t::format16bppGreyHost)
+		compFrame(compGrey<pngGrey16_t, op>, source, destination, xOffset, yOffset);
 }
 
 #endif /*UTILITIES_HXX*/
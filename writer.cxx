@@ -0,0 +1,392 @@
+#include <cerrno>
+#include <condition_variable>
+#include <exception>
+#include <limits>
+#include <mutex>
+#include <system_error>
+#include <memory.h>
+#include <zlib.h>
+#include "crc32.hxx"
+#include "unfilter.hxx"
+#include "convert.hxx"
+#include "threadPool.hxx"
+#include "apng.hxx"
+
+constexpr static const std::array<uint8_t, 8> pngSig =
+	{ 0x89, 0x50, 0x4E, 0x47, 0x0D, 0x0A, 0x1A, 0x0A };
+// Image data is split into chunks of at most this many bytes, so readers never need to hold too much of it at once.
+constexpr static const size_t maxChunkLength = 1024_KiB;
+
+static void write32(uint8_t *const data, const uint32_t value) noexcept
+{
+	data[0] = uint8_t(value >> 24U);
+	data[1] = uint8_t(value >> 16U);
+	data[2] = uint8_t(value >> 8U);
+	data[3] = uint8_t(value);
+}
+
+static void write16(uint8_t *const data, const uint16_t value) noexcept
+{
+	data[0] = uint8_t(value >> 8U);
+	data[1] = uint8_t(value);
+}
+
+static void writeData(stream_t &stream, const void *const data, const size_t length)
+{
+	if (length && !stream.write(data, length))
+		throw std::system_error(EIO, std::system_category());
+}
+
+// Writes a chunk whose data is prefix (used for fdAT's sequence number) followed by data.
+static void writeChunk(stream_t &stream, const char *const type, const uint8_t *const prefix, const size_t prefixLength,
+	const uint8_t *const data, const size_t length)
+{
+	std::array<uint8_t, 8> header;
+	write32(header.data(), uint32_t(prefixLength + length));
+	memcpy(header.data() + 4, type, 4);
+	uint32_t crc = 0;
+	crc32_t::crc(crc, header.data() + 4, 4);
+	crc32_t::crc(crc, prefix, prefixLength);
+	crc32_t::crc(crc, data, length);
+	std::array<uint8_t, 4> trailer;
+	write32(trailer.data(), crc);
+
+	writeData(stream, header.data(), header.size());
+	writeData(stream, prefix, prefixLength);
+	writeData(stream, data, length);
+	writeData(stream, trailer.data(), trailer.size());
+}
+
+template<size_t N> static void writeChunk(stream_t &stream, const char *const type, const std::array<uint8_t, N> &data)
+	{ writeChunk(stream, type, nullptr, 0, data.data(), data.size()); }
+
+// The pixel format a bitmap is written out as, which is the one PNG's own layout matches.
+static pixelFormat_t pngFormat(const pixelFormat_t format) noexcept
+{
+	switch (format)
+	{
+		case pixelFormat_t::format32bppBGRA:
+		case pixelFormat_t::format32bppRGBAPremultiplied:
+		case pixelFormat_t::format32bppBGRAPremultiplied:
+			return pixelFormat_t::format32bppRGBA;
+		case pixelFormat_t::format16bppGreyHost:
+			return pixelFormat_t::format16bppGrey;
+		case pixelFormat_t::format16bppGreyAHost:
+			return pixelFormat_t::format16bppGreyA;
+		case pixelFormat_t::format48bppRGBHost:
+			return pixelFormat_t::format48bppRGB;
+		case pixelFormat_t::format64bppRGBAHost:
+			return pixelFormat_t::format64bppRGBA;
+		default:
+			return format;
+	}
+}
+
+// IHDR's bit depth and colour type for one of the formats pngFormat() gives.
+static std::pair<uint8_t, uint8_t> pngHeader(const pixelFormat_t format) noexcept
+{
+	switch (format)
+	{
+		case pixelFormat_t::format8bppGrey:
+			return {8, 0};
+		case pixelFormat_t::format16bppGrey:
+			return {16, 0};
+		case pixelFormat_t::format8bppGreyA:
+			return {8, 4};
+		case pixelFormat_t::format16bppGreyA:
+			return {16, 4};
+		case pixelFormat_t::format24bppRGB:
+			return {8, 2};
+		case pixelFormat_t::format48bppRGB:
+			return {16, 2};
+		case pixelFormat_t::format64bppRGBA:
+			return {16, 6};
+		default:
+			return {8, 6};
+	}
+}
+
+// Turns a row of pixels into PNG's own layout, undoing what convert_t does when decoding into the bitmap's format.
+// Like convert_t, this takes the host byte order formats to be little-endian.
+static void toPNGRow(const pixelFormat_t format, uint8_t *const dst, const uint8_t *const src, const size_t length) noexcept
+{
+	const bool bgr = format == pixelFormat_t::format32bppBGRA || format == pixelFormat_t::format32bppBGRAPremultiplied;
+	switch (format)
+	{
+		case pixelFormat_t::format32bppBGRA:
+		case pixelFormat_t::format32bppRGBAPremultiplied:
+		case pixelFormat_t::format32bppBGRAPremultiplied:
+			for (size_t i = 0; i < length; i += 4)
+			{
+				const uint8_t alpha = src[i + 3];
+				for (size_t channel = 0; channel < 3; ++channel)
+				{
+					uint32_t value = src[i + (bgr ? 2 - channel : channel)];
+					if (format != pixelFormat_t::format32bppBGRA)
+						value = alpha ? ((value * 255U) + (alpha / 2U)) / alpha : 0;
+					dst[i + channel] = value > 255 ? 255 : uint8_t(value);
+				}
+				dst[i + 3] = alpha;
+			}
+			return;
+		case pixelFormat_t::format16bppGreyHost:
+		case pixelFormat_t::format16bppGreyAHost:
+		case pixelFormat_t::format48bppRGBHost:
+		case pixelFormat_t::format64bppRGBAHost:
+			for (size_t i = 0; i < length; i += 2)
+			{
+				dst[i] = src[i + 1];
+				dst[i + 1] = src[i];
+			}
+			return;
+		default:
+			memcpy(dst, src, length);
+	}
+}
+
+// Sums a filtered row's bytes as signed magnitudes, the usual estimate of how well it will deflate.
+static uint64_t filterCost(const uint8_t *const row, const size_t length) noexcept
+{
+	uint64_t cost = 0;
+	for (size_t i = 0; i < length; ++i)
+		cost += row[i] < 128 ? row[i] : 256U - row[i];
+	return cost;
+}
+
+// Filters a frame into scanlines ready for deflating, either using filter throughout or, when adaptive is set,
+// choosing each row's filter by filterCost().
+static std::vector<uint8_t> filterFrame(const bitmap_t &bitmap, const bool adaptive, const filterTypes_t filter)
+{
+	const pixelFormat_t format = bitmap.format();
+	const size_t bpp = pixelBytes(format);
+	const size_t rowLength = size_t(bitmap.width()) * bpp;
+	const bool convert = pngFormat(format) != format;
+	std::vector<uint8_t> scanlines((rowLength + 1) * bitmap.height());
+	// A row of zeros stands in for the row above the first, with room for converted rows and each filter's attempt.
+	std::vector<uint8_t> rows(rowLength * (adaptive ? 8 : 3));
+	const uint8_t *prevRow = rows.data();
+	uint8_t *convertedRows[2] = {rows.data() + rowLength, rows.data() + (rowLength * 2)};
+	uint8_t *const candidates = rows.data() + (rowLength * 3);
+
+	for (uint32_t y = 0; y < bitmap.height(); ++y)
+	{
+		const uint8_t *row = bitmap.data() + (rowLength * y);
+		if (convert)
+		{
+			toPNGRow(format, convertedRows[y & 1U], row, rowLength);
+			row = convertedRows[y & 1U];
+		}
+		uint8_t *const scanline = scanlines.data() + ((rowLength + 1) * y);
+		if (adaptive)
+		{
+			uint8_t best = 0;
+			uint64_t bestCost = std::numeric_limits<uint64_t>::max();
+			for (uint8_t type = 0; type < 5; ++type)
+			{
+				uint8_t *const candidate = candidates + (rowLength * type);
+				filterRow(filterTypes_t(type), candidate, row, prevRow, rowLength, bpp);
+				const uint64_t cost = filterCost(candidate, rowLength);
+				if (cost < bestCost)
+				{
+					best = type;
+					bestCost = cost;
+				}
+			}
+			scanline[0] = best;
+			memcpy(scanline + 1, candidates + (rowLength * best), rowLength);
+		}
+		else
+		{
+			scanline[0] = uint8_t(filter);
+			filterRow(filter, scanline + 1, row, prevRow, rowLength, bpp);
+		}
+		prevRow = row;
+	}
+	return scanlines;
+}
+
+struct deflateStream_t final
+{
+	z_stream stream;
+
+	deflateStream_t(const int32_t level) : stream{}
+	{
+		if (deflateInit(&stream, level) != Z_OK)
+			throw zlibError_t{};
+	}
+	~deflateStream_t() noexcept { deflateEnd(&stream); }
+	deflateStream_t(const deflateStream_t &) = delete;
+	deflateStream_t &operator =(const deflateStream_t &) = delete;
+};
+
+static std::vector<uint8_t> deflateFrame(const std::vector<uint8_t> &data, const int32_t level)
+{
+	constexpr size_t blockLength = std::numeric_limits<uInt>::max();
+	deflateStream_t deflater{level};
+	z_stream &stream = deflater.stream;
+	std::vector<uint8_t> result(deflateBound(&stream, data.size()));
+	size_t inputUsed = 0;
+	size_t outputUsed = 0;
+	for (;;)
+	{
+		const size_t input = data.size() - inputUsed < blockLength ? data.size() - inputUsed : blockLength;
+		const size_t output = result.size() - outputUsed < blockLength ? result.size() - outputUsed : blockLength;
+		stream.next_in = const_cast<uint8_t *>(data.data() + inputUsed);
+		stream.avail_in = uInt(input);
+		stream.next_out = result.data() + outputUsed;
+		stream.avail_out = uInt(output);
+		const int ret = deflate(&stream, inputUsed + input == data.size() ? Z_FINISH : Z_NO_FLUSH);
+		if (ret == Z_STREAM_ERROR)
+			throw zlibError_t{};
+		inputUsed += input - stream.avail_in;
+		outputUsed += output - stream.avail_out;
+		if (ret == Z_STREAM_END)
+			break;
+		if (outputUsed == result.size())
+			result.resize(result.size() * 2);
+	}
+	result.resize(outputUsed);
+	return result;
+}
+
+static std::vector<uint8_t> encodeFrame(const bitmap_t &bitmap, const encodeOptions_t &options)
+{
+	if (options.filter == filterStrategy_t::none)
+		return deflateFrame(filterFrame(bitmap, false, filterTypes_t::none), options.compressionLevel);
+	std::vector<uint8_t> best = deflateFrame(filterFrame(bitmap, true, filterTypes_t::none), options.compressionLevel);
+	if (options.filter == filterStrategy_t::exhaustive)
+	{
+		for (uint8_t type = 0; type < 5; ++type)
+		{
+			auto attempt = deflateFrame(filterFrame(bitmap, false, filterTypes_t(type)), options.compressionLevel);
+			if (attempt.size() < best.size())
+				best.swap(attempt);
+		}
+	}
+	return best;
+}
+
+static void checkFrames(const uint32_t width, const uint32_t height, const std::vector<apngEncoder_t::frame_t> &frames)
+{
+	if (!width || !height || width > 0x7FFFFFFFU || height > 0x7FFFFFFFU || frames.empty() ||
+		frames.size() > 0x7FFFFFFFU)
+		throw invalidPNG_t{};
+	for (size_t i = 0; i < frames.size(); ++i)
+	{
+		const apngEncoder_t::frame_t &frame = frames[i];
+		if (!frame.bitmap || pngFormat(frame.bitmap->format()) != pngFormat(frames[0].bitmap->format()))
+			throw invalidPNG_t{};
+		const uint64_t frameWidth = frame.bitmap->width();
+		const uint64_t frameHeight = frame.bitmap->height();
+		if (!frameWidth || !frameHeight || frame.xOffset + frameWidth > width || frame.yOffset + frameHeight > height)
+			throw invalidPNG_t{};
+		if (!i && (frameWidth != width || frameHeight != height || frame.xOffset || frame.yOffset))
+			throw invalidPNG_t{};
+	}
+}
+
+void apngEncoder_t::encode(stream_t &stream, const uint32_t width, const uint32_t height,
+	const std::vector<frame_t> &frames, const encodeOptions_t &options)
+{
+	checkFrames(width, height, frames);
+	const auto header = pngHeader(pngFormat(frames[0].bitmap->format()));
+	writeData(stream, pngSig.data(), pngSig.size());
+	std::array<uint8_t, 13> ihdr{};
+	write32(ihdr.data(), width);
+	write32(ihdr.data() + 4, height);
+	ihdr[8] = header.first;
+	ihdr[9] = header.second;
+	writeChunk(stream, "IHDR", ihdr);
+	std::array<uint8_t, 8> actl{};
+	write32(actl.data(), uint32_t(frames.size()));
+	write32(actl.data() + 4, options.loops);
+	writeChunk(stream, "acTL", actl);
+
+	uint32_t sequence = 0;
+	const auto writeFrame = [&](const uint32_t index, const std::vector<uint8_t> &data)
+	{
+		const frame_t &frame = frames[index];
+		std::array<uint8_t, 26> fctl{};
+		write32(fctl.data(), sequence++);
+		write32(fctl.data() + 4, frame.bitmap->width());
+		write32(fctl.data() + 8, frame.bitmap->height());
+		write32(fctl.data() + 12, frame.xOffset);
+		write32(fctl.data() + 16, frame.yOffset);
+		write16(fctl.data() + 20, frame.delayN);
+		write16(fctl.data() + 22, frame.delayD);
+		fctl[24] = uint8_t(disposeOp_t::_disposeOp_t(frame.disposeOp));
+		fctl[25] = uint8_t(blendOp_t::_blendOp_t(frame.blendOp));
+		writeChunk(stream, "fcTL", fctl);
+		for (size_t offset = 0; offset < data.size(); offset += maxChunkLength)
+		{
+			const size_t length = data.size() - offset < maxChunkLength ? data.size() - offset : maxChunkLength;
+			if (!index)
+				writeChunk(stream, "IDAT", nullptr, 0, data.data() + offset, length);
+			else
+			{
+				std::array<uint8_t, 4> sequenceIndex;
+				write32(sequenceIndex.data(), sequence++);
+				writeChunk(stream, "fdAT", sequenceIndex.data(), sequenceIndex.size(), data.data() + offset, length);
+			}
+		}
+	};
+
+	const uint32_t frameCount = uint32_t(frames.size());
+	const uint32_t workers = options.threads ? options.threads : threadPool_t::hardwareThreads();
+	if (workers == 1 || frameCount == 1)
+	{
+		for (uint32_t i = 0; i < frameCount; ++i)
+			writeFrame(i, encodeFrame(*frames[i].bitmap, options));
+	}
+	else
+	{
+		struct pendingFrame_t
+		{
+			std::vector<uint8_t> data;
+			std::exception_ptr error;
+			bool done{false};
+		};
+
+		std::vector<pendingFrame_t> pending(frameCount);
+		std::mutex pendingLock;
+		std::condition_variable frameDone;
+		uint32_t submitted = 0;
+
+		const auto encode = [&](const uint32_t index) noexcept
+		{
+			std::vector<uint8_t> data;
+			std::exception_ptr error;
+			try
+				{ data = encodeFrame(*frames[index].bitmap, options); }
+			catch (...)
+				{ error = std::current_exception(); }
+			std::lock_guard<std::mutex> lock{pendingLock};
+			pending[index].data.swap(data);
+			pending[index].error = error;
+			pending[index].done = true;
+			frameDone.notify_all();
+		};
+
+		// The pool is declared last so, even when unwinding, its workers finish before anything they use goes away.
+		threadPool_t pool{workers};
+		// Limit how far encoding runs ahead of writing so at most a few deflated frames per thread are held at once.
+		const uint32_t window = uint32_t(pool.size()) * 2;
+		for (uint32_t i = 0; i < frameCount; ++i)
+		{
+			for (; submitted < frameCount && submitted < i + window; ++submitted)
+			{
+				const uint32_t index = submitted;
+				pool.submit([&encode, index]() { encode(index); });
+			}
+			std::unique_lock<std::mutex> lock{pendingLock};
+			frameDone.wait(lock, [&]() { return pending[i].done; });
+			lock.unlock();
+			if (pending[i].error)
+				std::rethrow_exception(pending[i].error);
+			writeFrame(i, pending[i].data);
+			std::vector<uint8_t>{}.swap(pending[i].data);
+		}
+	}
+
+	writeChunk(stream, "IEND", std::array<uint8_t, 0>{});
+}